@@ -227,6 +227,7 @@ struct ast_expr {
 
 		struct {
 			struct val_type type;
+			// NULL, with a void type, for the empty expression
 			struct ast_expr *val;
 		} cast;
 
@@ -265,6 +266,8 @@ struct ast_toplevel {
 		struct {
 			size_t size;
 			struct ast_toplevel *body;
+			// NULL for an anonymous namespace
+			const char *name;
 		} namespace;
 	};
 };
@@ -0,0 +1,412 @@
+// vim: noet
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "callgraph.h"
+#include "memstats.h"
+#include "walk.h"
+
+// Node collection {{{
+
+// Names in a namespace are qualified by prefix, which ends in a dot unless
+// it is empty. The name is freed again if the node already exists.
+static void _cg_add_node(struct callgraph *cg, const char *prefix, const char *name, struct ast_toplevel *top) {
+	size_t prefix_len = strlen(prefix);
+	if (prefix_len) {
+		size_t len = prefix_len + strlen(name) + 1;
+		char *s = MEM_ALLOC(MEM_NAME, len);
+		memcpy(s, prefix, prefix_len);
+		memcpy(s + prefix_len, name, len - prefix_len);
+		name = s;
+	}
+
+	size_t *existing = strmap_get(&cg->names, name);
+	if (existing) {
+		if (prefix_len) MEM_FREE((char *)name);
+
+		// Prefer the definition over any prototypes
+		struct cg_node *node = cg->nodes + *existing;
+		if (top->type == EXPRTOP_FUNC && top->func.body
+				&& node->top->type == EXPRTOP_FUNC && !node->top->func.body) {
+			node->top = top;
+		}
+		return;
+	}
+
+	if (cg->nnodes == cg->alloc) {
+		cg->alloc = cg->alloc ? cg->alloc * 2 : 64;
+		cg->nodes = MEM_REALLOC(MEM_SCOPE, cg->nodes, cg->alloc * sizeof *cg->nodes);
+	}
+	strmap_put(&cg->names, name, cg->nnodes);
+	cg->nodes[cg->nnodes++] = (struct cg_node){
+		.name = name,
+		.prefix = prefix_len,
+		.top = top,
+	};
+}
+
+static void _cg_collect(struct callgraph *cg, const char *prefix, size_t ntops, struct ast_toplevel *tops) {
+	for (size_t i = 0; i < ntops; ++i) {
+		struct ast_toplevel *t = tops + i;
+		switch (t->type) {
+		case EXPRTOP_FUNC:
+			_cg_add_node(cg, prefix, t->func.name, t);
+			break;
+		case EXPRTOP_DECL:
+			_cg_add_node(cg, prefix, t->decl.name, t);
+			break;
+		case EXPRTOP_NAMESPACE:
+			if (!t->namespace.name) {
+				_cg_collect(cg, prefix, t->namespace.size, t->namespace.body);
+				break;
+			}
+
+			size_t prefix_len = strlen(prefix), name_len = strlen(t->namespace.name);
+			char *inner = MEM_ALLOC(MEM_NAME, prefix_len + name_len + 2);
+			memcpy(inner, prefix, prefix_len);
+			memcpy(inner + prefix_len, t->namespace.name, name_len);
+			strcpy(inner + prefix_len + name_len, ".");
+			_cg_collect(cg, inner, t->namespace.size, t->namespace.body);
+			MEM_FREE(inner);
+			break;
+		}
+	}
+}
+
+// }}}
+
+// Edge collection {{{
+
+struct _cg_ctx {
+	struct callgraph *cg;
+	struct cg_node *cur;
+	// seen[i] == cur index + 1 if the edge to i has already been added
+	size_t *seen;
+
+	// Stack of local names. Function literals cannot see the locals of their
+	// enclosing function, so lookups stop at base.
+	size_t nlocals, locals_alloc, base;
+	const char **locals;
+
+	// Saved scopes of enclosing functions
+	size_t nframes, frames_alloc;
+	struct {
+		size_t base, nlocals;
+	} *frames;
+
+	struct walk_stack walk;
+};
+
+static void _cg_push_frame(struct _cg_ctx *c) {
+	if (c->nframes == c->frames_alloc) {
+		c->frames_alloc = c->frames_alloc ? c->frames_alloc * 2 : 8;
+		c->frames = MEM_REALLOC(MEM_SCOPE, c->frames, c->frames_alloc * sizeof *c->frames);
+	}
+	c->frames[c->nframes].base = c->base;
+	c->frames[c->nframes].nlocals = c->nlocals;
+	++c->nframes;
+}
+
+static void _cg_push_local(struct _cg_ctx *c, const char *name) {
+	if (c->nlocals == c->locals_alloc) {
+		c->locals_alloc = c->locals_alloc ? c->locals_alloc * 2 : 16;
+		c->locals = MEM_REALLOC(MEM_SCOPE, c->locals, c->locals_alloc * sizeof *c->locals);
+	}
+	c->locals[c->nlocals++] = name;
+}
+
+static bool _cg_is_local(struct _cg_ctx *c, const char *name) {
+	for (size_t i = c->nlocals; i-- > c->base;) {
+		if (!strcmp(c->locals[i], name)) return true;
+	}
+	return false;
+}
+
+static void _cg_add_edge(struct _cg_ctx *c, size_t to) {
+	size_t from = c->cur - c->cg->nodes;
+	if (c->seen[to] == from + 1) return;
+	c->seen[to] = from + 1;
+
+	struct cg_node *n = c->cur;
+	if (n->ncallees == n->callees_alloc) {
+		n->callees_alloc = n->callees_alloc ? n->callees_alloc * 2 : 4;
+		n->callees = MEM_REALLOC(MEM_SCOPE, n->callees, n->callees_alloc * sizeof *n->callees);
+	}
+	n->callees[n->ncallees++] = to;
+}
+
+static bool _cg_pre(struct ast_expr *e, void *ctx) {
+	struct _cg_ctx *c = ctx;
+	++c->cur->size;
+
+	switch (e->t) {
+	case EXPR_FUNC:
+		_cg_push_frame(c);
+		c->base = c->nlocals;
+		for (size_t i = 0; i < e->func.nargs; ++i) {
+			_cg_push_local(c, e->func.args[i].name);
+		}
+		break;
+
+	case EXPR_IDENT:
+		if (_cg_is_local(c, e->ident)) break;
+		struct cg_node *to = cg_resolve(c->cg, c->cur, e->ident);
+		if (to) _cg_add_edge(c, to - c->cg->nodes);
+		break;
+
+	default:
+		break;
+	}
+	return true;
+}
+
+static void _cg_child(struct ast_expr *e, size_t i, void *ctx) {
+	if (e->t == EXPR_LET && i == 1) _cg_push_local(ctx, e->let.name);
+}
+
+static void _cg_post(struct ast_expr *e, void *ctx) {
+	struct _cg_ctx *c = ctx;
+	if (e->t == EXPR_LET) {
+		--c->nlocals;
+	} else if (e->t == EXPR_FUNC) {
+		--c->nframes;
+		c->base = c->frames[c->nframes].base;
+		c->nlocals = c->frames[c->nframes].nlocals;
+	}
+}
+
+static const struct walk_ops _cg_ops = {
+	.pre = _cg_pre,
+	.child = _cg_child,
+	.post = _cg_post,
+};
+
+// }}}
+
+// SCCs {{{
+
+// Iterative Tarjan, so deep call chains don't overflow the C stack
+static void _cg_sccs(struct callgraph *cg) {
+	size_t n = cg->nnodes;
+	size_t *index = MEM_ALLOC(MEM_SCOPE, n * sizeof *index);
+	size_t *low = MEM_ALLOC(MEM_SCOPE, n * sizeof *low);
+	bool *onstack = MEM_CALLOC(MEM_SCOPE, n, sizeof *onstack);
+	size_t *stack = MEM_ALLOC(MEM_SCOPE, n * sizeof *stack), nstack = 0;
+	struct {
+		size_t v, edge;
+	} *calls = MEM_ALLOC(MEM_SCOPE, n * sizeof *calls);
+	size_t ncalls = 0, next = 0, nsorted = 0;
+
+	cg->nsccs = 0;
+	cg->sccs = MEM_ALLOC(MEM_SCOPE, n * sizeof *cg->sccs);
+	cg->scc_start = MEM_ALLOC(MEM_SCOPE, (n + 1) * sizeof *cg->scc_start);
+
+	for (size_t i = 0; i < n; ++i) index[i] = SIZE_MAX;
+
+	for (size_t root = 0; root < n; ++root) {
+		if (index[root] != SIZE_MAX) continue;
+
+#define VISIT(x) do { \
+		index[x] = low[x] = next++; \
+		stack[nstack++] = x; \
+		onstack[x] = true; \
+		calls[ncalls].v = x; \
+		calls[ncalls].edge = 0; \
+		++ncalls; \
+	} while (0)
+
+		VISIT(root);
+		while (ncalls) {
+			size_t v = calls[ncalls-1].v;
+			struct cg_node *node = cg->nodes + v;
+
+			if (calls[ncalls-1].edge < node->ncallees) {
+				size_t w = node->callees[calls[ncalls-1].edge++];
+				if (index[w] == SIZE_MAX) {
+					VISIT(w);
+				} else if (onstack[w] && index[w] < low[v]) {
+					low[v] = index[w];
+				}
+				continue;
+			}
+
+			if (low[v] == index[v]) {
+				cg->scc_start[cg->nsccs] = nsorted;
+				size_t w;
+				do {
+					w = stack[--nstack];
+					onstack[w] = false;
+					cg->nodes[w].scc = cg->nsccs;
+					cg->sccs[nsorted++] = w;
+				} while (w != v);
+				++cg->nsccs;
+			}
+
+			--ncalls;
+			if (ncalls) {
+				size_t u = calls[ncalls-1].v;
+				if (low[v] < low[u]) low[u] = low[v];
+			}
+		}
+
+#undef VISIT
+	}
+	cg->scc_start[cg->nsccs] = nsorted;
+
+	MEM_FREE(index);
+	MEM_FREE(low);
+	MEM_FREE(onstack);
+	MEM_FREE(stack);
+	MEM_FREE(calls);
+}
+
+// }}}
+
+void cg_build(struct callgraph *cg, size_t ntops, struct ast_toplevel *tops) {
+	*cg = (struct callgraph){0};
+	_cg_collect(cg, "", ntops, tops);
+
+	struct _cg_ctx c = {
+		.cg = cg,
+		.seen = MEM_CALLOC(MEM_SCOPE, cg->nnodes, sizeof *c.seen),
+	};
+	for (size_t i = 0; i < cg->nnodes; ++i) {
+		struct ast_toplevel *top = cg->nodes[i].top;
+		c.cur = cg->nodes + i;
+		c.nlocals = c.base = 0;
+
+		if (top->type == EXPRTOP_FUNC) {
+			for (size_t j = 0; j < top->func.nargs; ++j) {
+				_cg_push_local(&c, top->func.args[j].name);
+			}
+			walk_expr(&c.walk, top->func.body, &_cg_ops, &c);
+		} else {
+			walk_expr(&c.walk, top->decl.val, &_cg_ops, &c);
+		}
+	}
+	MEM_FREE(c.seen);
+	MEM_FREE(c.locals);
+	MEM_FREE(c.frames);
+	walk_free(&c.walk);
+
+	_cg_sccs(cg);
+}
+
+void cg_free(struct callgraph *cg) {
+	for (size_t i = 0; i < cg->nnodes; ++i) {
+		MEM_FREE(cg->nodes[i].callees);
+		if (cg->nodes[i].prefix) MEM_FREE((char *)cg->nodes[i].name);
+	}
+	MEM_FREE(cg->nodes);
+	MEM_FREE(cg->sccs);
+	MEM_FREE(cg->scc_start);
+	MEM_FREE(cg->buf);
+	strmap_free(&cg->names);
+	*cg = (struct callgraph){0};
+}
+
+struct cg_node *cg_lookup(struct callgraph *cg, const char *name) {
+	size_t *i = strmap_get(&cg->names, name);
+	return i ? cg->nodes + *i : NULL;
+}
+
+struct cg_node *cg_resolve(struct callgraph *cg, struct cg_node *from, const char *name) {
+	if (!from->prefix) return cg_lookup(cg, name);
+
+	size_t name_len = strlen(name);
+	if (from->prefix + name_len + 1 > cg->buf_alloc) {
+		while (from->prefix + name_len + 1 > cg->buf_alloc) {
+			cg->buf_alloc = cg->buf_alloc ? cg->buf_alloc * 2 : 64;
+		}
+		cg->buf = MEM_REALLOC(MEM_NAME, cg->buf, cg->buf_alloc);
+	}
+	char *buf = cg->buf;
+	memcpy(buf, from->name, from->prefix);
+	struct cg_node *node = NULL;
+
+	// Drop one namespace at a time, down to the empty prefix
+	for (size_t len = from->prefix;;) {
+		memcpy(buf + len, name, name_len + 1);
+		node = cg_lookup(cg, buf);
+		if (node || !len) break;
+		--len;
+		while (len && buf[len-1] != '.') --len;
+	}
+	return node;
+}
+
+size_t cg_mark_reachable(struct callgraph *cg, size_t nroots, const char **roots) {
+	size_t *work = MEM_ALLOC(MEM_SCOPE, cg->nnodes * sizeof *work), nwork = 0;
+	size_t nreachable = 0;
+
+	for (size_t i = 0; i < cg->nnodes; ++i) {
+		cg->nodes[i].reachable = false;
+	}
+
+#define MARK(i) do { \
+		if (!cg->nodes[i].reachable) { \
+			cg->nodes[i].reachable = true; \
+			work[nwork++] = i; \
+			++nreachable; \
+		} \
+	} while (0)
+
+	for (size_t i = 0; i < nroots; ++i) {
+		size_t *root = strmap_get(&cg->names, roots[i]);
+		if (root) MARK(*root);
+	}
+	for (size_t i = 0; i < cg->nnodes; ++i) {
+		if (cg->nodes[i].top->type == EXPRTOP_DECL) MARK(i);
+	}
+
+	while (nwork) {
+		struct cg_node *node = cg->nodes + work[--nwork];
+		for (size_t i = 0; i < node->ncallees; ++i) {
+			MARK(node->callees[i]);
+		}
+	}
+
+#undef MARK
+
+	MEM_FREE(work);
+	cg->marked = true;
+	return nreachable;
+}
+
+void cg_report(struct callgraph *cg, FILE *f) {
+	size_t nfuncs = 0, npruned = 0;
+	size_t size = 0, pruned_size = 0;
+
+	for (size_t i = 0; i < cg->nnodes; ++i) {
+		struct cg_node *node = cg->nodes + i;
+		if (node->top->type != EXPRTOP_FUNC || !node->top->func.body) continue;
+
+		++nfuncs;
+		size += node->size;
+		if (!node->reachable) {
+			++npruned;
+			pruned_size += node->size;
+		}
+	}
+
+	fprintf(f, "callgraph: pruned %zu of %zu functions (%zu of %zu expression nodes)\n",
+		npruned, nfuncs, pruned_size, size);
+}
+
+void cg_dump(struct callgraph *cg, FILE *f) {
+	for (size_t i = 0; i < cg->nsccs; ++i) {
+		fprintf(f, "scc %zu {\n", i);
+		for (size_t j = cg->scc_start[i]; j < cg->scc_start[i+1]; ++j) {
+			struct cg_node *node = cg->nodes + cg->sccs[j];
+			fprintf(f, "\t%s", node->name);
+			if (cg->marked && !node->reachable) fputs(" (pruned)", f);
+			if (node->ncallees) fputs(" ->", f);
+			for (size_t k = 0; k < node->ncallees; ++k) {
+				fprintf(f, " %s", cg->nodes[node->callees[k]].name);
+			}
+			fputc('\n', f);
+		}
+		fputs("}\n", f);
+	}
+}
@@ -0,0 +1,70 @@
+// vim: noet
+
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+
+#include <stdio.h>
+#include "ast.h"
+#include "strmap.h"
+
+// One node per toplevel function or global variable. Edges are references
+// by name from the body or initializer, whether called or not.
+struct cg_node {
+	// Qualified by the enclosing named namespaces, as in ns.f. The first
+	// prefix characters are the namespaces and their trailing dot.
+	const char *name;
+	size_t prefix;
+	struct ast_toplevel *top;
+
+	// Number of expression nodes in the body or initializer
+	size_t size;
+
+	size_t ncallees, callees_alloc;
+	size_t *callees;
+
+	// SCCs are numbered in reverse topological order, so callees come first
+	size_t scc;
+	bool reachable;
+};
+
+struct callgraph {
+	size_t nnodes, alloc;
+	struct cg_node *nodes;
+	struct strmap names;
+
+	size_t nsccs;
+	// Nodes sorted by SCC; SCC i is sccs[scc_start[i] .. scc_start[i+1]]
+	size_t *sccs;
+	size_t *scc_start;
+
+	// Set once cg_mark_reachable has run
+	bool marked;
+
+	// Scratch space for the names cg_resolve tries, so lookups don't
+	// allocate. It makes cg_resolve unsafe to call from several threads.
+	char *buf;
+	size_t buf_alloc;
+};
+
+void cg_build(struct callgraph *cg, size_t ntops, struct ast_toplevel *tops);
+void cg_free(struct callgraph *cg);
+
+// Returns NULL if there is no toplevel with that qualified name
+struct cg_node *cg_lookup(struct callgraph *cg, const char *name);
+
+// Looks up a name referenced from the body of from, in from's namespace and
+// then each enclosing one in turn. Returns NULL if nothing matches.
+struct cg_node *cg_resolve(struct callgraph *cg, struct cg_node *from, const char *name);
+
+// Marks everything reachable from the roots, given by qualified name. Global
+// variables are always roots, as they are emitted regardless. Returns the
+// number of reachable nodes.
+size_t cg_mark_reachable(struct callgraph *cg, size_t nroots, const char **roots);
+
+// Prints how many functions and expression nodes were pruned
+void cg_report(struct callgraph *cg, FILE *f);
+
+// Prints every SCC with its members and their edges
+void cg_dump(struct callgraph *cg, FILE *f);
+
+#endif
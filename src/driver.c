@@ -0,0 +1,521 @@
+// vim: noet
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "driver.h"
+#include "lex.h"
+#include "memstats.h"
+#include "strmap.h"
+#include "y.tab.h"
+
+#define _drv_push(arr, n, alloc, x) do { \
+		if ((n) == (alloc)) { \
+			(alloc) = (alloc) ? (alloc) * 2 : 8; \
+			(arr) = realloc((arr), (alloc) * sizeof *(arr)); \
+		} \
+		(arr)[(n)++] = (x); \
+	} while (0)
+
+void drv_init(struct driver *d, size_t nfiles, char **paths, size_t jobs, size_t budget) {
+	d->nfiles = nfiles;
+	d->files = calloc(nfiles, sizeof *d->files);
+	for (size_t i = 0; i < nfiles; ++i) {
+		d->files[i].path = paths[i];
+		d->files[i].ok = true;
+	}
+	d->jobs = jobs ? jobs : 1;
+	d->budget = budget ? budget : DRV_DEFAULT_BUDGET;
+}
+
+void drv_free(struct driver *d) {
+	for (size_t i = 0; i < d->nfiles; ++i) {
+		struct drv_file *f = &d->files[i];
+		for (size_t j = 0; j < f->ndecls; ++j) MEM_FREE(f->decls[j]);
+		for (size_t j = 0; j < f->nrefs; ++j) MEM_FREE(f->refs[j]);
+		free(f->decls);
+		free(f->refs);
+		free(f->deps);
+		free(f->users);
+		free(f->out);
+	}
+	free(d->files);
+}
+
+// Dependency scan {{{
+
+static bool _drv_ident_start(char c) {
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool _drv_ident_char(char c) {
+	return _drv_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+static bool _drv_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Adds a copy of name to a list unless the set already has it
+static void _drv_add_name(char ***list, size_t *n, size_t *alloc, struct strmap *seen, const char *name, size_t len) {
+	char *s = MEM_STRNDUP(MEM_NAME, name, len);
+	if (!strmap_put(seen, s, 0)) {
+		MEM_FREE(s);
+		return;
+	}
+	_drv_push(*list, *n, *alloc, s);
+}
+
+// A much simpler tokenizer than the lexer's, which only needs to find
+// identifiers and braces, and skip comments and literals. Namespaces are
+// only used through a '.', so any identifier before one is a possible
+// reference.
+void drv_scan(struct drv_file *f, const char *src, size_t len) {
+	struct strmap decls = {0}, refs = {0};
+	for (size_t i = 0; i < f->ndecls; ++i) strmap_put(&decls, f->decls[i], 0);
+	for (size_t i = 0; i < f->nrefs; ++i) strmap_put(&refs, f->refs[i], 0);
+
+	size_t depth = 0;
+	bool after_ns = false, after_dot = false;
+	size_t i = 0;
+	while (i < len) {
+		char c = src[i];
+		if (_drv_space(c)) {
+			++i;
+			continue;
+		}
+
+		if (c == '/' && i + 1 < len && src[i+1] == '/') {
+			while (i < len && src[i] != '\n') ++i;
+			continue;
+		}
+		if (c == '/' && i + 1 < len && src[i+1] == '*') {
+			i += 2;
+			while (i < len && !(src[i] == '*' && i + 1 < len && src[i+1] == '/')) ++i;
+			i += 2;
+			continue;
+		}
+
+		bool ns = false, dot = false;
+		if (c == '"' || c == '\'') {
+			for (++i; i < len && src[i] != c; ++i) {
+				if (src[i] == '\\') ++i;
+			}
+			++i;
+		} else if (_drv_ident_start(c)) {
+			size_t start = i;
+			while (i < len && _drv_ident_char(src[i])) ++i;
+			size_t n = i - start;
+
+			size_t next = i;
+			while (next < len && _drv_space(src[next])) ++next;
+
+			if (after_ns) {
+				_drv_add_name(&f->decls, &f->ndecls, &f->decls_alloc, &decls, src + start, n);
+			} else if (!after_dot && next < len && src[next] == '.') {
+				_drv_add_name(&f->refs, &f->nrefs, &f->refs_alloc, &refs, src + start, n);
+			}
+			ns = depth == 0 && n == 2 && !memcmp(src + start, "ns", 2);
+		} else if (c >= '0' && c <= '9') {
+			// Covers every form of integer and float, suffixes included
+			while (i < len && (_drv_ident_char(src[i]) || src[i] == '.')) ++i;
+		} else {
+			if (c == '{') ++depth;
+			if (c == '}' && depth) --depth;
+			dot = c == '.';
+			++i;
+		}
+		after_ns = ns;
+		after_dot = dot;
+	}
+
+	strmap_free(&decls);
+	strmap_free(&refs);
+}
+
+void drv_link(struct driver *d) {
+	// Namespaces may be declared by several files, so each name maps to a
+	// list of the files declaring it
+	struct strmap owners = {0};
+	size_t nentries = 0, alloc = 0;
+	struct { size_t file, next; } *entries = NULL;
+
+	for (size_t i = 0; i < d->nfiles; ++i) {
+		struct drv_file *f = &d->files[i];
+		for (size_t j = 0; j < f->ndecls; ++j) {
+			size_t *head = strmap_get(&owners, f->decls[j]);
+			if (nentries == alloc) {
+				alloc = alloc ? alloc * 2 : 8;
+				entries = realloc(entries, alloc * sizeof *entries);
+			}
+			entries[nentries].file = i;
+			entries[nentries].next = head ? *head : SIZE_MAX;
+			if (head) *head = nentries;
+			else strmap_put(&owners, f->decls[j], nentries);
+			++nentries;
+		}
+	}
+
+	// Last file that added each file as a dependency, plus one
+	size_t *mark = calloc(d->nfiles, sizeof *mark);
+	for (size_t i = 0; i < d->nfiles; ++i) {
+		struct drv_file *f = &d->files[i];
+		for (size_t j = 0; j < f->nrefs; ++j) {
+			size_t *head = strmap_get(&owners, f->refs[j]);
+			for (size_t e = head ? *head : SIZE_MAX; e != SIZE_MAX; e = entries[e].next) {
+				size_t dep = entries[e].file;
+				if (dep == i || mark[dep] == i + 1) continue;
+				mark[dep] = i + 1;
+				_drv_push(f->deps, f->ndeps, f->deps_alloc, dep);
+				_drv_push(d->files[dep].users, d->files[dep].nusers, d->files[dep].users_alloc, i);
+			}
+		}
+	}
+
+	free(mark);
+	free(entries);
+	strmap_free(&owners);
+}
+
+// }}}
+
+// Scheduling {{{
+
+struct _drv_sched {
+	struct driver *d;
+	// Unfinished dependencies of each file, or NULL to ignore them
+	size_t *waiting;
+	bool *started;
+	// Min-heap of files whose dependencies are done, so that the lowest
+	// index goes first
+	size_t nready;
+	size_t *ready;
+	// Every file below this has been started
+	size_t lowest;
+	size_t nrunning, ndone;
+};
+
+static void _sched_push(struct _drv_sched *s, size_t i) {
+	size_t k = s->nready++;
+	while (k && s->ready[(k - 1) / 2] > i) {
+		s->ready[k] = s->ready[(k - 1) / 2];
+		k = (k - 1) / 2;
+	}
+	s->ready[k] = i;
+}
+
+static size_t _sched_pop(struct _drv_sched *s) {
+	size_t top = s->ready[0], last = s->ready[--s->nready];
+	size_t k = 0;
+	for (;;) {
+		size_t c = 2 * k + 1;
+		if (c >= s->nready) break;
+		if (c + 1 < s->nready && s->ready[c+1] < s->ready[c]) ++c;
+		if (s->ready[c] >= last) break;
+		s->ready[k] = s->ready[c];
+		k = c;
+	}
+	if (s->nready) s->ready[k] = last;
+	return top;
+}
+
+static void _sched_init(struct _drv_sched *s, struct driver *d, bool deps) {
+	s->d = d;
+	s->waiting = deps ? malloc(d->nfiles * sizeof *s->waiting) : NULL;
+	s->started = calloc(d->nfiles, sizeof *s->started);
+	s->ready = malloc(d->nfiles * sizeof *s->ready);
+	s->nready = s->lowest = s->nrunning = s->ndone = 0;
+	for (size_t i = 0; i < d->nfiles; ++i) {
+		if (deps) s->waiting[i] = d->files[i].ndeps;
+		if (!deps || !d->files[i].ndeps) _sched_push(s, i);
+	}
+}
+
+static void _sched_free(struct _drv_sched *s) {
+	free(s->waiting);
+	free(s->started);
+	free(s->ready);
+}
+
+// Returns false if nothing can start until a running file finishes, or
+// everything is done
+static bool _sched_next(struct _drv_sched *s, size_t *i) {
+	if (s->nready) {
+		*i = _sched_pop(s);
+		goto start;
+	}
+
+	// Only a cycle can leave files blocked with nothing running
+	if (s->nrunning || s->ndone == s->d->nfiles) return false;
+	while (s->started[s->lowest]) ++s->lowest;
+	*i = s->lowest;
+
+start:
+	s->started[*i] = true;
+	++s->nrunning;
+	return true;
+}
+
+static void _sched_done(struct _drv_sched *s, size_t i) {
+	--s->nrunning;
+	++s->ndone;
+	if (!s->waiting) return;
+
+	struct drv_file *f = &s->d->files[i];
+	for (size_t j = 0; j < f->nusers; ++j) {
+		size_t u = f->users[j];
+		if (!--s->waiting[u] && !s->started[u]) _sched_push(s, u);
+	}
+}
+
+void drv_order(struct driver *d, size_t *order) {
+	struct _drv_sched s;
+	_sched_init(&s, d, true);
+	size_t n = 0;
+	while (_sched_next(&s, &order[n])) _sched_done(&s, order[n++]);
+	_sched_free(&s);
+}
+
+// }}}
+
+// Thread pool {{{
+
+// Source of a file being worked on: mapped if it is a regular file, and
+// read in otherwise. Either way, it is followed by two NULs for the lexer.
+struct _drv_src {
+	struct lex_file map;
+	char *buf;
+	size_t len;
+	// Bytes counted against the budget
+	size_t charged;
+};
+
+// Runs both passes, so that sources loaded by the scan can be kept for the
+// build
+struct _drv_pool {
+	struct driver *d;
+	struct _drv_sched sched;
+	void (*work)(struct _drv_pool *p, size_t i);
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// Bytes of source currently loaded, kept sources included
+	size_t in_flight;
+	struct _drv_src *srcs;
+	// Whether each file's source was loaded by the scan and is waiting to
+	// be built. Only its owner touches a source that isn't kept.
+	bool *kept;
+};
+
+static void *_drv_worker(void *arg) {
+	struct _drv_pool *p = arg;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		size_t i;
+		if (!_sched_next(&p->sched, &i)) {
+			if (p->sched.ndone == p->d->nfiles) break;
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+		p->work(p, i);
+		pthread_mutex_lock(&p->lock);
+
+		_sched_done(&p->sched, i);
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void _drv_pool_init(struct _drv_pool *p, struct driver *d) {
+	*p = (struct _drv_pool){.d = d};
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->srcs = calloc(d->nfiles, sizeof *p->srcs);
+	p->kept = calloc(d->nfiles, sizeof *p->kept);
+}
+
+static void _drv_pool_free(struct _drv_pool *p) {
+	free(p->srcs);
+	free(p->kept);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+}
+
+static void _drv_pool_run(struct _drv_pool *p, bool deps, void (*work)(struct _drv_pool *p, size_t i)) {
+	struct driver *d = p->d;
+	p->work = work;
+	_sched_init(&p->sched, d, deps);
+
+	size_t nthreads = d->jobs < d->nfiles ? d->jobs : d->nfiles;
+	pthread_t *threads = malloc(nthreads * sizeof *threads);
+	// The calling thread is one of the workers
+	size_t started = 0;
+	for (size_t i = 1; i < nthreads; ++i) {
+		if (pthread_create(&threads[started], NULL, _drv_worker, p)) break;
+		++started;
+	}
+	_drv_worker(p);
+	for (size_t i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+
+	free(threads);
+	_sched_free(&p->sched);
+}
+
+static void _drv_fail(struct drv_file *f, const char *msg) {
+	FILE *out = open_memstream(&f->out, &f->outlen);
+	fprintf(out, "%s: %s\n", f->path, msg);
+	fclose(out);
+	f->ok = false;
+}
+
+static bool _drv_read(FILE *in, struct _drv_src *src) {
+	size_t alloc = 4096, n = 0;
+	char *buf = MEM_ALLOC(MEM_LEXER, alloc);
+	for (;;) {
+		n += fread(buf + n, 1, alloc - n - 2, in);
+		if (n < alloc - 2) break;
+		alloc *= 2;
+		buf = MEM_REALLOC(MEM_LEXER, buf, alloc);
+	}
+	if (ferror(in)) {
+		MEM_FREE(buf);
+		return false;
+	}
+	buf[n] = buf[n+1] = 0;
+	src->buf = buf;
+	src->len = n;
+	return true;
+}
+
+static void _drv_release(struct _drv_src *src) {
+	if (src->map.buf) lex_unmap(&src->map);
+	else MEM_FREE(src->buf);
+}
+
+// Unloads the last charged source kept, as files are built roughly in order.
+// Called with the lock held.
+static bool _drv_evict(struct _drv_pool *p) {
+	for (size_t i = p->d->nfiles; i--;) {
+		struct _drv_src *src = &p->srcs[i];
+		if (!p->kept[i] || !src->charged) continue;
+		_drv_release(src);
+		p->in_flight -= src->charged;
+		p->kept[i] = false;
+		return true;
+	}
+	return false;
+}
+
+// Loads a file once its size fits in the budget, evicting kept sources to
+// make room. Returns false on failure, with the file marked as failed.
+static bool _drv_load(struct _drv_pool *p, size_t i, struct _drv_src *src) {
+	struct drv_file *f = &p->d->files[i];
+	*src = (struct _drv_src){0};
+
+	if (lex_map(&src->map, f->path)) {
+		// Nothing is resident until it's read, so the budget can wait
+		// until after mapping
+		pthread_mutex_lock(&p->lock);
+		while (p->in_flight && p->in_flight + src->map.len > p->d->budget) {
+			if (!_drv_evict(p)) pthread_cond_wait(&p->cond, &p->lock);
+		}
+		p->in_flight += src->map.len;
+		pthread_mutex_unlock(&p->lock);
+
+		src->buf = src->map.buf;
+		src->len = src->map.len;
+		src->charged = src->map.len;
+		return true;
+	}
+
+	// Pipes and the like have no size to go by, so they aren't charged
+	FILE *in = errno == ENODEV ? fopen(f->path, "rb") : NULL;
+	if (!in || !_drv_read(in, src)) {
+		_drv_fail(f, strerror(errno));
+		if (in) fclose(in);
+		return false;
+	}
+	fclose(in);
+	return true;
+}
+
+static void _drv_unload(struct _drv_pool *p, struct _drv_src *src) {
+	_drv_release(src);
+
+	pthread_mutex_lock(&p->lock);
+	p->in_flight -= src->charged;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Keeps the source for the build, unless a load needs its room first
+static void _drv_scan_file(struct _drv_pool *p, size_t i) {
+	struct _drv_src *src = &p->srcs[i];
+	if (!_drv_load(p, i, src)) return;
+	drv_scan(&p->d->files[i], src->buf, src->len);
+
+	pthread_mutex_lock(&p->lock);
+	p->kept[i] = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Without a stream, as when parsing stdin, messages go to stderr
+int yyerror(yyscan_t scanner, const char *path, FILE *msgs, unsigned long *shape, const char *s) {
+	if (msgs) fprintf(msgs, "%s: %s\n", path, s);
+	else fprintf(stderr, "%s\n", s);
+	return 0;
+}
+
+// Each file has its own scanner, so files are lexed and parsed in parallel
+static void _drv_build_file(struct _drv_pool *p, size_t i) {
+	struct drv_file *f = &p->d->files[i];
+	// Already reported when scanning
+	if (!f->ok) return;
+
+	struct _drv_src *src = &p->srcs[i];
+	pthread_mutex_lock(&p->lock);
+	bool kept = p->kept[i];
+	p->kept[i] = false;
+	pthread_mutex_unlock(&p->lock);
+	if (!kept && !_drv_load(p, i, src)) return;
+
+	yyscan_t scanner;
+	if (!lex_init(&scanner)) {
+		_drv_fail(f, strerror(errno));
+		_drv_unload(p, src);
+		return;
+	}
+	FILE *msgs = open_memstream(&f->out, &f->outlen);
+	if (src->map.buf) lex_mapped(scanner, &src->map);
+	else lex_buffer(scanner, src->buf, src->len);
+	f->ok = !yyparse(scanner, f->path, msgs, NULL);
+	fclose(msgs);
+	lex_free(scanner);
+
+	_drv_unload(p, src);
+}
+
+// }}}
+
+bool drv_run(struct driver *d, FILE *out) {
+	struct _drv_pool p;
+	_drv_pool_init(&p, d);
+	_drv_pool_run(&p, false, _drv_scan_file);
+	drv_link(d);
+	_drv_pool_run(&p, true, _drv_build_file);
+	_drv_pool_free(&p);
+
+	bool ok = true;
+	for (size_t i = 0; i < d->nfiles; ++i) {
+		struct drv_file *f = &d->files[i];
+		if (f->outlen) fwrite(f->out, 1, f->outlen, out);
+		ok &= f->ok;
+	}
+	return ok;
+}
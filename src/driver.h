@@ -0,0 +1,62 @@
+// vim: noet
+
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct drv_file {
+	const char *path;
+
+	// Namespaces declared at the top level, and identifiers used before a
+	// '.', which may name a namespace declared by another file
+	size_t ndecls, decls_alloc;
+	char **decls;
+	size_t nrefs, refs_alloc;
+	char **refs;
+
+	// Files that are built before this one, and the files waiting on it
+	size_t ndeps, deps_alloc;
+	size_t *deps;
+	size_t nusers, users_alloc;
+	size_t *users;
+
+	// Diagnostics, printed in command-line order once every file is done
+	char *out;
+	size_t outlen;
+	bool ok;
+};
+
+#define DRV_DEFAULT_BUDGET ((size_t)256 << 20)
+
+struct driver {
+	size_t nfiles;
+	struct drv_file *files;
+
+	// Worker threads, including the caller
+	size_t jobs;
+	// Most bytes of source held in memory at once. A file larger than this
+	// is still built, but only while nothing else is loaded.
+	size_t budget;
+};
+
+void drv_init(struct driver *d, size_t nfiles, char **paths, size_t jobs, size_t budget);
+void drv_free(struct driver *d);
+
+// Finds the declared and referenced namespaces of a source file
+void drv_scan(struct drv_file *f, const char *src, size_t len);
+// Turns namespace references into dependencies between scanned files
+void drv_link(struct driver *d);
+// The order a single thread builds the files in: dependencies first, and
+// otherwise in command-line order. Cycles are broken at their first file.
+void drv_order(struct driver *d, size_t *order);
+
+// Scans, links and parses every file, each parse on its own scanner. A
+// file is loaded once for both, unless the budget needs its room between
+// them. The output is the same whatever the number of jobs, and the same as
+// building each file on its own. Returns false if any file failed.
+bool drv_run(struct driver *d, FILE *out);
+
+#endif
@@ -0,0 +1,267 @@
+// vim: noet
+
+#include <stdlib.h>
+#include <string.h>
+#include "elfobj.h"
+
+static const char *const _elf_names[ELF_NSECTS] = {
+	[ELF_TEXT] = ".text",
+	[ELF_RODATA] = ".rodata",
+	[ELF_BSS] = ".bss",
+	[ELF_INIT_ARRAY] = ".init_array",
+};
+
+void elf_init(struct elf_obj *o) {
+	*o = (struct elf_obj){0};
+	for (enum elf_sect s = 0; s < ELF_NSECTS; ++s) o->sects[s].align = 1;
+}
+
+void elf_free(struct elf_obj *o) {
+	for (enum elf_sect s = 0; s < ELF_NSECTS; ++s) {
+		free(o->sects[s].data);
+		free(o->sects[s].relocs);
+	}
+	for (size_t i = 0; i < o->nsyms; ++i) free(o->syms[i].name);
+	free(o->syms);
+	strmap_free(&o->names);
+	*o = (struct elf_obj){0};
+}
+
+size_t elf_sym(struct elf_obj *o, const char *name) {
+	size_t *existing = strmap_get(&o->names, name);
+	if (existing) return *existing;
+
+	if (o->nsyms == o->syms_alloc) {
+		o->syms_alloc = o->syms_alloc ? o->syms_alloc * 2 : 64;
+		o->syms = realloc(o->syms, o->syms_alloc * sizeof *o->syms);
+	}
+	o->syms[o->nsyms] = (struct elf_sym){.name = strdup(name), .sect = ELF_UNDEF, .global = true};
+	strmap_put(&o->names, o->syms[o->nsyms].name, o->nsyms);
+	return o->nsyms++;
+}
+
+void elf_define(struct elf_obj *o, size_t sym, enum elf_sect sect, size_t value, size_t size, bool func, bool global) {
+	struct elf_sym *s = o->syms + sym;
+	s->sect = sect;
+	s->value = value;
+	s->size = size;
+	s->func = func;
+	s->global = global;
+}
+
+size_t elf_append(struct elf_obj *o, enum elf_sect sect, const void *p, size_t n, size_t align) {
+	struct elf_section *s = o->sects + sect;
+	if (align > s->align) s->align = align;
+	size_t off = (s->size + align - 1) / align * align;
+
+	if (sect != ELF_BSS) {
+		if (off + n > s->alloc) {
+			while (off + n > s->alloc) s->alloc = s->alloc ? s->alloc * 2 : 4096;
+			s->data = realloc(s->data, s->alloc);
+		}
+		memset(s->data + s->size, 0, off - s->size);
+		if (p) {
+			memcpy(s->data + off, p, n);
+		} else {
+			memset(s->data + off, 0, n);
+		}
+	}
+	s->size = off + n;
+	return off;
+}
+
+void elf_reloc(struct elf_obj *o, enum elf_sect sect, size_t offset, size_t sym, uint32_t type, int64_t addend) {
+	struct elf_section *s = o->sects + sect;
+	if (s->nrelocs == s->relocs_alloc) {
+		s->relocs_alloc = s->relocs_alloc ? s->relocs_alloc * 2 : 64;
+		s->relocs = realloc(s->relocs, s->relocs_alloc * sizeof *s->relocs);
+	}
+	s->relocs[s->nrelocs++] = (struct elf_reloc){offset, sym, type, addend};
+}
+
+// Writing {{{
+
+// Section header indices in the output. Progbits sections come first, in
+// elf_sect order, then a relocation section for each of them.
+enum {
+	_SH_NULL,
+	_SH_RELA = 1 + ELF_NSECTS,
+	_SH_SYMTAB = _SH_RELA + ELF_NSECTS,
+	_SH_STRTAB,
+	_SH_SHSTRTAB,
+	_SH_NOTE,
+	_SH_COUNT,
+};
+
+struct _elf_out {
+	FILE *f;
+	size_t pos;
+};
+
+static void _elf_put(struct _elf_out *w, const void *p, size_t n) {
+	fwrite(p, 1, n, w->f);
+	w->pos += n;
+}
+
+static size_t _elf_pad(struct _elf_out *w, size_t align) {
+	static const uint8_t zeros[16];
+	while (w->pos % align) _elf_put(w, zeros, 1);
+	return w->pos;
+}
+
+// String tables are built in memory streams
+static uint32_t _elf_str(FILE *tab, const char *s) {
+	long off = ftell(tab);
+	fwrite(s, 1, strlen(s) + 1, tab);
+	return off;
+}
+
+bool elf_write(struct elf_obj *o, FILE *f) {
+	Elf64_Shdr sh[_SH_COUNT] = {0};
+	char *shstrtab, *strtab;
+	size_t shstrtab_len, strtab_len;
+	FILE *shstr = open_memstream(&shstrtab, &shstrtab_len);
+	FILE *str = open_memstream(&strtab, &strtab_len);
+	fputc(0, shstr);
+	fputc(0, str);
+
+	// ELF wants the locals first
+	size_t *index = malloc(o->nsyms * sizeof *index);
+	Elf64_Sym *syms = calloc(o->nsyms + 1, sizeof *syms);
+	size_t nsyms = 1;
+	for (int global = 0; global < 2; ++global) {
+		if (global) sh[_SH_SYMTAB].sh_info = nsyms;
+		for (size_t i = 0; i < o->nsyms; ++i) {
+			struct elf_sym *s = o->syms + i;
+			if (s->global != global) continue;
+			index[i] = nsyms;
+			syms[nsyms++] = (Elf64_Sym){
+				.st_name = _elf_str(str, s->name),
+				.st_info = ELF64_ST_INFO(s->global ? STB_GLOBAL : STB_LOCAL,
+					s->sect == ELF_UNDEF ? STT_NOTYPE : s->func ? STT_FUNC : STT_OBJECT),
+				.st_shndx = s->sect == ELF_UNDEF ? SHN_UNDEF : 1 + s->sect,
+				.st_value = s->value,
+				.st_size = s->size,
+			};
+		}
+	}
+
+	Elf64_Ehdr eh = {
+		.e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+		.e_type = ET_REL,
+		.e_machine = EM_X86_64,
+		.e_version = EV_CURRENT,
+		.e_ehsize = sizeof eh,
+		.e_shentsize = sizeof *sh,
+		.e_shnum = _SH_COUNT,
+		.e_shstrndx = _SH_SHSTRTAB,
+	};
+	struct _elf_out w = {f, 0};
+	_elf_put(&w, &eh, sizeof eh);
+
+	for (enum elf_sect s = 0; s < ELF_NSECTS; ++s) {
+		struct elf_section *sect = o->sects + s;
+		Elf64_Shdr *h = sh + 1 + s;
+		h->sh_name = _elf_str(shstr, _elf_names[s]);
+		h->sh_addralign = sect->align;
+		h->sh_size = sect->size;
+		switch (s) {
+		case ELF_TEXT:
+			h->sh_type = SHT_PROGBITS;
+			h->sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+			break;
+		case ELF_RODATA:
+			h->sh_type = SHT_PROGBITS;
+			h->sh_flags = SHF_ALLOC;
+			break;
+		case ELF_BSS:
+			h->sh_type = SHT_NOBITS;
+			h->sh_flags = SHF_ALLOC | SHF_WRITE;
+			break;
+		case ELF_INIT_ARRAY:
+			h->sh_type = SHT_INIT_ARRAY;
+			h->sh_flags = SHF_ALLOC | SHF_WRITE;
+			h->sh_entsize = sizeof (uint64_t);
+			break;
+		default:
+			break;
+		}
+		h->sh_offset = _elf_pad(&w, sect->align);
+		if (sect->data) _elf_put(&w, sect->data, sect->size);
+	}
+
+	for (enum elf_sect s = 0; s < ELF_NSECTS; ++s) {
+		struct elf_section *sect = o->sects + s;
+		Elf64_Shdr *h = sh + _SH_RELA + s;
+		char name[32];
+		snprintf(name, sizeof name, ".rela%s", _elf_names[s]);
+		*h = (Elf64_Shdr){
+			.sh_name = _elf_str(shstr, name),
+			.sh_type = SHT_RELA,
+			.sh_flags = SHF_INFO_LINK,
+			.sh_offset = _elf_pad(&w, 8),
+			.sh_size = sect->nrelocs * sizeof (Elf64_Rela),
+			.sh_link = _SH_SYMTAB,
+			.sh_info = 1 + s,
+			.sh_addralign = 8,
+			.sh_entsize = sizeof (Elf64_Rela),
+		};
+		for (size_t i = 0; i < sect->nrelocs; ++i) {
+			struct elf_reloc *r = sect->relocs + i;
+			Elf64_Rela rela = {
+				.r_offset = r->offset,
+				.r_info = ELF64_R_INFO(index[r->sym], r->type),
+				.r_addend = r->addend,
+			};
+			_elf_put(&w, &rela, sizeof rela);
+		}
+	}
+
+	sh[_SH_SYMTAB].sh_name = _elf_str(shstr, ".symtab");
+	sh[_SH_SYMTAB].sh_type = SHT_SYMTAB;
+	sh[_SH_SYMTAB].sh_offset = _elf_pad(&w, 8);
+	sh[_SH_SYMTAB].sh_size = nsyms * sizeof *syms;
+	sh[_SH_SYMTAB].sh_link = _SH_STRTAB;
+	sh[_SH_SYMTAB].sh_addralign = 8;
+	sh[_SH_SYMTAB].sh_entsize = sizeof *syms;
+	_elf_put(&w, syms, nsyms * sizeof *syms);
+
+	// Marks the stack as not executable
+	sh[_SH_NOTE].sh_name = _elf_str(shstr, ".note.GNU-stack");
+	sh[_SH_NOTE].sh_type = SHT_PROGBITS;
+	sh[_SH_NOTE].sh_offset = w.pos;
+	sh[_SH_NOTE].sh_addralign = 1;
+
+	sh[_SH_STRTAB].sh_name = _elf_str(shstr, ".strtab");
+	sh[_SH_SHSTRTAB].sh_name = _elf_str(shstr, ".shstrtab");
+	fclose(str);
+	fclose(shstr);
+
+	sh[_SH_STRTAB].sh_type = SHT_STRTAB;
+	sh[_SH_STRTAB].sh_offset = w.pos;
+	sh[_SH_STRTAB].sh_size = strtab_len;
+	sh[_SH_STRTAB].sh_addralign = 1;
+	_elf_put(&w, strtab, strtab_len);
+
+	sh[_SH_SHSTRTAB].sh_type = SHT_STRTAB;
+	sh[_SH_SHSTRTAB].sh_offset = w.pos;
+	sh[_SH_SHSTRTAB].sh_size = shstrtab_len;
+	sh[_SH_SHSTRTAB].sh_addralign = 1;
+	_elf_put(&w, shstrtab, shstrtab_len);
+
+	// The header already went out, so its section table offset is patched
+	// in afterwards
+	size_t shoff = _elf_pad(&w, 8);
+	_elf_put(&w, sh, sizeof sh);
+	bool ok = !fseek(f, offsetof(Elf64_Ehdr, e_shoff), SEEK_SET)
+		&& fwrite(&(Elf64_Off){shoff}, sizeof (Elf64_Off), 1, f) == 1
+		&& !fseek(f, 0, SEEK_END);
+
+	free(strtab);
+	free(shstrtab);
+	free(syms);
+	free(index);
+	return ok && !ferror(f);
+}
+
+// }}}
@@ -0,0 +1,69 @@
+// vim: noet
+
+#ifndef ELFOBJ_H
+#define ELFOBJ_H
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "strmap.h"
+
+// Relocatable x86-64 ELF objects, built up in memory and written at once
+
+enum elf_sect {
+	ELF_TEXT,
+	ELF_RODATA,
+	ELF_BSS,
+	ELF_INIT_ARRAY,
+	ELF_NSECTS,
+	// Symbols in no section are undefined
+	ELF_UNDEF = ELF_NSECTS,
+};
+
+// type is one of the R_X86_64_* from elf.h
+struct elf_reloc {
+	size_t offset, sym;
+	uint32_t type;
+	int64_t addend;
+};
+
+struct elf_sym {
+	char *name;
+	enum elf_sect sect;
+	size_t value, size;
+	bool global, func;
+};
+
+struct elf_section {
+	// Bss has a size but no data
+	size_t size, alloc, align;
+	uint8_t *data;
+
+	size_t nrelocs, relocs_alloc;
+	struct elf_reloc *relocs;
+};
+
+struct elf_obj {
+	struct elf_section sects[ELF_NSECTS];
+
+	size_t nsyms, syms_alloc;
+	struct elf_sym *syms;
+	struct strmap names;
+};
+
+void elf_init(struct elf_obj *o);
+void elf_free(struct elf_obj *o);
+
+// Finds a symbol by name, adding it as undefined if it's new. The name is
+// copied.
+size_t elf_sym(struct elf_obj *o, const char *name);
+void elf_define(struct elf_obj *o, size_t sym, enum elf_sect sect, size_t value, size_t size, bool func, bool global);
+
+// Pads the section to align, then appends n bytes, or reserves them in bss
+// if p is NULL. Returns their offset.
+size_t elf_append(struct elf_obj *o, enum elf_sect sect, const void *p, size_t n, size_t align);
+void elf_reloc(struct elf_obj *o, enum elf_sect sect, size_t offset, size_t sym, uint32_t type, int64_t addend);
+
+bool elf_write(struct elf_obj *o, FILE *f);
+
+#endif
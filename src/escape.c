@@ -0,0 +1,556 @@
+// vim: noet
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "escape.h"
+#include "memstats.h"
+#include "type.h"
+#include "walk.h"
+
+// Structs with more fields than this stay whole
+#define _ESC_SPLIT_FIELDS 4
+
+#define _PUSH(arr, n, alloc, init) do { \
+	if ((n) == (alloc)) { \
+		(alloc) = (alloc) ? (alloc) * 2 : (init); \
+		(arr) = realloc((arr), (alloc) * sizeof *(arr)); \
+	} \
+} while (0)
+
+static const char *const _esc_kind_names[ESC_NKINDS] = {
+	[ESC_CALL] = "calls",
+	[ESC_RETURN] = "returns",
+	[ESC_STORE] = "stores",
+	[ESC_GLOBAL] = "globals",
+	[ESC_OTHER] = "other uses",
+};
+
+struct _esc_binding {
+	const char *name;
+	struct ref_type type;
+	// NULL for arguments
+	struct ast_expr *let;
+
+	bool addr_taken;
+	// Bits of 1 << ESC_*
+	unsigned escapes;
+	// Used other than as the aggregate of a field access
+	bool whole;
+
+	// Set for a pointer initialized to the address of target or one of its
+	// fields. While it is only dereferenced, target doesn't escape through it.
+	size_t target;
+	struct ast_expr *lvalue;
+
+	// Names of the bindings it is split into
+	const char **fields;
+};
+
+// A dereference, or field access, of a binding
+struct _esc_site {
+	struct ast_expr *e;
+	size_t binding;
+};
+
+struct _esc_ctx {
+	struct walk_stack walk;
+
+	size_t nbindings, bindings_alloc;
+	struct _esc_binding *bindings;
+	// Indices of the bindings in scope, innermost last
+	size_t nscope, scope_alloc;
+	size_t *scope;
+
+	// The expression whose child is being visited, and which child
+	struct ast_expr *parent;
+	size_t index;
+	// How the value of the body escapes
+	enum escape_kind root;
+
+	size_t nderefs, derefs_alloc;
+	struct _esc_site *derefs;
+	size_t nfields, fields_alloc;
+	struct _esc_site *fields;
+	// Bindings of lets, innermost first
+	size_t nlets, lets_alloc;
+	size_t *lets;
+
+	// Names made by _fresh so far in the unit
+	size_t nfresh;
+};
+
+// Helpers {{{
+
+// Names containing '$' cannot be written in source, so they never clash
+static const char *_fresh(struct _esc_ctx *c, const char *name, const char *field) {
+	size_t len = strlen(name) + strlen(field) + 24;
+	char *s = MEM_ALLOC(MEM_NAME, len);
+	snprintf(s, len, "$%s.%s.%zu", name, field, ++c->nfresh);
+	return s;
+}
+
+// Strips field accesses off an lvalue, leaving an identifier or dereference
+static struct ast_expr *_lvalue_root(struct ast_expr *e) {
+	while (e->t == EXPR_FIELD_ACCESS) e = e->field_access.aggr;
+	return e;
+}
+
+static bool _is_unop(struct ast_expr *e, int op) {
+	return e && e->t == EXPR_UNOP && e->unop.t == op;
+}
+
+static bool _is_aggr(const struct val_type *t) {
+	return t->t == TYPE_STRUCT || t->t == TYPE_UNION;
+}
+
+static bool _is_scalar(const struct val_type *t) {
+	switch (t->t) {
+	case TYPE_INT:
+	case TYPE_FLOAT:
+	case TYPE_BOOL:
+	case TYPE_PTR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Frees an lvalue made of field accesses on an identifier
+static void _free_lvalue(struct ast_expr *e) {
+	while (e->t == EXPR_FIELD_ACCESS) {
+		struct ast_expr *aggr = e->field_access.aggr;
+		MEM_FREE(e);
+		e = aggr;
+	}
+	MEM_FREE(e);
+}
+
+// }}}
+
+// Analysis {{{
+
+static size_t _find(struct _esc_ctx *c, const char *name) {
+	for (size_t i = c->nscope; i-- > 0;) {
+		if (!strcmp(c->bindings[c->scope[i]].name, name)) return c->scope[i];
+	}
+	return SIZE_MAX;
+}
+
+static void _push_binding(struct _esc_ctx *c, const char *name, struct ref_type type, struct ast_expr *let) {
+	_PUSH(c->bindings, c->nbindings, c->bindings_alloc, 16);
+	c->bindings[c->nbindings] = (struct _esc_binding){
+		.name = name,
+		.type = type,
+		.let = let,
+		.target = SIZE_MAX,
+	};
+	if (c->nscope == c->scope_alloc) {
+		c->scope_alloc = c->scope_alloc ? c->scope_alloc * 2 : 16;
+		c->scope = MEM_REALLOC(MEM_SCOPE, c->scope, c->scope_alloc * sizeof *c->scope);
+	}
+	c->scope[c->nscope++] = c->nbindings++;
+}
+
+static void _push_site(struct _esc_site **sites, size_t *n, size_t *alloc, struct ast_expr *e, size_t binding) {
+	_PUSH(*sites, *n, *alloc, 16);
+	(*sites)[(*n)++] = (struct _esc_site){e, binding};
+}
+
+// The binding a let's pointer would be derived from, or SIZE_MAX. Only
+// plain lets qualify: deferred code would keep the pointer alive.
+static size_t _derived_target(struct _esc_ctx *c, struct ast_expr *let) {
+	if (let->let.deferred || let->let.type.vol || !_is_unop(let->let.val, UNOP_REF)) return SIZE_MAX;
+	struct ast_expr *root = _lvalue_root(let->let.val->unop.x);
+	if (root->t != EXPR_IDENT) return SIZE_MAX;
+	size_t target = _find(c, root->ident);
+	if (target == SIZE_MAX || c->bindings[target].target != SIZE_MAX) return SIZE_MAX;
+	return target;
+}
+
+// How a pointer used as the current child escapes
+static enum escape_kind _escape_kind(struct _esc_ctx *c) {
+	struct ast_expr *p = c->parent;
+	if (!p) return c->root;
+
+	switch (p->t) {
+	case EXPR_CALL:
+		return ESC_CALL;
+	case EXPR_RETURN:
+		return ESC_RETURN;
+	case EXPR_ARR_LIT:
+	case EXPR_COMPOSITE_LIT:
+		return ESC_STORE;
+	case EXPR_LET:
+		return c->index == 0 ? ESC_STORE : ESC_OTHER;
+	case EXPR_BINOP:
+		if (p->binop.t == BINOP_ASSIGN && c->index == 1) {
+			struct ast_expr *root = _lvalue_root(p->binop.x);
+			if (root->t == EXPR_IDENT && _find(c, root->ident) == SIZE_MAX) return ESC_GLOBAL;
+			return ESC_STORE;
+		}
+		return ESC_OTHER;
+	default:
+		return ESC_OTHER;
+	}
+}
+
+static void _escape(struct _esc_ctx *c, size_t binding, enum escape_kind kind) {
+	c->bindings[binding].escapes |= 1u << kind;
+}
+
+static bool _ref(struct _esc_ctx *c, struct ast_expr *e) {
+	struct ast_expr *root = _lvalue_root(e->unop.x);
+	if (root->t != EXPR_IDENT) {
+		// &*p gives the pointer back
+		if (_is_unop(root, UNOP_DEREF) && root->unop.x->t == EXPR_IDENT) {
+			size_t p = _find(c, root->unop.x->ident);
+			if (p != SIZE_MAX && c->bindings[p].target != SIZE_MAX) _escape(c, c->bindings[p].target, ESC_OTHER);
+		}
+		return true;
+	}
+
+	size_t i = _find(c, root->ident);
+	if (i == SIZE_MAX) return false;
+	struct _esc_binding *b = c->bindings + i;
+	b->addr_taken = true;
+	if (b->target != SIZE_MAX) _escape(c, b->target, ESC_OTHER);
+
+	if (_is_unop(c->parent, UNOP_DEREF)) {
+		_push_site(&c->derefs, &c->nderefs, &c->derefs_alloc, c->parent, i);
+	} else if (!(c->parent && c->parent->t == EXPR_LET && c->index == 0 && _derived_target(c, c->parent) == i)) {
+		_escape(c, i, _escape_kind(c));
+	}
+	return false;
+}
+
+static void _use(struct _esc_ctx *c, struct ast_expr *e) {
+	size_t i = _find(c, e->ident);
+	if (i == SIZE_MAX) return;
+	struct _esc_binding *b = c->bindings + i;
+
+	if (b->target != SIZE_MAX) {
+		struct ast_expr *root = _lvalue_root(b->lvalue);
+		if (!_is_unop(c->parent, UNOP_DEREF)) {
+			_escape(c, b->target, _escape_kind(c));
+		} else if (_find(c, root->ident) != b->target) {
+			// Shadowed here, so the target can't be named in place of *p
+			_escape(c, b->target, ESC_OTHER);
+		} else {
+			_push_site(&c->derefs, &c->nderefs, &c->derefs_alloc, c->parent, i);
+		}
+	}
+
+	if (c->parent && c->parent->t == EXPR_FIELD_ACCESS) {
+		_push_site(&c->fields, &c->nfields, &c->fields_alloc, c->parent, i);
+	} else {
+		b->whole = true;
+	}
+}
+
+static bool _analyze_pre(struct ast_expr *e, void *ctx) {
+	struct _esc_ctx *c = ctx;
+	switch (e->t) {
+	case EXPR_FUNC:
+		// Function literals are separate functions
+		return false;
+	case EXPR_UNOP:
+		if (e->unop.t == UNOP_REF) return _ref(c, e);
+		return true;
+	case EXPR_IDENT:
+		_use(c, e);
+		return true;
+	default:
+		return true;
+	}
+}
+
+static void _analyze_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _esc_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) {
+		size_t target = _derived_target(c, e);
+		_push_binding(c, e->let.name, e->let.type, e);
+		if (target != SIZE_MAX) {
+			struct _esc_binding *b = c->bindings + c->nbindings - 1;
+			b->target = target;
+			b->lvalue = e->let.val->unop.x;
+		}
+	}
+	c->parent = e;
+	c->index = i;
+}
+
+static void _analyze_post(struct ast_expr *e, void *ctx) {
+	struct _esc_ctx *c = ctx;
+	if (e->t == EXPR_LET) {
+		_PUSH(c->lets, c->nlets, c->lets_alloc, 16);
+		c->lets[c->nlets++] = c->scope[--c->nscope];
+	}
+}
+
+static void _analyze(struct _esc_ctx *c, size_t nargs, void *args, struct ast_expr *body) {
+	static const struct walk_ops ops = {
+		.pre = _analyze_pre,
+		.child = _analyze_child,
+		.post = _analyze_post,
+	};
+	struct {
+		const char *name;
+		struct ref_type type;
+	} *a = args;
+
+	for (size_t i = 0; i < c->nbindings; ++i) MEM_FREE(c->bindings[i].fields);
+	c->nbindings = c->nscope = 0;
+	c->nderefs = c->nfields = c->nlets = 0;
+	c->parent = NULL;
+	for (size_t i = 0; i < nargs; ++i) _push_binding(c, a[i].name, a[i].type, NULL);
+	walk_expr(&c->walk, body, &ops, c);
+}
+
+// }}}
+
+// Promotion {{{
+
+static bool _promotable(struct _esc_binding *b) {
+	return b->addr_taken && !b->escapes && !b->type.vol && b->target == SIZE_MAX;
+}
+
+// Dereferences become the lvalue they point at, and the pointers go away
+static size_t _promote(struct _esc_ctx *c) {
+	for (size_t i = 0; i < c->nderefs; ++i) {
+		struct ast_expr *d = c->derefs[i].e;
+		struct _esc_binding *b = c->bindings + c->derefs[i].binding;
+		if (b->target != SIZE_MAX) {
+			if (!_promotable(c->bindings + b->target)) continue;
+			struct ast_expr *lv = expr_clone(&c->walk, b->lvalue);
+			MEM_FREE(d->unop.x);
+			*d = *lv;
+			MEM_FREE(lv);
+		} else if (_promotable(b)) {
+			struct ast_expr *ref = d->unop.x, *lv = ref->unop.x;
+			*d = *lv;
+			MEM_FREE(lv);
+			MEM_FREE(ref);
+		}
+	}
+
+	for (size_t i = 0; i < c->nlets; ++i) {
+		struct _esc_binding *b = c->bindings + c->lets[i];
+		if (b->target == SIZE_MAX || !_promotable(c->bindings + b->target)) continue;
+		struct ast_expr *let = b->let, *body = let->let.body;
+		_free_lvalue(let->let.val->unop.x);
+		MEM_FREE(let->let.val);
+		*let = *body;
+		MEM_FREE(body);
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < c->nbindings; ++i) {
+		if (_promotable(c->bindings + i)) ++n;
+	}
+	return n;
+}
+
+// }}}
+
+// Scalar replacement {{{
+
+static bool _splittable(struct _esc_binding *b) {
+	if (!b->let || b->addr_taken || b->whole || b->type.vol) return false;
+	const struct val_type *t = &b->type.to;
+	struct ast_expr *val = b->let->let.val;
+	if (t->t != TYPE_STRUCT || !t->composite.nfields || t->composite.nfields > _ESC_SPLIT_FIELDS) return false;
+	if (val->t != EXPR_COMPOSITE_LIT || val->composite_lit.nelems != t->composite.nfields) return false;
+	for (size_t i = 0; i < t->composite.nfields; ++i) {
+		if (!_is_scalar(t->composite.fields[i].type)) return false;
+	}
+	return true;
+}
+
+static size_t _field_index(const struct val_type *t, const char *name) {
+	for (size_t i = 0; i < t->composite.nfields; ++i) {
+		if (!strcmp(t->composite.fields[i].name, name)) return i;
+	}
+	return SIZE_MAX;
+}
+
+// let x = S{a, b} in body becomes let $x.f = a in let $x.g = b in body, with
+// x.f and x.g read from the new bindings
+static size_t _split(struct _esc_ctx *c) {
+	size_t n = 0;
+	for (size_t i = 0; i < c->nbindings; ++i) {
+		struct _esc_binding *b = c->bindings + i;
+		if (!_splittable(b)) continue;
+		const struct val_type *t = &b->type.to;
+		b->fields = MEM_ALLOC(MEM_SCOPE, t->composite.nfields * sizeof *b->fields);
+		for (size_t j = 0; j < t->composite.nfields; ++j) {
+			b->fields[j] = _fresh(c, b->name, t->composite.fields[j].name);
+		}
+		++n;
+	}
+
+	// Field accesses first: they may sit in the literals moved below
+	for (size_t i = 0; i < c->nfields; ++i) {
+		struct ast_expr *e = c->fields[i].e;
+		struct _esc_binding *b = c->bindings + c->fields[i].binding;
+		if (!b->fields) continue;
+		size_t j = _field_index(&b->type.to, e->field_access.field);
+		if (j == SIZE_MAX) continue;
+		MEM_FREE(e->field_access.aggr);
+		e->t = EXPR_IDENT;
+		e->ident = b->fields[j];
+	}
+
+	for (size_t i = 0; i < c->nlets; ++i) {
+		struct _esc_binding *b = c->bindings + c->lets[i];
+		if (!b->fields) continue;
+		struct ast_expr *let = b->let, *lit = let->let.val;
+		const struct val_type *t = &b->type.to;
+		size_t nfields = t->composite.nfields;
+
+		// Built from the innermost out, which keeps the deferred code
+		struct ast_expr *body = let->let.body, *deferred = let->let.deferred;
+		for (size_t j = nfields; j-- > 0;) {
+			struct ast_expr *val = MEM_ALLOC(MEM_EXPR + lit->composite_lit.elems[j].t, sizeof *val);
+			*val = lit->composite_lit.elems[j];
+
+			struct ast_expr *e = j ? MEM_CALLOC(MEM_EXPR + EXPR_LET, 1, sizeof *e) : let;
+			*e = (struct ast_expr){.t = EXPR_LET, .type = body->type};
+			e->let.name = b->fields[j];
+			e->let.type = (struct ref_type){.mut = b->type.mut, .to = *t->composite.fields[j].type};
+			e->let.val = val;
+			e->let.body = body;
+			e->let.deferred = deferred;
+			body = e;
+			deferred = NULL;
+		}
+		MEM_FREE(lit->composite_lit.elems);
+		MEM_FREE(lit);
+	}
+	return n;
+}
+
+// }}}
+
+// Driver {{{
+
+static void _function(struct _esc_ctx *c, const char *name, size_t lit, size_t nargs, void *args, struct ast_expr *body,
+		FILE *report, struct escape_stats *stats) {
+	_analyze(c, nargs, args, body);
+	size_t promoted = _promote(c);
+	if (promoted) _analyze(c, nargs, args, body);
+	size_t split = _split(c);
+	if (split) _analyze(c, nargs, args, body);
+
+	size_t nregs = 0, escaping[ESC_NKINDS] = {0};
+	for (size_t i = 0; i < c->nbindings; ++i) {
+		struct _esc_binding *b = c->bindings + i;
+		if (!b->addr_taken && !_is_aggr(&b->type.to)) ++nregs;
+		for (int k = 0; k < ESC_NKINDS; ++k) {
+			if (b->escapes >> k & 1) ++escaping[k];
+		}
+	}
+
+	++stats->nfuncs;
+	stats->nbindings += c->nbindings;
+	stats->nregisters += nregs;
+	stats->npromoted += promoted;
+	stats->nsplit += split;
+	for (int k = 0; k < ESC_NKINDS; ++k) stats->nescaping[k] += escaping[k];
+
+	if (report) {
+		fprintf(report, "escape: %s", name);
+		if (lit) fprintf(report, " (literal %zu)", lit);
+		fprintf(report, ": %zu of %zu bindings in registers (%.0f%%), %zu promoted, %zu split",
+			nregs, c->nbindings, c->nbindings ? 100.0 * nregs / c->nbindings : 100.0, promoted, split);
+		const char *sep = "; escaping through ";
+		for (int k = 0; k < ESC_NKINDS; ++k) {
+			if (!escaping[k]) continue;
+			fprintf(report, "%s%s %zu", sep, _esc_kind_names[k], escaping[k]);
+			sep = ", ";
+		}
+		fputc('\n', report);
+	}
+}
+
+static bool _collect_funcs(struct ast_expr *e, void *ctx) {
+	if (e->t == EXPR_FUNC) {
+		struct {
+			size_t n, alloc;
+			struct ast_expr **funcs;
+		} *list = ctx;
+		_PUSH(list->funcs, list->n, list->alloc, 8);
+		list->funcs[list->n++] = e;
+	}
+	return true;
+}
+
+static void _toplevels(struct _esc_ctx *c, size_t ntops, struct ast_toplevel *tops, FILE *report, struct escape_stats *stats) {
+	for (size_t i = 0; i < ntops; ++i) {
+		struct ast_toplevel *t = tops + i;
+		const char *name;
+		struct ast_expr *body;
+		size_t nargs = 0;
+		void *args = NULL;
+
+		switch (t->type) {
+		case EXPRTOP_FUNC:
+			name = t->func.name;
+			body = t->func.body;
+			nargs = t->func.nargs;
+			args = t->func.args;
+			break;
+		case EXPRTOP_DECL:
+			name = t->decl.name;
+			body = t->decl.val;
+			break;
+		case EXPRTOP_NAMESPACE:
+			_toplevels(c, t->namespace.size, t->namespace.body, report, stats);
+			continue;
+		}
+		if (!body) continue;
+
+		struct {
+			size_t n, alloc;
+			struct ast_expr **funcs;
+		} lits = {0};
+		walk_expr(&c->walk, body, &(struct walk_ops){.pre = _collect_funcs}, &lits);
+
+		// Nested literals first, as rewriting a function may move the
+		// literals inside it
+		struct escape_stats before = *stats;
+		for (size_t j = lits.n; j-- > 0;) {
+			struct ast_expr *f = lits.funcs[j];
+			c->root = ESC_RETURN;
+			_function(c, name, j + 1, f->func.nargs, f->func.args, f->func.body, report, stats);
+		}
+		c->root = t->type == EXPRTOP_FUNC ? ESC_RETURN : ESC_GLOBAL;
+		_function(c, name, 0, nargs, args, body, report, stats);
+		free(lits.funcs);
+
+		if (stats->npromoted != before.npromoted || stats->nsplit != before.nsplit) {
+			annotate_toplevel(t);
+		}
+	}
+}
+
+void escape_unit(size_t ntops, struct ast_toplevel *tops, FILE *report, struct escape_stats *stats) {
+	struct _esc_ctx c = {0};
+	_toplevels(&c, ntops, tops, report, stats);
+
+	if (report) {
+		fprintf(report, "escape: %zu of %zu bindings in registers (%.0f%%), %zu promoted, %zu split\n",
+			stats->nregisters, stats->nbindings, stats->nbindings ? 100.0 * stats->nregisters / stats->nbindings : 100.0,
+			stats->npromoted, stats->nsplit);
+	}
+
+	for (size_t i = 0; i < c.nbindings; ++i) MEM_FREE(c.bindings[i].fields);
+	free(c.bindings);
+	MEM_FREE(c.scope);
+	free(c.derefs);
+	free(c.fields);
+	free(c.lets);
+	walk_free(&c.walk);
+}
+
+// }}}
@@ -0,0 +1,42 @@
+// vim: noet
+
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <stdio.h>
+#include "ast.h"
+
+// Ways the address of a binding can leave its function
+enum escape_kind {
+	ESC_CALL,   // Passed to a call
+	ESC_RETURN, // Returned, or the value of the function body
+	ESC_STORE,  // Stored in memory, an aggregate or another binding
+	ESC_GLOBAL, // Stored in a toplevel variable, or initializes one
+	ESC_OTHER,  // Used as a value any other way, e.g. in arithmetic
+	ESC_NKINDS,
+};
+
+struct escape_stats {
+	size_t nfuncs;
+	// Bindings after the pass, arguments included, and how many of them the
+	// VM compiler keeps in registers rather than memory
+	size_t nbindings, nregisters;
+	// Bindings that had their address taken, but only used it through
+	// dereferences in their own function, now accessed directly
+	size_t npromoted;
+	// Small structs split into a binding per field
+	size_t nsplit;
+	// Bindings left in memory, by how their address escapes. A binding can
+	// escape more than one way.
+	size_t nescaping[ESC_NKINDS];
+};
+
+// Runs escape analysis on every function of a unit checked with
+// annotate_unit, including function literals. Bindings whose address never
+// escapes have their dereferences rewritten into direct uses, and small
+// structs used only field by field become a binding per field, so that both
+// end up in registers. Functions that change are re-checked. Each
+// function's promotion rate is printed to report if non-NULL.
+void escape_unit(size_t ntops, struct ast_toplevel *tops, FILE *report, struct escape_stats *stats);
+
+#endif
@@ -0,0 +1,614 @@
+// vim: noet
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inline.h"
+#include "memstats.h"
+#include "type.h"
+#include "walk.h"
+
+// Rough cost of a call and return, in expression nodes
+#define CALL_BENEFIT 8
+// Constant arguments are likely to fold away once inlined
+#define CONST_ARG_BENEFIT 2
+// Benefit is multiplied by this for each enclosing loop, up to MAX_LOOP_DEPTH
+#define LOOP_FACTOR 4
+#define MAX_LOOP_DEPTH 3
+
+// Toplevel functions and function literals share this argument layout
+struct _inl_arg {
+	const char *name;
+	struct ref_type type;
+};
+
+struct _inl_callee {
+	const char *name;
+	size_t nargs;
+	struct _inl_arg *args;
+	struct ast_expr *body;
+	// NULL for function literals
+	struct cg_node *node;
+};
+
+struct _inl_info {
+	bool scanned;
+	size_t size;
+	// Some return is not in tail position
+	bool nontail_return;
+	// Names the body refers to without binding them
+	size_t nfree, free_alloc;
+	const char **free;
+};
+
+// Scopes {{{
+
+// Stack of bindings. Function literals cannot see the locals of their
+// enclosing function, so lookups stop at base.
+struct _inl_scope {
+	size_t n, alloc, base;
+	struct {
+		const char *name;
+		// New name, when cloning
+		const char *to;
+		// Binding let, or NULL for arguments
+		struct ast_expr *let;
+	} *names;
+
+	size_t nframes, frames_alloc;
+	struct {
+		size_t base, n;
+	} *frames;
+};
+
+static void _scope_push(struct _inl_scope *s, const char *name, const char *to, struct ast_expr *let) {
+	if (s->n == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 16;
+		s->names = MEM_REALLOC(MEM_SCOPE, s->names, s->alloc * sizeof *s->names);
+	}
+	s->names[s->n].name = name;
+	s->names[s->n].to = to;
+	s->names[s->n].let = let;
+	++s->n;
+}
+
+static void _scope_enter_func(struct _inl_scope *s, struct ast_expr *e) {
+	if (s->nframes == s->frames_alloc) {
+		s->frames_alloc = s->frames_alloc ? s->frames_alloc * 2 : 8;
+		s->frames = MEM_REALLOC(MEM_SCOPE, s->frames, s->frames_alloc * sizeof *s->frames);
+	}
+	s->frames[s->nframes].base = s->base;
+	s->frames[s->nframes].n = s->n;
+	++s->nframes;
+
+	s->base = s->n;
+	for (size_t i = 0; i < e->func.nargs; ++i) {
+		_scope_push(s, e->func.args[i].name, NULL, NULL);
+	}
+}
+
+static void _scope_leave_func(struct _inl_scope *s) {
+	--s->nframes;
+	s->base = s->frames[s->nframes].base;
+	s->n = s->frames[s->nframes].n;
+}
+
+// Returns SIZE_MAX if the name is not bound
+static size_t _scope_find(struct _inl_scope *s, const char *name) {
+	for (size_t i = s->n; i-- > s->base;) {
+		if (!strcmp(s->names[i].name, name)) return i;
+	}
+	return SIZE_MAX;
+}
+
+static void _scope_free(struct _inl_scope *s) {
+	MEM_FREE(s->names);
+	MEM_FREE(s->frames);
+	*s = (struct _inl_scope){0};
+}
+
+// }}}
+
+// Callee scanning {{{
+
+struct _scan_ctx {
+	struct _inl_scope scope;
+	struct _inl_info *info;
+	size_t nreturns;
+};
+
+static bool _scan_pre(struct ast_expr *e, void *ctx) {
+	struct _scan_ctx *c = ctx;
+	++c->info->size;
+
+	switch (e->t) {
+	case EXPR_FUNC:
+		_scope_enter_func(&c->scope, e);
+		break;
+
+	case EXPR_RETURN:
+		// Returns in nested function literals are their own
+		if (!c->scope.nframes) ++c->nreturns;
+		break;
+
+	case EXPR_IDENT:
+		if (_scope_find(&c->scope, e->ident) != SIZE_MAX) break;
+		for (size_t i = 0; i < c->info->nfree; ++i) {
+			if (!strcmp(c->info->free[i], e->ident)) return true;
+		}
+		if (c->info->nfree == c->info->free_alloc) {
+			c->info->free_alloc = c->info->free_alloc ? c->info->free_alloc * 2 : 8;
+			c->info->free = realloc(c->info->free, c->info->free_alloc * sizeof *c->info->free);
+		}
+		c->info->free[c->info->nfree++] = e->ident;
+		break;
+
+	default:
+		break;
+	}
+	return true;
+}
+
+static void _scan_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _scan_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) _scope_push(&c->scope, e->let.name, NULL, e);
+}
+
+static void _scan_post(struct ast_expr *e, void *ctx) {
+	struct _scan_ctx *c = ctx;
+	if (e->t == EXPR_LET) --c->scope.n;
+	else if (e->t == EXPR_FUNC) _scope_leave_func(&c->scope);
+}
+
+// Calls fn on every expression in tail position of body
+static void _for_tails(struct ast_expr *body, void (*fn)(struct ast_expr *e, void *ctx), void *ctx) {
+	size_t n = 0, alloc = 16;
+	struct ast_expr **stack = malloc(alloc * sizeof *stack);
+	stack[n++] = body;
+
+	while (n) {
+		struct ast_expr *e = stack[--n];
+		if (n + 2 > alloc) {
+			alloc *= 2;
+			stack = realloc(stack, alloc * sizeof *stack);
+		}
+
+		switch (e->t) {
+		case EXPR_BINOP:
+			if (e->binop.t == BINOP_SEQOP) stack[n++] = e->binop.y;
+			break;
+		case EXPR_IF:
+			stack[n++] = e->if_.t;
+			if (e->if_.f) stack[n++] = e->if_.f;
+			break;
+		case EXPR_LET:
+			stack[n++] = e->let.body;
+			break;
+		default:
+			fn(e, ctx);
+			break;
+		}
+	}
+	free(stack);
+}
+
+static void _count_return(struct ast_expr *e, void *ctx) {
+	if (e->t == EXPR_RETURN) ++*(size_t *)ctx;
+}
+
+static void _inl_scan(struct walk_stack *walk, struct _inl_callee *callee, struct _inl_info *info) {
+	static const struct walk_ops ops = {
+		.pre = _scan_pre,
+		.child = _scan_child,
+		.post = _scan_post,
+	};
+
+	struct _scan_ctx c = {.info = info};
+	for (size_t i = 0; i < callee->nargs; ++i) {
+		_scope_push(&c.scope, callee->args[i].name, NULL, NULL);
+	}
+	walk_expr(walk, callee->body, &ops, &c);
+	_scope_free(&c.scope);
+
+	size_t ntail = 0;
+	_for_tails(callee->body, _count_return, &ntail);
+
+	info->nontail_return = ntail != c.nreturns;
+	info->scanned = true;
+}
+
+// }}}
+
+// Cloning {{{
+
+// Names containing '.' cannot be written in source, so they never clash.
+// counter numbers the names made so far in the unit.
+static const char *_inl_fresh(size_t *counter, const char *name) {
+	size_t len = strlen(name) + 24;
+	char *s = MEM_ALLOC(MEM_NAME, len);
+	snprintf(s, len, "%s.%zu", name, ++*counter);
+	return s;
+}
+
+struct _rename_ctx {
+	struct _inl_scope scope;
+	size_t *counter;
+};
+
+static bool _rename_pre(struct ast_expr *e, void *ctx) {
+	struct _rename_ctx *c = ctx;
+	if (e->t == EXPR_FUNC) {
+		_scope_enter_func(&c->scope, e);
+	} else if (e->t == EXPR_IDENT) {
+		size_t i = _scope_find(&c->scope, e->ident);
+		if (i != SIZE_MAX && c->scope.names[i].to) e->ident = c->scope.names[i].to;
+	}
+	return true;
+}
+
+static void _rename_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _rename_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) {
+		// Lets in nested function literals needn't be renamed, but it's harmless
+		_scope_push(&c->scope, e->let.name, _inl_fresh(c->counter, e->let.name), e);
+	}
+}
+
+static void _rename_post(struct ast_expr *e, void *ctx) {
+	struct _rename_ctx *c = ctx;
+	if (e->t == EXPR_LET) {
+		e->let.name = c->scope.names[--c->scope.n].to;
+	} else if (e->t == EXPR_FUNC) {
+		_scope_leave_func(&c->scope);
+	}
+}
+
+// Deep-copies the callee's body, renaming its arguments to the given names
+// and every let to a fresh name
+static struct ast_expr *_inl_clone(struct walk_stack *walk, size_t *counter, struct _inl_callee *callee, const char **names) {
+	static const struct walk_ops ops = {
+		.pre = _rename_pre,
+		.child = _rename_child,
+		.post = _rename_post,
+	};
+
+	struct ast_expr *copy = expr_clone(walk, callee->body);
+
+	struct _rename_ctx c = {.counter = counter};
+	for (size_t i = 0; i < callee->nargs; ++i) {
+		_scope_push(&c.scope, callee->args[i].name, names[i], NULL);
+	}
+	walk_expr(walk, copy, &ops, &c);
+	_scope_free(&c.scope);
+
+	return copy;
+}
+
+// Replaces a tail return with its value, which the inlined body then yields
+static void _inl_strip_return(struct ast_expr *e, void *ctx) {
+	if (e->t != EXPR_RETURN) return;
+
+	struct ast_expr *val = e->return_.val;
+	if (val) {
+		*e = *val;
+		MEM_FREE(val);
+		return;
+	}
+
+	// A void return yields nothing
+	*e = (struct ast_expr){
+		.t = EXPR_CAST,
+		.type = {.t = TYPE_VOID},
+		.cast = {.type = {.t = TYPE_VOID}},
+	};
+}
+
+// }}}
+
+// Call sites {{{
+
+struct _inl_site {
+	struct ast_expr *call;
+	struct _inl_callee callee;
+};
+
+struct _inl_ctx {
+	const struct inline_opts *opts;
+	size_t max_callee_size;
+
+	struct callgraph *cg;
+	struct _inl_info *infos;
+
+	struct cg_node *caller;
+	size_t budget;
+	size_t loop_depth;
+	struct _inl_scope scope;
+
+	size_t nsites, sites_alloc;
+	struct _inl_site *sites;
+
+	size_t ncalls, ninlined;
+	size_t nfresh;
+	struct walk_stack walk, scan_walk;
+};
+
+static void _inl_decide(struct _inl_ctx *c, const char *callee_name, const char *reason) {
+	if (c->opts->report) {
+		fprintf(c->opts->report, "inline: %s <- %s: %s\n", c->caller->name, callee_name, reason);
+	}
+}
+
+static void _inl_consider(struct _inl_ctx *c, struct ast_expr *e) {
+	struct ast_expr *f = e->call.func, *lit = NULL;
+	struct _inl_callee callee = {0};
+
+	if (f->t == EXPR_FUNC) {
+		lit = f;
+		callee.name = "<literal>";
+	} else if (f->t == EXPR_IDENT) {
+		size_t local = _scope_find(&c->scope, f->ident);
+		if (local != SIZE_MAX) {
+			// Only immutable bindings are certain to still hold the literal
+			struct ast_expr *let = c->scope.names[local].let;
+			if (!let || let->let.type.mut || let->let.val->t != EXPR_FUNC) return;
+			lit = let->let.val;
+			callee.name = f->ident;
+		} else {
+			callee.node = cg_resolve(c->cg, c->caller, f->ident);
+			if (!callee.node || callee.node->top->type != EXPRTOP_FUNC) return;
+			callee.name = callee.node->name;
+		}
+	} else {
+		return;
+	}
+
+	++c->ncalls;
+
+	if (lit) {
+		callee.nargs = lit->func.nargs;
+		callee.args = (void *)lit->func.args;
+		callee.body = lit->func.body;
+	} else {
+		struct ast_toplevel *top = callee.node->top;
+		callee.nargs = top->func.nargs;
+		callee.args = (void *)top->func.args;
+		callee.body = top->func.body;
+	}
+
+	for (size_t i = 0; i < c->opts->nnoinline; ++i) {
+		if (!strcmp(c->opts->noinline[i], callee.name)) {
+			_inl_decide(c, callee.name, "noinline");
+			return;
+		}
+	}
+	if (!callee.body) {
+		_inl_decide(c, callee.name, "no body");
+		return;
+	}
+	if (callee.node && callee.node->scc == c->caller->scc) {
+		_inl_decide(c, callee.name, "recursive");
+		return;
+	}
+	if (callee.nargs != e->call.nargs) {
+		_inl_decide(c, callee.name, "arity mismatch");
+		return;
+	}
+
+	struct _inl_info lit_info = {0}, *info;
+	if (lit) {
+		info = &lit_info;
+		_inl_scan(&c->scan_walk, &callee, info);
+	} else {
+		info = c->infos + (callee.node - c->cg->nodes);
+		if (!info->scanned) _inl_scan(&c->scan_walk, &callee, info);
+	}
+
+	const char *reason = NULL;
+	char buf[128];
+	if (info->size > c->max_callee_size) {
+		reason = "too large";
+	} else if (info->nontail_return) {
+		reason = "non-tail return";
+	} else {
+		// The body's free names must still mean the same thing at the call
+		// site, where locals and the caller's namespaces may shadow them
+		for (size_t i = 0; i < info->nfree; ++i) {
+			if (_scope_find(&c->scope, info->free[i]) != SIZE_MAX) {
+				reason = "would capture a local";
+				break;
+			}
+			if (callee.node && cg_resolve(c->cg, callee.node, info->free[i])
+					!= cg_resolve(c->cg, c->caller, info->free[i])) {
+				reason = "would capture a global";
+				break;
+			}
+		}
+	}
+
+	size_t cost = 0, benefit = 0;
+	if (!reason) {
+		cost = info->size + callee.nargs - 1;
+
+		benefit = CALL_BENEFIT;
+		for (size_t i = 0; i < e->call.nargs; ++i) {
+			switch (e->call.args[i].t) {
+			case EXPR_INT_LIT:
+			case EXPR_FLOAT_LIT:
+			case EXPR_BOOL_LIT:
+				benefit += CONST_ARG_BENEFIT;
+				break;
+			default:
+				break;
+			}
+		}
+		for (size_t i = 0; i < c->loop_depth && i < MAX_LOOP_DEPTH; ++i) {
+			benefit *= LOOP_FACTOR;
+		}
+
+		if (cost > benefit) reason = "unprofitable";
+		else if (cost > c->budget) reason = "over budget";
+	}
+
+	if (lit) free(lit_info.free);
+
+	if (reason) {
+		if (cost) {
+			snprintf(buf, sizeof buf, "%s (cost %zu, benefit %zu)", reason, cost, benefit);
+			reason = buf;
+		}
+		_inl_decide(c, callee.name, reason);
+		return;
+	}
+
+	snprintf(buf, sizeof buf, "inlined (cost %zu, benefit %zu)", cost, benefit);
+	_inl_decide(c, callee.name, buf);
+	c->budget -= cost;
+
+	if (c->nsites == c->sites_alloc) {
+		c->sites_alloc = c->sites_alloc ? c->sites_alloc * 2 : 16;
+		c->sites = realloc(c->sites, c->sites_alloc * sizeof *c->sites);
+	}
+	c->sites[c->nsites].call = e;
+	c->sites[c->nsites].callee = callee;
+	++c->nsites;
+}
+
+static bool _site_pre(struct ast_expr *e, void *ctx) {
+	struct _inl_ctx *c = ctx;
+	if (e->t == EXPR_WHILE) ++c->loop_depth;
+	else if (e->t == EXPR_FUNC) _scope_enter_func(&c->scope, e);
+	return true;
+}
+
+static void _site_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _inl_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) _scope_push(&c->scope, e->let.name, NULL, e);
+}
+
+static void _site_post(struct ast_expr *e, void *ctx) {
+	struct _inl_ctx *c = ctx;
+	switch (e->t) {
+	case EXPR_CALL:
+		_inl_consider(c, e);
+		break;
+	case EXPR_WHILE:
+		--c->loop_depth;
+		break;
+	case EXPR_LET:
+		--c->scope.n;
+		break;
+	case EXPR_FUNC:
+		_scope_leave_func(&c->scope);
+		break;
+	default:
+		break;
+	}
+}
+
+// Turns f(x, y) into let a.1 = x; let b.2 = y; <body of f>
+static void _inl_apply(struct _inl_ctx *c, struct _inl_site *site) {
+	struct ast_expr *call = site->call;
+	struct _inl_callee *callee = &site->callee;
+
+	const char **names = malloc(callee->nargs * sizeof *names);
+	for (size_t i = 0; i < callee->nargs; ++i) {
+		names[i] = _inl_fresh(&c->nfresh, callee->args[i].name);
+	}
+
+	struct ast_expr *inner = _inl_clone(&c->walk, &c->nfresh, callee, names);
+	_for_tails(inner, _inl_strip_return, NULL);
+
+	for (size_t i = callee->nargs; i-- > 0;) {
+		struct ast_expr *val = MEM_ALLOC(MEM_EXPR + call->call.args[i].t, sizeof *val);
+		*val = call->call.args[i];
+
+		struct ast_expr *let = MEM_CALLOC(MEM_EXPR + EXPR_LET, 1, sizeof *let);
+		let->t = EXPR_LET;
+		let->let.name = names[i];
+		let->let.type = callee->args[i].type;
+		let->let.val = val;
+		let->let.body = inner;
+		inner = let;
+	}
+	free(names);
+
+	struct ast_expr *func = call->call.func, *args = call->call.args;
+	*call = *inner;
+	MEM_FREE(inner);
+	MEM_FREE(args);
+	if (func->t == EXPR_IDENT) MEM_FREE(func);
+}
+
+static bool _count_pre(struct ast_expr *e, void *ctx) {
+	++*(size_t *)ctx;
+	return true;
+}
+
+static void _inl_caller(struct _inl_ctx *c, struct cg_node *node) {
+	static const struct walk_ops ops = {
+		.pre = _site_pre,
+		.child = _site_child,
+		.post = _site_post,
+	};
+
+	struct ast_toplevel *top = node->top;
+	struct ast_expr *body = top->type == EXPRTOP_FUNC ? top->func.body : top->decl.val;
+	if (!body) return;
+
+	c->caller = node;
+	c->budget = c->opts->caller_budget ? c->opts->caller_budget : INLINE_DEFAULT_CALLER_BUDGET;
+	c->loop_depth = 0;
+	c->nsites = 0;
+	c->scope.n = c->scope.base = 0;
+	if (top->type == EXPRTOP_FUNC) {
+		for (size_t i = 0; i < top->func.nargs; ++i) {
+			_scope_push(&c->scope, top->func.args[i].name, NULL, NULL);
+		}
+	}
+
+	walk_expr(&c->walk, body, &ops, c);
+
+	// Sites were recorded in post-order, so calls nested in the arguments of
+	// other calls are rewritten before their arguments are moved
+	for (size_t i = 0; i < c->nsites; ++i) {
+		_inl_apply(c, c->sites + i);
+	}
+	c->ninlined += c->nsites;
+
+	if (c->nsites) {
+		annotate_toplevel(top);
+		node->size = 0;
+		walk_expr(&c->walk, body, &(struct walk_ops){.pre = _count_pre}, &node->size);
+	}
+}
+
+// }}}
+
+size_t inline_unit(struct callgraph *cg, const struct inline_opts *opts) {
+	struct _inl_ctx c = {
+		.opts = opts,
+		.max_callee_size = opts->max_callee_size ? opts->max_callee_size : INLINE_DEFAULT_MAX_CALLEE_SIZE,
+		.cg = cg,
+		.infos = calloc(cg->nnodes, sizeof *c.infos),
+	};
+
+	for (size_t i = 0; i < cg->nsccs; ++i) {
+		for (size_t j = cg->scc_start[i]; j < cg->scc_start[i+1]; ++j) {
+			_inl_caller(&c, cg->nodes + cg->sccs[j]);
+		}
+	}
+
+	if (opts->report) {
+		fprintf(opts->report, "inline: %zu of %zu call sites inlined\n", c.ninlined, c.ncalls);
+	}
+
+	for (size_t i = 0; i < cg->nnodes; ++i) {
+		free(c.infos[i].free);
+	}
+	free(c.infos);
+	free(c.sites);
+	_scope_free(&c.scope);
+	walk_free(&c.walk);
+	walk_free(&c.scan_walk);
+	return c.ninlined;
+}
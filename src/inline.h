@@ -0,0 +1,33 @@
+// vim: noet
+
+#ifndef INLINE_H
+#define INLINE_H
+
+#include <stdio.h>
+#include "callgraph.h"
+
+// Zero fields take the defaults below
+struct inline_opts {
+	// Largest callee body, in expression nodes, that will be inlined
+	size_t max_callee_size;
+	// How many expression nodes each caller may grow by
+	size_t caller_budget;
+
+	// Functions that must never be inlined, by qualified name
+	size_t nnoinline;
+	const char **noinline;
+
+	// Every decision is printed here if non-NULL
+	FILE *report;
+};
+
+#define INLINE_DEFAULT_MAX_CALLEE_SIZE 64
+#define INLINE_DEFAULT_CALLER_BUDGET 256
+
+// Inlines calls to toplevel functions and to function literals, visiting
+// callees before callers. The unit must have been checked with
+// annotate_unit; callers that change are re-checked. The call graph's edges
+// are stale afterwards. Returns the number of call sites inlined.
+size_t inline_unit(struct callgraph *cg, const struct inline_opts *opts);
+
+#endif
@@ -0,0 +1,927 @@
+// vim: noet
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lanes.h"
+#include "memstats.h"
+#include "type.h"
+#include "walk.h"
+
+// Helpers {{{
+
+#define _PUSH(arr, n, alloc, init) do { \
+	if ((n) == (alloc)) { \
+		(alloc) = (alloc) ? (alloc) * 2 : (init); \
+		(arr) = realloc((arr), (alloc) * sizeof *(arr)); \
+	} \
+} while (0)
+
+static bool _has(size_t n, const char **names, const char *name) {
+	for (size_t i = 0; i < n; ++i) {
+		if (!strcmp(names[i], name)) return true;
+	}
+	return false;
+}
+
+static struct lanes_reduction *_reduction(struct lanes_plan *p, const char *name) {
+	for (size_t i = 0; i < p->nreductions; ++i) {
+		if (!strcmp(p->reductions[i].name, name)) return p->reductions + i;
+	}
+	return NULL;
+}
+
+// Size in bytes of a type that fits in a lane, or 0
+static size_t _lane_size(struct val_type t) {
+	switch (t.t) {
+	case TYPE_INT:
+		return (t.int_ & 0xff) / 8;
+	case TYPE_FLOAT:
+		switch (t.float_) {
+		case F_32: return 4;
+		case F_64: return 8;
+		default: return 0;
+		}
+	default:
+		return 0;
+	}
+}
+
+// }}}
+
+// Analysis {{{
+
+struct _lanes_ctx {
+	struct loop_nest *ln;
+	struct loop *loop;
+	struct lanes_plan *plan;
+	struct walk_stack walk;
+
+	// Names bound inside the loop
+	size_t ninner, inner_alloc;
+	const char **inner;
+
+	// Updates of steppers, each of which must be at the end of the body
+	size_t nupdates, updates_alloc;
+	struct ast_expr **updates;
+
+	// Pointers and indices that accesses need to step
+	size_t nstepped, stepped_alloc;
+	const char **stepped;
+
+	// Outer bindings read as ordinary values
+	size_t nuses, uses_alloc;
+	struct ast_expr **uses;
+
+	bool has_store;
+};
+
+static void _reject(struct _lanes_ctx *c, const char *reason) {
+	if (!c->plan->reason) c->plan->reason = reason;
+}
+
+// Returns the binding an outer identifier refers to, or NULL for inner
+// bindings and globals
+static struct loop_binding *_outer(struct _lanes_ctx *c, struct ast_expr *e) {
+	if (e->t != EXPR_IDENT || _has(c->ninner, c->inner, e->ident)) return NULL;
+	for (size_t i = c->loop->nbindings; i-- > 0;) {
+		if (!strcmp(c->loop->bindings[i].name, e->ident)) return c->loop->bindings + i;
+	}
+	return NULL;
+}
+
+static bool _is_global(struct _lanes_ctx *c, struct ast_expr *e) {
+	return e->t == EXPR_IDENT && !_outer(c, e) && !_has(c->ninner, c->inner, e->ident);
+}
+
+// Recognizes x++, ++x and x = x + 1 on an outer binding
+static struct loop_binding *_step_of(struct _lanes_ctx *c, struct ast_expr *e) {
+	struct ast_expr *x;
+	if (e->t == EXPR_UNOP && (e->unop.t == UNOP_PREINC || e->unop.t == UNOP_POSTINC)) {
+		x = e->unop.x;
+	} else if (e->t == EXPR_BINOP && e->binop.t == BINOP_ASSIGN) {
+		x = e->binop.x;
+		struct ast_expr *y = e->binop.y;
+		if (x->t != EXPR_IDENT || y->t != EXPR_BINOP || y->binop.t != BINOP_ADD) return NULL;
+		struct ast_expr *a = y->binop.x, *b = y->binop.y;
+		if (a->t == EXPR_INT_LIT) {
+			struct ast_expr *tmp = a;
+			a = b;
+			b = tmp;
+		}
+		if (a->t != EXPR_IDENT || strcmp(a->ident, x->ident)) return NULL;
+		if (b->t != EXPR_INT_LIT || b->int_lit.u != 1) return NULL;
+	} else {
+		return NULL;
+	}
+
+	struct loop_binding *b = _outer(c, x);
+	if (!b || b->type.vol) return NULL;
+	if (b->type.to.t != TYPE_INT && b->type.to.t != TYPE_PTR) return NULL;
+	return b;
+}
+
+// Recognizes s = s op y for an associative integer op, returning y
+static struct ast_expr *_reduction_of(struct _lanes_ctx *c, struct ast_expr *e, int *op) {
+	struct ast_expr *x = e->binop.x, *y = e->binop.y;
+	struct loop_binding *b = _outer(c, x);
+	if (!b || b->type.vol || b->type.to.t != TYPE_INT) return NULL;
+	if (y->t != EXPR_BINOP) return NULL;
+
+	switch (y->binop.t) {
+	case BINOP_ADD:
+	case BINOP_MUL:
+	case BINOP_BIN_AND:
+	case BINOP_BIN_OR:
+	case BINOP_BIN_XOR:
+		break;
+	default:
+		return NULL;
+	}
+
+	*op = y->binop.t;
+	if (y->binop.x->t == EXPR_IDENT && !strcmp(y->binop.x->ident, x->ident)) return y->binop.y;
+	if (y->binop.y->t == EXPR_IDENT && !strcmp(y->binop.y->ident, x->ident)) return y->binop.x;
+	return NULL;
+}
+
+static void _access(struct _lanes_ctx *c, struct ast_expr *e, bool store) {
+	struct ast_expr *addr = e->unop.x;
+	struct lanes_plan *p = c->plan;
+	const char *base = NULL, *index = NULL;
+
+	if (addr->t == EXPR_IDENT) {
+		// *p, where p steps
+		struct loop_binding *b = _outer(c, addr);
+		if (b && b->type.to.t == TYPE_PTR) {
+			base = b->name;
+			_PUSH(c->stepped, c->nstepped, c->stepped_alloc, 4);
+			c->stepped[c->nstepped++] = b->name;
+		}
+	} else if (addr->t == EXPR_BINOP && addr->binop.t == BINOP_ADD) {
+		// *(a + i), where a is invariant and i steps
+		struct ast_expr *a = addr->binop.x, *i = addr->binop.y;
+		if (a->type.t != TYPE_PTR) {
+			struct ast_expr *tmp = a;
+			a = i;
+			i = tmp;
+		}
+		struct loop_binding *ab = _outer(c, a), *ib = _outer(c, i);
+		if (ab && ib && a->type.t == TYPE_PTR && i->type.t == TYPE_INT) {
+			base = ab->name;
+			index = ib->name;
+			// Checked once the steppers are known
+			_PUSH(c->uses, c->nuses, c->uses_alloc, 16);
+			c->uses[c->nuses++] = a;
+			_PUSH(c->stepped, c->nstepped, c->stepped_alloc, 4);
+			c->stepped[c->nstepped++] = ib->name;
+		}
+	}
+	if (!base) {
+		_reject(c, "access is not unit-stride");
+		return;
+	}
+	if (addr->type.ptr->vol) _reject(c, "volatile access");
+	if (!_lane_size(e->type)) _reject(c, "element does not fit a lane");
+
+	if (store) c->has_store = true;
+	_PUSH(p->accesses, p->naccesses, p->accesses_alloc, 8);
+	p->accesses[p->naccesses].e = e;
+	p->accesses[p->naccesses].base = base;
+	p->accesses[p->naccesses].index = index;
+	p->accesses[p->naccesses].store = store;
+	++p->naccesses;
+}
+
+static void _note_type(struct _lanes_ctx *c, struct val_type t) {
+	if (t.t == TYPE_VOID || t.t == TYPE_BOOL) return;
+	size_t size = _lane_size(t);
+	if (!size) _reject(c, "value does not fit a lane");
+	else if (size > c->plan->elem_size) c->plan->elem_size = size;
+}
+
+static bool _lanes_pre(struct ast_expr *e, void *ctx);
+static void _lanes_child(struct ast_expr *e, size_t i, void *ctx);
+static void _lanes_post(struct ast_expr *e, void *ctx);
+
+static const struct walk_ops _lanes_ops = {
+	.pre = _lanes_pre,
+	.child = _lanes_child,
+	.post = _lanes_post,
+};
+
+static bool _lanes_pre(struct ast_expr *e, void *ctx) {
+	struct _lanes_ctx *c = ctx;
+	struct loop_binding *b;
+	struct ast_expr *y;
+	int op;
+	if (c->plan->reason) return false;
+
+	switch (e->t) {
+	case EXPR_IDENT:
+		if (_outer(c, e)) {
+			_PUSH(c->uses, c->nuses, c->uses_alloc, 16);
+			c->uses[c->nuses++] = e;
+		} else if (_is_global(c, e)) {
+			_reject(c, "reads a global");
+		}
+		return true;
+
+	case EXPR_INT_LIT:
+	case EXPR_FLOAT_LIT:
+	case EXPR_BOOL_LIT:
+	case EXPR_LET:
+	case EXPR_CAST:
+		return true;
+
+	case EXPR_UNOP:
+		switch (e->unop.t) {
+		case UNOP_DEREF:
+			_access(c, e, false);
+			_note_type(c, e->type);
+			return false;
+		case UNOP_PREINC:
+		case UNOP_POSTINC:
+		case UNOP_PREDEC:
+		case UNOP_POSTDEC:
+			if ((b = _step_of(c, e))) {
+				_PUSH(c->updates, c->nupdates, c->updates_alloc, 4);
+				c->updates[c->nupdates++] = e;
+				_PUSH(c->plan->steppers, c->plan->nsteppers, c->plan->steppers_alloc, 4);
+				c->plan->steppers[c->plan->nsteppers++] = b->name;
+			} else if (e->unop.x->t != EXPR_IDENT || _outer(c, e->unop.x)) {
+				_reject(c, "loop-carried dependence");
+			}
+			return false;
+		case UNOP_REF:
+			_reject(c, "takes an address");
+			return false;
+		default:
+			return true;
+		}
+
+	case EXPR_BINOP:
+		switch (e->binop.t) {
+		case BINOP_BOOL_AND:
+		case BINOP_BOOL_OR:
+			_reject(c, "control flow in loop");
+			return false;
+		case BINOP_DIV:
+		case BINOP_MOD:
+			if (e->type.t == TYPE_INT) _reject(c, "integer division");
+			return true;
+		case BINOP_ASSIGN:
+			break;
+		default:
+			return true;
+		}
+
+		if (e->binop.x->t == EXPR_UNOP && e->binop.x->unop.t == UNOP_DEREF) {
+			_access(c, e->binop.x, true);
+			walk_expr(&c->walk, e->binop.y, &_lanes_ops, c);
+		} else if ((b = _step_of(c, e))) {
+			_PUSH(c->updates, c->nupdates, c->updates_alloc, 4);
+			c->updates[c->nupdates++] = e;
+			_PUSH(c->plan->steppers, c->plan->nsteppers, c->plan->steppers_alloc, 4);
+			c->plan->steppers[c->plan->nsteppers++] = b->name;
+		} else if ((y = _reduction_of(c, e, &op))) {
+			struct lanes_plan *p = c->plan;
+			if (_reduction(p, e->binop.x->ident)) _reject(c, "loop-carried dependence");
+			_PUSH(p->reductions, p->nreductions, p->reductions_alloc, 4);
+			p->reductions[p->nreductions].name = e->binop.x->ident;
+			p->reductions[p->nreductions].type = e->binop.x->type;
+			p->reductions[p->nreductions].op = op;
+			++p->nreductions;
+			walk_expr(&c->walk, y, &_lanes_ops, c);
+		} else if (e->binop.x->t == EXPR_IDENT && !_outer(c, e->binop.x) && !_is_global(c, e->binop.x)) {
+			// Bindings inside the loop are private to each lane
+			walk_expr(&c->walk, e->binop.y, &_lanes_ops, c);
+		} else {
+			_reject(c, "loop-carried dependence");
+		}
+		_note_type(c, e->type);
+		return false;
+
+	case EXPR_IF:
+		_reject(c, "control flow in loop");
+		return false;
+
+	case EXPR_FUNC:
+		_reject(c, "function literal in loop");
+		return false;
+
+	default:
+		_reject(c, "unsupported expression in loop");
+		return false;
+	}
+}
+
+static void _lanes_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _lanes_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) {
+		// Lanes rename reductions and offset steppers by name
+		for (size_t j = 0; j < c->loop->nbindings; ++j) {
+			if (!strcmp(c->loop->bindings[j].name, e->let.name)) _reject(c, "shadows an outer binding");
+		}
+		_PUSH(c->inner, c->ninner, c->inner_alloc, 8);
+		c->inner[c->ninner++] = e->let.name;
+	}
+}
+
+static void _lanes_post(struct ast_expr *e, void *ctx) {
+	struct _lanes_ctx *c = ctx;
+	if (e->t == EXPR_LET) --c->ninner;
+
+	// Sequences and lets just pass on a value noted elsewhere
+	if (e->t == EXPR_LET || (e->t == EXPR_BINOP && e->binop.t == BINOP_SEQOP)) return;
+	_note_type(c, e->type);
+}
+
+// Sequences can be far longer than the C stack is deep, so their spines
+// are flattened without recursion
+static void _spine(struct ast_expr *e, size_t *n, struct ast_expr ***elems) {
+	size_t alloc = 0, nstack = 0, stack_alloc = 0;
+	struct ast_expr **stack = NULL;
+	*n = 0;
+	*elems = NULL;
+
+	_PUSH(stack, nstack, stack_alloc, 16);
+	stack[nstack++] = e;
+	while (nstack) {
+		struct ast_expr *x = stack[--nstack];
+		if (x->t == EXPR_BINOP && x->binop.t == BINOP_SEQOP) {
+			_PUSH(stack, nstack, stack_alloc, 16);
+			stack[nstack++] = x->binop.y;
+			_PUSH(stack, nstack, stack_alloc, 16);
+			stack[nstack++] = x->binop.x;
+		} else {
+			_PUSH(*elems, *n, alloc, 16);
+			(*elems)[(*n)++] = x;
+		}
+	}
+	free(stack);
+}
+
+static void _plan_cond(struct _lanes_ctx *c, struct ast_expr *cond) {
+	struct lanes_plan *p = c->plan;
+	if (cond->t != EXPR_BINOP) {
+		_reject(c, "not countable");
+		return;
+	}
+
+	struct ast_expr *x = cond->binop.x, *y = cond->binop.y;
+	p->cmp = cond->binop.t;
+	switch (cond->binop.t) {
+	case BINOP_LT:
+	case BINOP_NEQUAL:
+		break;
+	case BINOP_GT:;
+		p->cmp = BINOP_LT;
+		// n > i is i < n
+		struct ast_expr *tmp = x;
+		x = y;
+		y = tmp;
+		break;
+	default:
+		_reject(c, "not countable");
+		return;
+	}
+
+	struct loop_binding *b = _outer(c, x);
+	if (!b || (y->t != EXPR_IDENT && y->t != EXPR_INT_LIT)) {
+		_reject(c, "not countable");
+		return;
+	}
+	p->counter = b->name;
+	p->limit = y;
+	if (y->t == EXPR_IDENT) {
+		if (!_outer(c, y)) {
+			_reject(c, "not countable");
+			return;
+		}
+		_PUSH(c->uses, c->nuses, c->uses_alloc, 16);
+		c->uses[c->nuses++] = y;
+	}
+}
+
+bool lanes_plan_loop(struct loop_nest *ln, struct loop *l, size_t vector_bytes, struct lanes_plan *plan) {
+	*plan = (struct lanes_plan){0};
+	struct _lanes_ctx c = {.ln = ln, .loop = l, .plan = plan};
+
+	for (size_t i = 0; i < ln->nloops; ++i) {
+		if (ln->loops[i]->parent == l) _reject(&c, "not innermost");
+	}
+	if (l->nbreaks || l->ncontinues || l->has_label || l->has_return) _reject(&c, "early exit");
+	if (l->has_call) _reject(&c, "call in loop");
+	if (plan->reason) goto end;
+
+	_plan_cond(&c, l->e->while_.cond);
+	if (plan->reason) goto end;
+	walk_expr(&c.walk, l->e->while_.body, &_lanes_ops, &c);
+	if (plan->reason) goto end;
+
+	if (!_has(plan->nsteppers, plan->steppers, plan->counter)) {
+		_reject(&c, "not countable");
+		goto end;
+	}
+
+	// Steppers must all move together, at the end of each iteration, or
+	// lanes would see different offsets
+	size_t nelems;
+	struct ast_expr **elems;
+	_spine(l->e->while_.body, &nelems, &elems);
+	size_t ntail = 0;
+	while (ntail < nelems) {
+		struct ast_expr *e = elems[nelems - ntail - 1];
+		bool is_update = false;
+		for (size_t i = 0; i < c.nupdates; ++i) is_update |= c.updates[i] == e;
+		if (!is_update) break;
+		++ntail;
+	}
+	free(elems);
+	if (ntail != c.nupdates) _reject(&c, "stepped in the middle of the loop");
+
+	for (size_t i = 0; i < plan->nsteppers; ++i) {
+		if (_has(i, plan->steppers, plan->steppers[i])) _reject(&c, "stepped more than once");
+	}
+	for (size_t i = 0; i < c.nstepped; ++i) {
+		if (!_has(plan->nsteppers, plan->steppers, c.stepped[i])) _reject(&c, "access is not unit-stride");
+	}
+
+	// Only lanes' own values and invariants may be read
+	for (size_t i = 0; i < c.nuses; ++i) {
+		struct ast_expr *e = c.uses[i];
+		struct loop_binding *b = NULL;
+		for (size_t j = l->nbindings; j-- > 0;) {
+			if (!strcmp(l->bindings[j].name, e->ident)) {
+				b = l->bindings + j;
+				break;
+			}
+		}
+		if (b->type.vol) _reject(&c, "volatile binding");
+		if (_has(plan->nsteppers, plan->steppers, b->name)) _reject(&c, "counter used as a value");
+		if (_reduction(plan, b->name)) _reject(&c, "loop-carried dependence");
+		if (c.has_store && strmap_get(&ln->addr_taken, b->name)) _reject(&c, "binding may alias a store");
+	}
+
+	// Lanes see steppers and reductions only as of the start of the
+	// unrolled iteration, so nothing else may read or write them
+	for (size_t i = 0; i < plan->nsteppers; ++i) {
+		if (strmap_get(&ln->addr_taken, plan->steppers[i])) _reject(&c, "stepper has its address taken");
+	}
+	for (size_t i = 0; i < plan->nreductions; ++i) {
+		if (strmap_get(&ln->addr_taken, plan->reductions[i].name)) _reject(&c, "reduction has its address taken");
+	}
+
+	// Lanes of one base must not overlap each other
+	for (size_t i = 0; i < plan->naccesses; ++i) {
+		struct lanes_access *a = plan->accesses + i;
+		for (size_t j = 0; j < i; ++j) {
+			struct lanes_access *b = plan->accesses + j;
+			if (strcmp(a->base, b->base)) continue;
+			if (!a->index != !b->index || (a->index && strcmp(a->index, b->index))) {
+				_reject(&c, "base accessed at two offsets");
+			}
+		}
+	}
+	if (plan->reason) goto end;
+
+	if (!plan->elem_size) plan->elem_size = 1;
+	plan->lanes = vector_bytes / plan->elem_size;
+	if (plan->lanes < 2) {
+		_reject(&c, "elements too wide");
+		goto end;
+	}
+
+	// Every stored base needs checking against every other base
+	for (size_t i = 0; i < plan->naccesses; ++i) {
+		if (!plan->accesses[i].store) continue;
+		const char *a = plan->accesses[i].base;
+		for (size_t j = 0; j < plan->naccesses; ++j) {
+			const char *b = plan->accesses[j].base;
+			if (!strcmp(a, b)) continue;
+
+			bool dup = false;
+			for (size_t k = 0; k < plan->nchecks; ++k) {
+				dup |= (!strcmp(plan->checks[k].a, a) && !strcmp(plan->checks[k].b, b))
+					|| (!strcmp(plan->checks[k].a, b) && !strcmp(plan->checks[k].b, a));
+			}
+			if (dup) continue;
+
+			_PUSH(plan->checks, plan->nchecks, plan->checks_alloc, 4);
+			plan->checks[plan->nchecks].a = a;
+			plan->checks[plan->nchecks].b = b;
+			++plan->nchecks;
+		}
+	}
+
+end:
+	free(c.inner);
+	free(c.updates);
+	free(c.stepped);
+	free(c.uses);
+	walk_free(&c.walk);
+	return !plan->reason;
+}
+
+void lanes_plan_free(struct lanes_plan *plan) {
+	free(plan->accesses);
+	free(plan->steppers);
+	free(plan->reductions);
+	free(plan->checks);
+	*plan = (struct lanes_plan){0};
+}
+
+// }}}
+
+// Transformation {{{
+
+struct _xform_ctx {
+	struct walk_stack walk;
+	// Numbers the names made so far in the unit
+	size_t nfresh;
+};
+
+#define _U64 ((struct val_type){.t = TYPE_INT, .int_ = U_64})
+#define _BOOL ((struct val_type){.t = TYPE_BOOL})
+
+// Alias checks compare addresses as bytes
+static struct ref_type _u8 = {.to = {.t = TYPE_INT, .int_ = U_8}};
+
+// Names containing '$' cannot be written in source, so they never clash
+static const char *_fresh(struct _xform_ctx *c, const char *prefix) {
+	size_t len = strlen(prefix) + 24;
+	char *s = MEM_ALLOC(MEM_NAME, len);
+	snprintf(s, len, "$%s.%zu", prefix, ++c->nfresh);
+	return s;
+}
+
+static struct ast_expr *_new(int t, struct val_type type) {
+	struct ast_expr *e = MEM_CALLOC(MEM_EXPR + t, 1, sizeof *e);
+	e->t = t;
+	e->type = type;
+	return e;
+}
+
+static struct ast_expr *_ident(const char *name, struct val_type type) {
+	struct ast_expr *e = _new(EXPR_IDENT, type);
+	e->ident = name;
+	return e;
+}
+
+static struct ast_expr *_binop(int op, struct ast_expr *x, struct ast_expr *y, struct val_type type) {
+	struct ast_expr *e = _new(EXPR_BINOP, type);
+	e->binop.t = op;
+	e->binop.x = x;
+	e->binop.y = y;
+	return e;
+}
+
+static struct ast_expr *_int_lit(enum int_type type, int64_t v) {
+	struct ast_expr *e = _new(EXPR_INT_LIT, (struct val_type){.t = TYPE_INT, .int_ = type});
+	e->int_lit.type = type;
+	e->int_lit.i = v;
+	return e;
+}
+
+static struct ast_expr *_cast(struct val_type type, struct ast_expr *val) {
+	struct ast_expr *e = _new(EXPR_CAST, type);
+	e->cast.type = type;
+	e->cast.val = val;
+	return e;
+}
+
+static struct ast_expr *_if(struct ast_expr *cond, struct ast_expr *t, struct ast_expr *f) {
+	struct ast_expr *e = _new(EXPR_IF, f ? t->type : (struct val_type){.t = TYPE_VOID});
+	e->if_.cond = cond;
+	e->if_.t = t;
+	e->if_.f = f;
+	return e;
+}
+
+static struct ast_expr *_let(const char *name, struct ref_type type, struct ast_expr *val, struct ast_expr *body) {
+	struct ast_expr *e = _new(EXPR_LET, body->type);
+	e->let.name = name;
+	e->let.type = type;
+	e->let.val = val;
+	e->let.body = body;
+	return e;
+}
+
+// Chains n expressions with ;
+static struct ast_expr *_seq(size_t n, struct ast_expr **items) {
+	struct ast_expr *e = items[n - 1];
+	for (size_t i = n - 1; i-- > 0;) e = _binop(BINOP_SEQOP, items[i], e, e->type);
+	return e;
+}
+
+static struct val_type _binding_type(struct loop *l, const char *name) {
+	for (size_t i = l->nbindings; i-- > 0;) {
+		if (!strcmp(l->bindings[i].name, name)) return l->bindings[i].type.to;
+	}
+	abort();
+}
+
+// The value x for which s op x is s
+static struct ast_expr *_identity(struct lanes_reduction *r) {
+	enum int_type type = r->type.int_;
+	size_t bits = type & 0xff;
+	switch (r->op) {
+	case BINOP_MUL:
+		return _int_lit(type, 1);
+	case BINOP_BIN_AND:
+		// All ones, kept zero-extended for unsigned types
+		return _int_lit(type, type & I_SIGNED || bits == 64 ? -1 : (int64_t)((UINT64_C(1) << bits) - 1));
+	default:
+		return _int_lit(type, 0);
+	}
+}
+
+// The number of iterations left, as a u64
+static struct ast_expr *_remaining(struct _xform_ctx *c, struct lanes_plan *plan, struct val_type type) {
+	struct ast_expr *counter = _ident(plan->counter, type);
+	struct ast_expr *limit = expr_clone(&c->walk, plan->limit);
+	struct ast_expr *n;
+	if (type.t == TYPE_PTR) {
+		n = _binop(BINOP_SUB, limit, counter, _U64);
+	} else {
+		// The unsigned difference is exact whenever counter < limit, and
+		// counts the steps to wrap around to limit otherwise
+		struct val_type u = {.t = TYPE_INT, .int_ = type.int_ & ~I_SIGNED};
+		if (u.int_ != type.int_) {
+			limit = _cast(u, limit);
+			counter = _cast(u, counter);
+		}
+		n = _binop(BINOP_SUB, limit, counter, u);
+		if (u.int_ != U_64) n = _cast(_U64, n);
+	}
+
+	// A pointer only reaches limit with != if it starts below it
+	if (plan->cmp == BINOP_NEQUAL && type.t != TYPE_PTR) return n;
+	struct ast_expr *cond = _binop(BINOP_LT, _ident(plan->counter, type), expr_clone(&c->walk, plan->limit), _BOOL);
+	return _if(cond, n, _int_lit(U_64, 0));
+}
+
+static struct lanes_access *_access_of(struct lanes_plan *plan, const char *base) {
+	for (size_t i = 0; i < plan->naccesses; ++i) {
+		if (!strcmp(plan->accesses[i].base, base)) return plan->accesses + i;
+	}
+	abort();
+}
+
+// The bytes each access covers over the iterations left don't overlap
+static struct ast_expr *_disjoint(struct _xform_ctx *c, const char *rem, struct lanes_access *a, struct lanes_access *b) {
+	struct val_type bytes = {.t = TYPE_PTR, .ptr = &_u8};
+	struct lanes_access *acc[2] = {a, b};
+	struct ast_expr *start[2], *end[2];
+	for (int i = 0; i < 2; ++i) {
+		size_t size = _lane_size(acc[i]->e->type);
+		struct ast_expr *len = _ident(rem, _U64);
+		if (size > 1) len = _binop(BINOP_MUL, len, _int_lit(U_64, size), _U64);
+		start[i] = _cast(bytes, expr_clone(&c->walk, acc[i]->e->unop.x));
+		end[i] = _binop(BINOP_ADD, _cast(bytes, expr_clone(&c->walk, acc[i]->e->unop.x)), len, bytes);
+	}
+	return _binop(BINOP_BOOL_OR,
+		_binop(BINOP_LTE, end[0], start[1], _BOOL),
+		_binop(BINOP_LTE, end[1], start[0], _BOOL),
+		_BOOL);
+}
+
+struct _lane_ctx {
+	struct lanes_plan *plan;
+	size_t lane;
+	// The accumulator standing in for each reduction
+	const char **accs;
+};
+
+static bool _lane_pre(struct ast_expr *e, void *ctx) {
+	struct _lane_ctx *c = ctx;
+	if (e->t == EXPR_IDENT) {
+		struct lanes_reduction *r = _reduction(c->plan, e->ident);
+		if (r) e->ident = c->accs[r - c->plan->reductions];
+		return true;
+	}
+	if (e->t != EXPR_UNOP || e->unop.t != UNOP_DEREF) return true;
+
+	// *p becomes *(p + lane), and *(a + i) becomes *((a + i) + lane),
+	// a constant offset code generation can fold into the access. If i may
+	// wrap around before the loop ends, it becomes *(a + (i + lane))
+	// instead.
+	struct ast_expr **step = &e->unop.x;
+	if ((*step)->t == EXPR_BINOP && c->plan->cmp != BINOP_LT) {
+		struct ast_expr *add = *step;
+		step = add->binop.x->type.t == TYPE_INT ? &add->binop.x : &add->binop.y;
+	}
+	struct ast_expr *s = *step;
+	enum int_type type = s->type.t == TYPE_PTR ? U_64 : s->type.int_;
+	*step = _binop(BINOP_ADD, s, _int_lit(type, c->lane), s->type);
+	return false;
+}
+
+// Puts the unrolled loop in front of the loop, which is left to run the
+// iterations that don't fill every lane:
+//   let $rem = <iterations left>;
+//   (if <alias checks>
+//     let $acc.k = <identity>; ...;
+//     let $n = $rem / lanes;
+//     (while $n != 0 (<body for lane 0>; ...; <body for lane lanes-1>;
+//       <steppers += lanes>; $n = $n - 1);
+//     s = s op $acc.k; ...));
+//   <the loop>
+static void _unroll(struct _xform_ctx *c, struct loop *l, struct lanes_plan *plan) {
+	size_t nelems;
+	struct ast_expr **elems;
+	_spine(l->e->while_.body, &nelems, &elems);
+	size_t nbody = nelems - plan->nsteppers;
+
+	// Each lane but the first accumulates on its own
+	size_t nred = plan->nreductions;
+	const char **accs = malloc(plan->lanes * nred * sizeof *accs);
+	for (size_t lane = 0; lane < plan->lanes; ++lane) {
+		for (size_t r = 0; r < nred; ++r) {
+			accs[lane * nred + r] = lane ? _fresh(c, "acc") : plan->reductions[r].name;
+		}
+	}
+
+	size_t nitems = 0, items_alloc = 0;
+	struct ast_expr **items = NULL;
+	for (size_t lane = 0; lane < plan->lanes; ++lane) {
+		struct _lane_ctx lc = {.plan = plan, .lane = lane, .accs = accs + lane * nred};
+		for (size_t i = 0; i < nbody; ++i) {
+			struct ast_expr *e = expr_clone(&c->walk, elems[i]);
+			if (lane) walk_expr(&c->walk, e, &(struct walk_ops){.pre = _lane_pre}, &lc);
+			_PUSH(items, nitems, items_alloc, 16);
+			items[nitems++] = e;
+		}
+	}
+	free(elems);
+
+	for (size_t i = 0; i < plan->nsteppers; ++i) {
+		const char *name = plan->steppers[i];
+		struct val_type type = _binding_type(l, name);
+		enum int_type step = type.t == TYPE_PTR ? U_64 : type.int_;
+		struct ast_expr *sum = _binop(BINOP_ADD, _ident(name, type), _int_lit(step, plan->lanes), type);
+		_PUSH(items, nitems, items_alloc, 16);
+		items[nitems++] = _binop(BINOP_ASSIGN, _ident(name, type), sum, type);
+	}
+
+	const char *rem = _fresh(c, "rem"), *iters = _fresh(c, "n");
+	struct ast_expr *dec = _binop(BINOP_SUB, _ident(iters, _U64), _int_lit(U_64, 1), _U64);
+	_PUSH(items, nitems, items_alloc, 16);
+	items[nitems++] = _binop(BINOP_ASSIGN, _ident(iters, _U64), dec, _U64);
+
+	struct ast_expr *loop = _new(EXPR_WHILE, (struct val_type){.t = TYPE_VOID});
+	loop->while_.cond = _binop(BINOP_NEQUAL, _ident(iters, _U64), _int_lit(U_64, 0), _BOOL);
+	loop->while_.body = _seq(nitems, items);
+
+	nitems = 0;
+	_PUSH(items, nitems, items_alloc, 16);
+	items[nitems++] = loop;
+	for (size_t r = 0; r < nred; ++r) {
+		struct lanes_reduction *red = plan->reductions + r;
+		for (size_t lane = 1; lane < plan->lanes; ++lane) {
+			struct ast_expr *y = _binop(red->op, _ident(red->name, red->type), _ident(accs[lane * nred + r], red->type), red->type);
+			_PUSH(items, nitems, items_alloc, 16);
+			items[nitems++] = _binop(BINOP_ASSIGN, _ident(red->name, red->type), y, red->type);
+		}
+	}
+	struct ast_expr *unrolled = _seq(nitems, items);
+	free(items);
+
+	for (size_t r = nred; r-- > 0;) {
+		for (size_t lane = plan->lanes; lane-- > 1;) {
+			struct ref_type type = {.mut = true, .to = plan->reductions[r].type};
+			unrolled = _let(accs[lane * nred + r], type, _identity(plan->reductions + r), unrolled);
+		}
+	}
+	free(accs);
+
+	size_t shift = 0;
+	while ((size_t)1 << shift < plan->lanes) ++shift;
+	struct ast_expr *n = _binop(BINOP_RSHIFT, _ident(rem, _U64), _int_lit(U_64, shift), _U64);
+	unrolled = _let(iters, (struct ref_type){.mut = true, .to = _U64}, n, unrolled);
+
+	if (plan->nchecks) {
+		struct ast_expr *cond = NULL;
+		for (size_t i = 0; i < plan->nchecks; ++i) {
+			struct lanes_access *a = _access_of(plan, plan->checks[i].a), *b = _access_of(plan, plan->checks[i].b);
+			struct ast_expr *d = _disjoint(c, rem, a, b);
+			cond = cond ? _binop(BINOP_BOOL_AND, cond, d, _BOOL) : d;
+		}
+		unrolled = _if(cond, unrolled, NULL);
+	}
+
+	struct ast_expr *w = MEM_ALLOC(MEM_EXPR + EXPR_WHILE, sizeof *w);
+	*w = *l->e;
+	struct val_type counter = _binding_type(l, plan->counter);
+	struct ast_expr *e = _let(rem, (struct ref_type){.to = _U64}, _remaining(c, plan, counter),
+		_binop(BINOP_SEQOP, unrolled, w, w->type));
+	*l->e = *e;
+	MEM_FREE(e);
+	l->e = w;
+}
+
+// }}}
+
+// Driver {{{
+
+struct _funcs {
+	size_t n, alloc;
+	struct ast_expr **funcs;
+};
+
+static bool _collect_funcs(struct ast_expr *e, void *ctx) {
+	if (e->t == EXPR_FUNC) {
+		struct _funcs *list = ctx;
+		_PUSH(list->funcs, list->n, list->alloc, 8);
+		list->funcs[list->n++] = e;
+	}
+	return true;
+}
+
+static void _lanes_function(struct _xform_ctx *c, const char *name, size_t lit, size_t nargs, struct loop_binding *args,
+		struct ast_expr *body, size_t vector_bytes, FILE *report, struct lanes_stats *stats) {
+	struct loop_nest ln;
+	loop_nest_build(&ln, nargs, args, body);
+
+	for (size_t i = 0; i < ln.nloops; ++i) {
+		struct lanes_plan plan;
+		bool ok = lanes_plan_loop(&ln, ln.loops[i], vector_bytes, &plan);
+		++stats->nloops;
+		if (ok) {
+			++stats->nunrolled;
+			stats->nchecks += plan.nchecks;
+		}
+
+		if (report) {
+			fprintf(report, "lanes: %s", name);
+			if (lit) fprintf(report, " (literal %zu)", lit);
+			fprintf(report, ": loop %zu: ", i);
+			if (ok) {
+				fprintf(report, "%zu lanes of %zu bytes, %zu alias checks, %zu reductions\n",
+					plan.lanes, plan.elem_size, plan.nchecks, plan.nreductions);
+			} else {
+				fprintf(report, "not unrolled: %s\n", plan.reason);
+			}
+		}
+
+		// Only innermost loops are unrolled, so the others still hold
+		if (ok) _unroll(c, ln.loops[i], &plan);
+		lanes_plan_free(&plan);
+	}
+
+	loop_nest_free(&ln);
+}
+
+static void _lanes_toplevels(struct _xform_ctx *c, size_t ntops, struct ast_toplevel *tops, size_t vector_bytes,
+		FILE *report, struct lanes_stats *stats) {
+	for (size_t i = 0; i < ntops; ++i) {
+		struct ast_toplevel *t = tops + i;
+		const char *name;
+		struct ast_expr *body;
+		size_t nargs = 0;
+		struct loop_binding *args = NULL;
+
+		switch (t->type) {
+		case EXPRTOP_FUNC:
+			name = t->func.name;
+			body = t->func.body;
+			nargs = t->func.nargs;
+			args = (void *)t->func.args;
+			break;
+		case EXPRTOP_DECL:
+			name = t->decl.name;
+			body = t->decl.val;
+			break;
+		case EXPRTOP_NAMESPACE:
+			_lanes_toplevels(c, t->namespace.size, t->namespace.body, vector_bytes, report, stats);
+			continue;
+		}
+		if (!body) continue;
+
+		struct _funcs lits = {0};
+		walk_expr(&c->walk, body, &(struct walk_ops){.pre = _collect_funcs}, &lits);
+
+		size_t before = stats->nunrolled;
+		_lanes_function(c, name, 0, nargs, args, body, vector_bytes, report, stats);
+		for (size_t j = 0; j < lits.n; ++j) {
+			struct ast_expr *f = lits.funcs[j];
+			_lanes_function(c, name, j + 1, f->func.nargs, (void *)f->func.args, f->func.body, vector_bytes, report, stats);
+		}
+		free(lits.funcs);
+
+		if (stats->nunrolled != before) annotate_toplevel(t);
+	}
+}
+
+void lanes_unit(size_t ntops, struct ast_toplevel *tops, size_t vector_bytes, FILE *report, struct lanes_stats *stats) {
+	struct _xform_ctx c = {0};
+	_lanes_toplevels(&c, ntops, tops, vector_bytes, report, stats);
+	walk_free(&c.walk);
+	if (report) {
+		fprintf(report, "lanes: %zu of %zu loops (%zu alias checks)\n",
+			stats->nunrolled, stats->nloops, stats->nchecks);
+	}
+}
+
+// }}}
@@ -0,0 +1,90 @@
+// vim: noet
+
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdio.h>
+#include "loop.h"
+
+// Vector register sizes, in bytes, which set how many lanes a loop is
+// unrolled to
+#define LANES_SSE2 16
+#define LANES_AVX2 32
+
+struct lanes_access {
+	// The dereference
+	struct ast_expr *e;
+	// The pointer that is indexed or stepped, and the index it is indexed
+	// with, or NULL if the pointer steps itself
+	const char *base, *index;
+	bool store;
+};
+
+// An integer binding accumulated with s = s op y
+struct lanes_reduction {
+	const char *name;
+	struct val_type type;
+	int op;
+};
+
+// How to run a loop several elements at a time. The unrolled loop runs
+// while at least lanes iterations remain, and the original loop finishes off
+// the rest.
+struct lanes_plan {
+	// Why the loop can't be unrolled by lanes, or NULL if it can
+	const char *reason;
+
+	// The loop runs while counter < limit, or counter != limit if cmp is
+	// BINOP_NEQUAL
+	const char *counter;
+	struct ast_expr *limit;
+	int cmp;
+
+	// Widest element type the loop works on, and how many fit in a vector
+	// register
+	size_t elem_size, lanes;
+
+	size_t naccesses, accesses_alloc;
+	struct lanes_access *accesses;
+
+	// Bindings that step by one element each iteration, including counter
+	size_t nsteppers, steppers_alloc;
+	const char **steppers;
+
+	// Integer bindings accumulated with + * & | ^, which become one
+	// accumulator per lane and are combined after the unrolled loop
+	size_t nreductions, reductions_alloc;
+	struct lanes_reduction *reductions;
+
+	// Pairs of bases that are stored through and may overlap; the unrolled
+	// loop is only entered if their ranges are disjoint
+	size_t nchecks, checks_alloc;
+	struct {
+		const char *a, *b;
+	} *checks;
+};
+
+// Returns true if the loop can be unrolled to as many lanes as fit in a
+// vector register of the given size.
+// The plan must be freed either way.
+bool lanes_plan_loop(struct loop_nest *ln, struct loop *l, size_t vector_bytes, struct lanes_plan *plan);
+void lanes_plan_free(struct lanes_plan *plan);
+
+struct lanes_stats {
+	size_t nloops, nunrolled;
+	size_t nchecks;
+};
+
+// Unrolls by lanes every loop it can in a unit checked with annotate_unit,
+// printing each decision to report if non-NULL. Functions that change are
+// re-checked.
+//
+// This is not vectorization: no backend has vector registers, so the
+// unrolled loop is scalar code, its body repeated once per lane, lane k
+// working on element counter + k, with the steppers advanced by lanes at the
+// end. The lanes of one iteration are independent of each other, which the
+// alias checks and reductions guarantee, so fewer loop tests and branches
+// run, and the lanes' loads and arithmetic can overlap.
+void lanes_unit(size_t ntops, struct ast_toplevel *tops, size_t vector_bytes, FILE *report, struct lanes_stats *stats);
+
+#endif
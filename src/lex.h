@@ -1,11 +1,46 @@
 #ifndef LEX_H
 #define LEX_H
 
+#include <stdbool.h>
 #include <stdio.h>
 
-int yylex(void);
-extern FILE *yyin;
-extern char *yytext;
-extern int yyleng;
+// The scanner is reentrant: all its state is in a yyscan_t, so each thread
+// can lex with its own
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+int yylex(yyscan_t scanner);
+char *yyget_text(yyscan_t scanner);
+
+// Fails with errno set. A new scanner reads stdin.
+bool lex_init(yyscan_t *scanner);
+void lex_free(yyscan_t scanner);
+
+// Lexes len bytes at buf in place, without copying them. buf[len] and
+// buf[len+1] must be NUL, and buf must be writable, as flex briefly writes
+// a NUL after each token.
+void lex_buffer(yyscan_t scanner, char *buf, size_t len);
+
+// A file mapped privately, followed by the two NULs lex_buffer needs
+struct lex_file {
+	char *buf;
+	size_t len, maplen;
+};
+
+// Fails with errno set, to ENODEV for pipes and other files that cannot be
+// mapped. Neither touches a scanner, so they are safe to call from any
+// thread, but a file still being lexed needs lex_end before unmapping.
+bool lex_map(struct lex_file *f, const char *path);
+void lex_unmap(struct lex_file *f);
+
+// Lexes a mapped file. Flex dirties every page it reads, so pages it has
+// moved past are dropped as it goes, and resident memory stays small.
+void lex_mapped(yyscan_t scanner, struct lex_file *f);
+
+// Drops the current input, so that the next yylex reads its input file
+// from scratch
+void lex_end(yyscan_t scanner);
 
 #endif
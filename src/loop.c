@@ -0,0 +1,911 @@
+// vim: noet
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loop.h"
+#include "memstats.h"
+#include "type.h"
+#include "walk.h"
+
+// Helpers {{{
+
+struct _loop_scope {
+	size_t n, alloc;
+	struct loop_binding *b;
+};
+
+static void _scope_push(struct _loop_scope *s, const char *name, struct ref_type type) {
+	if (s->n == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 16;
+		s->b = MEM_REALLOC(MEM_SCOPE, s->b, s->alloc * sizeof *s->b);
+	}
+	s->b[s->n].name = name;
+	s->b[s->n].type = type;
+	++s->n;
+}
+
+// Returns SIZE_MAX for globals
+static size_t _scope_find(struct _loop_scope *s, const char *name) {
+	for (size_t i = s->n; i-- > 0;) {
+		if (!strcmp(s->b[i].name, name)) return i;
+	}
+	return SIZE_MAX;
+}
+
+// Strips field accesses off an lvalue, leaving an identifier or dereference
+static struct ast_expr *_lvalue_root(struct ast_expr *e) {
+	while (e->t == EXPR_FIELD_ACCESS) e = e->field_access.aggr;
+	return e;
+}
+
+static bool _is_deref(struct ast_expr *e) {
+	return e->t == EXPR_UNOP && e->unop.t == UNOP_DEREF;
+}
+
+static bool _is_incdec(struct ast_expr *e) {
+	if (e->t != EXPR_UNOP) return false;
+	switch (e->unop.t) {
+	case UNOP_PREINC:
+	case UNOP_POSTINC:
+	case UNOP_PREDEC:
+	case UNOP_POSTDEC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Names containing '$' cannot be written in source, so they never clash.
+// counter numbers the names made so far in the unit.
+static const char *_fresh(size_t *counter, const char *prefix) {
+	size_t len = strlen(prefix) + 24;
+	char *s = MEM_ALLOC(MEM_NAME, len);
+	snprintf(s, len, "$%s.%zu", prefix, ++*counter);
+	return s;
+}
+
+static struct ast_expr *_new(int t, struct val_type type) {
+	struct ast_expr *e = MEM_CALLOC(MEM_EXPR + t, 1, sizeof *e);
+	e->t = t;
+	e->type = type;
+	return e;
+}
+
+static struct ast_expr *_ident(const char *name, struct val_type type) {
+	struct ast_expr *e = _new(EXPR_IDENT, type);
+	e->ident = name;
+	return e;
+}
+
+static struct ast_expr *_binop(int op, struct ast_expr *x, struct ast_expr *y, struct val_type type) {
+	struct ast_expr *e = _new(EXPR_BINOP, type);
+	e->binop.t = op;
+	e->binop.x = x;
+	e->binop.y = y;
+	return e;
+}
+
+static struct ast_expr *_int_lit(enum int_type type, int64_t v) {
+	struct ast_expr *e = _new(EXPR_INT_LIT, (struct val_type){.t = TYPE_INT, .int_ = type});
+	e->int_lit.type = type;
+	e->int_lit.i = v;
+	return e;
+}
+
+static struct ast_expr *_let(const char *name, struct ref_type type, struct ast_expr *val, struct ast_expr *body) {
+	struct ast_expr *e = _new(EXPR_LET, body->type);
+	e->let.name = name;
+	e->let.type = type;
+	e->let.val = val;
+	e->let.body = body;
+	return e;
+}
+
+// }}}
+
+// Loop nest {{{
+
+struct _nest_ctx {
+	struct loop_nest *ln;
+	struct _loop_scope scope;
+
+	size_t nstack, stack_alloc;
+	struct loop **stack;
+};
+
+static bool _nest_pre(struct ast_expr *e, void *ctx) {
+	struct _nest_ctx *c = ctx;
+	struct loop *top = c->nstack ? c->stack[c->nstack-1] : NULL;
+	struct ast_expr *root;
+
+	switch (e->t) {
+	case EXPR_FUNC:
+		// Function literals have loops of their own
+		return false;
+
+	case EXPR_WHILE:;
+		struct loop *l = calloc(1, sizeof *l);
+		l->e = e;
+		l->parent = top;
+		l->depth = c->nstack + 1;
+		l->nbindings = c->scope.n;
+		l->bindings = malloc(c->scope.n * sizeof *l->bindings);
+		memcpy(l->bindings, c->scope.b, c->scope.n * sizeof *l->bindings);
+
+		if (c->nstack == c->stack_alloc) {
+			c->stack_alloc = c->stack_alloc ? c->stack_alloc * 2 : 8;
+			c->stack = realloc(c->stack, c->stack_alloc * sizeof *c->stack);
+		}
+		c->stack[c->nstack++] = l;
+		break;
+
+	case EXPR_BREAK:
+		if (!top) break;
+		if (e->break_.lbl) top->has_label = true;
+		else ++top->nbreaks;
+		break;
+
+	case EXPR_CONTINUE:
+		if (!top) break;
+		if (e->continue_.lbl) top->has_label = true;
+		else ++top->ncontinues;
+		break;
+
+	case EXPR_RETURN:
+		if (top) top->has_return = true;
+		break;
+
+	case EXPR_CALL:
+		if (top) top->has_call = true;
+		break;
+
+	case EXPR_BINOP:
+		if (e->binop.t == BINOP_ASSIGN && top && _is_deref(_lvalue_root(e->binop.x))) {
+			top->has_store = true;
+		}
+		break;
+
+	case EXPR_UNOP:
+		if (_is_incdec(e)) {
+			if (top && _is_deref(_lvalue_root(e->unop.x))) top->has_store = true;
+		} else if (e->unop.t == UNOP_REF) {
+			root = _lvalue_root(e->unop.x);
+			if (root->t == EXPR_IDENT) strmap_put(&c->ln->addr_taken, root->ident, 0);
+		}
+		break;
+
+	default:
+		break;
+	}
+	return true;
+}
+
+static void _nest_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _nest_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) _scope_push(&c->scope, e->let.name, e->let.type);
+}
+
+static void _nest_post(struct ast_expr *e, void *ctx) {
+	struct _nest_ctx *c = ctx;
+	if (e->t == EXPR_LET) {
+		--c->scope.n;
+	} else if (e->t == EXPR_WHILE) {
+		struct loop *l = c->stack[--c->nstack];
+		if (l->parent) {
+			l->parent->has_call |= l->has_call;
+			l->parent->has_store |= l->has_store;
+			l->parent->has_return |= l->has_return;
+			l->parent->has_label |= l->has_label;
+		}
+
+		struct loop_nest *ln = c->ln;
+		if (ln->nloops == ln->alloc) {
+			ln->alloc = ln->alloc ? ln->alloc * 2 : 8;
+			ln->loops = realloc(ln->loops, ln->alloc * sizeof *ln->loops);
+		}
+		ln->loops[ln->nloops++] = l;
+	}
+}
+
+void loop_nest_build(struct loop_nest *ln, size_t nargs, struct loop_binding *args, struct ast_expr *body) {
+	static const struct walk_ops ops = {
+		.pre = _nest_pre,
+		.child = _nest_child,
+		.post = _nest_post,
+	};
+
+	*ln = (struct loop_nest){0};
+	struct _nest_ctx c = {.ln = ln};
+	for (size_t i = 0; i < nargs; ++i) {
+		_scope_push(&c.scope, args[i].name, args[i].type);
+	}
+
+	struct walk_stack walk = {0};
+	walk_expr(&walk, body, &ops, &c);
+	walk_free(&walk);
+
+	MEM_FREE(c.scope.b);
+	free(c.stack);
+}
+
+void loop_nest_free(struct loop_nest *ln) {
+	for (size_t i = 0; i < ln->nloops; ++i) {
+		free(ln->loops[i]->bindings);
+		free(ln->loops[i]);
+	}
+	free(ln->loops);
+	strmap_free(&ln->addr_taken);
+	*ln = (struct loop_nest){0};
+}
+
+void loop_nest_dump(struct loop_nest *ln, FILE *f) {
+	for (size_t i = 0; i < ln->nloops; ++i) {
+		struct loop *l = ln->loops[i];
+		fprintf(f, "loop %zu: depth %zu, %zu breaks, %zu continues", i, l->depth, l->nbreaks, l->ncontinues);
+		if (l->has_call) fputs(", calls", f);
+		if (l->has_store) fputs(", stores", f);
+		if (l->has_return) fputs(", returns", f);
+		if (l->has_label) fputs(", labelled jumps", f);
+		fputc('\n', f);
+	}
+}
+
+// }}}
+
+// Per-loop analysis {{{
+
+struct _opt_ctx {
+	struct loop_nest *ln;
+	struct loop *loop;
+	struct loop_stats *stats;
+
+	struct walk_stack walk;
+	struct _loop_scope scope;
+	size_t nfresh;
+
+	// Facts about each binding visible at the loop
+	size_t nouter, outer_alloc;
+	struct {
+		bool assigned;
+		// Assigned in some way other than a constant step
+		bool not_iv;
+		size_t nupdates, updates_alloc;
+		struct {
+			struct ast_expr *e;
+			int64_t step;
+		} *updates;
+	} *outer;
+
+	// Names bound inside the loop, which may shadow outer ones
+	struct strmap inner;
+
+	// Invariance of nodes whose parent is pending
+	size_t nflags, flags_alloc;
+	bool *flags;
+
+	// Maximal invariant expressions worth hoisting
+	bool collect_ivs;
+	size_t ncands, cands_alloc;
+	struct ast_expr **cands;
+
+	// iv * k and p + iv, where k and p are invariant
+	size_t nocc, occ_alloc;
+	struct {
+		struct ast_expr *e;
+		size_t iv;
+		struct ast_expr *k;
+		bool ptr;
+	} *occ;
+};
+
+static void _opt_reset(struct _opt_ctx *c, struct loop *l) {
+	c->loop = l;
+
+	c->scope.n = 0;
+	for (size_t i = 0; i < l->nbindings; ++i) {
+		_scope_push(&c->scope, l->bindings[i].name, l->bindings[i].type);
+	}
+
+	for (size_t i = 0; i < c->nouter; ++i) {
+		free(c->outer[i].updates);
+	}
+	if (l->nbindings > c->outer_alloc) {
+		c->outer_alloc = l->nbindings;
+		c->outer = realloc(c->outer, c->outer_alloc * sizeof *c->outer);
+	}
+	c->nouter = l->nbindings;
+	memset(c->outer, 0, c->nouter * sizeof *c->outer);
+
+	strmap_free(&c->inner);
+	c->inner = (struct strmap){0};
+
+	c->nflags = c->ncands = c->nocc = 0;
+}
+
+// Recognizes x = x + n, x = n + x and x = x - n
+static bool _step_of(struct ast_expr *e, int64_t *step) {
+	struct ast_expr *x = e->binop.x, *y = e->binop.y;
+	if (x->t != EXPR_IDENT || y->t != EXPR_BINOP) return false;
+	if (y->binop.t != BINOP_ADD && y->binop.t != BINOP_SUB) return false;
+
+	struct ast_expr *a = y->binop.x, *b = y->binop.y;
+	if (a->t == EXPR_IDENT && !strcmp(a->ident, x->ident) && b->t == EXPR_INT_LIT) {
+		*step = y->binop.t == BINOP_ADD ? b->int_lit.i : -b->int_lit.i;
+		return true;
+	}
+	if (y->binop.t == BINOP_ADD && b->t == EXPR_IDENT && !strcmp(b->ident, x->ident) && a->t == EXPR_INT_LIT) {
+		*step = a->int_lit.i;
+		return true;
+	}
+	return false;
+}
+
+static void _facts_assign(struct _opt_ctx *c, struct ast_expr *target, struct ast_expr *update, int64_t step, bool is_step) {
+	struct ast_expr *root = _lvalue_root(target);
+	if (root->t != EXPR_IDENT) return;
+
+	size_t i = _scope_find(&c->scope, root->ident);
+	if (i == SIZE_MAX || i >= c->nouter) return;
+
+	c->outer[i].assigned = true;
+	if (!is_step || root != target) {
+		c->outer[i].not_iv = true;
+		return;
+	}
+
+	if (c->outer[i].nupdates == c->outer[i].updates_alloc) {
+		c->outer[i].updates_alloc = c->outer[i].updates_alloc ? c->outer[i].updates_alloc * 2 : 4;
+		c->outer[i].updates = realloc(c->outer[i].updates, c->outer[i].updates_alloc * sizeof *c->outer[i].updates);
+	}
+	c->outer[i].updates[c->outer[i].nupdates].e = update;
+	c->outer[i].updates[c->outer[i].nupdates].step = step;
+	++c->outer[i].nupdates;
+}
+
+static bool _facts_pre(struct ast_expr *e, void *ctx) {
+	struct _opt_ctx *c = ctx;
+	switch (e->t) {
+	case EXPR_FUNC:
+		// Function literals can't see our bindings
+		return false;
+
+	case EXPR_BINOP:
+		if (e->binop.t == BINOP_ASSIGN) {
+			int64_t step = 0;
+			bool is_step = _step_of(e, &step);
+			_facts_assign(c, e->binop.x, e, step, is_step);
+		}
+		break;
+
+	case EXPR_UNOP:
+		switch (e->unop.t) {
+		case UNOP_PREINC:
+		case UNOP_POSTINC:
+			_facts_assign(c, e->unop.x, e, 1, true);
+			break;
+		case UNOP_PREDEC:
+		case UNOP_POSTDEC:
+			_facts_assign(c, e->unop.x, e, -1, true);
+			break;
+		case UNOP_REF:;
+			struct ast_expr *root = _lvalue_root(e->unop.x);
+			if (root->t != EXPR_IDENT) break;
+			size_t i = _scope_find(&c->scope, root->ident);
+			if (i != SIZE_MAX && i < c->nouter) c->outer[i].not_iv = true;
+			break;
+		default:
+			break;
+		}
+		break;
+
+	default:
+		break;
+	}
+	return true;
+}
+
+static void _scope_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _opt_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) _scope_push(&c->scope, e->let.name, e->let.type);
+}
+
+static void _facts_child(struct ast_expr *e, size_t i, void *ctx) {
+	struct _opt_ctx *c = ctx;
+	if (e->t == EXPR_LET && i == 1) strmap_put(&c->inner, e->let.name, 0);
+	_scope_child(e, i, ctx);
+}
+
+static void _facts_post(struct ast_expr *e, void *ctx) {
+	struct _opt_ctx *c = ctx;
+	if (e->t == EXPR_LET) --c->scope.n;
+}
+
+static bool _ident_invariant(struct _opt_ctx *c, struct ast_expr *e) {
+	size_t i = _scope_find(&c->scope, e->ident);
+	// Globals may change behind our back, but functions are constant
+	if (i == SIZE_MAX) return e->type.t == TYPE_FUNC;
+	// Declared inside the loop
+	if (i >= c->nouter) return false;
+	if (c->outer[i].assigned) return false;
+
+	struct loop_binding *b = c->scope.b + i;
+	if (b->type.vol) return false;
+	// Stores and calls may write to anything whose address has escaped
+	if ((c->loop->has_store || c->loop->has_call) && strmap_get(&c->ln->addr_taken, b->name)) {
+		return false;
+	}
+	return true;
+}
+
+static bool _invariant(struct _opt_ctx *c, struct ast_expr *e, bool *kids) {
+	switch (e->t) {
+	case EXPR_INT_LIT:
+	case EXPR_FLOAT_LIT:
+	case EXPR_BOOL_LIT:
+		return true;
+
+	case EXPR_IDENT:
+		return _ident_invariant(c, e);
+
+	case EXPR_BINOP:
+		switch (e->binop.t) {
+		case BINOP_ASSIGN:
+		case BINOP_SEQOP:
+			return false;
+		case BINOP_DIV:
+		case BINOP_MOD:
+			// Hoisting must not introduce a trap the loop wouldn't have hit
+			if (e->type.t == TYPE_INT && !(e->binop.y->t == EXPR_INT_LIT && e->binop.y->int_lit.u)) {
+				return false;
+			}
+			return kids[0] && kids[1];
+		default:
+			return kids[0] && kids[1];
+		}
+
+	case EXPR_UNOP:
+		switch (e->unop.t) {
+		case UNOP_MINUS:
+		case UNOP_PLUS:
+		case UNOP_BIN_NOT:
+		case UNOP_BOOL_NOT:
+			return kids[0];
+		case UNOP_SIZEOF:
+			return true;
+		case UNOP_REF:;
+			// Addresses of bindings outside the loop don't change
+			struct ast_expr *root = _lvalue_root(e->unop.x);
+			if (root->t != EXPR_IDENT) return false;
+			size_t i = _scope_find(&c->scope, root->ident);
+			return i == SIZE_MAX || i < c->nouter;
+		default:
+			// Loads may trap or see stores; the rest write
+			return false;
+		}
+
+	case EXPR_CAST:
+		// A cast with no value yields nothing
+		if (!e->cast.val) return true;
+		return kids[0];
+	case EXPR_FIELD_ACCESS:
+		return kids[0];
+
+	default:
+		return false;
+	}
+}
+
+static bool _worth_hoisting(struct ast_expr *e) {
+	switch (e->t) {
+	case EXPR_INT_LIT:
+	case EXPR_FLOAT_LIT:
+	case EXPR_BOOL_LIT:
+	case EXPR_IDENT:
+		return false;
+	case EXPR_UNOP:
+		return e->unop.t != UNOP_REF && e->unop.t != UNOP_SIZEOF;
+	case EXPR_CAST:
+		if (!e->cast.val) return false;
+		switch (e->cast.val->t) {
+		case EXPR_INT_LIT:
+		case EXPR_FLOAT_LIT:
+		case EXPR_BOOL_LIT:
+			return false;
+		default:
+			return true;
+		}
+	default:
+		return true;
+	}
+}
+
+// Positions that need an lvalue, or that aren't evaluated
+static bool _hoistable_pos(struct ast_expr *e, size_t i) {
+	if (e->t == EXPR_BINOP) return e->binop.t != BINOP_ASSIGN || i != 0;
+	if (e->t == EXPR_UNOP) return e->unop.t != UNOP_REF && e->unop.t != UNOP_SIZEOF && !_is_incdec(e);
+	return true;
+}
+
+// Returns the outer binding if e is an induction variable
+static size_t _iv_of(struct _opt_ctx *c, struct ast_expr *e) {
+	if (e->t != EXPR_IDENT) return SIZE_MAX;
+
+	size_t i = _scope_find(&c->scope, e->ident);
+	if (i == SIZE_MAX || i >= c->nouter) return SIZE_MAX;
+	if (c->outer[i].not_iv || !c->outer[i].nupdates) return SIZE_MAX;
+
+	struct loop_binding *b = c->scope.b + i;
+	if (b->type.to.t != TYPE_INT || b->type.vol) return SIZE_MAX;
+	if (strmap_get(&c->ln->addr_taken, b->name)) return SIZE_MAX;
+	return i;
+}
+
+// Whether p + iv can become a pointer stepped alongside iv. A narrower iv
+// wraps at its own width, where the pointer would run on past it.
+static bool _ptr_iv_ok(struct _opt_ctx *c, size_t iv) {
+	return (c->scope.b[iv].type.to.int_ & ~I_SIGNED) == 64;
+}
+
+// Factors get copied to every step, so they must mean the same thing there
+static bool _factor_ok(struct _opt_ctx *c, struct ast_expr *k, bool inv) {
+	if (k->t == EXPR_INT_LIT) return true;
+	return inv && k->t == EXPR_IDENT && !strmap_get(&c->inner, k->ident);
+}
+
+static void _add_occ(struct _opt_ctx *c, struct ast_expr *e, size_t iv, struct ast_expr *k, bool ptr) {
+	if (c->nocc == c->occ_alloc) {
+		c->occ_alloc = c->occ_alloc ? c->occ_alloc * 2 : 8;
+		c->occ = realloc(c->occ, c->occ_alloc * sizeof *c->occ);
+	}
+	c->occ[c->nocc].e = e;
+	c->occ[c->nocc].iv = iv;
+	c->occ[c->nocc].k = k;
+	c->occ[c->nocc].ptr = ptr;
+	++c->nocc;
+}
+
+static void _inv_push(struct _opt_ctx *c, bool inv) {
+	if (c->nflags == c->flags_alloc) {
+		c->flags_alloc = c->flags_alloc ? c->flags_alloc * 2 : 64;
+		c->flags = realloc(c->flags, c->flags_alloc * sizeof *c->flags);
+	}
+	c->flags[c->nflags++] = inv;
+}
+
+static bool _inv_pre(struct ast_expr *e, void *ctx) {
+	if (e->t == EXPR_FUNC) {
+		// Skipped, so post won't push its flag
+		_inv_push(ctx, false);
+		return false;
+	}
+	return true;
+}
+
+static void _inv_post(struct ast_expr *e, void *ctx) {
+	struct _opt_ctx *c = ctx;
+	if (e->t == EXPR_LET) --c->scope.n;
+
+	size_t n = expr_nchildren(e), npresent = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (expr_child(e, i)) ++npresent;
+	}
+	c->nflags -= npresent;
+	bool *kids = c->flags + c->nflags;
+	bool inv = _invariant(c, e, kids);
+
+	if (c->collect_ivs && e->t == EXPR_BINOP) {
+		struct ast_expr *x = e->binop.x, *y = e->binop.y;
+		size_t iv;
+		if (e->binop.t == BINOP_MUL && e->type.t == TYPE_INT) {
+			if ((iv = _iv_of(c, x)) != SIZE_MAX && _factor_ok(c, y, kids[1])) _add_occ(c, e, iv, y, false);
+			else if ((iv = _iv_of(c, y)) != SIZE_MAX && _factor_ok(c, x, kids[0])) _add_occ(c, e, iv, x, false);
+		} else if (e->binop.t == BINOP_ADD && e->type.t == TYPE_PTR) {
+			if ((iv = _iv_of(c, x)) != SIZE_MAX && _ptr_iv_ok(c, iv) && _factor_ok(c, y, kids[1])) _add_occ(c, e, iv, y, true);
+			else if ((iv = _iv_of(c, y)) != SIZE_MAX && _ptr_iv_ok(c, iv) && _factor_ok(c, x, kids[0])) _add_occ(c, e, iv, x, true);
+		}
+	} else if (!c->collect_ivs && !(inv && _worth_hoisting(e))) {
+		// Invariant children of a node that won't be hoisted as a whole
+		for (size_t i = 0, k = 0; i < n; ++i) {
+			struct ast_expr *child = expr_child(e, i);
+			if (!child) continue;
+			if (kids[k++] && _worth_hoisting(child) && _hoistable_pos(e, i)) {
+				if (c->ncands == c->cands_alloc) {
+					c->cands_alloc = c->cands_alloc ? c->cands_alloc * 2 : 8;
+					c->cands = realloc(c->cands, c->cands_alloc * sizeof *c->cands);
+				}
+				c->cands[c->ncands++] = child;
+			}
+		}
+	}
+
+	_inv_push(c, inv);
+}
+
+static void _opt_analyze(struct _opt_ctx *c, struct loop *l, bool collect_ivs) {
+	static const struct walk_ops facts_ops = {
+		.pre = _facts_pre,
+		.child = _facts_child,
+		.post = _facts_post,
+	};
+	static const struct walk_ops inv_ops = {
+		.pre = _inv_pre,
+		.child = _scope_child,
+		.post = _inv_post,
+	};
+
+	_opt_reset(c, l);
+	walk_expr(&c->walk, l->e, &facts_ops, c);
+	c->collect_ivs = collect_ivs;
+	walk_expr(&c->walk, l->e, &inv_ops, c);
+}
+
+// }}}
+
+// Transformations {{{
+
+// Wraps the loop in lets, outermost first
+static void _wrap_loop(struct _opt_ctx *c, size_t n, const char **names, struct ast_expr **vals, bool mut) {
+	if (!n) return;
+
+	struct ast_expr *w = MEM_ALLOC(MEM_EXPR + EXPR_WHILE, sizeof *w);
+	*w = *c->loop->e;
+
+	struct ast_expr *inner = w;
+	for (size_t i = n; i-- > 0;) {
+		struct ref_type type = {.mut = mut, .to = vals[i]->type};
+		inner = _let(names[i], type, vals[i], inner);
+	}
+
+	*c->loop->e = *inner;
+	MEM_FREE(inner);
+	c->loop->e = w;
+}
+
+static void _opt_licm(struct _opt_ctx *c) {
+	_opt_analyze(c, c->loop, false);
+	if (!c->ncands) return;
+
+	const char **names = malloc(c->ncands * sizeof *names);
+	struct ast_expr **vals = malloc(c->ncands * sizeof *vals);
+	for (size_t i = 0; i < c->ncands; ++i) {
+		struct ast_expr *e = c->cands[i];
+		names[i] = _fresh(&c->nfresh, "licm");
+		vals[i] = MEM_ALLOC(MEM_EXPR + e->t, sizeof *vals[i]);
+		*vals[i] = *e;
+
+		struct ast_expr *ident = _ident(names[i], e->type);
+		*e = *ident;
+		MEM_FREE(ident);
+	}
+
+	_wrap_loop(c, c->ncands, names, vals, false);
+	c->stats->nhoisted += c->ncands;
+
+	// The hoisted values are now bound outside the loop
+	struct loop *l = c->loop;
+	l->bindings = realloc(l->bindings, (l->nbindings + c->ncands) * sizeof *l->bindings);
+	for (size_t i = 0; i < c->ncands; ++i) {
+		l->bindings[l->nbindings].name = names[i];
+		l->bindings[l->nbindings].type = (struct ref_type){.to = vals[i]->type};
+		++l->nbindings;
+	}
+	free(names);
+	free(vals);
+}
+
+static bool _same_k(struct ast_expr *a, struct ast_expr *b) {
+	if (a->t != b->t) return false;
+	if (a->t == EXPR_IDENT) return !strcmp(a->ident, b->ident);
+	if (a->t == EXPR_INT_LIT) return a->int_lit.type == b->int_lit.type && a->int_lit.u == b->int_lit.u;
+	return false;
+}
+
+// Strength reduction: each iv * k and p + iv in the loop gets a variable
+// of its own, initialized before the loop and stepped wherever iv is
+static void _opt_ivs(struct _opt_ctx *c) {
+	_opt_analyze(c, c->loop, true);
+	if (!c->nocc) return;
+
+	struct {
+		size_t iv;
+		struct ast_expr *k;
+		bool ptr;
+		struct val_type type;
+		const char *name;
+	} *groups = malloc(c->nocc * sizeof *groups);
+	size_t ngroups = 0;
+	size_t *group_of = malloc(c->nocc * sizeof *group_of);
+
+	for (size_t i = 0; i < c->nocc; ++i) {
+		size_t g;
+		for (g = 0; g < ngroups; ++g) {
+			if (groups[g].iv == c->occ[i].iv && groups[g].ptr == c->occ[i].ptr
+					&& _same_k(groups[g].k, c->occ[i].k)) break;
+		}
+		if (g == ngroups) {
+			groups[g].iv = c->occ[i].iv;
+			groups[g].k = c->occ[i].k;
+			groups[g].ptr = c->occ[i].ptr;
+			groups[g].type = c->occ[i].e->type;
+			groups[g].name = _fresh(&c->nfresh, "iv");
+			++ngroups;
+		}
+		group_of[i] = g;
+	}
+
+	// Initial values, computed from the variables' values on entry
+	const char **names = malloc(ngroups * sizeof *names);
+	struct ast_expr **vals = malloc(ngroups * sizeof *vals);
+	for (size_t g = 0; g < ngroups; ++g) {
+		struct loop_binding *b = c->scope.b + groups[g].iv;
+		struct ast_expr *iv = _ident(b->name, b->type.to);
+		struct ast_expr *k = expr_clone(&c->walk, groups[g].k);
+		names[g] = groups[g].name;
+		vals[g] = groups[g].ptr
+			? _binop(BINOP_ADD, k, iv, groups[g].type)
+			: _binop(BINOP_MUL, iv, k, groups[g].type);
+	}
+
+	for (size_t i = 0; i < c->nocc; ++i) {
+		struct ast_expr *ident = _ident(groups[group_of[i]].name, c->occ[i].e->type);
+		*c->occ[i].e = *ident;
+		MEM_FREE(ident);
+	}
+
+	// Turn each step of an iv into
+	//   let $t = <step>; $iv.1 = $iv.1 + k; ...; $t
+	size_t nivs = 0;
+	for (size_t iv = 0; iv < c->nouter; ++iv) {
+		bool used = false;
+		for (size_t g = 0; g < ngroups; ++g) used |= groups[g].iv == iv;
+		if (!used) continue;
+		++nivs;
+
+		enum int_type int_type = c->scope.b[iv].type.to.int_;
+		for (size_t u = 0; u < c->outer[iv].nupdates; ++u) {
+			struct ast_expr *update = c->outer[iv].updates[u].e;
+			int64_t step = c->outer[iv].updates[u].step;
+			uint64_t mag = step < 0 ? -(uint64_t)step : (uint64_t)step;
+
+			const char *tmp = _fresh(&c->nfresh, "t");
+			struct ast_expr *body = _ident(tmp, update->type);
+			for (size_t g = ngroups; g-- > 0;) {
+				if (groups[g].iv != iv) continue;
+
+				struct val_type type = groups[g].type;
+				struct ast_expr *delta;
+				int op = step < 0 ? BINOP_SUB : BINOP_ADD;
+				if (groups[g].ptr) {
+					// Pointers can only have integers added to them
+					bool is_signed = int_type & I_SIGNED;
+					delta = _int_lit(is_signed || step > 0 ? int_type : I_64, step);
+					op = BINOP_ADD;
+				} else if (mag == 1) {
+					delta = expr_clone(&c->walk, groups[g].k);
+				} else {
+					delta = _binop(BINOP_MUL, expr_clone(&c->walk, groups[g].k), _int_lit(int_type, mag), type);
+				}
+
+				struct ast_expr *sum = _binop(op, _ident(groups[g].name, type), delta, type);
+				struct ast_expr *assign = _binop(BINOP_ASSIGN, _ident(groups[g].name, type), sum, type);
+				body = _binop(BINOP_SEQOP, assign, body, body->type);
+			}
+
+			struct ast_expr *val = MEM_ALLOC(MEM_EXPR + update->t, sizeof *val);
+			*val = *update;
+			struct ast_expr *let = _let(tmp, (struct ref_type){.to = update->type}, val, body);
+			*update = *let;
+			MEM_FREE(let);
+		}
+	}
+
+	_wrap_loop(c, ngroups, names, vals, true);
+	c->stats->nivs += nivs;
+	c->stats->nreduced += c->nocc;
+
+	free(groups);
+	free(group_of);
+	free(names);
+	free(vals);
+}
+
+// }}}
+
+// Driver {{{
+
+static bool _collect_funcs(struct ast_expr *e, void *ctx) {
+	if (e->t == EXPR_FUNC) {
+		struct {
+			size_t n, alloc;
+			struct ast_expr **funcs;
+		} *list = ctx;
+		if (list->n == list->alloc) {
+			list->alloc = list->alloc ? list->alloc * 2 : 8;
+			list->funcs = realloc(list->funcs, list->alloc * sizeof *list->funcs);
+		}
+		list->funcs[list->n++] = e;
+	}
+	return true;
+}
+
+static void _opt_function(struct _opt_ctx *c, size_t nargs, struct loop_binding *args, struct ast_expr *body) {
+	struct loop_nest ln;
+	loop_nest_build(&ln, nargs, args, body);
+	c->ln = &ln;
+
+	for (size_t i = 0; i < ln.nloops; ++i) {
+		c->loop = ln.loops[i];
+		if (c->loop->has_label) {
+			++c->stats->nskipped;
+			continue;
+		}
+
+		// Hoisting first turns invariant factors into plain names
+		_opt_licm(c);
+		_opt_ivs(c);
+	}
+
+	c->stats->nloops += ln.nloops;
+	loop_nest_free(&ln);
+}
+
+static void _opt_toplevels(struct _opt_ctx *c, size_t ntops, struct ast_toplevel *tops) {
+	for (size_t i = 0; i < ntops; ++i) {
+		struct ast_toplevel *t = tops + i;
+		struct ast_expr *body;
+		size_t nargs = 0;
+		struct loop_binding *args = NULL;
+
+		switch (t->type) {
+		case EXPRTOP_FUNC:
+			body = t->func.body;
+			nargs = t->func.nargs;
+			args = (void *)t->func.args;
+			break;
+		case EXPRTOP_DECL:
+			body = t->decl.val;
+			break;
+		case EXPRTOP_NAMESPACE:
+			_opt_toplevels(c, t->namespace.size, t->namespace.body);
+			continue;
+		}
+		if (!body) continue;
+
+		struct {
+			size_t n, alloc;
+			struct ast_expr **funcs;
+		} lits = {0};
+		walk_expr(&c->walk, body, &(struct walk_ops){.pre = _collect_funcs}, &lits);
+
+		struct loop_stats before = *c->stats;
+		for (size_t j = lits.n; j-- > 0;) {
+			struct ast_expr *f = lits.funcs[j];
+			_opt_function(c, f->func.nargs, (void *)f->func.args, f->func.body);
+		}
+		_opt_function(c, nargs, args, body);
+		free(lits.funcs);
+
+		if (c->stats->nhoisted != before.nhoisted || c->stats->nreduced != before.nreduced) {
+			annotate_toplevel(t);
+		}
+	}
+}
+
+void loop_opt_unit(size_t ntops, struct ast_toplevel *tops, struct loop_stats *stats) {
+	struct _opt_ctx c = {.stats = stats};
+	_opt_toplevels(&c, ntops, tops);
+
+	for (size_t i = 0; i < c.nouter; ++i) {
+		free(c.outer[i].updates);
+	}
+	free(c.outer);
+	MEM_FREE(c.scope.b);
+	free(c.flags);
+	free(c.cands);
+	free(c.occ);
+	strmap_free(&c.inner);
+	walk_free(&c.walk);
+}
+
+// }}}
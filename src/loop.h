@@ -0,0 +1,70 @@
+// vim: noet
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdio.h>
+#include "ast.h"
+#include "strmap.h"
+
+struct loop_binding {
+	const char *name;
+	struct ref_type type;
+};
+
+struct loop {
+	// The EXPR_WHILE. Optimizations may wrap it in lets, in which case this
+	// is updated to point at its new location.
+	struct ast_expr *e;
+	struct loop *parent;
+	// 1 for outermost loops
+	size_t depth;
+
+	// Unlabelled break and continue, which target the innermost loop
+	size_t nbreaks, ncontinues;
+	// A labelled break or continue anywhere in the loop. It may target any
+	// enclosing loop, so such loops are not optimized.
+	bool has_label;
+
+	// Anywhere in the loop, including nested loops
+	bool has_call;
+	bool has_store; // Assignment through a pointer
+	bool has_return;
+
+	// Bindings visible at the loop, outermost first
+	size_t nbindings;
+	struct loop_binding *bindings;
+};
+
+// Loops of one function body. Function literals are separate functions.
+struct loop_nest {
+	// Innermost loops first
+	size_t nloops, alloc;
+	struct loop **loops;
+
+	// Names that have their address taken anywhere in the function
+	struct strmap addr_taken;
+};
+
+void loop_nest_build(struct loop_nest *ln, size_t nargs, struct loop_binding *args, struct ast_expr *body);
+void loop_nest_free(struct loop_nest *ln);
+void loop_nest_dump(struct loop_nest *ln, FILE *f);
+
+struct loop_stats {
+	size_t nloops;
+	// Loops left alone for containing a labelled jump
+	size_t nskipped;
+	// Loop-invariant expressions moved out of their loop
+	size_t nhoisted;
+	// Induction variables and the multiplies and pointer offsets reduced to
+	// additions on them. Only 64-bit ivs offset pointers, as narrower ones
+	// could wrap.
+	size_t nivs, nreduced;
+};
+
+// Runs loop-invariant code motion, then strength reduction, on every loop
+// of a unit checked with annotate_unit, innermost loops first. Loops with
+// labelled jumps are skipped. Functions that change are re-checked.
+void loop_opt_unit(size_t ntops, struct ast_toplevel *tops, struct loop_stats *stats);
+
+#endif
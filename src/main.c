@@ -0,0 +1,170 @@
+// vim: noet
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "driver.h"
+#include "memstats.h"
+#include "program.h"
+#include "vm.h"
+#include "x64.h"
+#include "y.tab.h"
+
+static void _usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-j jobs] [-m budget-MiB] [-M text|json] [file...]\n", argv0);
+	fprintf(stderr, "       %s -w [-r] [-j jobs] [-M text|json] [-o object] unit-file...\n", argv0);
+	fprintf(stderr, "With no files, a single unit is read from stdin.\n");
+	fprintf(stderr, "-w links unit files into one program rooted at main, and prints its bytecode.\n");
+	fprintf(stderr, "-r reports what was inlined, pruned and optimized in the program.\n");
+	fprintf(stderr, "-o writes the program as an x86-64 ELF object instead.\n");
+	fprintf(stderr, "-M prints memory statistics at exit, if built with -DCEC_MEMSTATS.\n");
+}
+
+// Native code for the module, written as a relocatable object
+static bool _write_object(struct vm_module *m, const char *path) {
+	struct elf_obj o;
+	elf_init(&o);
+	bool ok = x64_compile_module(m, &o);
+	if (!ok) {
+		fprintf(stderr, "%s\n", m->error);
+		elf_free(&o);
+		return false;
+	}
+
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		elf_free(&o);
+		return false;
+	}
+	ok = elf_write(&o, f);
+	if (fclose(f) || !ok) {
+		fprintf(stderr, "%s: write failed\n", path);
+		ok = false;
+	}
+	elf_free(&o);
+	return ok;
+}
+
+// Whole-program mode
+static bool _link(size_t nunits, char **paths, size_t jobs, const char *object, FILE *report) {
+	const char *roots[] = {"main"};
+	struct program p;
+	prog_init(&p);
+
+	bool ok = true;
+	for (size_t i = 0; i < nunits && ok; ++i) {
+		ok = prog_add_unit(&p, paths[i]);
+	}
+	if (ok) {
+		prog_mark_reachable(&p, 1, roots);
+		ok = prog_load(&p);
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: %s\n", p.error_name, p.error);
+		prog_free(&p);
+		return false;
+	}
+
+	prog_optimize(&p, 1, roots, &(struct inline_opts){.report = report});
+	struct vm_module m;
+	ok = vm_compile_unit_jobs(&m, p.ntops, p.tops, jobs);
+	if (ok && object) {
+		ok = _write_object(&m, object);
+	} else if (ok) {
+		for (size_t i = 0; i < m.nfuncs; ++i) vm_disasm(m.funcs[i], stdout);
+	} else {
+		fprintf(stderr, "%s\n", m.error);
+	}
+	vm_module_free(&m);
+	prog_free(&p);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t budget = DRV_DEFAULT_BUDGET;
+	void (*report)(FILE *f) = NULL;
+	bool whole = false;
+	const char *object = NULL;
+	FILE *opt_report = NULL;
+
+	int opt;
+	char *end;
+	while ((opt = getopt(argc, argv, "j:m:M:o:rw")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = strtol(optarg, &end, 10);
+			if (*end || jobs < 1) {
+				_usage(argv[0]);
+				return 2;
+			}
+			break;
+
+		case 'm':
+			budget = strtoul(optarg, &end, 10) << 20;
+			if (*end || !budget) {
+				_usage(argv[0]);
+				return 2;
+			}
+			break;
+
+		case 'M':
+			if (!strcmp(optarg, "text")) {
+				report = mem_report;
+			} else if (!strcmp(optarg, "json")) {
+				report = mem_report_json;
+			} else {
+				_usage(argv[0]);
+				return 2;
+			}
+			break;
+
+		case 'o':
+			object = optarg;
+			break;
+
+		case 'r':
+			opt_report = stderr;
+			break;
+
+		case 'w':
+			whole = true;
+			break;
+
+		default:
+			_usage(argv[0]);
+			return 2;
+		}
+	}
+
+	bool ok;
+	if ((object || opt_report) && !whole) {
+		_usage(argv[0]);
+		return 2;
+	}
+	if (whole) {
+		if (optind == argc) {
+			_usage(argv[0]);
+			return 2;
+		}
+		ok = _link(argc - optind, argv + optind, jobs > 0 ? jobs : 1, object, opt_report);
+	} else if (optind == argc) {
+		yyscan_t scanner;
+		if (!lex_init(&scanner)) {
+			perror(argv[0]);
+			return 1;
+		}
+		ok = !yyparse(scanner, "<stdin>", NULL, NULL);
+		lex_free(scanner);
+	} else {
+		struct driver d;
+		drv_init(&d, argc - optind, argv + optind, jobs > 0 ? jobs : 1, budget);
+		ok = drv_run(&d, stderr);
+		drv_free(&d);
+	}
+
+	if (report) report(stderr);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,304 @@
+// vim: noet
+
+#include <stdint.h>
+#include <string.h>
+#include "memstats.h"
+
+static const char *const _mem_expr_names[MEM_NEXPR] = {
+	"EXPR_BINOP",
+	"EXPR_UNOP",
+	"EXPR_CALL",
+	"EXPR_IF",
+	"EXPR_WHILE",
+	"EXPR_BREAK",
+	"EXPR_CONTINUE",
+	"EXPR_RETURN",
+	"EXPR_FUNC",
+	"EXPR_INT_LIT",
+	"EXPR_FLOAT_LIT",
+	"EXPR_ARR_LIT",
+	"EXPR_COMPOSITE_LIT",
+	"EXPR_BOOL_LIT",
+	"EXPR_FIELD_ACCESS",
+	"EXPR_LET",
+	"EXPR_CAST",
+	"EXPR_IDENT",
+};
+
+static const char *const _mem_type_names[MEM_NTYPE] = {
+	"TYPE_PTR",
+	"TYPE_FUNC",
+	"TYPE_VOID",
+	"TYPE_INT",
+	"TYPE_FLOAT",
+	"TYPE_NEWTYPE",
+	"TYPE_STRUCT",
+	"TYPE_UNION",
+	"TYPE_BOOL",
+};
+
+const char *mem_cat_name(enum mem_cat cat) {
+	if (cat < MEM_TOPLEVEL) return _mem_expr_names[cat - MEM_EXPR];
+	if (cat >= MEM_TYPE && cat < MEM_NAME) return _mem_type_names[cat - MEM_TYPE];
+	switch (cat) {
+	case MEM_TOPLEVEL: return "ast_toplevel";
+	case MEM_NAME: return "names";
+	case MEM_SCOPE: return "scopes";
+	case MEM_LEXER: return "lexer";
+	default: return "?";
+	}
+}
+
+#ifdef CEC_MEMSTATS
+
+#include <pthread.h>
+
+// Every live accounted block, so that frees know what they release. Open
+// addressing with linear probing, and backward-shift deletion.
+struct _mem_entry {
+	uintptr_t p;
+	size_t size;
+	enum mem_cat cat;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	size_t n, alloc;
+	struct _mem_entry *slots;
+
+	struct mem_stats cats[MEM_NCATS], total;
+} _mem = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t _mem_hash(uintptr_t p) {
+	return (size_t)((p >> 4) * 0x9e3779b97f4a7c15u);
+}
+
+static void _mem_insert(uintptr_t p, size_t size, enum mem_cat cat) {
+	if (2 * (_mem.n + 1) > _mem.alloc) {
+		size_t old_alloc = _mem.alloc;
+		struct _mem_entry *old = _mem.slots;
+		_mem.alloc = old_alloc ? old_alloc * 2 : 1024;
+		_mem.slots = calloc(_mem.alloc, sizeof *_mem.slots);
+		_mem.n = 0;
+		for (size_t i = 0; i < old_alloc; ++i) {
+			if (old[i].p) _mem_insert(old[i].p, old[i].size, old[i].cat);
+		}
+		free(old);
+	}
+
+	size_t mask = _mem.alloc - 1, i = _mem_hash(p) & mask;
+	while (_mem.slots[i].p && _mem.slots[i].p != p) i = (i + 1) & mask;
+	if (!_mem.slots[i].p) ++_mem.n;
+	_mem.slots[i] = (struct _mem_entry){p, size, cat};
+}
+
+// Returns false if p is not accounted for
+static bool _mem_remove(uintptr_t p, struct _mem_entry *out) {
+	if (!_mem.alloc) return false;
+	size_t mask = _mem.alloc - 1, i = _mem_hash(p) & mask;
+	while (_mem.slots[i].p != p) {
+		if (!_mem.slots[i].p) return false;
+		i = (i + 1) & mask;
+	}
+	*out = _mem.slots[i];
+
+	// Move back any later entry of the run that could live in the gap
+	for (size_t j = (i + 1) & mask; _mem.slots[j].p; j = (j + 1) & mask) {
+		size_t home = _mem_hash(_mem.slots[j].p) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			_mem.slots[i] = _mem.slots[j];
+			i = j;
+		}
+	}
+	_mem.slots[i].p = 0;
+	--_mem.n;
+	return true;
+}
+
+static size_t _mem_bucket(size_t size) {
+	size_t b = 0;
+	for (size_t s = 16; s < size && b < MEM_NBUCKETS - 1; s <<= 1) ++b;
+	return b;
+}
+
+static void _mem_count_alloc(struct mem_stats *s, size_t size) {
+	++s->nallocs;
+	s->bytes += size;
+	s->live += size;
+	if (s->live > s->peak) s->peak = s->live;
+	++s->hist[_mem_bucket(size)];
+}
+
+static void _mem_count_free(struct mem_stats *s, size_t size) {
+	++s->nfrees;
+	s->live -= size;
+}
+
+static void _mem_untrack(void *p);
+
+static void _mem_track(void *p, size_t size, enum mem_cat cat) {
+	// Still there if the block was released with plain free
+	_mem_untrack(p);
+	_mem_insert((uintptr_t)p, size, cat);
+	_mem_count_alloc(&_mem.cats[cat], size);
+	_mem_count_alloc(&_mem.total, size);
+}
+
+static void _mem_untrack(void *p) {
+	struct _mem_entry e;
+	if (!_mem_remove((uintptr_t)p, &e)) return;
+	_mem_count_free(&_mem.cats[e.cat], e.size);
+	_mem_count_free(&_mem.total, e.size);
+}
+
+void *mem_alloc(enum mem_cat cat, size_t size) {
+	void *p = malloc(size);
+	if (!p) return NULL;
+	pthread_mutex_lock(&_mem.lock);
+	_mem_track(p, size, cat);
+	pthread_mutex_unlock(&_mem.lock);
+	return p;
+}
+
+void *mem_calloc(enum mem_cat cat, size_t n, size_t size) {
+	void *p = calloc(n, size);
+	if (!p) return NULL;
+	pthread_mutex_lock(&_mem.lock);
+	_mem_track(p, n * size, cat);
+	pthread_mutex_unlock(&_mem.lock);
+	return p;
+}
+
+// Counts as freeing the old block and allocating the new one
+void *mem_realloc(enum mem_cat cat, void *p, size_t size) {
+	pthread_mutex_lock(&_mem.lock);
+	void *q = realloc(p, size);
+	if (q || !size) {
+		if (p) _mem_untrack(p);
+		if (q) _mem_track(q, size, cat);
+	}
+	pthread_mutex_unlock(&_mem.lock);
+	return q;
+}
+
+char *mem_strndup(enum mem_cat cat, const char *s, size_t n) {
+	char *p = strndup(s, n);
+	if (!p) return NULL;
+	pthread_mutex_lock(&_mem.lock);
+	_mem_track(p, strlen(p) + 1, cat);
+	pthread_mutex_unlock(&_mem.lock);
+	return p;
+}
+
+void mem_free(void *p) {
+	if (!p) return;
+	pthread_mutex_lock(&_mem.lock);
+	_mem_untrack(p);
+	free(p);
+	pthread_mutex_unlock(&_mem.lock);
+}
+
+bool mem_get(enum mem_cat cat, struct mem_stats *stats) {
+	pthread_mutex_lock(&_mem.lock);
+	*stats = _mem.cats[cat];
+	pthread_mutex_unlock(&_mem.lock);
+	return true;
+}
+
+bool mem_get_total(struct mem_stats *stats) {
+	pthread_mutex_lock(&_mem.lock);
+	*stats = _mem.total;
+	pthread_mutex_unlock(&_mem.lock);
+	return true;
+}
+
+#else
+
+bool mem_get(enum mem_cat cat, struct mem_stats *stats) {
+	*stats = (struct mem_stats){0};
+	return false;
+}
+
+bool mem_get_total(struct mem_stats *stats) {
+	*stats = (struct mem_stats){0};
+	return false;
+}
+
+#endif
+
+// Reports {{{
+
+static double _mem_avg(struct mem_stats *s) {
+	return s->nallocs ? (double)s->bytes / s->nallocs : 0;
+}
+
+static void _mem_report_line(FILE *f, const char *name, struct mem_stats *s) {
+	fprintf(f, "%-20s %10zu %10zu %14zu %10.1f %14zu %14zu\n",
+		name, s->nallocs, s->nfrees, s->bytes, _mem_avg(s), s->live, s->peak);
+}
+
+void mem_report(FILE *f) {
+	struct mem_stats total;
+	if (!mem_get_total(&total)) {
+		fprintf(f, "Memory accounting is disabled; build with -DCEC_MEMSTATS\n");
+		return;
+	}
+
+	fprintf(f, "%-20s %10s %10s %14s %10s %14s %14s\n",
+		"category", "allocs", "frees", "bytes", "avg", "live", "peak");
+	for (enum mem_cat cat = 0; cat < MEM_NCATS; ++cat) {
+		struct mem_stats s;
+		mem_get(cat, &s);
+		if (s.nallocs) _mem_report_line(f, mem_cat_name(cat), &s);
+	}
+	_mem_report_line(f, "total", &total);
+
+	fprintf(f, "\nAllocation sizes:\n");
+	for (enum mem_cat cat = 0; cat < MEM_NCATS; ++cat) {
+		struct mem_stats s;
+		mem_get(cat, &s);
+		if (!s.nallocs) continue;
+		fprintf(f, "%-20s", mem_cat_name(cat));
+		for (size_t b = 0; b < MEM_NBUCKETS; ++b) {
+			if (!s.hist[b]) continue;
+			bool last = b == MEM_NBUCKETS - 1;
+			fprintf(f, " %s%zu:%zu", last ? ">" : "<=", (size_t)16 << (last ? b - 1 : b), s.hist[b]);
+		}
+		fprintf(f, "\n");
+	}
+}
+
+static void _mem_json_stats(FILE *f, struct mem_stats *s) {
+	fprintf(f, "\"allocs\": %zu, \"frees\": %zu, \"bytes\": %zu, \"avg_size\": %.1f, \"live\": %zu, \"peak\": %zu, \"histogram\": [",
+		s->nallocs, s->nfrees, s->bytes, _mem_avg(s), s->live, s->peak);
+	for (size_t b = 0; b < MEM_NBUCKETS; ++b) {
+		fprintf(f, "%s%zu", b ? ", " : "", s->hist[b]);
+	}
+	fprintf(f, "]");
+}
+
+// Histogram bucket i counts sizes up to 16 << i, and the last everything above
+void mem_report_json(FILE *f) {
+	struct mem_stats total;
+	if (!mem_get_total(&total)) {
+		fprintf(f, "{\"enabled\": false}\n");
+		return;
+	}
+
+	fprintf(f, "{\"enabled\": true, \"total\": {");
+	_mem_json_stats(f, &total);
+	fprintf(f, "}, \"categories\": {");
+	bool first = true;
+	for (enum mem_cat cat = 0; cat < MEM_NCATS; ++cat) {
+		struct mem_stats s;
+		mem_get(cat, &s);
+		if (!s.nallocs) continue;
+		fprintf(f, "%s\n\t\"%s\": {", first ? "" : ",", mem_cat_name(cat));
+		_mem_json_stats(f, &s);
+		fprintf(f, "}");
+		first = false;
+	}
+	fprintf(f, "\n}}\n");
+}
+
+// }}}
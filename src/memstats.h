@@ -0,0 +1,82 @@
+// vim: noet
+
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+
+// Memory accounting for the front end, enabled by building with
+// -DCEC_MEMSTATS. Otherwise the MEM_* macros are the plain allocator calls,
+// and their category arguments are never evaluated.
+
+#define MEM_NEXPR (EXPR_IDENT + 1)
+#define MEM_NTYPE (TYPE_BOOL + 1)
+
+enum mem_cat {
+	// Expression nodes, by the t they were allocated with, plus the
+	// argument and element arrays they own. Use MEM_EXPR + t.
+	MEM_EXPR,
+	MEM_TOPLEVEL = MEM_EXPR + MEM_NEXPR,
+	// Types allocated on their own, by kind. Use MEM_TYPE + t. A ref_type
+	// counts as the kind of its val_type.
+	MEM_TYPE,
+	// Identifiers and generated names
+	MEM_NAME = MEM_TYPE + MEM_NTYPE,
+	// Binding and function stacks of the checker and the optimizations
+	MEM_SCOPE,
+	// Flex's buffers, and source files loaded for it
+	MEM_LEXER,
+	MEM_NCATS,
+};
+
+#ifdef CEC_MEMSTATS
+
+// Memory from these may be released with plain free, and memory from plain
+// malloc with mem_free, but then it is not accounted for
+void *mem_alloc(enum mem_cat cat, size_t size);
+void *mem_calloc(enum mem_cat cat, size_t n, size_t size);
+void *mem_realloc(enum mem_cat cat, void *p, size_t size);
+char *mem_strndup(enum mem_cat cat, const char *s, size_t n);
+void mem_free(void *p);
+
+#define MEM_ALLOC(cat, size) mem_alloc((cat), (size))
+#define MEM_CALLOC(cat, n, size) mem_calloc((cat), (n), (size))
+#define MEM_REALLOC(cat, p, size) mem_realloc((cat), (p), (size))
+#define MEM_STRNDUP(cat, s, n) mem_strndup((cat), (s), (n))
+#define MEM_FREE(p) mem_free(p)
+
+#else
+
+#define MEM_ALLOC(cat, size) malloc(size)
+#define MEM_CALLOC(cat, n, size) calloc((n), (size))
+#define MEM_REALLOC(cat, p, size) realloc((p), (size))
+#define MEM_STRNDUP(cat, s, n) strndup((s), (n))
+#define MEM_FREE(p) free(p)
+
+#endif
+
+// Allocation sizes are bucketed by powers of two, from 16 bytes or less up
+// to more than 256 KiB
+#define MEM_NBUCKETS 16
+
+struct mem_stats {
+	size_t nallocs, nfrees;
+	// Total ever allocated, currently live and the most live at once
+	size_t bytes, live, peak;
+	size_t hist[MEM_NBUCKETS];
+};
+
+// Both return false, leaving stats zeroed, when accounting is compiled out
+bool mem_get(enum mem_cat cat, struct mem_stats *stats);
+bool mem_get_total(struct mem_stats *stats);
+
+const char *mem_cat_name(enum mem_cat cat);
+
+// Print every category that has seen an allocation
+void mem_report(FILE *f);
+void mem_report_json(FILE *f);
+
+#endif
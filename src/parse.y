@@ -1,7 +1,27 @@
-%{
+%code requires {
 #include "lex.h"
-int yyerror(const char *s);
-%}
+}
+
+// Pure, so that any number of files can be parsed at once, each with its
+// own scanner. yyerror reports to msgs, prefixed with path. If shape isn't
+// NULL, it is set to a hash of the shape of every expression tree in the
+// unit, which is all the parser builds so far.
+%define api.pure full
+%define api.value.type {unsigned long}
+%parse-param {yyscan_t scanner} {const char *path} {FILE *msgs} {unsigned long *shape}
+%lex-param {yyscan_t scanner}
+
+%code {
+int yyerror(yyscan_t scanner, const char *path, FILE *msgs, unsigned long *shape, const char *s);
+// Tokens carry no values, so the scanner has no yylval to fill in
+#define yylex(lval, scanner) (*(lval) = 0, yylex(scanner))
+
+// A node with children x and y, either of which may be 0 for none. tag is
+// the operator's token, so prefix and binary '-' differ by their children.
+static unsigned long _shape(unsigned long tag, unsigned long x, unsigned long y) {
+	return ((tag * 1000003 + x) * 1000003 + y) * 1000003;
+}
+}
 
 %token IDENTIFIER DEC_INTEGER OCT_INTEGER BIN_INTEGER HEX_INTEGER FLOAT STRING CHARACTER
 %token FN NS ARROW
@@ -18,9 +38,39 @@ int yyerror(const char *s);
 %token LOGICAL_OR LOGICAL_AND EQUAL NOT_EQUAL LTE GTE
 %token LSH RSH INCR DECR
 
+// Lowest first. A function literal's body, the value of break and return,
+// and an if without else have no closing token, so each extends as far right
+// as it can: the rules that would end one early take BODY, below every token
+// that could continue it. So fn () 1 + 2 is fn () (1 + 2), a; fn () b; c is
+// a; fn () (b; c), and else pairs with the nearest if. A bare break or return
+// ending a function body takes the next toplevel as its value unless it is
+// parenthesized. ptr T [...] and ptr T {...} dereference a literal, rather
+// than being literals of pointer type, and fn (...) [...] is a function
+// literal, not an array of functions.
+%precedence BODY
+%precedence IDENTIFIER FN ';' ELSE '[' '{'
+%right '=' ADDEQ SUBEQ MULEQ DIVEQ MODEQ LSHEQ RSHEQ ANDEQ XOREQ IOREQ
+%left LOGICAL_OR
+%left LOGICAL_AND
+%left EQUAL NOT_EQUAL
+%left '<' '>' LTE GTE
+%left '|'
+%left '^'
+%left '&'
+%left LSH RSH
+%left '+' '-'
+%left '*' '/' '%'
+%precedence PREFIX
+%precedence INCR DECR '.' '('
+
+// Every conflict is resolved above, so any new one fails the build
+%expect 0
+
 %%
 
-toplevels : toplevel toplevels | ;
+unit : toplevels { if (shape) *shape = $1; } ;
+
+toplevels : toplevel toplevels { $$ = _shape(0, $1, $2); } | { $$ = 0; } ;
 
 toplevel
 	: global_function
@@ -28,38 +78,43 @@ toplevel
 	| namespace
 	;
 
+// Only prototypes may leave arguments unnamed. Definitions and prototypes
+// share one argument list, as they can't be told apart before the body.
 global_function
-	: FN identifier '(' named_arguments ')' func_ret expr
-	| FN identifier '(' maybe_named_arguments ')' func_ret ';'
-	;
-named_arguments
-	: identifier ref_type ',' named_arguments
-	| identifier ref_type
-	|
-	;
-maybe_named_arguments
-	: identifier ref_type ',' maybe_named_arguments
-	| ref_type ',' maybe_named_arguments
-	| identifier ref_type
-	| ref_type
-	|
+	: FN identifier '(' arguments ')' func_ret expr {
+		if ($4) {
+			yyerror(scanner, path, msgs, shape, "unnamed argument in a definition");
+			YYERROR;
+		}
+		$$ = $7;
+	}
+	| FN identifier '(' arguments ')' func_ret ';' { $$ = 0; }
+	;
+// 1 if any argument is unnamed
+arguments
+	: identifier ref_type ',' arguments { $$ = $4; }
+	| ref_type ',' arguments { $$ = 1; }
+	| identifier ref_type { $$ = 0; }
+	| ref_type { $$ = 1; }
+	| { $$ = 0; }
 	;
 func_ret
 	: ARROW val_type
 	|
 	;
 
+// The initializer is an op, as an expr would take the ';' for a sequence
 global_variable
-	: identifier ref_type ';'
-	| identifier ref_type '=' expr ';'
+	: identifier ref_type ';' { $$ = 0; }
+	| identifier ref_type '=' op ';' { $$ = $4; }
 	;
 
 namespace
-	: NS identifier '{' toplevels '}'
+	: NS identifier '{' toplevels '}' { $$ = $4; }
 	;
 
 ref_type
-	: val_type
+	: val_type %prec BODY
 	;
 val_type
 	: PTR ref_type
@@ -72,7 +127,7 @@ val_type
 	;
 
 function_type
-	: FN '(' maybe_named_arguments ')' func_ret
+	: FN '(' arguments ')' func_ret %prec BODY
 	;
 
 int_type
@@ -99,14 +154,14 @@ expr
 	| break
 	| CONTINUE
 	| return
-	| op_sequence
+	| op_sequence %prec BODY
 
 if
 	: IF '(' expr ')' expr else
 	;
 else
 	: ELSE expr
-	|
+	| %prec BODY
 	;
 
 while
@@ -114,126 +169,72 @@ while
 	;
 
 break
-	: BREAK
+	: BREAK %prec BODY
 	| BREAK expr
 	;
 
 return
-	: RETURN
+	: RETURN %prec BODY
 	| RETURN expr
 	;
 
 op_sequence
-	: op_sequence ';' op_assign
-	| op_assign
-	;
-
-op_assign
-	: op_lor assignop op_assign
-	| op_lor
-	;
-assignop
-	: '='
-	| ADDEQ
-	| SUBEQ
-	| MULEQ
-	| DIVEQ
-	| MODEQ
-	| LSHEQ
-	| RSHEQ
-	| ANDEQ
-	| XOREQ
-	| IOREQ
-	;
-
-op_lor
-	: op_lor LOGICAL_OR op_land
-	| op_land
-	;
-
-op_land
-	: op_land LOGICAL_AND op_eq
-	| op_eq
-	;
-
-op_eq
-	: op_eq EQUAL op_cmp
-	| op_eq NOT_EQUAL op_cmp
-	| op_cmp
-	;
-
-op_cmp
-	: op_cmp cmpop op_ior
-	| op_ior
-	;
-cmpop
-	: '<'
-	| '>'
-	| LTE
-	| GTE
-	;
-
-op_ior
-	: op_ior '|' op_xor
-	| op_xor
-	;
-
-op_xor
-	: op_xor '|' op_and
-	| op_and
-	;
-
-op_and
-	: op_and '&' op_shift
-	| op_shift
-	;
-
-op_shift
-	: op_shift LSH op_add
-	| op_shift RSH op_add
-	| op_add
-	;
-
-op_add
-	: op_add '+' op_mul
-	| op_add '-' op_mul
-	| op_mul
-	;
-
-op_mul
-	: op_mul '*' op_prefix
-	| op_mul '/' op_prefix
-	| op_mul '%' op_prefix
-	| op_prefix
-	;
-
-op_prefix
-	: prefixop op_prefix
-	| '(' val_type ')' op_prefix
-	| op_postfix
-	;
-prefixop
-	: PTR
-	| INCR
-	| DECR
-	| '!'
-	| '~'
-	| '+'
-	| '-'
-
-op_postfix
-	: op_postfix INCR
-	| op_postfix DECR
-	| op_postfix '.' identifier
-	| op_postfix '(' exprs ')'
-	| literal
-	| '(' expr ')'
-	| '[' expr ']'
+	: op_sequence ';' op { $$ = _shape(';', $1, $3); }
+	| op %prec BODY
+	;
+
+// Every operator is one rule, ordered by the precedence declarations above,
+// so a primary expression reduces straight to op
+op
+	: op '=' op { $$ = _shape('=', $1, $3); }
+	| op ADDEQ op { $$ = _shape(ADDEQ, $1, $3); }
+	| op SUBEQ op { $$ = _shape(SUBEQ, $1, $3); }
+	| op MULEQ op { $$ = _shape(MULEQ, $1, $3); }
+	| op DIVEQ op { $$ = _shape(DIVEQ, $1, $3); }
+	| op MODEQ op { $$ = _shape(MODEQ, $1, $3); }
+	| op LSHEQ op { $$ = _shape(LSHEQ, $1, $3); }
+	| op RSHEQ op { $$ = _shape(RSHEQ, $1, $3); }
+	| op ANDEQ op { $$ = _shape(ANDEQ, $1, $3); }
+	| op XOREQ op { $$ = _shape(XOREQ, $1, $3); }
+	| op IOREQ op { $$ = _shape(IOREQ, $1, $3); }
+	| op LOGICAL_OR op { $$ = _shape(LOGICAL_OR, $1, $3); }
+	| op LOGICAL_AND op { $$ = _shape(LOGICAL_AND, $1, $3); }
+	| op EQUAL op { $$ = _shape(EQUAL, $1, $3); }
+	| op NOT_EQUAL op { $$ = _shape(NOT_EQUAL, $1, $3); }
+	| op '<' op { $$ = _shape('<', $1, $3); }
+	| op '>' op { $$ = _shape('>', $1, $3); }
+	| op LTE op { $$ = _shape(LTE, $1, $3); }
+	| op GTE op { $$ = _shape(GTE, $1, $3); }
+	| op '|' op { $$ = _shape('|', $1, $3); }
+	| op '^' op { $$ = _shape('^', $1, $3); }
+	| op '&' op { $$ = _shape('&', $1, $3); }
+	| op LSH op { $$ = _shape(LSH, $1, $3); }
+	| op RSH op { $$ = _shape(RSH, $1, $3); }
+	| op '+' op { $$ = _shape('+', $1, $3); }
+	| op '-' op { $$ = _shape('-', $1, $3); }
+	| op '*' op { $$ = _shape('*', $1, $3); }
+	| op '/' op { $$ = _shape('/', $1, $3); }
+	| op '%' op { $$ = _shape('%', $1, $3); }
+	| PTR op %prec PREFIX { $$ = _shape(PTR, 0, $2); }
+	| INCR op %prec PREFIX { $$ = _shape(INCR, 0, $2); }
+	| DECR op %prec PREFIX { $$ = _shape(DECR, 0, $2); }
+	| '!' op %prec PREFIX { $$ = _shape('!', 0, $2); }
+	| '~' op %prec PREFIX { $$ = _shape('~', 0, $2); }
+	| '+' op %prec PREFIX { $$ = _shape('+', 0, $2); }
+	| '-' op %prec PREFIX { $$ = _shape('-', 0, $2); }
+	| '(' val_type ')' op %prec PREFIX { $$ = _shape(PREFIX, 0, $4); }
+	| op INCR { $$ = _shape(INCR, $1, 0); }
+	| op DECR { $$ = _shape(DECR, $1, 0); }
+	| op '.' identifier { $$ = _shape('.', $1, 0); }
+	| op '(' exprs ')' { $$ = _shape('(', $1, $3); }
+	| literal { $$ = 1; }
+	| '(' expr ')' { $$ = $2; }
+	| '[' expr ']' { $$ = _shape('[', 0, $2); }
 	;
 exprs
-	: expr ',' exprs
+	: expr ',' exprs { $$ = _shape(',', $1, $3); }
 	| expr
-	|
+	| { $$ = 0; }
 	;
 
 literal
@@ -252,7 +253,12 @@ literal_composite
 	: val_type '{' exprs '}'
 	;
 literal_function
-	: FN '(' named_arguments ')' func_ret expr
+	: FN '(' arguments ')' func_ret expr {
+		if ($3) {
+			yyerror(scanner, path, msgs, shape, "unnamed argument in a definition");
+			YYERROR;
+		}
+	}
 	;
 
 // Lexical elements
@@ -0,0 +1,271 @@
+// vim: noet
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pass.h"
+#include "strmap.h"
+
+static uint64_t _now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void pm_add(struct pass_manager *pm, struct pass *p) {
+	if (pm->npasses == pm->alloc) {
+		pm->alloc = pm->alloc ? pm->alloc * 2 : 8;
+		pm->passes = realloc(pm->passes, pm->alloc * sizeof *pm->passes);
+	}
+	pm->passes[pm->npasses].pass = p;
+	pm->passes[pm->npasses].group = 0;
+	pm->passes[pm->npasses].ns = 0;
+	++pm->npasses;
+}
+
+// Scheduling {{{
+
+enum {
+	_UNVISITED,
+	_VISITING,
+	_DONE,
+};
+
+// Assigns the pass a group after all of its dependencies, appending it to topo
+static bool _pm_visit(struct pass_manager *pm, struct strmap *names, uint8_t *state, size_t i, size_t *topo, size_t *ntopo) {
+	if (state[i] == _DONE) return true;
+	if (state[i] == _VISITING) return false;
+	state[i] = _VISITING;
+
+	struct pass *p = pm->passes[i].pass;
+	size_t group = 0;
+	for (const char *const *dep = p->deps; dep && *dep; ++dep) {
+		size_t *d = strmap_get(names, *dep);
+		if (!d) return false;
+		if (!_pm_visit(pm, names, state, *d, topo, ntopo)) return false;
+
+		// Local passes can see what local dependencies did at the current
+		// node, so they can share a traversal
+		size_t min = pm->passes[*d].group;
+		if (!p->local || !pm->passes[*d].pass->local) ++min;
+		if (min > group) group = min;
+	}
+
+	pm->passes[i].group = group;
+	topo[(*ntopo)++] = i;
+	state[i] = _DONE;
+	return true;
+}
+
+bool pm_schedule(struct pass_manager *pm) {
+	struct strmap names = {0};
+	for (size_t i = 0; i < pm->npasses; ++i) {
+		strmap_put(&names, pm->passes[i].pass->name, i);
+	}
+
+	uint8_t *state = calloc(pm->npasses, sizeof *state);
+	size_t *topo = malloc(pm->npasses * sizeof *topo), ntopo = 0;
+	bool ok = true;
+	for (size_t i = 0; ok && i < pm->npasses; ++i) {
+		ok = _pm_visit(pm, &names, state, i, topo, &ntopo);
+	}
+	free(state);
+	strmap_free(&names);
+	if (!ok) {
+		free(topo);
+		return false;
+	}
+
+	pm->ngroups = 0;
+	for (size_t i = 0; i < pm->npasses; ++i) {
+		if (pm->passes[i].group >= pm->ngroups) pm->ngroups = pm->passes[i].group + 1;
+	}
+
+	// Stable counting sort of the topological order by group
+	free(pm->group_start);
+	free(pm->group_ns);
+	pm->group_start = calloc(pm->ngroups + 1, sizeof *pm->group_start);
+	pm->group_ns = calloc(pm->ngroups, sizeof *pm->group_ns);
+	for (size_t i = 0; i < pm->npasses; ++i) {
+		++pm->group_start[pm->passes[i].group + 1];
+	}
+	for (size_t g = 0; g < pm->ngroups; ++g) {
+		pm->group_start[g+1] += pm->group_start[g];
+	}
+
+	size_t *next = malloc(pm->ngroups * sizeof *next);
+	memcpy(next, pm->group_start, pm->ngroups * sizeof *next);
+	free(pm->order);
+	pm->order = malloc(pm->npasses * sizeof *pm->order);
+	for (size_t i = 0; i < ntopo; ++i) {
+		pm->order[next[pm->passes[topo[i]].group]++] = topo[i];
+	}
+	free(next);
+	free(topo);
+
+	return true;
+}
+
+// }}}
+
+// Fused traversal {{{
+
+struct _fused {
+	struct pass_manager *pm;
+	size_t *passes, npasses;
+
+	// Depth at which each pass started skipping, or SIZE_MAX
+	size_t depth;
+	size_t *skip;
+};
+
+// Runs a hook, accounting its time to pass i if timing is enabled
+#define TIMED(pm, i, call) do { \
+		if ((pm)->timing) { \
+			uint64_t _t0 = _now(); \
+			call; \
+			(pm)->passes[i].ns += _now() - _t0; \
+		} else { \
+			call; \
+		} \
+	} while (0)
+
+static bool _fused_pre(struct ast_expr *e, void *ctx) {
+	struct _fused *f = ctx;
+	++f->depth;
+
+	bool any = false;
+	for (size_t k = 0; k < f->npasses; ++k) {
+		if (f->skip[k] != SIZE_MAX) continue;
+
+		size_t i = f->passes[k];
+		struct pass *p = f->pm->passes[i].pass;
+		bool keep = true;
+		if (p->pre) TIMED(f->pm, i, keep = p->pre(e, p->ctx));
+
+		if (keep) any = true;
+		else f->skip[k] = f->depth;
+	}
+
+	if (!any) {
+		// No pass wants the subtree, so post won't be called either
+		for (size_t k = 0; k < f->npasses; ++k) {
+			if (f->skip[k] == f->depth) f->skip[k] = SIZE_MAX;
+		}
+		--f->depth;
+	}
+	return any;
+}
+
+static void _fused_child(struct ast_expr *e, size_t c, void *ctx) {
+	struct _fused *f = ctx;
+	for (size_t k = 0; k < f->npasses; ++k) {
+		if (f->skip[k] != SIZE_MAX) continue;
+
+		size_t i = f->passes[k];
+		struct pass *p = f->pm->passes[i].pass;
+		if (p->child) TIMED(f->pm, i, p->child(e, c, p->ctx));
+	}
+}
+
+static void _fused_post(struct ast_expr *e, void *ctx) {
+	struct _fused *f = ctx;
+	for (size_t k = 0; k < f->npasses; ++k) {
+		if (f->skip[k] == f->depth) {
+			f->skip[k] = SIZE_MAX;
+			continue;
+		}
+		if (f->skip[k] != SIZE_MAX) continue;
+
+		size_t i = f->passes[k];
+		struct pass *p = f->pm->passes[i].pass;
+		if (p->post) TIMED(f->pm, i, p->post(e, p->ctx));
+	}
+	--f->depth;
+}
+
+static const struct walk_ops _fused_ops = {
+	.pre = _fused_pre,
+	.child = _fused_child,
+	.post = _fused_post,
+};
+
+static void _fused_toplevels(struct _fused *f, size_t ntops, struct ast_toplevel *tops) {
+	struct pass_manager *pm = f->pm;
+
+	for (size_t t = 0; t < ntops; ++t) {
+		struct ast_toplevel *top = tops + t;
+
+		for (size_t k = 0; k < f->npasses; ++k) {
+			struct pass *p = pm->passes[f->passes[k]].pass;
+			if (p->top_pre) TIMED(pm, f->passes[k], p->top_pre(top, p->ctx));
+		}
+
+		switch (top->type) {
+		case EXPRTOP_FUNC:
+			walk_expr(&pm->walk, top->func.body, &_fused_ops, f);
+			break;
+		case EXPRTOP_DECL:
+			walk_expr(&pm->walk, top->decl.val, &_fused_ops, f);
+			break;
+		case EXPRTOP_NAMESPACE:
+			_fused_toplevels(f, top->namespace.size, top->namespace.body);
+			break;
+		}
+
+		for (size_t k = 0; k < f->npasses; ++k) {
+			struct pass *p = pm->passes[f->passes[k]].pass;
+			if (p->top_post) TIMED(pm, f->passes[k], p->top_post(top, p->ctx));
+		}
+	}
+}
+
+void pm_run(struct pass_manager *pm, size_t ntops, struct ast_toplevel *tops) {
+	for (size_t g = 0; g < pm->ngroups; ++g) {
+		uint64_t t0 = pm->timing ? _now() : 0;
+
+		struct _fused f = {
+			.pm = pm,
+			.passes = pm->order + pm->group_start[g],
+			.npasses = pm->group_start[g+1] - pm->group_start[g],
+		};
+		f.skip = malloc(f.npasses * sizeof *f.skip);
+		for (size_t k = 0; k < f.npasses; ++k) {
+			f.skip[k] = SIZE_MAX;
+
+			struct pass *p = pm->passes[f.passes[k]].pass;
+			if (p->begin) TIMED(pm, f.passes[k], p->begin(ntops, tops, p->ctx));
+		}
+
+		_fused_toplevels(&f, ntops, tops);
+		free(f.skip);
+
+		if (pm->timing) pm->group_ns[g] += _now() - t0;
+	}
+}
+
+// }}}
+
+void pm_report(struct pass_manager *pm, FILE *f) {
+	for (size_t g = 0; g < pm->ngroups; ++g) {
+		fprintf(f, "traversal %zu", g);
+		if (pm->timing) fprintf(f, " (%.3f ms)", pm->group_ns[g] / 1e6);
+		fputs(":\n", f);
+
+		for (size_t k = pm->group_start[g]; k < pm->group_start[g+1]; ++k) {
+			size_t i = pm->order[k];
+			fprintf(f, "\t%s", pm->passes[i].pass->name);
+			if (pm->timing) fprintf(f, " %.3f ms", pm->passes[i].ns / 1e6);
+			fputc('\n', f);
+		}
+	}
+}
+
+void pm_free(struct pass_manager *pm) {
+	free(pm->passes);
+	free(pm->order);
+	free(pm->group_start);
+	free(pm->group_ns);
+	walk_free(&pm->walk);
+	*pm = (struct pass_manager){0};
+}
@@ -0,0 +1,70 @@
+// vim: noet
+
+#ifndef PASS_H
+#define PASS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ast.h"
+#include "walk.h"
+
+// A pass over every toplevel of a unit. Any hook may be NULL.
+struct pass {
+	const char *name;
+	// NULL-terminated names of passes that must run first
+	const char *const *deps;
+
+	// Set if the pass only reads what its dependencies computed for the
+	// current node, its ancestors and its finished children. A local pass
+	// shares a traversal with the local passes it depends on; at each node,
+	// hooks run in dependency order.
+	bool local;
+
+	void (*begin)(size_t ntops, struct ast_toplevel *tops, void *ctx);
+	void (*top_pre)(struct ast_toplevel *t, void *ctx);
+	void (*top_post)(struct ast_toplevel *t, void *ctx);
+
+	// As in walk_ops. Returning false from pre skips the subtree for this
+	// pass only.
+	bool (*pre)(struct ast_expr *e, void *ctx);
+	void (*child)(struct ast_expr *e, size_t i, void *ctx);
+	void (*post)(struct ast_expr *e, void *ctx);
+
+	void *ctx;
+};
+
+struct pass_manager {
+	size_t npasses, alloc;
+	struct {
+		struct pass *pass;
+		size_t group;
+		// Time spent in the pass's hooks, if timing is enabled
+		uint64_t ns;
+	} *passes;
+
+	// Passes sorted by group, then dependency order
+	size_t ngroups;
+	size_t *order;
+	size_t *group_start;
+
+	// Time each hook call; off by default as it costs two clock reads per call
+	bool timing;
+	uint64_t *group_ns;
+
+	struct walk_stack walk;
+};
+
+void pm_add(struct pass_manager *pm, struct pass *p);
+
+// Orders passes and fuses them into as few traversals as possible. Returns
+// false if a dependency is missing or cyclic.
+bool pm_schedule(struct pass_manager *pm);
+
+void pm_run(struct pass_manager *pm, size_t ntops, struct ast_toplevel *tops);
+
+// Prints the traversals, their passes and, if timed, their times
+void pm_report(struct pass_manager *pm, FILE *f);
+
+void pm_free(struct pass_manager *pm);
+
+#endif
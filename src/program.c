@@ -0,0 +1,862 @@
+// vim: noet
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "callgraph.h"
+#include "escape.h"
+#include "loop.h"
+#include "memstats.h"
+#include "program.h"
+#include "type.h"
+#include "lanes.h"
+#include "walk.h"
+
+// Unit files are a cache for the machine that wrote them, so numbers are
+// stored in its byte order. Strings are indices into the unit's string
+// table, or PROG_NONE for NULL.
+#define PROG_NONE UINT32_MAX
+// Ends a body, which is its nodes in postorder
+#define PROG_END 0xff
+
+// Toplevel functions and function literals share this argument layout
+struct _prog_arg {
+	const char *name;
+	struct ref_type type;
+};
+
+static bool _prog_fail(struct program *p, const char *msg, const char *name) {
+	p->error = msg;
+	p->error_name = name;
+	return false;
+}
+
+// Writing {{{
+
+struct _prog_writer {
+	FILE *f, *syms, *bodies;
+	size_t nsyms;
+
+	// Strings are numbered in the order they are first used
+	struct strmap strings;
+	size_t nstrings, strings_alloc;
+	const char **strtab;
+	size_t strbytes;
+
+	// What the body being written uses
+	size_t nnodes;
+	struct strmap refs;
+	size_t nrefs, refs_alloc;
+	const char **reflist;
+
+	struct walk_stack walk;
+};
+
+static void _put(struct _prog_writer *w, const void *p, size_t n) {
+	fwrite(p, 1, n, w->f);
+}
+
+static void _put_u8(struct _prog_writer *w, uint8_t x) {
+	_put(w, &x, sizeof x);
+}
+
+static void _put_u32(struct _prog_writer *w, uint32_t x) {
+	_put(w, &x, sizeof x);
+}
+
+static void _put_u64(struct _prog_writer *w, uint64_t x) {
+	_put(w, &x, sizeof x);
+}
+
+static void _put_str(struct _prog_writer *w, const char *s) {
+	if (!s) {
+		_put_u32(w, PROG_NONE);
+		return;
+	}
+	if (strmap_put(&w->strings, s, w->nstrings)) {
+		if (w->nstrings == w->strings_alloc) {
+			w->strings_alloc = w->strings_alloc ? w->strings_alloc * 2 : 64;
+			w->strtab = realloc(w->strtab, w->strings_alloc * sizeof *w->strtab);
+		}
+		w->strtab[w->nstrings++] = s;
+		w->strbytes += strlen(s) + 1;
+	}
+	_put_u32(w, *strmap_get(&w->strings, s));
+}
+
+static void _put_vtype(struct _prog_writer *w, const struct val_type *t);
+
+static void _put_rtype(struct _prog_writer *w, const struct ref_type *t) {
+	_put_u8(w, t->vol | t->mut << 1);
+	_put_vtype(w, &t->to);
+}
+
+static void _put_vtype(struct _prog_writer *w, const struct val_type *t) {
+	_put_u8(w, t->t);
+	switch (t->t) {
+	case TYPE_PTR:
+		_put_rtype(w, t->ptr);
+		break;
+
+	case TYPE_FUNC:
+		_put_u64(w, t->func.nargs);
+		for (size_t i = 0; i < t->func.nargs; ++i) {
+			_put_rtype(w, t->func.args + i);
+		}
+		_put_u8(w, t->func.ret_type != NULL);
+		if (t->func.ret_type) _put_vtype(w, t->func.ret_type);
+		break;
+
+	case TYPE_INT:
+		_put_u32(w, t->int_);
+		break;
+
+	case TYPE_FLOAT:
+		_put_u8(w, t->float_);
+		break;
+
+	case TYPE_NEWTYPE:
+		_put_str(w, t->newtype_name);
+		break;
+
+	case TYPE_STRUCT:
+	case TYPE_UNION:
+		_put_u64(w, t->composite.nfields);
+		for (size_t i = 0; i < t->composite.nfields; ++i) {
+			_put_str(w, t->composite.fields[i].name);
+			_put_vtype(w, t->composite.fields[i].type);
+		}
+		break;
+
+	case TYPE_VOID:
+	case TYPE_BOOL:
+		break;
+	}
+}
+
+static void _put_args(struct _prog_writer *w, size_t nargs, const struct _prog_arg *args) {
+	_put_u64(w, nargs);
+	for (size_t i = 0; i < nargs; ++i) {
+		_put_str(w, args[i].name);
+		_put_rtype(w, &args[i].type);
+	}
+}
+
+static void _put_expr(struct ast_expr *e, void *ctx) {
+	struct _prog_writer *w = ctx;
+	++w->nnodes;
+
+	// Only the first three children are ever optional
+	uint8_t absent = 0;
+	size_t n = expr_nchildren(e);
+	for (size_t i = 0; i < n && i < 3; ++i) {
+		if (!expr_child(e, i)) absent |= 1 << i;
+	}
+	_put_u8(w, e->t);
+	_put_u8(w, absent);
+
+	switch (e->t) {
+	case EXPR_BINOP:
+		_put_u8(w, e->binop.t);
+		break;
+
+	case EXPR_UNOP:
+		_put_u8(w, e->unop.t);
+		break;
+
+	case EXPR_CALL:
+		_put_u64(w, e->call.nargs);
+		break;
+
+	case EXPR_BREAK:
+		_put_str(w, e->break_.lbl);
+		break;
+
+	case EXPR_CONTINUE:
+		_put_str(w, e->continue_.lbl);
+		break;
+
+	case EXPR_FUNC:
+		_put_args(w, e->func.nargs, (void *)e->func.args);
+		_put_vtype(w, &e->func.ret);
+		break;
+
+	case EXPR_INT_LIT:
+		_put_u32(w, e->int_lit.type);
+		_put_u64(w, e->int_lit.u);
+		break;
+
+	case EXPR_FLOAT_LIT:;
+		// In hex, which reads back exactly
+		char buf[64];
+		int len = snprintf(buf, sizeof buf, "%La", e->float_lit.x);
+		_put_u8(w, e->float_lit.type);
+		_put_u8(w, len);
+		_put(w, buf, len);
+		break;
+
+	case EXPR_ARR_LIT:
+		_put_u64(w, e->array_lit.nelems);
+		break;
+
+	case EXPR_COMPOSITE_LIT:
+		_put_vtype(w, &e->composite_lit.type);
+		_put_u64(w, e->composite_lit.nelems);
+		break;
+
+	case EXPR_BOOL_LIT:
+		_put_u8(w, e->bool_lit);
+		break;
+
+	case EXPR_FIELD_ACCESS:
+		_put_str(w, e->field_access.field);
+		break;
+
+	case EXPR_LET:
+		_put_str(w, e->let.name);
+		_put_rtype(w, &e->let.type);
+		break;
+
+	case EXPR_CAST:
+		_put_vtype(w, &e->cast.type);
+		break;
+
+	case EXPR_IDENT:
+		_put_str(w, e->ident);
+		if (strmap_put(&w->refs, e->ident, 0)) {
+			if (w->nrefs == w->refs_alloc) {
+				w->refs_alloc = w->refs_alloc ? w->refs_alloc * 2 : 16;
+				w->reflist = realloc(w->reflist, w->refs_alloc * sizeof *w->reflist);
+			}
+			w->reflist[w->nrefs++] = e->ident;
+		}
+		break;
+
+	case EXPR_IF:
+	case EXPR_WHILE:
+	case EXPR_RETURN:
+		break;
+	}
+}
+
+static void _put_top(struct _prog_writer *w, struct ast_toplevel *t) {
+	// The body goes first, as its summary says where it is and what it uses
+	struct ast_expr *body = t->type == EXPRTOP_FUNC ? t->func.body : t->decl.val;
+	fflush(w->bodies);
+	uint64_t off = ftell(w->bodies);
+	w->nnodes = w->nrefs = 0;
+	strmap_free(&w->refs);
+	if (body) {
+		w->f = w->bodies;
+		walk_expr(&w->walk, body, &(struct walk_ops){.post = _put_expr}, w);
+		_put_u8(w, PROG_END);
+	}
+
+	w->f = w->syms;
+	_put_u8(w, t->type);
+	if (t->type == EXPRTOP_FUNC) {
+		_put_str(w, t->func.name);
+		_put_args(w, t->func.nargs, (void *)t->func.args);
+		_put_vtype(w, &t->func.ret);
+	} else {
+		_put_str(w, t->decl.name);
+		_put_rtype(w, &t->decl.type);
+	}
+	_put_u8(w, body != NULL);
+	_put_u64(w, w->nnodes);
+	_put_u64(w, w->nrefs);
+	for (size_t i = 0; i < w->nrefs; ++i) _put_str(w, w->reflist[i]);
+	_put_u64(w, off);
+	++w->nsyms;
+}
+
+static void _put_tops(struct _prog_writer *w, size_t ntops, struct ast_toplevel *tops) {
+	for (size_t i = 0; i < ntops; ++i) {
+		if (tops[i].type == EXPRTOP_NAMESPACE) {
+			_put_tops(w, tops[i].namespace.size, tops[i].namespace.body);
+		} else {
+			_put_top(w, tops + i);
+		}
+	}
+}
+
+bool prog_write_unit(FILE *f, size_t ntops, struct ast_toplevel *tops) {
+	struct _prog_writer w = {0};
+	char *syms, *bodies;
+	size_t syms_len, bodies_len;
+	w.syms = open_memstream(&syms, &syms_len);
+	w.bodies = open_memstream(&bodies, &bodies_len);
+	_put_tops(&w, ntops, tops);
+	fclose(w.syms);
+	fclose(w.bodies);
+
+	w.f = f;
+	_put(&w, PROG_MAGIC, 4);
+	_put_u32(&w, PROG_VERSION);
+	_put_u64(&w, w.nstrings);
+	_put_u64(&w, w.strbytes);
+	for (size_t i = 0; i < w.nstrings; ++i) {
+		_put(&w, w.strtab[i], strlen(w.strtab[i]) + 1);
+	}
+	_put_u64(&w, w.nsyms);
+	_put(&w, syms, syms_len);
+	_put(&w, bodies, bodies_len);
+
+	free(syms);
+	free(bodies);
+	free(w.strtab);
+	free(w.reflist);
+	strmap_free(&w.strings);
+	strmap_free(&w.refs);
+	walk_free(&w.walk);
+	return !ferror(f);
+}
+
+// }}}
+
+// Reading {{{
+
+// Reads never fail outright; they set bad and return zeroes instead
+struct _prog_reader {
+	FILE *f;
+	// No count can be larger than the file
+	uint64_t size;
+	struct prog_unit *u;
+	bool bad;
+};
+
+static bool _prog_open(struct _prog_reader *r, const char *path) {
+	struct stat st;
+	r->f = fopen(path, "rb");
+	if (r->f && !fstat(fileno(r->f), &st)) {
+		r->size = st.st_size;
+		return true;
+	}
+	if (r->f) fclose(r->f);
+	return false;
+}
+
+static void _get(struct _prog_reader *r, void *p, size_t n) {
+	if (fread(p, 1, n, r->f) != n) {
+		r->bad = true;
+		memset(p, 0, n);
+	}
+}
+
+static uint8_t _get_u8(struct _prog_reader *r) {
+	uint8_t x;
+	_get(r, &x, sizeof x);
+	return x;
+}
+
+static uint32_t _get_u32(struct _prog_reader *r) {
+	uint32_t x;
+	_get(r, &x, sizeof x);
+	return x;
+}
+
+static uint64_t _get_u64(struct _prog_reader *r) {
+	uint64_t x;
+	_get(r, &x, sizeof x);
+	return x;
+}
+
+static size_t _get_len(struct _prog_reader *r) {
+	uint64_t x = _get_u64(r);
+	if (x > r->size) {
+		r->bad = true;
+		return 0;
+	}
+	return x;
+}
+
+static const char *_get_str(struct _prog_reader *r) {
+	uint32_t i = _get_u32(r);
+	if (i == PROG_NONE) return NULL;
+	if (i >= r->u->nnames) {
+		r->bad = true;
+		return NULL;
+	}
+	return r->u->names[i];
+}
+
+static void _get_vtype(struct _prog_reader *r, struct val_type *t);
+
+static void _get_rtype(struct _prog_reader *r, struct ref_type *t) {
+	uint8_t quals = _get_u8(r);
+	t->vol = quals & 1;
+	t->mut = quals >> 1 & 1;
+	_get_vtype(r, &t->to);
+}
+
+static void _get_vtype(struct _prog_reader *r, struct val_type *t) {
+	*t = (struct val_type){.t = _get_u8(r)};
+	if (t->t > TYPE_BOOL) {
+		r->bad = true;
+		return;
+	}
+
+	struct ref_type rt;
+	struct val_type vt;
+	switch (t->t) {
+	case TYPE_PTR:
+		// A ref_type counts as the kind of its val_type
+		_get_rtype(r, &rt);
+		t->ptr = MEM_ALLOC(MEM_TYPE + rt.to.t, sizeof *t->ptr);
+		*t->ptr = rt;
+		break;
+
+	case TYPE_FUNC:
+		t->func.nargs = _get_len(r);
+		t->func.args = MEM_ALLOC(MEM_TYPE + TYPE_FUNC, t->func.nargs * sizeof *t->func.args);
+		for (size_t i = 0; i < t->func.nargs; ++i) {
+			_get_rtype(r, t->func.args + i);
+		}
+		if (_get_u8(r)) {
+			_get_vtype(r, &vt);
+			t->func.ret_type = MEM_ALLOC(MEM_TYPE + vt.t, sizeof *t->func.ret_type);
+			*t->func.ret_type = vt;
+		}
+		break;
+
+	case TYPE_INT:
+		t->int_ = _get_u32(r);
+		break;
+
+	case TYPE_FLOAT:
+		t->float_ = _get_u8(r);
+		break;
+
+	case TYPE_NEWTYPE:
+		t->newtype_name = _get_str(r);
+		break;
+
+	case TYPE_STRUCT:
+	case TYPE_UNION:
+		t->composite.nfields = _get_len(r);
+		t->composite.fields = MEM_ALLOC(MEM_TYPE + t->t, t->composite.nfields * sizeof *t->composite.fields);
+		for (size_t i = 0; i < t->composite.nfields; ++i) {
+			t->composite.fields[i].name = _get_str(r);
+			_get_vtype(r, &vt);
+			t->composite.fields[i].type = MEM_ALLOC(MEM_TYPE + vt.t, sizeof vt);
+			*t->composite.fields[i].type = vt;
+		}
+		break;
+
+	case TYPE_VOID:
+	case TYPE_BOOL:
+		break;
+	}
+}
+
+static struct _prog_arg *_get_args(struct _prog_reader *r, enum mem_cat cat, size_t *nargs) {
+	*nargs = _get_len(r);
+	struct _prog_arg *args = MEM_ALLOC(cat, *nargs * sizeof *args);
+	for (size_t i = 0; i < *nargs; ++i) {
+		args[i].name = _get_str(r);
+		_get_rtype(r, &args[i].type);
+	}
+	return args;
+}
+
+// Everything but the children
+static void _get_fields(struct _prog_reader *r, struct ast_expr *e) {
+	enum mem_cat cat = MEM_EXPR + e->t;
+	switch (e->t) {
+	case EXPR_BINOP:
+		e->binop.t = _get_u8(r);
+		break;
+
+	case EXPR_UNOP:
+		e->unop.t = _get_u8(r);
+		break;
+
+	case EXPR_CALL:
+		e->call.nargs = _get_len(r);
+		e->call.args = MEM_ALLOC(cat, e->call.nargs * sizeof *e->call.args);
+		break;
+
+	case EXPR_BREAK:
+		e->break_.lbl = _get_str(r);
+		break;
+
+	case EXPR_CONTINUE:
+		e->continue_.lbl = _get_str(r);
+		break;
+
+	case EXPR_FUNC:
+		e->func.args = (void *)_get_args(r, cat, &e->func.nargs);
+		_get_vtype(r, &e->func.ret);
+		break;
+
+	case EXPR_INT_LIT:
+		e->int_lit.type = _get_u32(r);
+		e->int_lit.u = _get_u64(r);
+		break;
+
+	case EXPR_FLOAT_LIT:;
+		char buf[256];
+		e->float_lit.type = _get_u8(r);
+		uint8_t len = _get_u8(r);
+		_get(r, buf, len);
+		buf[len] = 0;
+		e->float_lit.x = strtold(buf, NULL);
+		break;
+
+	case EXPR_ARR_LIT:
+		e->array_lit.nelems = _get_len(r);
+		e->array_lit.elems = MEM_ALLOC(cat, e->array_lit.nelems * sizeof *e->array_lit.elems);
+		break;
+
+	case EXPR_COMPOSITE_LIT:
+		_get_vtype(r, &e->composite_lit.type);
+		e->composite_lit.nelems = _get_len(r);
+		e->composite_lit.elems = MEM_ALLOC(cat, e->composite_lit.nelems * sizeof *e->composite_lit.elems);
+		break;
+
+	case EXPR_BOOL_LIT:
+		e->bool_lit = _get_u8(r);
+		break;
+
+	case EXPR_FIELD_ACCESS:
+		e->field_access.field = _get_str(r);
+		break;
+
+	case EXPR_LET:
+		e->let.name = _get_str(r);
+		_get_rtype(r, &e->let.type);
+		break;
+
+	case EXPR_CAST:
+		_get_vtype(r, &e->cast.type);
+		break;
+
+	case EXPR_IDENT:
+		e->ident = _get_str(r);
+		if (!e->ident) r->bad = true;
+		break;
+
+	case EXPR_IF:
+	case EXPR_WHILE:
+	case EXPR_RETURN:
+		break;
+	}
+}
+
+// Rebuilds a body on a stack of finished subtrees, as expr_clone does
+static struct ast_expr *_get_body(struct _prog_reader *r) {
+	size_t n = 0, alloc = 0;
+	struct ast_expr **stack = NULL;
+
+	for (;;) {
+		uint8_t t = _get_u8(r);
+		if (r->bad || t == PROG_END) break;
+		if (t > EXPR_IDENT) {
+			r->bad = true;
+			break;
+		}
+
+		struct ast_expr *e = MEM_ALLOC(MEM_EXPR + t, sizeof *e);
+		*e = (struct ast_expr){.t = t};
+		uint8_t absent = _get_u8(r);
+		_get_fields(r, e);
+
+		size_t nkids = expr_nchildren(e), npresent = 0;
+		for (size_t i = 0; i < nkids; ++i) {
+			if (i >= 3 || !(absent >> i & 1)) ++npresent;
+		}
+		if (r->bad || npresent > n) {
+			r->bad = true;
+			break;
+		}
+
+		n -= npresent;
+		for (size_t i = 0, k = n; i < nkids; ++i) {
+			if (i < 3 && absent >> i & 1) continue;
+			if (expr_set_child(e, i, stack[k])) MEM_FREE(stack[k]);
+			++k;
+		}
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			stack = realloc(stack, alloc * sizeof *stack);
+		}
+		stack[n++] = e;
+	}
+
+	struct ast_expr *body = NULL;
+	if (!r->bad && n == 1) {
+		body = stack[0];
+	} else {
+		r->bad = true;
+	}
+	free(stack);
+	return body;
+}
+
+static void _get_sym(struct _prog_reader *r, struct prog_sym *s) {
+	uint8_t type = _get_u8(r);
+	s->name = _get_str(r);
+	if (!s->name) r->bad = true;
+
+	if (type == EXPRTOP_FUNC) {
+		s->top.type = EXPRTOP_FUNC;
+		s->top.func.name = s->name;
+		s->top.func.args = (void *)_get_args(r, MEM_TOPLEVEL, &s->top.func.nargs);
+		_get_vtype(r, &s->top.func.ret);
+	} else if (type == EXPRTOP_DECL) {
+		s->top.type = EXPRTOP_DECL;
+		s->top.decl.name = s->name;
+		_get_rtype(r, &s->top.decl.type);
+	} else {
+		r->bad = true;
+		return;
+	}
+
+	s->has_body = _get_u8(r);
+	s->size = _get_u64(r);
+	s->nrefs = _get_len(r);
+	s->refs = malloc(s->nrefs * sizeof *s->refs);
+	for (size_t i = 0; i < s->nrefs; ++i) s->refs[i] = _get_str(r);
+	s->body_off = _get_u64(r);
+}
+
+// }}}
+
+// Merging {{{
+
+static bool _prog_same_type(struct prog_sym *x, struct prog_sym *y) {
+	if (x->top.type == EXPRTOP_DECL) return rtype_eq(&x->top.decl.type, &y->top.decl.type);
+
+	if (x->top.func.nargs != y->top.func.nargs) return false;
+	for (size_t i = 0; i < x->top.func.nargs; ++i) {
+		if (!rtype_eq(&x->top.func.args[i].type, &y->top.func.args[i].type)) return false;
+	}
+	return vtype_eq(&x->top.func.ret, &y->top.func.ret);
+}
+
+static bool _prog_merge(struct program *p, size_t i) {
+	struct prog_sym *s = p->syms + i;
+	if (strmap_put(&p->names, s->name, i)) return true;
+
+	size_t *j = strmap_get(&p->names, s->name);
+	struct prog_sym *old = p->syms + *j;
+	if (old->top.type != s->top.type || !_prog_same_type(old, s)) {
+		return _prog_fail(p, "conflicting declarations", s->name);
+	}
+	if (old->has_body && s->has_body) {
+		return _prog_fail(p, "defined more than once", s->name);
+	}
+	if (s->has_body) *j = i;
+	return true;
+}
+
+static bool _prog_canonical(struct program *p, size_t i) {
+	return *strmap_get(&p->names, p->syms[i].name) == i;
+}
+
+// }}}
+
+void prog_init(struct program *p) {
+	*p = (struct program){0};
+}
+
+void prog_free(struct program *p) {
+	for (size_t i = 0; i < p->nunits; ++i) {
+		MEM_FREE(p->units[i].strings);
+		free(p->units[i].names);
+	}
+	for (size_t i = 0; i < p->nsyms; ++i) {
+		free(p->syms[i].refs);
+	}
+	free(p->units);
+	free(p->syms);
+	strmap_free(&p->names);
+	free(p->tops);
+	*p = (struct program){0};
+}
+
+bool prog_add_unit(struct program *p, const char *path) {
+	struct prog_unit u = {.path = path};
+	struct _prog_reader r = {.u = &u};
+	if (!_prog_open(&r, path)) return _prog_fail(p, "cannot open unit", path);
+
+	char magic[4];
+	_get(&r, magic, sizeof magic);
+	if (memcmp(magic, PROG_MAGIC, sizeof magic) || _get_u32(&r) != PROG_VERSION) {
+		fclose(r.f);
+		return _prog_fail(p, "not a unit file of this version", path);
+	}
+
+	u.nnames = _get_len(&r);
+	size_t nbytes = _get_len(&r);
+	u.strings = MEM_ALLOC(MEM_NAME, nbytes ? nbytes : 1);
+	u.names = malloc(u.nnames * sizeof *u.names);
+	_get(&r, u.strings, nbytes);
+	size_t k = 0;
+	for (size_t i = 0, start = 0; i < nbytes && k < u.nnames; ++i) {
+		if (u.strings[i]) continue;
+		u.names[k++] = u.strings + start;
+		start = i + 1;
+	}
+	if (k != u.nnames || (nbytes && u.strings[nbytes-1])) r.bad = true;
+
+	size_t first = p->nsyms, nsyms = _get_len(&r);
+	for (size_t i = 0; i < nsyms && !r.bad; ++i) {
+		if (p->nsyms == p->syms_alloc) {
+			p->syms_alloc = p->syms_alloc ? p->syms_alloc * 2 : 64;
+			p->syms = realloc(p->syms, p->syms_alloc * sizeof *p->syms);
+		}
+		struct prog_sym *s = p->syms + p->nsyms++;
+		*s = (struct prog_sym){.unit = p->nunits};
+		_get_sym(&r, s);
+	}
+	u.bodies = ftell(r.f);
+	fclose(r.f);
+
+	if (r.bad) {
+		for (size_t i = first; i < p->nsyms; ++i) free(p->syms[i].refs);
+		p->nsyms = first;
+		MEM_FREE(u.strings);
+		free(u.names);
+		return _prog_fail(p, "corrupt unit file", path);
+	}
+
+	if (p->nunits == p->units_alloc) {
+		p->units_alloc = p->units_alloc ? p->units_alloc * 2 : 16;
+		p->units = realloc(p->units, p->units_alloc * sizeof *p->units);
+	}
+	p->units[p->nunits++] = u;
+
+	for (size_t i = first; i < p->nsyms; ++i) {
+		if (!_prog_merge(p, i)) return false;
+	}
+	return true;
+}
+
+size_t prog_mark_reachable(struct program *p, size_t nroots, const char **roots) {
+	size_t *work = malloc(p->nsyms * sizeof *work), nwork = 0;
+	size_t nreachable = 0;
+
+	for (size_t i = 0; i < p->nsyms; ++i) {
+		p->syms[i].reachable = false;
+	}
+
+#define MARK(i) do { \
+		if (!p->syms[i].reachable) { \
+			p->syms[i].reachable = true; \
+			work[nwork++] = i; \
+			++nreachable; \
+		} \
+	} while (0)
+
+	for (size_t i = 0; i < nroots; ++i) {
+		size_t *root = strmap_get(&p->names, roots[i]);
+		if (root) MARK(*root);
+	}
+	for (size_t i = 0; i < p->nsyms; ++i) {
+		if (p->syms[i].top.type == EXPRTOP_DECL && _prog_canonical(p, i)) MARK(i);
+	}
+
+	while (nwork) {
+		struct prog_sym *s = p->syms + work[--nwork];
+		for (size_t i = 0; i < s->nrefs; ++i) {
+			size_t *to = strmap_get(&p->names, s->refs[i]);
+			if (to) MARK(*to);
+		}
+	}
+
+#undef MARK
+
+	free(work);
+	return nreachable;
+}
+
+// Symbols of a unit are contiguous, from start to end. The file is only
+// opened if one of them has a body to load.
+static bool _prog_load_unit(struct program *p, size_t unit, size_t start, size_t end) {
+	struct prog_unit *u = p->units + unit;
+	struct _prog_reader r = {.u = u};
+
+	for (size_t i = start; i < end; ++i) {
+		struct prog_sym *s = p->syms + i;
+		if (!s->reachable || !_prog_canonical(p, i)) continue;
+
+		if (s->has_body) {
+			if (!r.f && !_prog_open(&r, u->path)) return _prog_fail(p, "cannot open unit", u->path);
+			if (fseek(r.f, u->bodies + s->body_off, SEEK_SET)) r.bad = true;
+			struct ast_expr *body = _get_body(&r);
+			if (r.bad) {
+				fclose(r.f);
+				return _prog_fail(p, "corrupt unit file", u->path);
+			}
+
+			if (s->top.type == EXPRTOP_FUNC) {
+				s->top.func.body = body;
+			} else {
+				s->top.decl.val = body;
+			}
+		}
+		p->tops[p->ntops++] = s->top;
+	}
+
+	if (r.f) fclose(r.f);
+	return true;
+}
+
+bool prog_load(struct program *p) {
+	free(p->tops);
+	p->ntops = 0;
+	p->tops = malloc(p->nsyms * sizeof *p->tops);
+
+	for (size_t i = 0; i < p->nsyms;) {
+		size_t end = i;
+		while (end < p->nsyms && p->syms[end].unit == p->syms[i].unit) ++end;
+		if (!_prog_load_unit(p, p->syms[i].unit, i, end)) return false;
+		i = end;
+	}
+	return true;
+}
+
+void prog_optimize(struct program *p, size_t nroots, const char **roots, const struct inline_opts *opts) {
+	annotate_unit(p->ntops, p->tops);
+
+	struct callgraph cg;
+	cg_build(&cg, p->ntops, p->tops);
+	inline_unit(&cg, opts);
+	cg_free(&cg);
+
+	// Edges are stale after inlining, and callees inlined everywhere are dead
+	cg_build(&cg, p->ntops, p->tops);
+	cg_mark_reachable(&cg, nroots, roots);
+	if (opts->report) cg_report(&cg, opts->report);
+
+	bool *keep = malloc(p->ntops * sizeof *keep);
+	for (size_t i = 0; i < p->ntops; ++i) {
+		struct ast_toplevel *t = p->tops + i;
+		keep[i] = cg_lookup(&cg, t->type == EXPRTOP_FUNC ? t->func.name : t->decl.name)->reachable;
+	}
+	cg_free(&cg);
+
+	size_t n = 0;
+	for (size_t i = 0; i < p->ntops; ++i) {
+		if (keep[i]) p->tops[n++] = p->tops[i];
+	}
+	p->ntops = n;
+	free(keep);
+
+	// Before strength reduction, which turns indexing into pointers of its
+	// own. Lanes are counted for SSE2, the vector size every x86-64 has.
+	struct lanes_stats lanes = {0};
+	lanes_unit(p->ntops, p->tops, LANES_SSE2, opts->report, &lanes);
+
+	struct loop_stats loops = {0};
+	loop_opt_unit(p->ntops, p->tops, &loops);
+	if (opts->report) {
+		fprintf(opts->report, "loop: %zu loops (%zu skipped), %zu hoisted, %zu reduced on %zu induction variables\n",
+			loops.nloops, loops.nskipped, loops.nhoisted, loops.nreduced, loops.nivs);
+	}
+
+	struct escape_stats stats = {0};
+	escape_unit(p->ntops, p->tops, opts->report, &stats);
+}
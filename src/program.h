@@ -0,0 +1,93 @@
+// vim: noet
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ast.h"
+#include "inline.h"
+#include "strmap.h"
+
+// Whole-program mode. Each checked unit is saved once as a unit file: a
+// summary of every toplevel up front, then their bodies. A program reads
+// the summaries of all its units, resolves names across them, and loads
+// only the bodies reachable from its roots, so that memory grows with the
+// program that is kept rather than the number of units.
+
+#define PROG_MAGIC "CECU"
+#define PROG_VERSION 1
+
+// Namespaces are flattened, as names are global anyway. Expression types
+// are not saved; they are checked again once the program is merged.
+bool prog_write_unit(FILE *f, size_t ntops, struct ast_toplevel *tops);
+
+struct prog_sym {
+	// Its signature; the function body or initializer is NULL until loaded
+	struct ast_toplevel top;
+	const char *name;
+	size_t unit;
+
+	bool has_body;
+	// Number of expression nodes in the body
+	size_t size;
+	// Every name used in the body. Locals are included, so this may name
+	// more toplevels than the body really uses.
+	size_t nrefs;
+	const char **refs;
+	uint64_t body_off;
+
+	bool reachable;
+};
+
+struct prog_unit {
+	const char *path;
+	// Every string in the unit, one after the other
+	char *strings;
+	size_t nnames;
+	const char **names;
+	// Where the bodies start in the file
+	uint64_t bodies;
+};
+
+struct program {
+	size_t nunits, units_alloc;
+	struct prog_unit *units;
+
+	size_t nsyms, syms_alloc;
+	struct prog_sym *syms;
+	// The symbol each name resolves to: its definition if there is one,
+	// otherwise its first prototype
+	struct strmap names;
+
+	// The merged unit, filled in by prog_load
+	size_t ntops;
+	struct ast_toplevel *tops;
+
+	// Why the last call failed, and the path or name concerned
+	const char *error;
+	const char *error_name;
+};
+
+void prog_init(struct program *p);
+void prog_free(struct program *p);
+
+// Reads a unit's summaries, and merges its names into the program. path
+// must outlive the program, as bodies are loaded from it later.
+bool prog_add_unit(struct program *p, const char *path);
+
+// Marks what the roots reach, by the summaries alone. Global variables are
+// always roots. Returns the number of reachable symbols.
+size_t prog_mark_reachable(struct program *p, size_t nroots, const char **roots);
+
+// Loads the bodies of reachable symbols, one unit at a time, and merges
+// them into tops in unit order
+bool prog_load(struct program *p);
+
+// Checks the merged unit, inlines across what were unit boundaries, then
+// drops toplevels that are no longer reachable from the roots.
+// Unrolling by lanes, loop optimizations and then escape analysis run last,
+// printing to the same report as inlining.
+void prog_optimize(struct program *p, size_t nroots, const char **roots, const struct inline_opts *opts);
+
+#endif
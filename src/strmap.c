@@ -0,0 +1,66 @@
+// vim: noet
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "strmap.h"
+
+static uint64_t _strhash(const char *s) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+void strmap_free(struct strmap *m) {
+	free(m->slots);
+	m->slots = NULL;
+	m->size = m->alloc = 0;
+}
+
+static size_t _strmap_find(struct strmap *m, const char *key) {
+	size_t mask = m->alloc - 1;
+	size_t i = _strhash(key) & mask;
+	while (m->slots[i].key && strcmp(m->slots[i].key, key)) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void _strmap_grow(struct strmap *m) {
+	struct strmap new = {
+		.size = m->size,
+		.alloc = m->alloc ? m->alloc * 2 : 16,
+	};
+	new.slots = calloc(new.alloc, sizeof *new.slots);
+
+	for (size_t i = 0; i < m->alloc; ++i) {
+		if (!m->slots[i].key) continue;
+		new.slots[_strmap_find(&new, m->slots[i].key)] = m->slots[i];
+	}
+
+	free(m->slots);
+	*m = new;
+}
+
+bool strmap_put(struct strmap *m, const char *key, size_t val) {
+	// Keep the load factor under 3/4
+	if (4 * (m->size + 1) > 3 * m->alloc) _strmap_grow(m);
+
+	size_t i = _strmap_find(m, key);
+	if (m->slots[i].key) return false;
+
+	m->slots[i].key = key;
+	m->slots[i].val = val;
+	++m->size;
+	return true;
+}
+
+size_t *strmap_get(struct strmap *m, const char *key) {
+	if (!m->alloc) return NULL;
+	size_t i = _strmap_find(m, key);
+	return m->slots[i].key ? &m->slots[i].val : NULL;
+}
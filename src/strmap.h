@@ -0,0 +1,27 @@
+// vim: noet
+
+#ifndef STRMAP_H
+#define STRMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Open-addressed hash map from strings to indices. Keys are not copied, so
+// they must outlive the map.
+struct strmap {
+	size_t size, alloc;
+	struct {
+		const char *key;
+		size_t val;
+	} *slots;
+};
+
+void strmap_free(struct strmap *m);
+
+// Returns false if the key is already present, leaving the old value in place
+bool strmap_put(struct strmap *m, const char *key, size_t val);
+
+// Returns NULL if the key is not present
+size_t *strmap_get(struct strmap *m, const char *key);
+
+#endif
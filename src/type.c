@@ -4,11 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ast.h"
+#include "memstats.h"
+#include "pass.h"
+#include "strmap.h"
+#include "type.h"
+#include "walk.h"
 
 // Type equality checks {{{
 
-bool vtype_eq(struct val_type *x, struct val_type *y);
-
 bool rtype_eq(struct ref_type *x, struct ref_type *y) {
 	if (!x || !y) return false;
 
@@ -112,21 +115,97 @@ struct {
 
 #define cur_func (_func_stack.funcs[_func_stack.nfuncs-1])
 
+static void _push_func(size_t nargs, void *args, struct val_type ret) {
+	if (_func_stack.nfuncs == _func_stack.alloc) {
+		size_t old = _func_stack.alloc;
+		_func_stack.alloc = old ? old * 2 : 8;
+		_func_stack.funcs = MEM_REALLOC(MEM_SCOPE, _func_stack.funcs, _func_stack.alloc * sizeof _func_stack.funcs[0]);
+		memset(_func_stack.funcs + old, 0, (_func_stack.alloc - old) * sizeof _func_stack.funcs[0]);
+	}
+	_func_stack.funcs[_func_stack.nfuncs].nargs = nargs;
+	_func_stack.funcs[_func_stack.nfuncs].args = args;
+	_func_stack.funcs[_func_stack.nfuncs].ret = ret;
+	_func_stack.funcs[_func_stack.nfuncs].nscopes = 0;
+	++_func_stack.nfuncs;
+}
 
-#define VALTYPE 0
-#define REFTYPE (1<<0)
-#define REF_MUT (1<<1)
-#define REF_VOL (1<<2)
+static void _push_scope(const char *name, struct ref_type type) {
+	if (cur_func.nscopes == cur_func.scopes_alloc) {
+		cur_func.scopes_alloc = cur_func.scopes_alloc ? cur_func.scopes_alloc * 2 : 8;
+		cur_func.scopes = MEM_REALLOC(MEM_SCOPE, cur_func.scopes, cur_func.scopes_alloc * sizeof cur_func.scopes[0]);
+	}
+	cur_func.scopes[cur_func.nscopes].name = name;
+	cur_func.scopes[cur_func.nscopes].type = type;
+	++cur_func.nscopes;
+}
 
-uint8_t annotate_type(struct ast_expr *e) {
+// Toplevel functions and variables of the unit being checked, by the same
+// qualified names as the call graph's
+struct {
+	struct strmap names;
+	size_t n, alloc;
+	struct ref_type *types;
+	char **keys;
+
+	// The toplevels of each namespace and their prefix, which ends in a dot
+	// unless it is empty. A toplevel checked on its own is found here.
+	size_t nscopes, scopes_alloc;
+	struct {
+		struct ast_toplevel *tops;
+		size_t ntops;
+		char *prefix;
+		size_t len;
+	} *scopes;
+
+	// Namespace of the toplevel being checked
+	size_t scope;
+
+	// Scratch space for qualified names, so lookups don't allocate
+	char *buf;
+	size_t buf_alloc;
+} _globals;
+
+// Looks a name up as cg_resolve does, in the current namespace and then each
+// enclosing one in turn
+static size_t *_lookup_global(const char *name) {
+	if (!_globals.nscopes) return NULL;
+	const char *prefix = _globals.scopes[_globals.scope].prefix;
+	size_t prefix_len = _globals.scopes[_globals.scope].len;
+	if (!prefix_len) return strmap_get(&_globals.names, name);
+
+	size_t name_len = strlen(name);
+	if (prefix_len + name_len + 1 > _globals.buf_alloc) {
+		while (prefix_len + name_len + 1 > _globals.buf_alloc) {
+			_globals.buf_alloc = _globals.buf_alloc ? _globals.buf_alloc * 2 : 64;
+		}
+		_globals.buf = MEM_REALLOC(MEM_NAME, _globals.buf, _globals.buf_alloc);
+	}
+	char *buf = _globals.buf;
+	memcpy(buf, prefix, prefix_len);
+	size_t *i = NULL;
+
+	// Drop one namespace at a time, down to the empty prefix
+	for (size_t len = prefix_len;;) {
+		memcpy(buf + len, name, name_len + 1);
+		i = strmap_get(&_globals.names, buf);
+		if (i || !len) break;
+		--len;
+		while (len && buf[len-1] != '.') --len;
+	}
+	return i;
+}
+
+// Annotates a single node whose children have already been annotated.
+// flags holds the tflags of each present child, in evaluation order.
+static uint8_t _annotate_node(struct ast_expr *e, uint8_t *flags) {
 	uint8_t x_tflags; // fuck C
 	switch (e->t) {
 	// EXPR_BINOP {{{
 	case EXPR_BINOP:
-		x_tflags = annotate_type(e->binop.x);
-		uint8_t y_tflags = annotate_type(e->binop.y);
+		x_tflags = flags[0];
+		uint8_t y_tflags = flags[1];
 
-		if (e->unop.t != BINOP_SEQOP) {
+		if (e->binop.t != BINOP_SEQOP) {
 			if (!vtype_eq(&e->binop.x->type, &e->binop.y->type)) {
 				// XXX error
 			}
@@ -276,7 +355,7 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_UNOP {{{
 	case EXPR_UNOP:
-		x_tflags = annotate_type(e->unop.x);
+		x_tflags = flags[0];
 
 		if (e->unop.x->type.t == TYPE_VOID) {
 			// XXX error
@@ -288,7 +367,7 @@ uint8_t annotate_type(struct ast_expr *e) {
 				// XXX error
 			}
 			e->type.t = TYPE_PTR;
-			e->type.ptr = malloc(sizeof *e->type.ptr);
+			e->type.ptr = MEM_ALLOC(MEM_TYPE + e->unop.x->type.t, sizeof *e->type.ptr);
 			e->type.ptr->mut = x_tflags & REF_MUT;
 			e->type.ptr->vol = x_tflags & REF_VOL;
 			e->type.ptr->to = e->unop.x->type;
@@ -352,13 +431,15 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_CALL {{{
 	case EXPR_CALL:
-		annotate_type(e->call.func);
 		if (e->call.func->type.t != TYPE_FUNC) {
 			// XXX error
 		}
 
-		for (size_t i = 0; i < e->call.func->type.func.nargs; ++i) {
-			annotate_type(e->call.args + i);
+		if (e->call.nargs != e->call.func->type.func.nargs) {
+			// XXX error
+		}
+
+		for (size_t i = 0; i < e->call.func->type.func.nargs && i < e->call.nargs; ++i) {
 			if (!vtype_eq(&e->call.func->type.func.args[i].to, &e->call.args[i].type)) {
 				// XXX error
 			}
@@ -369,16 +450,11 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_IF {{{
 	case EXPR_IF:
-		annotate_type(e->if_.cond);
-		annotate_type(e->if_.t);
-
 		if (e->if_.cond->type.t != TYPE_BOOL) {
 			 // XXX error
 		}
 
-		if (e->if_.f) annotate_type(e->if_.f);
-
-		if (vtype_eq(&e->if_.f->type, &e->if_.t->type)) {
+		if (e->if_.f && vtype_eq(&e->if_.f->type, &e->if_.t->type)) {
 			e->type = e->if_.t->type;
 		} else {
 			e->type.t = TYPE_VOID;
@@ -389,9 +465,7 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_WHILE {{{
 	case EXPR_WHILE:
-		annotate_type(e->while_.cond);
-		annotate_type(e->while_.body);
-		if (e->if_.cond->type.t != TYPE_BOOL) {
+		if (e->while_.cond->type.t != TYPE_BOOL) {
 			 // XXX error
 		}
 		e->type.t = TYPE_VOID;
@@ -412,8 +486,6 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_RETURN {{{
 	case EXPR_RETURN:
-		if (e->return_.val) annotate_type(e->return_.val);
-
 		struct val_type ret_type = e->return_.val ? e->return_.val->type : (struct val_type){.t=TYPE_VOID};
 
 		if (!vtype_eq(&cur_func.ret, &ret_type)) {
@@ -426,21 +498,12 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_FUNC {{{
 	case EXPR_FUNC:
-		if (_func_stack.nfuncs == _func_stack.alloc) {
-			_func_stack.alloc *= 2;
-			_func_stack.funcs = realloc(_func_stack.funcs, _func_stack.alloc * sizeof _func_stack.funcs[0]);
-		}
-		_func_stack.funcs[_func_stack.nfuncs].nargs = e->func.nargs;
-		_func_stack.funcs[_func_stack.nfuncs].args = (void *)e->func.args; // FUCK C
-		_func_stack.funcs[_func_stack.nfuncs].ret = e->func.ret;
-
-		++_func_stack.nfuncs;
-		annotate_type(e->func.body);
+		// Pushed in _annotate_pre
 		--_func_stack.nfuncs;
 
 		e->type.t = TYPE_FUNC;
 		e->type.func.nargs = e->func.nargs;
-		e->type.func.args = malloc(e->func.nargs * sizeof e->type.func.args[0]);
+		e->type.func.args = MEM_ALLOC(MEM_TYPE + TYPE_FUNC, e->func.nargs * sizeof e->type.func.args[0]);
 		for (size_t i = 0; i < e->func.nargs; ++i) {
 			e->type.func.args[i] = e->func.args[i].type;
 		}
@@ -480,7 +543,7 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_FIELD_ACCESS {{{
 	case EXPR_FIELD_ACCESS:;
-		uint8_t aggr_tflags = annotate_type(e->field_access.aggr);
+		uint8_t aggr_tflags = flags[0];
 		struct val_type aggr_type = e->field_access.aggr->type; // FIXME: newtypes
 		if (aggr_type.t != TYPE_STRUCT
 				&& aggr_type.t != TYPE_UNION) {
@@ -495,13 +558,14 @@ uint8_t annotate_type(struct ast_expr *e) {
 		}
 
 		// XXX error
+		return VALTYPE;
 	// }}}
 
 	// EXPR_LET {{{
-	case EXPR_LET:
-		annotate_type(e->let.val);
-		uint8_t body_tflags = annotate_type(e->let.body);
-		if (e->let.deferred) annotate_type(e->let.deferred);
+	case EXPR_LET:;
+		// Pushed in _annotate_child
+		--cur_func.nscopes;
+		uint8_t body_tflags = flags[1];
 
 		if (!vtype_eq(&e->let.val->type, &e->let.type.to)) {
 			// XXX error
@@ -513,9 +577,7 @@ uint8_t annotate_type(struct ast_expr *e) {
 
 	// EXPR_CAST {{{
 	case EXPR_CAST:
-		annotate_type(e->cast.val);
-		struct val_type to = e->cast.type, from = e->cast.val->type;
-		if (_cast_valid(e->cast.val->type, e->cast.type)) {
+		if (e->cast.val ? _cast_valid(e->cast.val->type, e->cast.type) : e->cast.type.t == TYPE_VOID) {
 			e->type = e->cast.type;
 		} else {
 			// XXX error
@@ -535,7 +597,8 @@ uint8_t annotate_type(struct ast_expr *e) {
 				return ret;
 			}
 		}
-		for (size_t i = 0; i < cur_func.nscopes; ++i) {
+		// Innermost binding wins
+		for (size_t i = cur_func.nscopes; i-- > 0;) {
 			if (!strcmp(cur_func.scopes[i].name, e->ident)) {
 				struct ref_type type = cur_func.scopes[i].type;
 				e->type = type.to;
@@ -545,7 +608,232 @@ uint8_t annotate_type(struct ast_expr *e) {
 				return ret;
 			}
 		}
+		size_t *global = _lookup_global(e->ident);
+		if (global) {
+			struct ref_type type = _globals.types[*global];
+			e->type = type.to;
+			uint8_t ret = REFTYPE;
+			if (type.mut) ret |= REF_MUT;
+			if (type.vol) ret |= REF_VOL;
+			return ret;
+		}
 		// XXX error
+		return VALTYPE;
 	// }}}
 	}
+	return VALTYPE;
+}
+
+// Traversal {{{
+
+// Annotation runs on an explicit stack, as sequences and generated code can
+// nest far deeper than the C stack allows
+struct {
+	struct walk_stack walk;
+
+	// tflags of annotated nodes whose parent is still pending
+	size_t n, alloc;
+	uint8_t *flags;
+} _annotate_state;
+
+static bool _annotate_pre(struct ast_expr *e, void *ctx) {
+	if (e->t == EXPR_FUNC) {
+		_push_func(e->func.nargs, e->func.args, e->func.ret);
+	}
+	return true;
+}
+
+static void _annotate_child(struct ast_expr *e, size_t i, void *ctx) {
+	// The binding is visible in the body and the deferred expression
+	if (e->t == EXPR_LET && i == 1) {
+		_push_scope(e->let.name, e->let.type);
+	}
 }
+
+static void _annotate_post(struct ast_expr *e, void *ctx) {
+	size_t nchildren = 0, n = expr_nchildren(e);
+	for (size_t i = 0; i < n; ++i) {
+		if (expr_child(e, i)) ++nchildren;
+	}
+
+	_annotate_state.n -= nchildren;
+	uint8_t tflags = _annotate_node(e, _annotate_state.flags + _annotate_state.n);
+
+	if (_annotate_state.n == _annotate_state.alloc) {
+		_annotate_state.alloc = _annotate_state.alloc ? _annotate_state.alloc * 2 : 64;
+		_annotate_state.flags = MEM_REALLOC(MEM_SCOPE, _annotate_state.flags, _annotate_state.alloc);
+	}
+	_annotate_state.flags[_annotate_state.n++] = tflags;
+}
+
+uint8_t annotate_type(struct ast_expr *e) {
+	static const struct walk_ops ops = {
+		.pre = _annotate_pre,
+		.child = _annotate_child,
+		.post = _annotate_post,
+	};
+
+	if (!e) return VALTYPE;
+
+	size_t base = _annotate_state.n;
+	walk_expr(&_annotate_state.walk, e, &ops, NULL);
+	_annotate_state.n = base;
+	return _annotate_state.flags[base];
+}
+
+// }}}
+
+// Toplevels {{{
+
+// The name is freed again if it is already declared
+static void _add_global(char *name, struct ref_type type) {
+	if (_globals.n == _globals.alloc) {
+		_globals.alloc = _globals.alloc ? _globals.alloc * 2 : 64;
+		_globals.types = MEM_REALLOC(MEM_SCOPE, _globals.types, _globals.alloc * sizeof _globals.types[0]);
+		_globals.keys = MEM_REALLOC(MEM_SCOPE, _globals.keys, _globals.alloc * sizeof _globals.keys[0]);
+	}
+	if (!strmap_put(&_globals.names, name, _globals.n)) {
+		// Redeclaration; prototypes and definitions share a name
+		// XXX error if the types differ
+		MEM_FREE(name);
+		return;
+	}
+	_globals.keys[_globals.n] = name;
+	_globals.types[_globals.n++] = type;
+}
+
+static char *_qualify(const char *prefix, size_t prefix_len, const char *name, const char *suffix) {
+	size_t name_len = strlen(name), suffix_len = strlen(suffix);
+	char *s = MEM_ALLOC(MEM_NAME, prefix_len + name_len + suffix_len + 1);
+	memcpy(s, prefix, prefix_len);
+	memcpy(s + prefix_len, name, name_len);
+	memcpy(s + prefix_len + name_len, suffix, suffix_len + 1);
+	return s;
+}
+
+// Takes ownership of prefix
+static void _declare_toplevels(char *prefix, size_t n, struct ast_toplevel *tops) {
+	if (_globals.nscopes == _globals.scopes_alloc) {
+		_globals.scopes_alloc = _globals.scopes_alloc ? _globals.scopes_alloc * 2 : 8;
+		_globals.scopes = MEM_REALLOC(MEM_SCOPE, _globals.scopes, _globals.scopes_alloc * sizeof _globals.scopes[0]);
+	}
+	size_t len = strlen(prefix);
+	_globals.scopes[_globals.nscopes].tops = tops;
+	_globals.scopes[_globals.nscopes].ntops = n;
+	_globals.scopes[_globals.nscopes].prefix = prefix;
+	_globals.scopes[_globals.nscopes].len = len;
+	++_globals.nscopes;
+
+	for (size_t i = 0; i < n; ++i) {
+		struct ast_toplevel *t = tops + i;
+		switch (t->type) {
+		case EXPRTOP_FUNC:;
+			struct ref_type type = {.vol = false, .mut = false};
+			type.to.t = TYPE_FUNC;
+			type.to.func.nargs = t->func.nargs;
+			type.to.func.args = MEM_ALLOC(MEM_TYPE + TYPE_FUNC, t->func.nargs * sizeof type.to.func.args[0]);
+			for (size_t j = 0; j < t->func.nargs; ++j) {
+				type.to.func.args[j] = t->func.args[j].type;
+			}
+			type.to.func.ret_type = &t->func.ret;
+			_add_global(_qualify(prefix, len, t->func.name, ""), type);
+			break;
+
+		case EXPRTOP_DECL:
+			_add_global(_qualify(prefix, len, t->decl.name, ""), t->decl.type);
+			break;
+
+		case EXPRTOP_NAMESPACE:
+			if (t->namespace.name) {
+				_declare_toplevels(_qualify(prefix, len, t->namespace.name, "."), t->namespace.size, t->namespace.body);
+			} else {
+				_declare_toplevels(_qualify(prefix, len, "", ""), t->namespace.size, t->namespace.body);
+			}
+			break;
+		}
+	}
+}
+
+// The namespace whose toplevels include t, or the outermost one if t was
+// not declared
+static size_t _scope_of(struct ast_toplevel *t) {
+	for (size_t i = 0; i < _globals.nscopes; ++i) {
+		struct ast_toplevel *tops = _globals.scopes[i].tops;
+		if (t >= tops && t < tops + _globals.scopes[i].ntops) return i;
+	}
+	return 0;
+}
+
+static void _type_top_pre(struct ast_toplevel *t, void *ctx) {
+	_globals.scope = _scope_of(t);
+	switch (t->type) {
+	case EXPRTOP_FUNC:
+		_push_func(t->func.nargs, t->func.args, t->func.ret);
+		break;
+	case EXPRTOP_DECL:
+		// Initializers are checked in a void function of their own
+		_push_func(0, NULL, (struct val_type){.t=TYPE_VOID});
+		break;
+	case EXPRTOP_NAMESPACE:
+		break;
+	}
+}
+
+static void _type_top_post(struct ast_toplevel *t, void *ctx) {
+	switch (t->type) {
+	case EXPRTOP_FUNC:
+		--_func_stack.nfuncs;
+		break;
+	case EXPRTOP_DECL:
+		--_func_stack.nfuncs;
+		if (t->decl.val && !vtype_eq(&t->decl.val->type, &t->decl.type.to)) {
+			// XXX error
+		}
+		break;
+	case EXPRTOP_NAMESPACE:
+		break;
+	}
+	_annotate_state.n = 0;
+}
+
+static void _type_begin(size_t ntops, struct ast_toplevel *tops, void *ctx) {
+	strmap_free(&_globals.names);
+	for (size_t i = 0; i < _globals.n; ++i) MEM_FREE(_globals.keys[i]);
+	for (size_t i = 0; i < _globals.nscopes; ++i) MEM_FREE(_globals.scopes[i].prefix);
+	_globals.n = _globals.nscopes = 0;
+	_declare_toplevels(_qualify("", 0, "", ""), ntops, tops);
+}
+
+struct pass type_pass = {
+	.name = "type",
+	.local = true,
+	.begin = _type_begin,
+	.top_pre = _type_top_pre,
+	.top_post = _type_top_post,
+	.pre = _annotate_pre,
+	.child = _annotate_child,
+	.post = _annotate_post,
+};
+
+void annotate_toplevel(struct ast_toplevel *t) {
+	if (t->type == EXPRTOP_NAMESPACE) {
+		for (size_t i = 0; i < t->namespace.size; ++i) {
+			annotate_toplevel(t->namespace.body + i);
+		}
+		return;
+	}
+
+	_type_top_pre(t, NULL);
+	annotate_type(t->type == EXPRTOP_FUNC ? t->func.body : t->decl.val);
+	_type_top_post(t, NULL);
+}
+
+void annotate_unit(size_t n, struct ast_toplevel *tops) {
+	struct pass_manager pm = {0};
+	pm_add(&pm, &type_pass);
+	pm_schedule(&pm);
+	pm_run(&pm, n, tops);
+	pm_free(&pm);
+}
+
+// }}}
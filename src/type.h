@@ -0,0 +1,29 @@
+// vim: noet
+
+#ifndef TYPE_H
+#define TYPE_H
+
+#include <stdint.h>
+#include "ast.h"
+#include "pass.h"
+
+// Flags returned by annotate_type
+#define VALTYPE 0
+#define REFTYPE (1<<0)
+#define REF_MUT (1<<1)
+#define REF_VOL (1<<2)
+
+bool vtype_eq(struct val_type *x, struct val_type *y);
+bool rtype_eq(struct ref_type *x, struct ref_type *y);
+
+uint8_t annotate_type(struct ast_expr *e);
+void annotate_toplevel(struct ast_toplevel *t);
+
+// Declares every toplevel in the unit, then checks them all. Runs type_pass
+// through a pass manager of its own.
+void annotate_unit(size_t n, struct ast_toplevel *tops);
+
+// The checker as a pass, for other passes to depend on
+extern struct pass type_pass;
+
+#endif
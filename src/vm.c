@@ -0,0 +1,394 @@
+// vim: noet
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+
+const char *const vm_op_names[VM_NOPS] = {
+#define X(op) #op,
+	VM_OPS(X)
+#undef X
+};
+
+// Layout {{{
+
+size_t vm_alignof(const struct val_type *t) {
+	switch (t->t) {
+	case TYPE_INT:
+		return (t->int_ & 0xff) / 8;
+	case TYPE_FLOAT:
+		switch (t->float_) {
+		case F_32: return _Alignof(float);
+		case F_64: return _Alignof(double);
+		case F_80: return _Alignof(long double);
+		}
+		return 1;
+	case TYPE_PTR:
+	case TYPE_FUNC:
+		return sizeof (uint64_t);
+	case TYPE_STRUCT:
+	case TYPE_UNION:;
+		size_t align = 1;
+		for (size_t i = 0; i < t->composite.nfields; ++i) {
+			size_t a = vm_alignof(t->composite.fields[i].type);
+			if (a > align) align = a;
+		}
+		return align;
+	default:
+		return 1;
+	}
+}
+
+size_t vm_sizeof(const struct val_type *t) {
+	switch (t->t) {
+	case TYPE_INT:
+		return (t->int_ & 0xff) / 8;
+	case TYPE_FLOAT:
+		switch (t->float_) {
+		case F_32: return sizeof (float);
+		case F_64: return sizeof (double);
+		case F_80: return sizeof (long double);
+		}
+		return 0;
+	case TYPE_BOOL:
+		return 1;
+	case TYPE_PTR:
+	case TYPE_FUNC:
+		return sizeof (uint64_t);
+	case TYPE_STRUCT:
+	case TYPE_UNION:;
+		// C layout: fields in order, each at its natural alignment
+		size_t size = 0;
+		for (size_t i = 0; i < t->composite.nfields; ++i) {
+			const struct val_type *ft = t->composite.fields[i].type;
+			size_t fsize = vm_sizeof(ft), falign = vm_alignof(ft);
+			if (t->t == TYPE_UNION) {
+				if (fsize > size) size = fsize;
+			} else {
+				size = (size + falign - 1) / falign * falign + fsize;
+			}
+		}
+		size_t align = vm_alignof(t);
+		return (size + align - 1) / align * align;
+	default:
+		return 0;
+	}
+}
+
+// }}}
+
+// Modules {{{
+
+void vm_module_free(struct vm_module *m) {
+	for (size_t i = 0; i < m->nfuncs; ++i) {
+		free(m->funcs[i]->code);
+		free(m->funcs[i]->consts);
+		free(m->funcs[i]->arg_types);
+		free(m->funcs[i]->call_types);
+		free(m->funcs[i]->relocs);
+		free(m->funcs[i]);
+	}
+	free(m->funcs);
+	free(m->globals);
+	strmap_free(&m->names);
+	free(m->globals_mem);
+	*m = (struct vm_module){0};
+}
+
+struct vm_func *vm_lookup(struct vm_module *m, const char *name) {
+	size_t *i = strmap_get(&m->names, name);
+	return i ? m->globals[*i].func : NULL;
+}
+
+void vm_disasm(struct vm_func *f, FILE *out) {
+	fprintf(out, "%s: %zu args, %zu registers, %zu bytes of memory\n", f->name, f->nargs, f->nregs, f->memsize);
+	for (size_t pc = 0; pc < f->ncode; ++pc) {
+		uint32_t i = f->code[pc];
+		fprintf(out, "%5zu  %-10s ", pc, vm_op_names[VM_OP(i)]);
+		switch (VM_OP(i)) {
+		case VM_LOADK:
+		case VM_ADDR:
+			fprintf(out, "r%u, k%u (0x%" PRIx64 ")\n", VM_A(i), VM_BX(i), f->consts[VM_BX(i)].u);
+			break;
+		case VM_LOADI:
+			fprintf(out, "r%u, %d\n", VM_A(i), VM_SBX(i));
+			break;
+		case VM_JMP:
+			fprintf(out, "%zd\n", (ptrdiff_t)pc + 1 + VM_SAX(i));
+			break;
+		case VM_JT:
+		case VM_JF:
+			fprintf(out, "r%u, %zd\n", VM_A(i), (ptrdiff_t)pc + 1 + VM_SBX(i));
+			break;
+		case VM_COPY:
+			fprintf(out, "r%u, r%u, %u\n", VM_A(i), VM_B(i), f->code[++pc]);
+			break;
+		case VM_RET:
+			fprintf(out, "r%u\n", VM_A(i));
+			break;
+		case VM_RET0:
+			fputc('\n', out);
+			break;
+		default:
+			// Loads and stores take an offset, and calls a count
+			if (VM_OP(i) == VM_CALL || (VM_OP(i) >= VM_LD8U && VM_OP(i) <= VM_STF80)) {
+				fprintf(out, "r%u, r%u, %u\n", VM_A(i), VM_B(i), VM_C(i));
+			} else {
+				fprintf(out, "r%u, r%u, r%u\n", VM_A(i), VM_B(i), VM_C(i));
+			}
+			break;
+		}
+	}
+}
+
+// }}}
+
+// Interpreter {{{
+
+const char *vm_status_str(enum vm_status status) {
+	switch (status) {
+	case VM_OK: return "ok";
+	case VM_ERR_DIV_ZERO: return "division by zero";
+	case VM_ERR_NULL_CALL: return "call through null function";
+	case VM_ERR_STACK: return "stack overflow";
+	}
+	return "unknown error";
+}
+
+void vm_init(struct vm *vm, size_t nregs, size_t memsize, size_t max_frames) {
+	vm->nregs = nregs ? nregs : VM_DEFAULT_REGS;
+	vm->memsize = memsize ? memsize : VM_DEFAULT_MEM;
+	vm->max_frames = max_frames ? max_frames : VM_DEFAULT_FRAMES;
+	vm->regs = calloc(vm->nregs, sizeof *vm->regs);
+	vm->mem = aligned_alloc(16, (vm->memsize + 15) & ~(size_t)15);
+	vm->frames = malloc(vm->max_frames * sizeof *vm->frames);
+}
+
+void vm_free(struct vm *vm) {
+	free(vm->regs);
+	free(vm->mem);
+	free(vm->frames);
+	*vm = (struct vm){0};
+}
+
+#define FRAME_MEM(f) (((f)->memsize + 15) & ~(size_t)15)
+
+#define LOAD(ctype, member) do { \
+	ctype v; \
+	memcpy(&v, (void *)(uintptr_t)(R(B).u + C), sizeof v); \
+	R(A).member = v; \
+} while (0)
+
+#define STORE(ctype, member) do { \
+	ctype v = R(B).member; \
+	memcpy((void *)(uintptr_t)(R(A).u + C), &v, sizeof v); \
+} while (0)
+
+// Float ops for one type: F is the opcode suffix, f the union member
+#define FLOAT_OPS(F, f, fmod_) \
+	CASE(ADD_##F) R(A).f = R(B).f + R(C).f; NEXT; \
+	CASE(SUB_##F) R(A).f = R(B).f - R(C).f; NEXT; \
+	CASE(MUL_##F) R(A).f = R(B).f * R(C).f; NEXT; \
+	CASE(DIV_##F) R(A).f = R(B).f / R(C).f; NEXT; \
+	CASE(MOD_##F) R(A).f = fmod_(R(B).f, R(C).f); NEXT; \
+	CASE(NEG_##F) R(A).f = -R(B).f; NEXT; \
+	CASE(EQ_##F) R(A).u = R(B).f == R(C).f; NEXT; \
+	CASE(LT_##F) R(A).u = R(B).f < R(C).f; NEXT; \
+	CASE(LE_##F) R(A).u = R(B).f <= R(C).f; NEXT; \
+	CASE(TOBOOL_##F) R(A).u = R(B).f != 0; NEXT;
+
+enum vm_status vm_call(struct vm *vm, struct vm_func *f, size_t nargs, const union vm_value *args, union vm_value *ret) {
+	if (f->nregs > vm->nregs || FRAME_MEM(f) > vm->memsize) return VM_ERR_STACK;
+
+	struct vm_func *fn = f;
+	union vm_value *regs = vm->regs;
+	uint8_t *mem = vm->mem;
+	const uint32_t *ip = fn->code;
+	const union vm_value *k = fn->consts;
+	size_t nframes = 0;
+	enum vm_status status = VM_OK;
+	uint32_t i;
+
+	if (nargs) memcpy(regs, args, nargs * sizeof *regs);
+
+#define R(r) regs[r]
+#define A VM_A(i)
+#define B VM_B(i)
+#define C VM_C(i)
+
+#ifdef __GNUC__
+	// Each handler jumps straight to the next, which predicts far better
+	// than a shared switch
+	static const void *const labels[VM_NOPS] = {
+#define X(op) &&op_##op,
+		VM_OPS(X)
+#undef X
+	};
+#define CASE(op) op_##op:
+#define NEXT goto *labels[VM_OP(i = *ip++)]
+	NEXT;
+#else
+#define CASE(op) case VM_##op:
+#define NEXT goto dispatch
+dispatch:
+	switch (VM_OP(i = *ip++)) {
+#endif
+
+	CASE(MOV) R(A) = R(B); NEXT;
+	CASE(LOADK) R(A) = k[VM_BX(i)]; NEXT;
+	CASE(LOADI) R(A).i = VM_SBX(i); NEXT;
+	CASE(ADDR) R(A).u = (uintptr_t)mem + k[VM_BX(i)].u; NEXT;
+
+	CASE(ADD) R(A).u = R(B).u + R(C).u; NEXT;
+	CASE(SUB) R(A).u = R(B).u - R(C).u; NEXT;
+	CASE(MUL) R(A).u = R(B).u * R(C).u; NEXT;
+	CASE(DIVS)
+		if (!R(C).i) goto div_zero;
+		// INT64_MIN / -1 overflows; wrap like the other ops
+		R(A).i = R(C).i == -1 ? (int64_t)-R(B).u : R(B).i / R(C).i;
+		NEXT;
+	CASE(DIVU)
+		if (!R(C).u) goto div_zero;
+		R(A).u = R(B).u / R(C).u;
+		NEXT;
+	CASE(MODS)
+		if (!R(C).i) goto div_zero;
+		R(A).i = R(C).i == -1 ? 0 : R(B).i % R(C).i;
+		NEXT;
+	CASE(MODU)
+		if (!R(C).u) goto div_zero;
+		R(A).u = R(B).u % R(C).u;
+		NEXT;
+	CASE(AND) R(A).u = R(B).u & R(C).u; NEXT;
+	CASE(OR) R(A).u = R(B).u | R(C).u; NEXT;
+	CASE(XOR) R(A).u = R(B).u ^ R(C).u; NEXT;
+	// Shifting by the width or more shifts everything out
+	CASE(SHL) R(A).u = R(C).u >= 64 ? 0 : R(B).u << R(C).u; NEXT;
+	CASE(SHRS) R(A).i = R(C).u >= 64 ? (R(B).i < 0 ? -1 : 0) : R(B).i >> R(C).u; NEXT;
+	CASE(SHRU) R(A).u = R(C).u >= 64 ? 0 : R(B).u >> R(C).u; NEXT;
+	CASE(NEG) R(A).u = -R(B).u; NEXT;
+	CASE(NOT) R(A).u = ~R(B).u; NEXT;
+	CASE(LNOT) R(A).u = !R(B).u; NEXT;
+
+	CASE(SEXT8) R(A).i = (int8_t)R(B).u; NEXT;
+	CASE(SEXT16) R(A).i = (int16_t)R(B).u; NEXT;
+	CASE(SEXT32) R(A).i = (int32_t)R(B).u; NEXT;
+	CASE(ZEXT8) R(A).u = (uint8_t)R(B).u; NEXT;
+	CASE(ZEXT16) R(A).u = (uint16_t)R(B).u; NEXT;
+	CASE(ZEXT32) R(A).u = (uint32_t)R(B).u; NEXT;
+	CASE(TOBOOL) R(A).u = R(B).u != 0; NEXT;
+
+	CASE(EQ) R(A).u = R(B).u == R(C).u; NEXT;
+	CASE(LTS) R(A).u = R(B).i < R(C).i; NEXT;
+	CASE(LTU) R(A).u = R(B).u < R(C).u; NEXT;
+	CASE(LES) R(A).u = R(B).i <= R(C).i; NEXT;
+	CASE(LEU) R(A).u = R(B).u <= R(C).u; NEXT;
+
+	FLOAT_OPS(F32, f32, fmodf)
+	FLOAT_OPS(F64, f64, fmod)
+	FLOAT_OPS(F80, f80, fmodl)
+
+	CASE(F32_F64) R(A).f64 = R(B).f32; NEXT;
+	CASE(F32_F80) R(A).f80 = R(B).f32; NEXT;
+	CASE(F64_F32) R(A).f32 = R(B).f64; NEXT;
+	CASE(F64_F80) R(A).f80 = R(B).f64; NEXT;
+	CASE(F80_F32) R(A).f32 = R(B).f80; NEXT;
+	CASE(F80_F64) R(A).f64 = R(B).f80; NEXT;
+
+	CASE(LD8U) LOAD(uint8_t, u); NEXT;
+	CASE(LD8S) LOAD(int8_t, i); NEXT;
+	CASE(LD16U) LOAD(uint16_t, u); NEXT;
+	CASE(LD16S) LOAD(int16_t, i); NEXT;
+	CASE(LD32U) LOAD(uint32_t, u); NEXT;
+	CASE(LD32S) LOAD(int32_t, i); NEXT;
+	CASE(LD64) LOAD(uint64_t, u); NEXT;
+	CASE(LDF32) LOAD(float, f32); NEXT;
+	CASE(LDF64) LOAD(double, f64); NEXT;
+	CASE(LDF80) LOAD(long double, f80); NEXT;
+
+	CASE(ST8) STORE(uint8_t, u); NEXT;
+	CASE(ST16) STORE(uint16_t, u); NEXT;
+	CASE(ST32) STORE(uint32_t, u); NEXT;
+	CASE(ST64) STORE(uint64_t, u); NEXT;
+	CASE(STF32) STORE(float, f32); NEXT;
+	CASE(STF64) STORE(double, f64); NEXT;
+	CASE(STF80) STORE(long double, f80); NEXT;
+
+	CASE(COPY)
+		memmove((void *)(uintptr_t)R(A).u, (void *)(uintptr_t)R(B).u, *ip++);
+		NEXT;
+
+	CASE(JMP) ip += VM_SAX(i); NEXT;
+	CASE(JT) if (R(A).u) ip += VM_SBX(i); NEXT;
+	CASE(JF) if (!R(A).u) ip += VM_SBX(i); NEXT;
+
+	CASE(CALL) {
+		struct vm_func *callee = (struct vm_func *)(uintptr_t)R(B).u;
+		if (!callee) {
+			status = VM_ERR_NULL_CALL;
+			goto done;
+		}
+
+		// Arguments are already in place as the callee's first registers
+		union vm_value *callee_regs = regs + B + 1;
+		uint8_t *callee_mem = mem + FRAME_MEM(fn);
+		if (nframes == vm->max_frames
+				|| callee_regs + callee->nregs > vm->regs + vm->nregs
+				|| callee_mem + FRAME_MEM(callee) > vm->mem + vm->memsize) {
+			status = VM_ERR_STACK;
+			goto done;
+		}
+
+		vm->frames[nframes++] = (struct vm_frame){
+			.func = fn,
+			.ip = ip,
+			.regs = regs,
+			.mem = mem,
+			.ret = A,
+		};
+		fn = callee;
+		regs = callee_regs;
+		mem = callee_mem;
+		ip = fn->code;
+		k = fn->consts;
+		NEXT;
+	}
+
+	CASE(RET)
+	CASE(RET0) {
+		union vm_value v = R(A);
+		if (!nframes) {
+			if (ret && VM_OP(i) == VM_RET) *ret = v;
+			goto done;
+		}
+
+		struct vm_frame *frame = vm->frames + --nframes;
+		fn = frame->func;
+		regs = frame->regs;
+		mem = frame->mem;
+		ip = frame->ip;
+		k = fn->consts;
+		if (VM_OP(i) == VM_RET) regs[frame->ret] = v;
+		NEXT;
+	}
+
+#ifndef __GNUC__
+	}
+#endif
+
+#undef CASE
+#undef NEXT
+#undef R
+#undef A
+#undef B
+#undef C
+
+div_zero:
+	status = VM_ERR_DIV_ZERO;
+done:
+	return status;
+}
+
+// }}}
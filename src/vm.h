@@ -0,0 +1,203 @@
+// vim: noet
+
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ast.h"
+#include "strmap.h"
+
+// Instructions are 32 bits wide: an 8-bit opcode followed by either three
+// 8-bit operands a, b and c, an 8-bit a and 16-bit bx, or a 24-bit ax.
+// Register operands index the current frame. Jump offsets are signed and
+// relative to the next instruction.
+#define VM_OPS(X) \
+	/* a = b; a = consts[bx]; a = sign-extended bx */ \
+	X(MOV) X(LOADK) X(LOADI) \
+	/* a = frame memory + consts[bx] */ \
+	X(ADDR) \
+	/* a = b op c on 64-bit integers */ \
+	X(ADD) X(SUB) X(MUL) X(DIVS) X(DIVU) X(MODS) X(MODU) \
+	X(AND) X(OR) X(XOR) X(SHL) X(SHRS) X(SHRU) \
+	/* a = op b */ \
+	X(NEG) X(NOT) X(LNOT) \
+	/* a = b truncated and extended from a narrower integer type */ \
+	X(SEXT8) X(SEXT16) X(SEXT32) X(ZEXT8) X(ZEXT16) X(ZEXT32) \
+	/* a = b != 0 */ \
+	X(TOBOOL) \
+	/* a = b op c, giving a bool */ \
+	X(EQ) X(LTS) X(LTU) X(LES) X(LEU) \
+	/* Floating point versions of the above */ \
+	X(ADD_F32) X(SUB_F32) X(MUL_F32) X(DIV_F32) X(MOD_F32) X(NEG_F32) \
+	X(EQ_F32) X(LT_F32) X(LE_F32) X(TOBOOL_F32) \
+	X(ADD_F64) X(SUB_F64) X(MUL_F64) X(DIV_F64) X(MOD_F64) X(NEG_F64) \
+	X(EQ_F64) X(LT_F64) X(LE_F64) X(TOBOOL_F64) \
+	X(ADD_F80) X(SUB_F80) X(MUL_F80) X(DIV_F80) X(MOD_F80) X(NEG_F80) \
+	X(EQ_F80) X(LT_F80) X(LE_F80) X(TOBOOL_F80) \
+	/* a = b converted between floating point types */ \
+	X(F32_F64) X(F32_F80) X(F64_F32) X(F64_F80) X(F80_F32) X(F80_F64) \
+	/* a = *(b + c) */ \
+	X(LD8U) X(LD8S) X(LD16U) X(LD16S) X(LD32U) X(LD32S) X(LD64) \
+	X(LDF32) X(LDF64) X(LDF80) \
+	/* *(a + c) = b */ \
+	X(ST8) X(ST16) X(ST32) X(ST64) X(STF32) X(STF64) X(STF80) \
+	/* Copy the number of bytes in the next word from b to a */ \
+	X(COPY) \
+	/* Jump by ax; by bx if a is true; by bx if a is false */ \
+	X(JMP) X(JT) X(JF) \
+	/* a = b(b+1, ..., b+c) */ \
+	X(CALL) \
+	/* Return a; return nothing */ \
+	X(RET) X(RET0)
+
+enum vm_op {
+#define X(op) VM_##op,
+	VM_OPS(X)
+#undef X
+	VM_NOPS,
+};
+
+extern const char *const vm_op_names[VM_NOPS];
+
+#define VM_OP(i) ((i) & 0xff)
+#define VM_A(i) ((i) >> 8 & 0xff)
+#define VM_B(i) ((i) >> 16 & 0xff)
+#define VM_C(i) ((i) >> 24)
+#define VM_BX(i) ((i) >> 16)
+#define VM_SBX(i) ((int32_t)(i) >> 16)
+#define VM_SAX(i) ((int32_t)(i) >> 8)
+
+#define VM_ABC(op, a, b, c) ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(b) << 16 | (uint32_t)(c) << 24)
+#define VM_ABX(op, a, bx) ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(uint16_t)(bx) << 16)
+#define VM_AX(op, ax) ((uint32_t)(op) | (uint32_t)(ax) << 8)
+
+// Integers are kept sign- or zero-extended to 64 bits according to their
+// type. Booleans are 0 or 1. Pointers and functions are addresses in u.
+// Aggregates live in memory and are represented by their address.
+union vm_value {
+	uint64_t u;
+	int64_t i;
+	float f32;
+	double f64;
+	long double f80;
+};
+
+// Marks a constant as an address, for backends that cannot use the VM's own
+// pointers. global indexes the module's globals: its storage, or its
+// function if it has none. It is SIZE_MAX for function literals.
+struct vm_reloc {
+	uint16_t konst;
+	size_t global;
+	struct vm_func *func;
+};
+
+struct vm_func {
+	const char *name;
+	size_t nargs;
+	// Registers used, including the arguments
+	size_t nregs;
+	// Frame memory, for aggregates and bindings whose address is taken
+	size_t memsize;
+
+	size_t ncode, code_alloc;
+	uint32_t *code;
+
+	size_t nconsts, consts_alloc;
+	union vm_value *consts;
+
+	// Types for native backends, which the VM itself does without
+	struct val_type *arg_types;
+	struct val_type ret_type;
+	// The callee type of each CALL, in order
+	size_t ncalls, calls_alloc;
+	struct val_type *call_types;
+	size_t nrelocs, relocs_alloc;
+	struct vm_reloc *relocs;
+};
+
+struct vm_global {
+	const char *name;
+	struct val_type type;
+	// Toplevel functions have no storage, and an offset of SIZE_MAX. func
+	// is NULL for prototypes that are never defined.
+	struct vm_func *func;
+	size_t offset;
+};
+
+struct vm_module {
+	size_t nfuncs, funcs_alloc;
+	struct vm_func **funcs;
+
+	size_t nglobals, globals_alloc;
+	struct vm_global *globals;
+	struct strmap names;
+
+	// Storage for toplevel variables, filled in by running init
+	size_t globals_size;
+	uint8_t *globals_mem;
+	struct vm_func *init;
+
+	// Why compilation failed, or NULL
+	const char *error;
+};
+
+// Compiles a unit checked with annotate_unit. On failure, error is set and
+// the module must still be freed.
+//
+// Register operands are 8 bits wide and nothing is spilled to memory, so a
+// function whose arguments, live bindings and temporaries need more than 256
+// registers at once fails with "too many registers". Functions and calls
+// take at most 255 arguments, failing with "too many arguments", and a
+// function has at most 65536 constants.
+bool vm_compile_unit(struct vm_module *m, size_t ntops, struct ast_toplevel *tops);
+// The same, compiling functions on up to jobs threads. The module does not
+// depend on the number of threads.
+bool vm_compile_unit_jobs(struct vm_module *m, size_t ntops, struct ast_toplevel *tops, size_t jobs);
+void vm_module_free(struct vm_module *m);
+struct vm_func *vm_lookup(struct vm_module *m, const char *name);
+void vm_disasm(struct vm_func *f, FILE *out);
+
+size_t vm_sizeof(const struct val_type *t);
+size_t vm_alignof(const struct val_type *t);
+
+enum vm_status {
+	VM_OK,
+	VM_ERR_DIV_ZERO,
+	VM_ERR_NULL_CALL,
+	VM_ERR_STACK,
+};
+
+const char *vm_status_str(enum vm_status status);
+
+struct vm_frame {
+	struct vm_func *func;
+	const uint32_t *ip;
+	union vm_value *regs;
+	uint8_t *mem;
+	uint8_t ret;
+};
+
+struct vm {
+	size_t nregs;
+	union vm_value *regs;
+	size_t memsize;
+	uint8_t *mem;
+	size_t max_frames;
+	struct vm_frame *frames;
+};
+
+#define VM_DEFAULT_REGS 65536
+#define VM_DEFAULT_MEM (1 << 20)
+#define VM_DEFAULT_FRAMES 4096
+
+// Zero sizes take the defaults above
+void vm_init(struct vm *vm, size_t nregs, size_t memsize, size_t max_frames);
+void vm_free(struct vm *vm);
+
+// Runs f to completion. Aggregate arguments are passed by address. An
+// aggregate result points into the VM's memory, and is only valid until
+// the next call. Run a module's init before anything else in it.
+enum vm_status vm_call(struct vm *vm, struct vm_func *f, size_t nargs, const union vm_value *args, union vm_value *ret);
+
+#endif
@@ -0,0 +1,1392 @@
+// vim: noet
+
+#include <float.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "walk.h"
+
+struct _vm_local {
+	const char *name;
+	struct val_type type;
+	// Bindings in memory keep their address in reg
+	bool mem;
+	uint8_t reg;
+};
+
+// Lets and loops that break, continue and return have to leave
+struct _vm_block {
+	bool loop;
+
+	// Lets: what to run on the way out, and the locals in scope for it
+	struct ast_expr *deferred;
+	size_t nlocals;
+
+	// Loops: where continue goes, and the jumps out to patch
+	size_t start;
+	size_t nbreaks, breaks_alloc;
+	size_t *breaks;
+};
+
+// A function waiting to be compiled
+struct _vm_pending {
+	struct vm_func *f;
+	size_t nargs;
+	struct {
+		const char *name;
+		struct ref_type type;
+	} *args;
+	struct val_type ret;
+	struct ast_expr *body;
+};
+
+// Workers read the module's globals, but never change it. Everything they
+// produce stays here until it's stitched in.
+struct _vm_gen {
+	struct vm_module *m;
+	struct vm_func *f;
+	const char *error;
+
+	// Function literals, in the order they were found
+	size_t nfuncs, funcs_alloc;
+	struct vm_func **funcs;
+
+	// Registers are allocated like a stack
+	size_t top;
+
+	size_t nlocals, locals_alloc;
+	struct _vm_local *locals;
+
+	size_t nblocks, blocks_alloc;
+	struct _vm_block *blocks;
+
+	// Names in the current function that have their address taken
+	struct strmap addr_taken;
+	struct walk_stack walk;
+
+	size_t npending, pending_alloc;
+	struct _vm_pending *pending;
+};
+
+// An assignable location: a register, or memory at reg + off
+struct _vm_lval {
+	bool mem;
+	uint8_t reg, off;
+};
+
+static void _expr(struct _vm_gen *g, struct ast_expr *e, uint8_t dst);
+static uint8_t _operand(struct _vm_gen *g, struct ast_expr *e);
+
+// Helpers {{{
+
+static void _fail(struct _vm_gen *g, const char *msg) {
+	if (!g->error) g->error = msg;
+}
+
+static size_t _emit(struct _vm_gen *g, uint32_t insn) {
+	struct vm_func *f = g->f;
+	if (f->ncode == f->code_alloc) {
+		f->code_alloc = f->code_alloc ? f->code_alloc * 2 : 64;
+		f->code = realloc(f->code, f->code_alloc * sizeof *f->code);
+	}
+	f->code[f->ncode] = insn;
+	return f->ncode++;
+}
+
+// Points the jump at `at` to target
+static void _patch(struct _vm_gen *g, size_t at, size_t target) {
+	uint32_t *insn = g->f->code + at;
+	ptrdiff_t off = (ptrdiff_t)target - (ptrdiff_t)(at + 1);
+	if (VM_OP(*insn) == VM_JMP) {
+		if (off < -(1 << 23) || off >= 1 << 23) _fail(g, "function too large");
+		*insn = VM_AX(VM_JMP, off);
+	} else {
+		if (off < INT16_MIN || off > INT16_MAX) _fail(g, "function too large");
+		*insn = VM_ABX(VM_OP(*insn), VM_A(*insn), off);
+	}
+}
+
+static uint8_t _reg(struct _vm_gen *g) {
+	if (g->top > UINT8_MAX) {
+		_fail(g, "too many registers");
+		return UINT8_MAX;
+	}
+	if (g->top + 1 > g->f->nregs) g->f->nregs = g->top + 1;
+	return g->top++;
+}
+
+static bool _is_addr(struct vm_func *f, size_t konst) {
+	for (size_t i = 0; i < f->nrelocs; ++i) {
+		if (f->relocs[i].konst == konst) return true;
+	}
+	return false;
+}
+
+// Bytes of a constant that a float of the given type is read from. An x87
+// long double leaves the rest of its storage as padding, whose bytes are
+// unspecified even after the union is zeroed.
+static size_t _float_bytes(enum float_type t) {
+	switch (t) {
+	case F_32: return sizeof (float);
+	case F_64: return sizeof (double);
+	case F_80: return LDBL_MANT_DIG == 64 ? 10 : sizeof (long double);
+	}
+	return 0;
+}
+
+// Only the first size bytes of v are compared with existing constants, as
+// that is all its uses read
+static uint16_t _const(struct _vm_gen *g, union vm_value v, size_t size) {
+	struct vm_func *f = g->f;
+	for (size_t i = 0; i < f->nconsts; ++i) {
+		if (!memcmp(f->consts + i, &v, size) && !_is_addr(f, i)) return i;
+	}
+	if (f->nconsts > UINT16_MAX) {
+		_fail(g, "too many constants");
+		return 0;
+	}
+
+	if (f->nconsts == f->consts_alloc) {
+		f->consts_alloc = f->consts_alloc ? f->consts_alloc * 2 : 16;
+		f->consts = realloc(f->consts, f->consts_alloc * sizeof *f->consts);
+	}
+	f->consts[f->nconsts] = v;
+	return f->nconsts++;
+}
+
+static uint16_t _const_u(struct _vm_gen *g, uint64_t u) {
+	union vm_value v;
+	memset(&v, 0, sizeof v);
+	v.u = u;
+	return _const(g, v, sizeof v.u);
+}
+
+// A constant holding the address of a global or function literal. These
+// are never shared with plain constants that happen to be equal.
+static uint16_t _const_addr(struct _vm_gen *g, uintptr_t addr, size_t global, struct vm_func *func) {
+	struct vm_func *f = g->f;
+	for (size_t i = 0; i < f->nrelocs; ++i) {
+		if (f->relocs[i].global == global && f->relocs[i].func == func) return f->relocs[i].konst;
+	}
+	if (f->nconsts > UINT16_MAX) {
+		_fail(g, "too many constants");
+		return 0;
+	}
+
+	if (f->nconsts == f->consts_alloc) {
+		f->consts_alloc = f->consts_alloc ? f->consts_alloc * 2 : 16;
+		f->consts = realloc(f->consts, f->consts_alloc * sizeof *f->consts);
+	}
+	memset(f->consts + f->nconsts, 0, sizeof *f->consts);
+	f->consts[f->nconsts].u = addr;
+
+	if (f->nrelocs == f->relocs_alloc) {
+		f->relocs_alloc = f->relocs_alloc ? f->relocs_alloc * 2 : 8;
+		f->relocs = realloc(f->relocs, f->relocs_alloc * sizeof *f->relocs);
+	}
+	f->relocs[f->nrelocs++] = (struct vm_reloc){f->nconsts, global, func};
+	return f->nconsts++;
+}
+
+// The address of a global's storage
+static uint16_t _const_global(struct _vm_gen *g, struct vm_global *global) {
+	return _const_addr(g, (uintptr_t)g->m->globals_mem + global->offset, global - g->m->globals, NULL);
+}
+
+static void _int(struct _vm_gen *g, uint8_t dst, int64_t v) {
+	if (v >= INT16_MIN && v <= INT16_MAX) {
+		_emit(g, VM_ABX(VM_LOADI, dst, v));
+	} else {
+		_emit(g, VM_ABX(VM_LOADK, dst, _const_u(g, v)));
+	}
+}
+
+static void _mov(struct _vm_gen *g, uint8_t dst, uint8_t src) {
+	if (dst != src) _emit(g, VM_ABC(VM_MOV, dst, src, 0));
+}
+
+// Reserves frame memory, returning its offset
+static size_t _slot(struct _vm_gen *g, const struct val_type *t) {
+	size_t align = vm_alignof(t);
+	size_t off = (g->f->memsize + align - 1) / align * align;
+	g->f->memsize = off + vm_sizeof(t);
+	return off;
+}
+
+static bool _is_aggr(const struct val_type *t) {
+	return t->t == TYPE_STRUCT || t->t == TYPE_UNION;
+}
+
+static bool _is_signed(const struct val_type *t) {
+	return t->t == TYPE_INT && t->int_ & I_SIGNED;
+}
+
+// The F32 version of a float op, adjusted to the given float type
+static int _float_op(int op, const struct val_type *t) {
+	return op + t->float_ * (VM_ADD_F64 - VM_ADD_F32);
+}
+
+// Wraps an integer result to its type's width
+static void _normalize(struct _vm_gen *g, const struct val_type *t, uint8_t r) {
+	if (t->t != TYPE_INT) return;
+
+	int op;
+	switch (t->int_) {
+	case U_8: op = VM_ZEXT8; break;
+	case U_16: op = VM_ZEXT16; break;
+	case U_32: op = VM_ZEXT32; break;
+	case I_8: op = VM_SEXT8; break;
+	case I_16: op = VM_SEXT16; break;
+	case I_32: op = VM_SEXT32; break;
+	default: return;
+	}
+	_emit(g, VM_ABC(op, r, r, 0));
+}
+
+static uint64_t _normalize_value(enum int_type t, uint64_t u) {
+	switch (t) {
+	case U_8: return (uint8_t)u;
+	case U_16: return (uint16_t)u;
+	case U_32: return (uint32_t)u;
+	case I_8: return (int8_t)u;
+	case I_16: return (int16_t)u;
+	case I_32: return (int32_t)u;
+	default: return u;
+	}
+}
+
+static int _load_op(const struct val_type *t) {
+	switch (t->t) {
+	case TYPE_INT:
+		switch (t->int_) {
+		case U_8: return VM_LD8U;
+		case I_8: return VM_LD8S;
+		case U_16: return VM_LD16U;
+		case I_16: return VM_LD16S;
+		case U_32: return VM_LD32U;
+		case I_32: return VM_LD32S;
+		default: return VM_LD64;
+		}
+	case TYPE_BOOL:
+		return VM_LD8U;
+	case TYPE_FLOAT:
+		return VM_LDF32 + t->float_;
+	default:
+		return VM_LD64;
+	}
+}
+
+static int _store_op(const struct val_type *t) {
+	switch (t->t) {
+	case TYPE_INT:
+		switch (t->int_ & 0xff) {
+		case 8: return VM_ST8;
+		case 16: return VM_ST16;
+		case 32: return VM_ST32;
+		default: return VM_ST64;
+		}
+	case TYPE_BOOL:
+		return VM_ST8;
+	case TYPE_FLOAT:
+		return VM_STF32 + t->float_;
+	default:
+		return VM_ST64;
+	}
+}
+
+// Finds a field, setting its offset
+static const struct val_type *_field(struct _vm_gen *g, const struct val_type *t, const char *name, size_t *off) {
+	if (!_is_aggr(t)) {
+		_fail(g, "field access on non-aggregate");
+		return t;
+	}
+
+	size_t pos = 0;
+	for (size_t i = 0; i < t->composite.nfields; ++i) {
+		const struct val_type *ft = t->composite.fields[i].type;
+		size_t align = vm_alignof(ft);
+		if (t->t == TYPE_STRUCT) pos = (pos + align - 1) / align * align;
+		if (!name || !strcmp(t->composite.fields[i].name, name)) {
+			*off = t->t == TYPE_STRUCT ? pos : 0;
+			return ft;
+		}
+		pos += vm_sizeof(ft);
+	}
+
+	_fail(g, "no such field");
+	return t;
+}
+
+// }}}
+
+// Scopes {{{
+
+static struct _vm_local *_local(struct _vm_gen *g, const char *name) {
+	for (size_t i = g->nlocals; i-- > 0;) {
+		if (!strcmp(g->locals[i].name, name)) return g->locals + i;
+	}
+	return NULL;
+}
+
+static void _push_local(struct _vm_gen *g, const char *name, const struct val_type *t, bool mem, uint8_t reg) {
+	if (g->nlocals == g->locals_alloc) {
+		g->locals_alloc = g->locals_alloc ? g->locals_alloc * 2 : 16;
+		g->locals = realloc(g->locals, g->locals_alloc * sizeof *g->locals);
+	}
+	g->locals[g->nlocals++] = (struct _vm_local){name, *t, mem, reg};
+}
+
+static size_t _push_block(struct _vm_gen *g, struct _vm_block b) {
+	if (g->nblocks == g->blocks_alloc) {
+		g->blocks_alloc = g->blocks_alloc ? g->blocks_alloc * 2 : 16;
+		g->blocks = realloc(g->blocks, g->blocks_alloc * sizeof *g->blocks);
+	}
+	g->blocks[g->nblocks] = b;
+	return g->nblocks++;
+}
+
+static struct vm_global *_global(struct _vm_gen *g, const char *name) {
+	size_t *i = strmap_get(&g->m->names, name);
+	return i ? g->m->globals + *i : NULL;
+}
+
+// Emits the deferred expressions of every let above block `from`,
+// innermost first, each seeing only the bindings it was written with
+static void _run_defers(struct _vm_gen *g, size_t from) {
+	size_t nblocks = g->nblocks, nlocals = g->nlocals;
+	if (nblocks <= from) return;
+
+	// Compiling the deferred code may push blocks and locals over the ones
+	// we're leaving, so keep copies
+	struct _vm_block *blocks = malloc((nblocks - from) * sizeof *blocks);
+	memcpy(blocks, g->blocks + from, (nblocks - from) * sizeof *blocks);
+	struct _vm_local *locals = malloc((nlocals + 1) * sizeof *locals);
+	memcpy(locals, g->locals, nlocals * sizeof *locals);
+
+	for (size_t b = nblocks; b-- > from;) {
+		struct _vm_block *block = blocks + (b - from);
+		if (block->loop || !block->deferred) continue;
+
+		g->nblocks = b;
+		g->nlocals = block->nlocals;
+		size_t top = g->top;
+		_expr(g, block->deferred, _reg(g));
+		g->top = top;
+	}
+
+	memcpy(g->blocks + from, blocks, (nblocks - from) * sizeof *blocks);
+	memcpy(g->locals, locals, nlocals * sizeof *locals);
+	g->nblocks = nblocks;
+	g->nlocals = nlocals;
+	free(blocks);
+	free(locals);
+}
+
+// }}}
+
+// Locations {{{
+
+// Brings an offset into range of the 8-bit offset operand
+static struct _vm_lval _at(struct _vm_gen *g, uint8_t reg, size_t off) {
+	if (off <= UINT8_MAX) return (struct _vm_lval){true, reg, off};
+
+	uint8_t r = _reg(g);
+	_emit(g, VM_ABX(VM_LOADK, r, _const_u(g, off)));
+	_emit(g, VM_ABC(VM_ADD, r, reg, r));
+	return (struct _vm_lval){true, r, 0};
+}
+
+// The location a pointer points at. Constant offsets, such as those of a
+// vector loop's lanes, fold into the load or store.
+static struct _vm_lval _deref(struct _vm_gen *g, struct ast_expr *p) {
+	if (p->t == EXPR_BINOP && p->binop.t == BINOP_ADD && p->binop.x->type.t == TYPE_PTR && p->binop.y->t == EXPR_INT_LIT) {
+		struct ast_expr *k = p->binop.y;
+		size_t size = vm_sizeof(&p->type.ptr->to);
+		bool neg = k->int_lit.type & I_SIGNED && k->int_lit.i < 0;
+		if (size && !neg && k->int_lit.u <= UINT8_MAX / size) {
+			return (struct _vm_lval){true, _operand(g, p->binop.x), k->int_lit.u * size};
+		}
+	}
+	return (struct _vm_lval){true, _operand(g, p), 0};
+}
+
+static struct _vm_lval _lvalue(struct _vm_gen *g, struct ast_expr *e) {
+	switch (e->t) {
+	case EXPR_IDENT:;
+		struct _vm_local *l = _local(g, e->ident);
+		if (l) return (struct _vm_lval){l->mem, l->reg, 0};
+
+		struct vm_global *global = _global(g, e->ident);
+		if (!global || global->offset == SIZE_MAX) {
+			_fail(g, "not an lvalue");
+			break;
+		}
+		uint8_t r = _reg(g);
+		_emit(g, VM_ABX(VM_LOADK, r, _const_global(g, global)));
+		return (struct _vm_lval){true, r, 0};
+
+	case EXPR_UNOP:
+		if (e->unop.t != UNOP_DEREF) break;
+		return _deref(g, e->unop.x);
+
+	case EXPR_FIELD_ACCESS:;
+		struct ast_expr *aggr = e->field_access.aggr;
+		struct _vm_lval base;
+		if (aggr->t == EXPR_IDENT || aggr->t == EXPR_FIELD_ACCESS
+				|| (aggr->t == EXPR_UNOP && aggr->unop.t == UNOP_DEREF)) {
+			base = _lvalue(g, aggr);
+		} else {
+			// Temporaries, such as call results, are already addresses
+			base = (struct _vm_lval){true, _operand(g, aggr), 0};
+		}
+
+		size_t off;
+		_field(g, &aggr->type, e->field_access.field, &off);
+		return _at(g, base.reg, base.off + off);
+
+	default:
+		break;
+	}
+
+	_fail(g, "not an lvalue");
+	return (struct _vm_lval){0};
+}
+
+// The address of a memory location
+static void _address(struct _vm_gen *g, struct _vm_lval lv, uint8_t dst) {
+	if (!lv.mem) {
+		_fail(g, "address of a register");
+	} else if (lv.off) {
+		_int(g, dst, lv.off);
+		_emit(g, VM_ABC(VM_ADD, dst, lv.reg, dst));
+	} else {
+		_mov(g, dst, lv.reg);
+	}
+}
+
+static void _load(struct _vm_gen *g, struct _vm_lval lv, const struct val_type *t, uint8_t dst) {
+	if (_is_aggr(t)) {
+		_address(g, lv, dst);
+	} else if (!lv.mem) {
+		_mov(g, dst, lv.reg);
+	} else {
+		_emit(g, VM_ABC(_load_op(t), dst, lv.reg, lv.off));
+	}
+}
+
+static void _store(struct _vm_gen *g, struct _vm_lval lv, const struct val_type *t, uint8_t src) {
+	if (_is_aggr(t)) {
+		uint8_t r = _reg(g);
+		_address(g, lv, r);
+		_emit(g, VM_ABC(VM_COPY, r, src, 0));
+		_emit(g, vm_sizeof(t));
+	} else if (!lv.mem) {
+		_mov(g, lv.reg, src);
+	} else {
+		_emit(g, VM_ABC(_store_op(t), lv.reg, src, lv.off));
+	}
+}
+
+// Copies an aggregate into fresh frame memory, leaving its address in r
+static void _copy_aggr(struct _vm_gen *g, const struct val_type *t, uint8_t r) {
+	size_t top = g->top;
+	uint8_t tmp = _reg(g);
+	_emit(g, VM_ABX(VM_ADDR, tmp, _const_u(g, _slot(g, t))));
+	_emit(g, VM_ABC(VM_COPY, tmp, r, 0));
+	_emit(g, vm_sizeof(t));
+	_mov(g, r, tmp);
+	g->top = top;
+}
+
+// }}}
+
+// Expressions {{{
+
+// Returns a register holding e's value, using a local's own register
+// instead of copying it where possible
+static uint8_t _operand(struct _vm_gen *g, struct ast_expr *e) {
+	if (e->t == EXPR_IDENT) {
+		struct _vm_local *l = _local(g, e->ident);
+		if (l && !l->mem) return l->reg;
+	}
+	uint8_t r = _reg(g);
+	_expr(g, e, r);
+	return r;
+}
+
+// Compiles all but the last item of a sequence, and returns the last.
+// Sequences can be far longer than the C stack is deep, so their spines
+// are flattened without recursion.
+static struct ast_expr *_sequence(struct _vm_gen *g, struct ast_expr *e) {
+	size_t nitems = 0, items_alloc = 0, nstack = 0, stack_alloc = 0;
+	struct ast_expr **items = NULL, **stack = NULL;
+
+#define PUSH(arr, n, alloc, x) do { \
+	if (n == alloc) { \
+		alloc = alloc ? alloc * 2 : 16; \
+		arr = realloc(arr, alloc * sizeof *arr); \
+	} \
+	arr[n++] = x; \
+} while (0)
+
+	PUSH(stack, nstack, stack_alloc, e);
+	while (nstack) {
+		struct ast_expr *x = stack[--nstack];
+		if (x->t == EXPR_BINOP && x->binop.t == BINOP_SEQOP) {
+			PUSH(stack, nstack, stack_alloc, x->binop.y);
+			PUSH(stack, nstack, stack_alloc, x->binop.x);
+		} else {
+			PUSH(items, nitems, items_alloc, x);
+		}
+	}
+
+#undef PUSH
+
+	size_t top = g->top;
+	for (size_t i = 0; i < nitems - 1; ++i) {
+		_expr(g, items[i], _reg(g));
+		g->top = top;
+	}
+	struct ast_expr *last = items[nitems - 1];
+	free(items);
+	free(stack);
+	return last;
+}
+
+static void _binop(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	struct ast_expr *x = e->binop.x, *y = e->binop.y;
+	const struct val_type *t = &x->type;
+	size_t j;
+
+	switch (e->binop.t) {
+	case BINOP_ASSIGN:;
+		struct _vm_lval lv = _lvalue(g, x);
+		uint8_t v = _operand(g, y);
+		_store(g, lv, t, v);
+		_mov(g, dst, v);
+		return;
+
+	case BINOP_BOOL_AND:
+	case BINOP_BOOL_OR:
+		_expr(g, x, dst);
+		j = _emit(g, VM_ABX(e->binop.t == BINOP_BOOL_AND ? VM_JF : VM_JT, dst, 0));
+		_expr(g, y, dst);
+		_patch(g, j, g->f->ncode);
+		return;
+
+	default:
+		break;
+	}
+
+	uint8_t a = _operand(g, x), b = _operand(g, y);
+	bool flt = t->t == TYPE_FLOAT, sgn = _is_signed(t);
+	bool wrap = false;
+	int op;
+
+	switch (e->binop.t) {
+	case BINOP_ADD:
+		if (x->type.t == TYPE_PTR || y->type.t == TYPE_PTR) {
+			// Scale the offset by the pointee's size
+			uint8_t p = a, n = b;
+			if (y->type.t == TYPE_PTR) {
+				p = b;
+				n = a;
+			}
+			size_t size = vm_sizeof(&e->type.ptr->to);
+			if (size > 1) {
+				uint8_t s = _reg(g);
+				_int(g, s, size);
+				_emit(g, VM_ABC(VM_MUL, s, n, s));
+				n = s;
+			}
+			_emit(g, VM_ABC(VM_ADD, dst, p, n));
+			return;
+		}
+		op = flt ? _float_op(VM_ADD_F32, t) : VM_ADD;
+		wrap = true;
+		break;
+
+	case BINOP_SUB:
+		if (t->t == TYPE_PTR) {
+			_emit(g, VM_ABC(VM_SUB, dst, a, b));
+			size_t size = vm_sizeof(&t->ptr->to);
+			if (size > 1) {
+				uint8_t s = _reg(g);
+				_int(g, s, size);
+				_emit(g, VM_ABC(VM_DIVS, dst, dst, s));
+			}
+			return;
+		}
+		op = flt ? _float_op(VM_SUB_F32, t) : VM_SUB;
+		wrap = true;
+		break;
+
+	case BINOP_MUL:
+		op = flt ? _float_op(VM_MUL_F32, t) : VM_MUL;
+		wrap = true;
+		break;
+
+	case BINOP_DIV:
+		op = flt ? _float_op(VM_DIV_F32, t) : sgn ? VM_DIVS : VM_DIVU;
+		// MIN / -1 overflows
+		wrap = sgn;
+		break;
+
+	case BINOP_MOD:
+		op = flt ? _float_op(VM_MOD_F32, t) : sgn ? VM_MODS : VM_MODU;
+		break;
+
+	case BINOP_LSHIFT:
+	case BINOP_RSHIFT:
+		if (flt) _fail(g, "shift of a float");
+		if (e->binop.t == BINOP_LSHIFT) {
+			op = VM_SHL;
+			wrap = true;
+		} else {
+			op = sgn ? VM_SHRS : VM_SHRU;
+		}
+		break;
+
+	case BINOP_BIN_AND: op = VM_AND; break;
+	case BINOP_BIN_OR: op = VM_OR; break;
+	case BINOP_BIN_XOR: op = VM_XOR; break;
+
+	case BINOP_EQUAL:
+	case BINOP_NEQUAL:
+		if (_is_aggr(t)) _fail(g, "comparison of aggregates");
+		_emit(g, VM_ABC(flt ? _float_op(VM_EQ_F32, t) : VM_EQ, dst, a, b));
+		if (e->binop.t == BINOP_NEQUAL) _emit(g, VM_ABC(VM_LNOT, dst, dst, 0));
+		return;
+
+	case BINOP_LT:
+	case BINOP_GT:
+		op = flt ? _float_op(VM_LT_F32, t) : sgn ? VM_LTS : VM_LTU;
+		goto compare;
+	case BINOP_LTE:
+	case BINOP_GTE:
+		op = flt ? _float_op(VM_LE_F32, t) : sgn ? VM_LES : VM_LEU;
+	compare:
+		// x > y is y < x
+		if (e->binop.t == BINOP_GT || e->binop.t == BINOP_GTE) {
+			uint8_t tmp = a;
+			a = b;
+			b = tmp;
+		}
+		break;
+
+	default:
+		_fail(g, "unknown binary operator");
+		return;
+	}
+
+	_emit(g, VM_ABC(op, dst, a, b));
+	if (wrap) _normalize(g, &e->type, dst);
+}
+
+static void _unop(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	struct ast_expr *x = e->unop.x;
+	const struct val_type *t = &x->type;
+	struct _vm_lval lv;
+
+	switch (e->unop.t) {
+	case UNOP_REF:
+		_address(g, _lvalue(g, x), dst);
+		break;
+
+	case UNOP_DEREF:
+		_load(g, _deref(g, x), &e->type, dst);
+		break;
+
+	case UNOP_PREINC:
+	case UNOP_POSTINC:
+	case UNOP_PREDEC:
+	case UNOP_POSTDEC:;
+		bool inc = e->unop.t == UNOP_PREINC || e->unop.t == UNOP_POSTINC;
+		bool pre = e->unop.t == UNOP_PREINC || e->unop.t == UNOP_PREDEC;
+		lv = _lvalue(g, x);
+		uint8_t old = _reg(g), new = _reg(g), one = _reg(g);
+		_load(g, lv, t, old);
+
+		if (t->t == TYPE_FLOAT) {
+			union vm_value v;
+			memset(&v, 0, sizeof v);
+			switch (t->float_) {
+			case F_32: v.f32 = 1; break;
+			case F_64: v.f64 = 1; break;
+			case F_80: v.f80 = 1; break;
+			}
+			_emit(g, VM_ABX(VM_LOADK, one, _const(g, v, _float_bytes(t->float_))));
+			_emit(g, VM_ABC(_float_op(inc ? VM_ADD_F32 : VM_SUB_F32, t), new, old, one));
+		} else {
+			_int(g, one, t->t == TYPE_PTR ? vm_sizeof(&t->ptr->to) : 1);
+			_emit(g, VM_ABC(inc ? VM_ADD : VM_SUB, new, old, one));
+			_normalize(g, t, new);
+		}
+
+		_store(g, lv, t, new);
+		_mov(g, dst, pre ? new : old);
+		break;
+
+	case UNOP_BOOL_NOT:
+		_emit(g, VM_ABC(VM_LNOT, dst, _operand(g, x), 0));
+		break;
+
+	case UNOP_BIN_NOT:
+		_emit(g, VM_ABC(VM_NOT, dst, _operand(g, x), 0));
+		_normalize(g, t, dst);
+		break;
+
+	case UNOP_MINUS:
+		if (t->t == TYPE_FLOAT) {
+			_emit(g, VM_ABC(_float_op(VM_NEG_F32, t), dst, _operand(g, x), 0));
+		} else {
+			_emit(g, VM_ABC(VM_NEG, dst, _operand(g, x), 0));
+			_normalize(g, t, dst);
+		}
+		break;
+
+	case UNOP_PLUS:
+		_mov(g, dst, _operand(g, x));
+		break;
+
+	case UNOP_SIZEOF:
+		// Not evaluated
+		_int(g, dst, vm_sizeof(t));
+		break;
+	}
+}
+
+static void _call(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	if (e->call.nargs > UINT8_MAX) {
+		_fail(g, "too many arguments");
+		return;
+	}
+
+	// The callee and arguments go at the top, where the callee's frame
+	// will start
+	uint8_t func = _reg(g);
+	_expr(g, e->call.func, func);
+	for (size_t i = 0; i < e->call.nargs; ++i) {
+		struct ast_expr *arg = e->call.args + i;
+		uint8_t r = _reg(g);
+		_expr(g, arg, r);
+		// Arguments are the callee's to modify
+		if (_is_aggr(&arg->type)) _copy_aggr(g, &arg->type, r);
+		g->top = r + 1;
+	}
+
+	_emit(g, VM_ABC(VM_CALL, dst, func, e->call.nargs));
+	struct vm_func *f = g->f;
+	if (f->ncalls == f->calls_alloc) {
+		f->calls_alloc = f->calls_alloc ? f->calls_alloc * 2 : 8;
+		f->call_types = realloc(f->call_types, f->calls_alloc * sizeof *f->call_types);
+	}
+	f->call_types[f->ncalls++] = e->call.func->type;
+	// An aggregate result lives in the callee's frame, which the next call
+	// will reuse
+	if (_is_aggr(&e->type)) _copy_aggr(g, &e->type, dst);
+}
+
+static void _while(struct _vm_gen *g, struct ast_expr *e) {
+	size_t top = g->top;
+	size_t start = g->f->ncode;
+	size_t jf = _emit(g, VM_ABX(VM_JF, _operand(g, e->while_.cond), 0));
+	g->top = top;
+
+	size_t b = _push_block(g, (struct _vm_block){.loop = true, .start = start});
+	_expr(g, e->while_.body, _reg(g));
+	g->top = top;
+	_patch(g, _emit(g, VM_AX(VM_JMP, 0)), start);
+
+	size_t end = g->f->ncode;
+	_patch(g, jf, end);
+	for (size_t i = 0; i < g->blocks[b].nbreaks; ++i) {
+		_patch(g, g->blocks[b].breaks[i], end);
+	}
+	free(g->blocks[b].breaks);
+	--g->nblocks;
+}
+
+static void _jump_out(struct _vm_gen *g, struct ast_expr *e) {
+	bool is_break = e->t == EXPR_BREAK;
+	if (is_break ? e->break_.lbl : e->continue_.lbl) {
+		_fail(g, "labelled jumps are not supported");
+		return;
+	}
+
+	size_t b = g->nblocks;
+	while (b-- > 0 && !g->blocks[b].loop);
+	if (b == SIZE_MAX) {
+		_fail(g, is_break ? "break outside loop" : "continue outside loop");
+		return;
+	}
+
+	_run_defers(g, b + 1);
+	size_t j = _emit(g, VM_AX(VM_JMP, 0));
+	struct _vm_block *loop = g->blocks + b;
+	if (is_break) {
+		if (loop->nbreaks == loop->breaks_alloc) {
+			loop->breaks_alloc = loop->breaks_alloc ? loop->breaks_alloc * 2 : 4;
+			loop->breaks = realloc(loop->breaks, loop->breaks_alloc * sizeof *loop->breaks);
+		}
+		loop->breaks[loop->nbreaks++] = j;
+	} else {
+		_patch(g, j, loop->start);
+	}
+}
+
+static void _return(struct _vm_gen *g, struct ast_expr *e) {
+	struct ast_expr *val = e->return_.val;
+	uint8_t r = 0;
+	if (val) {
+		r = _reg(g);
+		_expr(g, val, r);
+		// Deferred code mustn't change what's returned
+		if (_is_aggr(&val->type)) _copy_aggr(g, &val->type, r);
+	}
+	_run_defers(g, 0);
+	_emit(g, val ? VM_ABC(VM_RET, r, 0, 0) : VM_ABC(VM_RET0, 0, 0, 0));
+}
+
+// Binds a let's value, leaving its body to be compiled
+static void _let_enter(struct _vm_gen *g, struct ast_expr *e) {
+	const struct val_type *t = &e->let.type.to;
+	bool mem = _is_aggr(t) || strmap_get(&g->addr_taken, e->let.name);
+
+	uint8_t r = _reg(g);
+	if (mem) {
+		_emit(g, VM_ABX(VM_ADDR, r, _const_u(g, _slot(g, t))));
+		_store(g, (struct _vm_lval){true, r, 0}, t, _operand(g, e->let.val));
+		g->top = r + 1;
+	} else {
+		_expr(g, e->let.val, r);
+	}
+
+	_push_local(g, e->let.name, t, mem, r);
+	_push_block(g, (struct _vm_block){.deferred = e->let.deferred, .nlocals = g->nlocals});
+}
+
+// Runs a let's deferred code once its body is compiled to dst
+static void _let_leave(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	--g->nblocks;
+	if (e->let.deferred) {
+		// Deferred code mustn't change the let's value
+		if (_is_aggr(&e->type)) _copy_aggr(g, &e->type, dst);
+		_expr(g, e->let.deferred, _reg(g));
+	}
+	--g->nlocals;
+}
+
+static void _composite(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	const struct val_type *t = &e->composite_lit.type;
+	if (!_is_aggr(t)) {
+		_fail(g, "composite literal of non-aggregate type");
+		return;
+	}
+	if (e->composite_lit.nelems > t->composite.nfields) {
+		_fail(g, "too many elements in composite literal");
+		return;
+	}
+
+	_emit(g, VM_ABX(VM_ADDR, dst, _const_u(g, _slot(g, t))));
+	size_t pos = 0;
+	for (size_t i = 0; i < e->composite_lit.nelems; ++i) {
+		const struct val_type *ft = t->composite.fields[i].type;
+		size_t align = vm_alignof(ft);
+		if (t->t == TYPE_STRUCT) pos = (pos + align - 1) / align * align;
+
+		size_t top = g->top;
+		uint8_t v = _operand(g, e->composite_lit.elems + i);
+		_store(g, _at(g, dst, t->t == TYPE_STRUCT ? pos : 0), ft, v);
+		g->top = top;
+		pos += vm_sizeof(ft);
+	}
+}
+
+static void _cast(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	const struct val_type *to = &e->cast.type;
+	if (to->t == TYPE_VOID) {
+		if (e->cast.val) _expr(g, e->cast.val, _reg(g));
+		return;
+	}
+
+	const struct val_type *from = &e->cast.val->type;
+	uint8_t r = _operand(g, e->cast.val);
+	if (to->t == TYPE_BOOL && from->t == TYPE_FLOAT) {
+		_emit(g, VM_ABC(_float_op(VM_TOBOOL_F32, from), dst, r, 0));
+	} else if (to->t == TYPE_BOOL && from->t != TYPE_BOOL) {
+		_emit(g, VM_ABC(VM_TOBOOL, dst, r, 0));
+	} else if (to->t == TYPE_FLOAT && from->t == TYPE_FLOAT && to->float_ != from->float_) {
+		static const int ops[3][3] = {
+			[F_32] = {[F_64] = VM_F32_F64, [F_80] = VM_F32_F80},
+			[F_64] = {[F_32] = VM_F64_F32, [F_80] = VM_F64_F80},
+			[F_80] = {[F_32] = VM_F80_F32, [F_64] = VM_F80_F64},
+		};
+		_emit(g, VM_ABC(ops[from->float_][to->float_], dst, r, 0));
+	} else {
+		// Integers are re-extended to the new width; the rest is unchanged
+		_mov(g, dst, r);
+		_normalize(g, to, dst);
+	}
+}
+
+static void _ident(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	struct _vm_local *l = _local(g, e->ident);
+	if (l) {
+		_load(g, (struct _vm_lval){l->mem, l->reg, 0}, &l->type, dst);
+		return;
+	}
+
+	struct vm_global *global = _global(g, e->ident);
+	if (!global) {
+		_fail(g, "undefined name");
+	} else if (global->offset == SIZE_MAX) {
+		// NULL for prototypes that are never defined
+		_emit(g, VM_ABX(VM_LOADK, dst, _const_addr(g, (uintptr_t)global->func, global - g->m->globals, global->func)));
+	} else {
+		_load(g, _lvalue(g, e), &global->type, dst);
+	}
+}
+
+static void _push_pending(struct _vm_gen *g, struct _vm_pending p) {
+	if (g->npending == g->pending_alloc) {
+		g->pending_alloc = g->pending_alloc ? g->pending_alloc * 2 : 16;
+		g->pending = realloc(g->pending, g->pending_alloc * sizeof *g->pending);
+	}
+	g->pending[g->npending++] = p;
+}
+
+static void _func_lit(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	struct vm_func *f = calloc(1, sizeof *f);
+	f->name = "(literal)";
+	if (g->nfuncs == g->funcs_alloc) {
+		g->funcs_alloc = g->funcs_alloc ? g->funcs_alloc * 2 : 16;
+		g->funcs = realloc(g->funcs, g->funcs_alloc * sizeof *g->funcs);
+	}
+	g->funcs[g->nfuncs++] = f;
+
+	_push_pending(g, (struct _vm_pending){
+		.f = f,
+		.nargs = e->func.nargs,
+		.args = (void *)e->func.args,
+		.ret = e->func.ret,
+		.body = e->func.body,
+	});
+
+	_emit(g, VM_ABX(VM_LOADK, dst, _const_addr(g, (uintptr_t)f, SIZE_MAX, f)));
+}
+
+// Compiles anything but a let, an if or a sequence
+static void _node(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	size_t top = g->top;
+	union vm_value v;
+
+	switch (e->t) {
+	case EXPR_BINOP:
+		_binop(g, e, dst);
+		break;
+
+	case EXPR_UNOP:
+		_unop(g, e, dst);
+		break;
+
+	case EXPR_CALL:
+		_call(g, e, dst);
+		break;
+
+	case EXPR_WHILE:
+		_while(g, e);
+		break;
+
+	case EXPR_BREAK:
+	case EXPR_CONTINUE:
+		_jump_out(g, e);
+		break;
+
+	case EXPR_RETURN:
+		_return(g, e);
+		break;
+
+	case EXPR_FUNC:
+		_func_lit(g, e, dst);
+		break;
+
+	case EXPR_INT_LIT:
+		_int(g, dst, _normalize_value(e->int_lit.type, e->int_lit.u));
+		break;
+
+	case EXPR_FLOAT_LIT:
+		memset(&v, 0, sizeof v);
+		switch (e->float_lit.type) {
+		case F_32: v.f32 = e->float_lit.x; break;
+		case F_64: v.f64 = e->float_lit.x; break;
+		case F_80: v.f80 = e->float_lit.x; break;
+		}
+		_emit(g, VM_ABX(VM_LOADK, dst, _const(g, v, _float_bytes(e->float_lit.type))));
+		break;
+
+	case EXPR_ARR_LIT:
+		_fail(g, "array literals are not supported");
+		break;
+
+	case EXPR_COMPOSITE_LIT:
+		_composite(g, e, dst);
+		break;
+
+	case EXPR_BOOL_LIT:
+		_emit(g, VM_ABX(VM_LOADI, dst, e->bool_lit));
+		break;
+
+	case EXPR_FIELD_ACCESS:
+		_load(g, _lvalue(g, e), &e->type, dst);
+		break;
+
+	case EXPR_CAST:
+		_cast(g, e, dst);
+		break;
+
+	case EXPR_IDENT:
+		_ident(g, e, dst);
+		break;
+
+	case EXPR_LET:
+	case EXPR_IF:
+		break;
+	}
+
+	g->top = top;
+}
+
+// A let or if whose last child is being compiled
+struct _vm_tail {
+	struct ast_expr *e;
+	size_t top;
+	// The if's jump past the branch being compiled
+	size_t jump;
+};
+
+// Lets, ifs and sequences pass dst on to their last child, so chains of
+// them, such as else-if chains, need no registers and can be far deeper
+// than the C stack. They are followed on a stack of their own. Most other
+// nesting holds a register per level, and runs out of registers first.
+static void _expr(struct _vm_gen *g, struct ast_expr *e, uint8_t dst) {
+	size_t ntails = 0, tails_alloc = 0;
+	struct _vm_tail *tails = NULL;
+
+	for (;;) {
+		struct _vm_tail tail = {.e = e, .top = g->top};
+		if (e->t == EXPR_BINOP && e->binop.t == BINOP_SEQOP) {
+			e = _sequence(g, e);
+			continue;
+		} else if (e->t == EXPR_LET) {
+			_let_enter(g, e);
+			e = e->let.body;
+		} else if (e->t == EXPR_IF) {
+			tail.jump = _emit(g, VM_ABX(VM_JF, _operand(g, e->if_.cond), 0));
+			g->top = tail.top;
+			if (e->if_.f) {
+				_expr(g, e->if_.t, dst);
+				size_t j = _emit(g, VM_AX(VM_JMP, 0));
+				_patch(g, tail.jump, g->f->ncode);
+				tail.jump = j;
+				e = e->if_.f;
+			} else {
+				e = e->if_.t;
+			}
+		} else {
+			_node(g, e, dst);
+			break;
+		}
+
+		if (ntails == tails_alloc) {
+			tails_alloc = tails_alloc ? tails_alloc * 2 : 16;
+			tails = realloc(tails, tails_alloc * sizeof *tails);
+		}
+		tails[ntails++] = tail;
+	}
+
+	while (ntails--) {
+		struct _vm_tail *tail = tails + ntails;
+		if (tail->e->t == EXPR_LET) {
+			_let_leave(g, tail->e, dst);
+		} else {
+			_patch(g, tail->jump, g->f->ncode);
+		}
+		g->top = tail->top;
+	}
+	free(tails);
+}
+
+// }}}
+
+// Functions {{{
+
+static bool _scan_addr_taken(struct ast_expr *e, void *ctx) {
+	struct _vm_gen *g = ctx;
+	if (e->t == EXPR_FUNC) return false;
+	if (e->t == EXPR_UNOP && e->unop.t == UNOP_REF) {
+		struct ast_expr *root = e->unop.x;
+		while (root->t == EXPR_FIELD_ACCESS) root = root->field_access.aggr;
+		if (root->t == EXPR_IDENT) strmap_put(&g->addr_taken, root->ident, 0);
+	}
+	return true;
+}
+
+static void _function(struct _vm_gen *g, struct _vm_pending *p) {
+	struct vm_func *f = p->f;
+	g->f = f;
+	g->top = 0;
+	g->nlocals = 0;
+	g->nblocks = 0;
+	f->nargs = p->nargs;
+	f->ret_type = p->ret;
+	f->arg_types = malloc(p->nargs * sizeof *f->arg_types);
+	for (size_t i = 0; i < p->nargs; ++i) f->arg_types[i] = p->args[i].type.to;
+
+	strmap_free(&g->addr_taken);
+	walk_expr(&g->walk, p->body, &(struct walk_ops){.pre = _scan_addr_taken}, g);
+
+	if (p->nargs > UINT8_MAX) {
+		_fail(g, "too many arguments");
+		return;
+	}
+	for (size_t i = 0; i < p->nargs; ++i) _reg(g);
+
+	for (size_t i = 0; i < p->nargs; ++i) {
+		const struct val_type *t = &p->args[i].type.to;
+		if (_is_aggr(t)) {
+			// Passed by address, already copied by the caller
+			_push_local(g, p->args[i].name, t, true, i);
+		} else if (strmap_get(&g->addr_taken, p->args[i].name)) {
+			uint8_t r = _reg(g);
+			_emit(g, VM_ABX(VM_ADDR, r, _const_u(g, _slot(g, t))));
+			_store(g, (struct _vm_lval){true, r, 0}, t, i);
+			_push_local(g, p->args[i].name, t, true, r);
+		} else {
+			_push_local(g, p->args[i].name, t, false, i);
+		}
+	}
+
+	uint8_t r = _reg(g);
+	_expr(g, p->body, r);
+	if (p->ret.t == TYPE_VOID) {
+		_emit(g, VM_ABC(VM_RET0, 0, 0, 0));
+	} else {
+		_emit(g, VM_ABC(VM_RET, r, 0, 0));
+	}
+}
+
+static struct vm_func *_new_func(struct vm_module *m, const char *name) {
+	struct vm_func *f = calloc(1, sizeof *f);
+	f->name = name;
+	if (m->nfuncs == m->funcs_alloc) {
+		m->funcs_alloc = m->funcs_alloc ? m->funcs_alloc * 2 : 16;
+		m->funcs = realloc(m->funcs, m->funcs_alloc * sizeof *m->funcs);
+	}
+	m->funcs[m->nfuncs++] = f;
+	return f;
+}
+
+static void _declare(struct _vm_gen *g, size_t ntops, struct ast_toplevel *tops) {
+	struct vm_module *m = g->m;
+	for (size_t i = 0; i < ntops; ++i) {
+		struct ast_toplevel *t = tops + i;
+		const char *name;
+		struct val_type type;
+
+		switch (t->type) {
+		case EXPRTOP_FUNC:
+			name = t->func.name;
+			type = (struct val_type){.t = TYPE_FUNC};
+			break;
+		case EXPRTOP_DECL:
+			name = t->decl.name;
+			type = t->decl.type.to;
+			break;
+		case EXPRTOP_NAMESPACE:
+			_declare(g, t->namespace.size, t->namespace.body);
+			continue;
+		}
+
+		size_t *existing = strmap_get(&m->names, name);
+		struct vm_global *global;
+		if (existing) {
+			// Prototypes come before definitions
+			global = m->globals + *existing;
+		} else {
+			if (m->nglobals == m->globals_alloc) {
+				m->globals_alloc = m->globals_alloc ? m->globals_alloc * 2 : 16;
+				m->globals = realloc(m->globals, m->globals_alloc * sizeof *m->globals);
+			}
+			strmap_put(&m->names, name, m->nglobals);
+			global = m->globals + m->nglobals++;
+			*global = (struct vm_global){.name = name, .type = type};
+
+			if (t->type == EXPRTOP_FUNC) {
+				global->offset = SIZE_MAX;
+			} else {
+				size_t align = vm_alignof(&type);
+				global->offset = (m->globals_size + align - 1) / align * align;
+				m->globals_size = global->offset + vm_sizeof(&type);
+			}
+		}
+
+		if (t->type == EXPRTOP_FUNC && t->func.body && !global->func) {
+			global->func = _new_func(m, name);
+			_push_pending(g, (struct _vm_pending){
+				.f = global->func,
+				.nargs = t->func.nargs,
+				.args = (void *)t->func.args,
+				.ret = t->func.ret,
+				.body = t->func.body,
+			});
+		}
+	}
+}
+
+static void _init_globals(struct _vm_gen *g, size_t ntops, struct ast_toplevel *tops) {
+	for (size_t i = 0; i < ntops; ++i) {
+		struct ast_toplevel *t = tops + i;
+		if (t->type == EXPRTOP_NAMESPACE) {
+			_init_globals(g, t->namespace.size, t->namespace.body);
+		} else if (t->type == EXPRTOP_DECL && t->decl.val) {
+			struct vm_global *global = _global(g, t->decl.name);
+			size_t top = g->top;
+			uint8_t addr = _reg(g);
+			_emit(g, VM_ABX(VM_LOADK, addr, _const_global(g, global)));
+			_store(g, (struct _vm_lval){true, addr, 0}, &global->type, _operand(g, t->decl.val));
+			g->top = top;
+		}
+	}
+}
+
+static void _gen_free(struct _vm_gen *g) {
+	free(g->funcs);
+	free(g->locals);
+	free(g->blocks);
+	free(g->pending);
+	strmap_free(&g->addr_taken);
+	walk_free(&g->walk);
+}
+
+// }}}
+
+// Parallel code generation {{{
+
+// A function from the toplevel or init, with every literal inside it
+struct _vm_unit {
+	struct _vm_pending p;
+	size_t nfuncs;
+	struct vm_func **funcs;
+	const char *error;
+};
+
+struct _vm_pool {
+	struct vm_module *m;
+	size_t nunits;
+	struct _vm_unit *units;
+
+	pthread_mutex_t lock;
+	size_t next;
+};
+
+static void _compile(struct _vm_gen *g, struct _vm_unit *u) {
+	g->error = NULL;
+	g->npending = 0;
+	_push_pending(g, u->p);
+	// Function literals are added as they're found
+	for (size_t i = 0; i < g->npending && !g->error; ++i) {
+		struct _vm_pending p = g->pending[i];
+		_function(g, &p);
+	}
+
+	u->nfuncs = g->nfuncs;
+	u->funcs = g->funcs;
+	u->error = g->error;
+	g->nfuncs = g->funcs_alloc = 0;
+	g->funcs = NULL;
+}
+
+static void _add_funcs(struct vm_module *m, size_t n, struct vm_func **funcs) {
+	if (!n) return;
+	if (m->nfuncs + n > m->funcs_alloc) {
+		while (m->nfuncs + n > m->funcs_alloc) m->funcs_alloc *= 2;
+		m->funcs = realloc(m->funcs, m->funcs_alloc * sizeof *m->funcs);
+	}
+	memcpy(m->funcs + m->nfuncs, funcs, n * sizeof *funcs);
+	m->nfuncs += n;
+}
+
+static void *_worker(void *arg) {
+	struct _vm_pool *p = arg;
+	struct _vm_gen g = {.m = p->m};
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		size_t i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		if (i >= p->nunits) break;
+		_compile(&g, p->units + i);
+	}
+	_gen_free(&g);
+	return NULL;
+}
+
+static void _pool_run(struct _vm_pool *p, size_t jobs) {
+	pthread_mutex_init(&p->lock, NULL);
+	size_t nthreads = jobs < p->nunits ? jobs : p->nunits;
+	pthread_t *threads = malloc(nthreads * sizeof *threads);
+	// The calling thread is one of the workers
+	size_t started = 0;
+	for (size_t i = 1; i < nthreads; ++i) {
+		if (pthread_create(&threads[started], NULL, _worker, p)) break;
+		++started;
+	}
+	_worker(p);
+	for (size_t i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&p->lock);
+}
+
+// }}}
+
+bool vm_compile_unit(struct vm_module *m, size_t ntops, struct ast_toplevel *tops) {
+	return vm_compile_unit_jobs(m, ntops, tops, 1);
+}
+
+bool vm_compile_unit_jobs(struct vm_module *m, size_t ntops, struct ast_toplevel *tops, size_t jobs) {
+	*m = (struct vm_module){0};
+	struct _vm_gen g = {.m = m};
+
+	_declare(&g, ntops, tops);
+	size_t size = (m->globals_size + 15) & ~(size_t)15;
+	m->globals_mem = aligned_alloc(16, size ? size : 16);
+	memset(m->globals_mem, 0, m->globals_size);
+
+	// Variables are initialized in order, as their values may have effects
+	m->init = _new_func(m, "(init)");
+	m->init->ret_type = (struct val_type){.t = TYPE_VOID};
+	g.f = m->init;
+	_init_globals(&g, ntops, tops);
+	_emit(&g, VM_ABC(VM_RET0, 0, 0, 0));
+
+	// Each definition, and each literal in init, is compiled on its own
+	struct _vm_pool p = {.m = m, .nunits = g.npending};
+	p.units = calloc(p.nunits, sizeof *p.units);
+	for (size_t i = 0; i < p.nunits; ++i) p.units[i].p = g.pending[i];
+	if (!g.error && p.nunits) _pool_run(&p, jobs ? jobs : 1);
+
+	// Stitch the results in source order, whichever worker did them
+	m->error = g.error;
+	_add_funcs(m, g.nfuncs, g.funcs);
+	for (size_t i = 0; i < p.nunits; ++i) {
+		struct _vm_unit *u = p.units + i;
+		if (!m->error) m->error = u->error;
+		_add_funcs(m, u->nfuncs, u->funcs);
+		free(u->funcs);
+	}
+
+	free(p.units);
+	_gen_free(&g);
+	return !m->error;
+}
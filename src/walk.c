@@ -0,0 +1,231 @@
+// vim: noet
+
+#include <stdlib.h>
+#include "memstats.h"
+#include "walk.h"
+
+size_t expr_nchildren(struct ast_expr *e) {
+	switch (e->t) {
+	case EXPR_BINOP:
+		return 2;
+	case EXPR_UNOP:
+		return 1;
+	case EXPR_CALL:
+		return 1 + e->call.nargs;
+	case EXPR_IF:
+		return 3;
+	case EXPR_WHILE:
+		return 2;
+	case EXPR_RETURN:
+		return 1;
+	case EXPR_FUNC:
+		return 1;
+	case EXPR_ARR_LIT:
+		return e->array_lit.nelems;
+	case EXPR_COMPOSITE_LIT:
+		return e->composite_lit.nelems;
+	case EXPR_FIELD_ACCESS:
+		return 1;
+	case EXPR_LET:
+		return 3;
+	case EXPR_CAST:
+		return 1;
+
+	case EXPR_BREAK:
+	case EXPR_CONTINUE:
+	case EXPR_INT_LIT:
+	case EXPR_FLOAT_LIT:
+	case EXPR_BOOL_LIT:
+	case EXPR_IDENT:
+		return 0;
+	}
+	return 0;
+}
+
+struct ast_expr *expr_child(struct ast_expr *e, size_t i) {
+	switch (e->t) {
+	case EXPR_BINOP:
+		return i ? e->binop.y : e->binop.x;
+	case EXPR_UNOP:
+		return e->unop.x;
+	case EXPR_CALL:
+		return i ? e->call.args + i - 1 : e->call.func;
+	case EXPR_IF:
+		return i == 0 ? e->if_.cond : i == 1 ? e->if_.t : e->if_.f;
+	case EXPR_WHILE:
+		return i ? e->while_.body : e->while_.cond;
+	case EXPR_RETURN:
+		return e->return_.val;
+	case EXPR_FUNC:
+		return e->func.body;
+	case EXPR_ARR_LIT:
+		return e->array_lit.elems + i;
+	case EXPR_COMPOSITE_LIT:
+		return e->composite_lit.elems + i;
+	case EXPR_FIELD_ACCESS:
+		return e->field_access.aggr;
+	case EXPR_LET:
+		return i == 0 ? e->let.val : i == 1 ? e->let.body : e->let.deferred;
+	case EXPR_CAST:
+		return e->cast.val;
+
+	default:
+		return NULL;
+	}
+}
+
+bool expr_set_child(struct ast_expr *e, size_t i, struct ast_expr *c) {
+	switch (e->t) {
+	case EXPR_BINOP:
+		if (i) e->binop.y = c;
+		else e->binop.x = c;
+		return false;
+	case EXPR_UNOP:
+		e->unop.x = c;
+		return false;
+	case EXPR_CALL:
+		if (!i) {
+			e->call.func = c;
+			return false;
+		}
+		e->call.args[i-1] = *c;
+		return true;
+	case EXPR_IF:
+		if (i == 0) e->if_.cond = c;
+		else if (i == 1) e->if_.t = c;
+		else e->if_.f = c;
+		return false;
+	case EXPR_WHILE:
+		if (i) e->while_.body = c;
+		else e->while_.cond = c;
+		return false;
+	case EXPR_RETURN:
+		e->return_.val = c;
+		return false;
+	case EXPR_FUNC:
+		e->func.body = c;
+		return false;
+	case EXPR_ARR_LIT:
+		e->array_lit.elems[i] = *c;
+		return true;
+	case EXPR_COMPOSITE_LIT:
+		e->composite_lit.elems[i] = *c;
+		return true;
+	case EXPR_FIELD_ACCESS:
+		e->field_access.aggr = c;
+		return false;
+	case EXPR_LET:
+		if (i == 0) e->let.val = c;
+		else if (i == 1) e->let.body = c;
+		else e->let.deferred = c;
+		return false;
+	case EXPR_CAST:
+		e->cast.val = c;
+		return false;
+
+	default:
+		return false;
+	}
+}
+
+static void _walk_push(struct walk_stack *s, struct ast_expr *e) {
+	if (s->n == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 64;
+		s->frames = MEM_REALLOC(MEM_SCOPE, s->frames, s->alloc * sizeof *s->frames);
+	}
+	s->frames[s->n].e = e;
+	s->frames[s->n].next = 0;
+	++s->n;
+}
+
+void walk_expr(struct walk_stack *s, struct ast_expr *root, const struct walk_ops *ops, void *ctx) {
+	if (!root) return;
+	if (ops->pre && !ops->pre(root, ctx)) return;
+
+	// Frames below base belong to an enclosing walk
+	size_t base = s->n;
+	_walk_push(s, root);
+
+	while (s->n > base) {
+		struct ast_expr *e = s->frames[s->n-1].e;
+		size_t n = expr_nchildren(e), i = s->frames[s->n-1].next;
+
+		struct ast_expr *c = NULL;
+		while (i < n && !(c = expr_child(e, i))) ++i;
+		s->frames[s->n-1].next = i + 1;
+
+		if (i < n) {
+			if (ops->child) ops->child(e, i, ctx);
+			if (ops->pre && !ops->pre(c, ctx)) continue;
+			_walk_push(s, c);
+		} else {
+			--s->n;
+			if (ops->post) ops->post(e, ctx);
+		}
+	}
+}
+
+void walk_free(struct walk_stack *s) {
+	MEM_FREE(s->frames);
+	*s = (struct walk_stack){0};
+}
+
+// Cloning {{{
+
+struct _clone_ctx {
+	// Copies waiting for their parent
+	size_t n, alloc;
+	struct ast_expr **out;
+};
+
+static void _clone_post(struct ast_expr *e, void *ctx) {
+	struct _clone_ctx *c = ctx;
+
+	size_t n = expr_nchildren(e), npresent = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (expr_child(e, i)) ++npresent;
+	}
+	c->n -= npresent;
+	struct ast_expr **kids = c->out + c->n;
+
+	struct ast_expr *copy = MEM_ALLOC(MEM_EXPR + e->t, sizeof *copy);
+	*copy = *e;
+	switch (e->t) {
+	case EXPR_CALL:
+		copy->call.args = MEM_ALLOC(MEM_EXPR + e->t, e->call.nargs * sizeof *copy->call.args);
+		break;
+	case EXPR_ARR_LIT:
+		copy->array_lit.elems = MEM_ALLOC(MEM_EXPR + e->t, e->array_lit.nelems * sizeof *copy->array_lit.elems);
+		break;
+	case EXPR_COMPOSITE_LIT:
+		copy->composite_lit.elems = MEM_ALLOC(MEM_EXPR + e->t, e->composite_lit.nelems * sizeof *copy->composite_lit.elems);
+		break;
+	default:
+		break;
+	}
+
+	for (size_t i = 0, k = 0; i < n; ++i) {
+		if (!expr_child(e, i)) continue;
+		if (expr_set_child(copy, i, kids[k])) MEM_FREE(kids[k]);
+		++k;
+	}
+
+	if (c->n == c->alloc) {
+		c->alloc = c->alloc ? c->alloc * 2 : 16;
+		c->out = MEM_REALLOC(MEM_SCOPE, c->out, c->alloc * sizeof *c->out);
+	}
+	c->out[c->n++] = copy;
+}
+
+struct ast_expr *expr_clone(struct walk_stack *s, struct ast_expr *e) {
+	if (!e) return NULL;
+
+	struct _clone_ctx c = {0};
+	walk_expr(s, e, &(struct walk_ops){.post = _clone_post}, &c);
+
+	struct ast_expr *copy = c.out[0];
+	MEM_FREE(c.out);
+	return copy;
+}
+
+// }}}
@@ -0,0 +1,46 @@
+// vim: noet
+
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ast.h"
+
+// Children of an expression, in evaluation order. Optional children that are
+// absent are returned as NULL.
+size_t expr_nchildren(struct ast_expr *e);
+struct ast_expr *expr_child(struct ast_expr *e, size_t i);
+
+// Replaces child i. Children stored by pointer are pointed at c. Call
+// arguments and literal elements are stored inline, so *c is copied into
+// place instead; in that case this returns true and c may be freed.
+bool expr_set_child(struct ast_expr *e, size_t i, struct ast_expr *c);
+
+struct walk_ops {
+	// Called before the children. Returning false skips the children and post.
+	bool (*pre)(struct ast_expr *e, void *ctx);
+	// Called before descending into child i, once the previous children are done
+	void (*child)(struct ast_expr *e, size_t i, void *ctx);
+	void (*post)(struct ast_expr *e, void *ctx);
+};
+
+// Heap-allocated traversal stack. Its size is proportional to the depth of
+// the tree, and it may be reused across walks to avoid reallocating.
+struct walk_stack {
+	size_t n, alloc;
+	struct {
+		struct ast_expr *e;
+		size_t next;
+	} *frames;
+};
+
+// Walks the tree without recursing in C. Any op may be NULL. Walks may be
+// nested on the same stack from within ops.
+void walk_expr(struct walk_stack *s, struct ast_expr *root, const struct walk_ops *ops, void *ctx);
+void walk_free(struct walk_stack *s);
+
+// Deep-copies an expression. Types and names are shared with the original.
+struct ast_expr *expr_clone(struct walk_stack *s, struct ast_expr *e);
+
+#endif
@@ -0,0 +1,1828 @@
+// vim: noet
+
+#include <stdlib.h>
+#include <string.h>
+#include "x64.h"
+
+// Registers, numbered as they are encoded
+enum {
+	_RAX, _RCX, _RDX, _RBX, _RSP, _RBP, _RSI, _RDI,
+	_R8, _R9, _R10, _R11, _R12, _R13, _R14, _R15,
+};
+
+// rax, rcx, rdx and r11 are never allocated, so any instruction may use
+// them as scratch. So may the xmm registers, as floats are kept in
+// general registers between instructions.
+static const uint8_t _callee_saved[] = {_RBX, _R12, _R13, _R14, _R15};
+static const uint8_t _caller_saved[] = {_RSI, _RDI, _R8, _R9, _R10};
+static const uint8_t _int_args[] = {_RDI, _RSI, _RDX, _RCX, _R8, _R9};
+
+// Condition codes, for jcc, setcc and cmovcc
+enum {
+	_CC_B = 0x2, _CC_AE, _CC_E, _CC_NE, _CC_BE, _CC_A,
+	_CC_P = 0xa, _CC_NP, _CC_L, _CC_GE, _CC_LE, _CC_G,
+};
+
+// REX prefixes: one for 64-bit operands, and an empty one that makes byte
+// registers 4 to 7 mean spl to dil rather than ah to bh
+#define _W 0x48
+#define _REX 0x40
+
+// Calling convention {{{
+
+// SysV classes, for each eightbyte of a value
+enum _x64_class {
+	_NONE,
+	_INTEGER,
+	_SSE,
+	_X87,
+	_MEMORY,
+};
+
+struct _x64_abi {
+	enum _x64_class cls[2];
+	size_t size, align;
+};
+
+static bool _is_aggr(const struct val_type *t) {
+	return t->t == TYPE_STRUCT || t->t == TYPE_UNION;
+}
+
+static void _merge(enum _x64_class *c, enum _x64_class with) {
+	if (*c == with || with == _NONE) return;
+	if (*c == _NONE) {
+		*c = with;
+	} else if (*c == _MEMORY || with == _MEMORY) {
+		*c = _MEMORY;
+	} else if (*c == _INTEGER || with == _INTEGER) {
+		*c = _INTEGER;
+	} else {
+		// x87 mixed with anything else
+		*c = _MEMORY;
+	}
+}
+
+static void _classify_at(const struct val_type *t, size_t off, enum _x64_class cls[2]) {
+	switch (t->t) {
+	case TYPE_STRUCT:
+	case TYPE_UNION:;
+		size_t pos = 0;
+		for (size_t i = 0; i < t->composite.nfields; ++i) {
+			const struct val_type *ft = t->composite.fields[i].type;
+			size_t align = vm_alignof(ft);
+			if (t->t == TYPE_STRUCT) pos = (pos + align - 1) / align * align;
+			_classify_at(ft, off + (t->t == TYPE_STRUCT ? pos : 0), cls);
+			pos += vm_sizeof(ft);
+		}
+		break;
+	case TYPE_FLOAT:
+		if (t->float_ != F_80) {
+			_merge(&cls[off / 8], _SSE);
+		} else if (off) {
+			_merge(&cls[0], _MEMORY);
+		} else {
+			_merge(&cls[0], _X87);
+			_merge(&cls[1], _X87);
+		}
+		break;
+	case TYPE_VOID:
+		break;
+	default:
+		_merge(&cls[off / 8], _INTEGER);
+		break;
+	}
+}
+
+static struct _x64_abi _classify(const struct val_type *t) {
+	struct _x64_abi a = {{_NONE, _NONE}, vm_sizeof(t), vm_alignof(t)};
+	if (t->t == TYPE_VOID) return a;
+	if (a.size > 16) {
+		a.cls[0] = a.cls[1] = _MEMORY;
+		return a;
+	}
+	_classify_at(t, 0, a.cls);
+	if (a.cls[0] == _MEMORY || a.cls[1] == _MEMORY) a.cls[0] = a.cls[1] = _MEMORY;
+	return a;
+}
+
+// Where an argument goes: in registers, one per eightbyte, or on the stack
+// at an offset from the first stack argument
+struct _x64_place {
+	struct _x64_abi abi;
+	bool stack;
+	uint8_t regs[2];
+	size_t off;
+};
+
+struct _x64_cc {
+	size_t ngpr, nsse, stack;
+};
+
+static struct _x64_place _place(struct _x64_cc *cc, const struct val_type *t) {
+	struct _x64_place p = {.abi = _classify(t)};
+	size_t ngpr = 0, nsse = 0;
+	bool mem = false;
+	for (int i = 0; i < 2; ++i) {
+		switch (p.abi.cls[i]) {
+		case _INTEGER: ++ngpr; break;
+		case _SSE: ++nsse; break;
+		case _X87: case _MEMORY: mem = true; break;
+		case _NONE: break;
+		}
+	}
+
+	if (!mem && cc->ngpr + ngpr <= 6 && cc->nsse + nsse <= 8) {
+		for (int i = 0; i < 2; ++i) {
+			if (p.abi.cls[i] == _INTEGER) p.regs[i] = _int_args[cc->ngpr++];
+			if (p.abi.cls[i] == _SSE) p.regs[i] = cc->nsse++;
+		}
+		return p;
+	}
+
+	size_t align = p.abi.align > 8 ? 16 : 8;
+	p.stack = true;
+	p.off = (cc->stack + align - 1) / align * align;
+	cc->stack = p.off + (p.abi.size + 7) / 8 * 8;
+	if (!_is_aggr(t) && cc->stack < p.off + 8) cc->stack = p.off + 8;
+	return p;
+}
+
+// Whether a result comes back through a pointer passed in rdi
+static bool _hidden(const struct val_type *t) {
+	return _is_aggr(t) && _classify(t).cls[0] == _MEMORY;
+}
+
+// }}}
+
+// Encoding {{{
+
+typedef uint64_t _x64_set[4];
+
+// Where a virtual register lives: one register for the whole function, or
+// a frame slot
+struct _x64_vreg {
+	// Its live range, as positions: 2k + 2 where instruction k reads, 2k + 3
+	// where it writes, and 1 for arguments on entry
+	size_t start, end;
+	size_t nuses, ndefs;
+	// Holds an F80 somewhere, so it lives in a 16-byte slot
+	bool wide;
+	// Live at a call, so it needs a callee-saved register
+	bool call;
+	// Folded into the one instruction that uses it
+	bool folded;
+	int reg;
+	int32_t slot;
+};
+
+struct _x64_block {
+	size_t start, end;
+	size_t nsuccs, succs[2];
+	_x64_set gen, kill, in, out;
+};
+
+struct _x64_fixup {
+	size_t at, pc;
+};
+
+struct _x64_gen {
+	struct vm_module *m;
+	struct elf_obj *o;
+	const char *error;
+
+	// The symbol of each of the module's functions, and the same sorted by
+	// address, for literals
+	size_t *syms;
+	struct _x64_func {
+		struct vm_func *f;
+		size_t sym;
+	} *by_addr;
+
+	// The function being compiled, and what's known of each instruction
+	struct vm_func *f;
+	size_t ninsns;
+	size_t *pcs;
+	// Instruction index of each pc, or SIZE_MAX for COPY sizes
+	size_t *index;
+	size_t *offsets;
+	bool *leader, *skip;
+	// For CALLs, the symbol they call directly, plus one
+	size_t *direct;
+	// The reloc of each constant, or NULL
+	struct vm_reloc **konsts;
+
+	size_t nblocks;
+	struct _x64_block *blocks;
+	struct _x64_vreg vregs[256];
+
+	// Frame layout, as offsets from rbp
+	uint16_t saved;
+	size_t nsaved;
+	int32_t hidden, tmp, mem, result;
+	int32_t *arg_slots;
+	int32_t frame;
+
+	size_t ncode, code_alloc;
+	uint8_t *code;
+	size_t nfixups, fixups_alloc;
+	struct _x64_fixup *fixups;
+	size_t nrelocs, relocs_alloc;
+	struct elf_reloc *relocs;
+};
+
+// A register, or memory at base + disp
+struct _x64_rm {
+	bool mem;
+	uint8_t reg;
+	int32_t disp;
+};
+
+static struct _x64_rm _r(uint8_t reg) {
+	return (struct _x64_rm){false, reg, 0};
+}
+
+static struct _x64_rm _m(uint8_t base, int32_t disp) {
+	return (struct _x64_rm){true, base, disp};
+}
+
+static void _byte(struct _x64_gen *x, uint8_t b) {
+	if (x->ncode == x->code_alloc) {
+		x->code_alloc = x->code_alloc ? x->code_alloc * 2 : 4096;
+		x->code = realloc(x->code, x->code_alloc);
+	}
+	x->code[x->ncode++] = b;
+}
+
+static void _u32(struct _x64_gen *x, uint32_t v) {
+	for (int i = 0; i < 4; ++i) _byte(x, v >> i * 8);
+}
+
+static void _u64(struct _x64_gen *x, uint64_t v) {
+	for (int i = 0; i < 8; ++i) _byte(x, v >> i * 8);
+}
+
+// Opcodes of one to three bytes, most significant first
+static void _opcode(struct _x64_gen *x, uint32_t op) {
+	if (op > 0xffff) _byte(x, op >> 16);
+	if (op > 0xff) _byte(x, op >> 8);
+	_byte(x, op);
+}
+
+static void _modrm(struct _x64_gen *x, uint8_t pfx, uint8_t rex, uint32_t op, uint8_t reg, struct _x64_rm rm) {
+	if (pfx) _byte(x, pfx);
+	rex |= (reg & 8) >> 1 | (rm.reg & 8) >> 3;
+	if (rex) _byte(x, rex | 0x40);
+	_opcode(x, op);
+
+	uint8_t r = (reg & 7) << 3, b = rm.reg & 7;
+	if (!rm.mem) {
+		_byte(x, 0xc0 | r | b);
+		return;
+	}
+	// rbp and r13 have no form without a displacement, and rsp and r12
+	// need a SIB byte
+	uint8_t mod = !rm.disp && b != 5 ? 0 : rm.disp >= -128 && rm.disp <= 127 ? 0x40 : 0x80;
+	_byte(x, mod | r | b);
+	if (b == 4) _byte(x, 0x24);
+	if (mod == 0x40) _byte(x, rm.disp);
+	if (mod == 0x80) _u32(x, rm.disp);
+}
+
+static void _reloc(struct _x64_gen *x, size_t sym, uint32_t type, int64_t addend) {
+	if (x->nrelocs == x->relocs_alloc) {
+		x->relocs_alloc = x->relocs_alloc ? x->relocs_alloc * 2 : 64;
+		x->relocs = realloc(x->relocs, x->relocs_alloc * sizeof *x->relocs);
+	}
+	x->relocs[x->nrelocs++] = (struct elf_reloc){x->ncode, sym, type, addend};
+}
+
+// An instruction addressing a symbol relative to rip
+static void _rip(struct _x64_gen *x, uint8_t rex, uint32_t op, uint8_t reg, size_t sym, uint32_t type) {
+	rex |= (reg & 8) >> 1;
+	if (rex) _byte(x, rex | 0x40);
+	_opcode(x, op);
+	_byte(x, (reg & 7) << 3 | 5);
+	_reloc(x, sym, type, -4);
+	_u32(x, 0);
+}
+
+// Instructions with no operands, or their operands built in
+static void _raw(struct _x64_gen *x, size_t n, const uint8_t *bytes) {
+	for (size_t i = 0; i < n; ++i) _byte(x, bytes[i]);
+}
+#define _RAW(x, ...) _raw(x, sizeof (uint8_t[]){__VA_ARGS__}, (uint8_t[]){__VA_ARGS__})
+
+static void _mov(struct _x64_gen *x, uint8_t dst, struct _x64_rm src) {
+	if (!src.mem && src.reg == dst) return;
+	_modrm(x, 0, _W, 0x8b, dst, src);
+}
+
+static void _store(struct _x64_gen *x, struct _x64_rm dst, uint8_t src) {
+	if (!dst.mem) {
+		_mov(x, dst.reg, _r(src));
+	} else {
+		_modrm(x, 0, _W, 0x89, src, dst);
+	}
+}
+
+static void _lea(struct _x64_gen *x, uint8_t dst, struct _x64_rm src) {
+	_modrm(x, 0, _W, 0x8d, dst, src);
+}
+
+// Flags are clobbered when v is zero
+static void _imm(struct _x64_gen *x, uint8_t dst, uint64_t v) {
+	if (!v) {
+		_modrm(x, 0, 0, 0x31, dst, _r(dst));
+	} else if (v <= UINT32_MAX) {
+		if (dst & 8) _byte(x, 0x41);
+		_byte(x, 0xb8 | (dst & 7));
+		_u32(x, v);
+	} else if ((int64_t)v >= INT32_MIN && (int64_t)v <= INT32_MAX) {
+		_modrm(x, 0, _W, 0xc7, 0, _r(dst));
+		_u32(x, v);
+	} else {
+		_byte(x, _W | (dst & 8) >> 3);
+		_byte(x, 0xb8 | (dst & 7));
+		_u64(x, v);
+	}
+}
+
+// Adds a 32-bit immediate, with op the /digit of the 0x81 group
+static void _alu_imm(struct _x64_gen *x, uint8_t op, struct _x64_rm rm, int32_t imm) {
+	if (imm >= -128 && imm <= 127) {
+		_modrm(x, 0, _W, 0x83, op, rm);
+		_byte(x, imm);
+	} else {
+		_modrm(x, 0, _W, 0x81, op, rm);
+		_u32(x, imm);
+	}
+}
+
+// setcc al, then zero-extended to all of rax
+static void _setcc(struct _x64_gen *x, uint8_t cc) {
+	_RAW(x, 0x0f, 0x90 | cc, 0xc0);
+	_RAW(x, 0x0f, 0xb6, 0xc0);
+}
+
+// A short jump forwards, returning where to patch
+static size_t _jcc8(struct _x64_gen *x, int cc) {
+	_byte(x, cc < 0 ? 0xeb : 0x70 | cc);
+	_byte(x, 0);
+	return x->ncode - 1;
+}
+
+static void _patch8(struct _x64_gen *x, size_t at) {
+	x->code[at] = x->ncode - (at + 1);
+}
+
+// A jump to an instruction of the bytecode, patched once it's placed
+static void _jump(struct _x64_gen *x, int cc, size_t pc) {
+	if (cc < 0) {
+		_byte(x, 0xe9);
+	} else {
+		_RAW(x, 0x0f, 0x80 | cc);
+	}
+	if (x->nfixups == x->fixups_alloc) {
+		x->fixups_alloc = x->fixups_alloc ? x->fixups_alloc * 2 : 64;
+		x->fixups = realloc(x->fixups, x->fixups_alloc * sizeof *x->fixups);
+	}
+	x->fixups[x->nfixups++] = (struct _x64_fixup){x->ncode, pc};
+	_u32(x, 0);
+}
+
+// xmm <- integer register or memory, and back, as 32 or 64 bits
+static void _to_xmm(struct _x64_gen *x, bool wide, uint8_t xmm, struct _x64_rm src) {
+	_modrm(x, 0x66, wide ? _W : 0, 0x0f6e, xmm, src);
+}
+
+static void _from_xmm(struct _x64_gen *x, bool wide, struct _x64_rm dst, uint8_t xmm) {
+	_modrm(x, 0x66, wide ? _W : 0, 0x0f7e, xmm, dst);
+}
+
+// x87 memory operations: the opcode, and the /digit
+static void _x87(struct _x64_gen *x, uint8_t op, uint8_t digit, struct _x64_rm rm) {
+	_modrm(x, 0, 0, op, digit, rm);
+}
+
+#define _FLD32 0xd9, 0
+#define _FLD64 0xdd, 0
+#define _FLD80 0xdb, 5
+#define _FSTP32 0xd9, 3
+#define _FSTP64 0xdd, 3
+#define _FSTP80 0xdb, 7
+
+// Loads an integer of type t from src, extended to 64 bits as the VM keeps
+// it. C only defines the bits of its own width.
+static void _extend(struct _x64_gen *x, const struct val_type *t, uint8_t dst, struct _x64_rm src) {
+	// Byte registers 4 to 7 need an empty REX prefix
+	uint8_t rex8 = !src.mem && src.reg >= 4 ? _REX : 0;
+	if (t->t == TYPE_BOOL) {
+		_modrm(x, 0, rex8, 0x0fb6, dst, src);
+		return;
+	}
+	if (t->t != TYPE_INT) {
+		_mov(x, dst, src);
+		return;
+	}
+	switch (t->int_) {
+	case U_8: _modrm(x, 0, rex8, 0x0fb6, dst, src); break;
+	case I_8: _modrm(x, 0, _W, 0x0fbe, dst, src); break;
+	case U_16: _modrm(x, 0, 0, 0x0fb7, dst, src); break;
+	case I_16: _modrm(x, 0, _W, 0x0fbf, dst, src); break;
+	case U_32: _modrm(x, 0, 0, 0x8b, dst, src); break;
+	case I_32: _modrm(x, 0, _W, 0x63, dst, src); break;
+	default: _mov(x, dst, src); break;
+	}
+}
+
+// Copies n bytes from one register's address to another's, loading all
+// of it before storing any, so that they may overlap. Clobbers rax, rcx
+// and the xmm registers.
+static void _copy(struct _x64_gen *x, uint8_t dst, uint8_t src, size_t n) {
+	if (n >= 16) {
+		size_t nchunks = (n + 15) / 16;
+		for (size_t i = 0; i < nchunks; ++i) {
+			size_t off = i == nchunks - 1 ? n - 16 : i * 16;
+			_modrm(x, 0, 0, 0x0f10, i, _m(src, off));
+		}
+		for (size_t i = 0; i < nchunks; ++i) {
+			size_t off = i == nchunks - 1 ? n - 16 : i * 16;
+			_modrm(x, 0, 0, 0x0f11, i, _m(dst, off));
+		}
+		return;
+	}
+
+	// Two overlapping halves of the largest size that fits
+	size_t size = n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : n;
+	if (!size) return;
+	uint8_t pfx = size == 2 ? 0x66 : 0, rex = size == 8 ? _W : 0;
+	uint32_t load = size == 1 ? 0x8a : 0x8b, store = size == 1 ? 0x88 : 0x89;
+	_modrm(x, pfx, rex, load, _RAX, _m(src, 0));
+	if (n > size) _modrm(x, pfx, rex, load, _RCX, _m(src, n - size));
+	_modrm(x, pfx, rex, store, _RAX, _m(dst, 0));
+	if (n > size) _modrm(x, pfx, rex, store, _RCX, _m(dst, n - size));
+}
+
+// }}}
+
+// Analysis {{{
+
+#define _SET_HAS(s, v) ((s)[(v) / 64] >> (v) % 64 & 1)
+#define _SET_ADD(s, v) ((s)[(v) / 64] |= (uint64_t)1 << (v) % 64)
+#define _SET_DEL(s, v) ((s)[(v) / 64] &= ~((uint64_t)1 << (v) % 64))
+
+static bool _is_unary(enum vm_op op) {
+	return op == VM_MOV
+		|| (op >= VM_NEG && op <= VM_TOBOOL)
+		|| op == VM_NEG_F32 || op == VM_TOBOOL_F32
+		|| op == VM_NEG_F64 || op == VM_TOBOOL_F64
+		|| op == VM_NEG_F80 || op == VM_TOBOOL_F80
+		|| (op >= VM_F32_F64 && op <= VM_LDF80);
+}
+
+// The registers an instruction reads, and the one it writes or -1
+static size_t _operands(uint32_t i, uint8_t *uses, int *def) {
+	enum vm_op op = VM_OP(i);
+	uint8_t a = VM_A(i), b = VM_B(i), c = VM_C(i);
+	*def = -1;
+
+	switch (op) {
+	case VM_LOADK:
+	case VM_LOADI:
+	case VM_ADDR:
+		*def = a;
+		return 0;
+	case VM_JMP:
+	case VM_RET0:
+		return 0;
+	case VM_JT:
+	case VM_JF:
+	case VM_RET:
+		uses[0] = a;
+		return 1;
+	case VM_COPY:
+		uses[0] = a;
+		uses[1] = b;
+		return 2;
+	case VM_CALL:
+		*def = a;
+		for (size_t j = 0; j <= c; ++j) uses[j] = b + j;
+		return c + 1;
+	default:
+		if (op >= VM_ST8 && op <= VM_STF80) {
+			uses[0] = a;
+			uses[1] = b;
+			return 2;
+		}
+		*def = a;
+		uses[0] = b;
+		if (_is_unary(op)) return 1;
+		uses[1] = c;
+		return 2;
+	}
+}
+
+static bool _is_float80_op(enum vm_op op) {
+	return op >= VM_ADD_F80 && op <= VM_TOBOOL_F80;
+}
+
+static const struct val_type *_call_type(struct _x64_gen *x, size_t ncall) {
+	if (ncall >= x->f->ncalls || x->f->call_types[ncall].t != TYPE_FUNC) {
+		if (!x->error) x->error = "call without a function type";
+		return NULL;
+	}
+	return x->f->call_types + ncall;
+}
+
+static bool _is_f80(const struct val_type *t) {
+	return t->t == TYPE_FLOAT && t->float_ == F_80;
+}
+
+// Splits the code into basic blocks
+static void _blocks(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	x->ninsns = 0;
+	for (size_t pc = 0; pc < f->ncode; ++pc) {
+		x->index[pc] = x->ninsns;
+		x->pcs[x->ninsns++] = pc;
+		if (VM_OP(f->code[pc]) == VM_COPY) x->index[++pc] = SIZE_MAX;
+	}
+	x->index[f->ncode] = x->ninsns;
+
+	memset(x->leader, 0, (x->ninsns + 1) * sizeof *x->leader);
+	x->leader[0] = true;
+	for (size_t k = 0; k < x->ninsns; ++k) {
+		size_t pc = x->pcs[k];
+		uint32_t i = f->code[pc];
+		switch (VM_OP(i)) {
+		case VM_JMP:
+			x->leader[x->index[pc + 1 + VM_SAX(i)]] = true;
+			x->leader[k + 1] = true;
+			break;
+		case VM_JT:
+		case VM_JF:
+			x->leader[x->index[pc + 1 + VM_SBX(i)]] = true;
+			x->leader[k + 1] = true;
+			break;
+		case VM_RET:
+		case VM_RET0:
+			x->leader[k + 1] = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	x->nblocks = 0;
+	for (size_t k = 0; k < x->ninsns; ++k) {
+		if (!x->leader[k]) continue;
+		struct _x64_block *b = x->blocks + x->nblocks++;
+		memset(b, 0, sizeof *b);
+		b->start = k;
+		b->end = k;
+		while (b->end + 1 < x->ninsns && !x->leader[b->end + 1]) ++b->end;
+	}
+
+	// Successors, as block numbers
+	size_t *block_of = malloc((x->ninsns + 1) * sizeof *block_of);
+	for (size_t n = 0; n < x->nblocks; ++n) {
+		for (size_t k = x->blocks[n].start; k <= x->blocks[n].end; ++k) block_of[k] = n;
+	}
+	block_of[x->ninsns] = SIZE_MAX;
+	for (size_t n = 0; n < x->nblocks; ++n) {
+		struct _x64_block *b = x->blocks + n;
+		size_t pc = x->pcs[b->end];
+		uint32_t i = f->code[pc];
+		switch (VM_OP(i)) {
+		case VM_JMP:
+			b->succs[b->nsuccs++] = block_of[x->index[pc + 1 + VM_SAX(i)]];
+			break;
+		case VM_JT:
+		case VM_JF:
+			b->succs[b->nsuccs++] = block_of[x->index[pc + 1 + VM_SBX(i)]];
+			// fallthrough
+		default:
+			if (block_of[b->end + 1] != SIZE_MAX) b->succs[b->nsuccs++] = block_of[b->end + 1];
+			break;
+		case VM_RET:
+		case VM_RET0:
+			break;
+		}
+	}
+	free(block_of);
+}
+
+static void _extend_range(struct _x64_vreg *v, size_t pos) {
+	if (pos < v->start) v->start = pos;
+	if (pos > v->end) v->end = pos;
+}
+
+// Liveness, and from it one range for each register covering all of its
+// lifetime
+static void _ranges(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	uint8_t uses[257];
+	int def;
+
+	for (size_t n = 0; n < x->nblocks; ++n) {
+		struct _x64_block *b = x->blocks + n;
+		for (size_t k = b->end + 1; k-- > b->start;) {
+			size_t nuses = _operands(f->code[x->pcs[k]], uses, &def);
+			if (def >= 0) {
+				_SET_ADD(b->kill, def);
+				_SET_DEL(b->gen, def);
+			}
+			for (size_t j = 0; j < nuses; ++j) _SET_ADD(b->gen, uses[j]);
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t n = x->nblocks; n-- > 0;) {
+			struct _x64_block *b = x->blocks + n;
+			for (size_t s = 0; s < b->nsuccs; ++s) {
+				for (int w = 0; w < 4; ++w) b->out[w] |= x->blocks[b->succs[s]].in[w];
+			}
+			for (int w = 0; w < 4; ++w) {
+				uint64_t in = b->gen[w] | (b->out[w] & ~b->kill[w]);
+				if (in != b->in[w]) changed = true;
+				b->in[w] = in;
+			}
+		}
+	}
+
+	for (size_t n = 0; n < x->nblocks; ++n) {
+		struct _x64_block *b = x->blocks + n;
+		for (size_t v = 0; v < 256; ++v) {
+			if (_SET_HAS(b->in, v)) _extend_range(x->vregs + v, 2 * b->start + 2);
+			if (_SET_HAS(b->out, v)) _extend_range(x->vregs + v, 2 * b->end + 3);
+		}
+		for (size_t k = b->start; k <= b->end; ++k) {
+			size_t nuses = _operands(f->code[x->pcs[k]], uses, &def);
+			for (size_t j = 0; j < nuses; ++j) {
+				_extend_range(x->vregs + uses[j], 2 * k + 2);
+				++x->vregs[uses[j]].nuses;
+			}
+			if (def >= 0) {
+				_extend_range(x->vregs + def, 2 * k + 3);
+				++x->vregs[def].ndefs;
+			}
+		}
+	}
+	for (size_t v = 0; v < f->nargs; ++v) {
+		if (x->vregs[v].nuses) _extend_range(x->vregs + v, 1);
+	}
+}
+
+// Registers that hold an F80 anywhere get 16-byte slots. They're found
+// from the ops and types that involve them, then through moves.
+static void _widen(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	struct _x64_vreg *v = x->vregs;
+	size_t ncall = 0;
+
+	for (size_t i = 0; i < f->nargs; ++i) {
+		if (_is_f80(f->arg_types + i)) v[i].wide = true;
+	}
+	for (size_t k = 0; k < x->ninsns; ++k) {
+		uint32_t i = f->code[x->pcs[k]];
+		enum vm_op op = VM_OP(i);
+		uint8_t a = VM_A(i), b = VM_B(i), c = VM_C(i);
+
+		if (_is_float80_op(op)) {
+			bool to_bool = op == VM_EQ_F80 || op == VM_LT_F80 || op == VM_LE_F80 || op == VM_TOBOOL_F80;
+			if (!to_bool) v[a].wide = true;
+			v[b].wide = true;
+			if (!_is_unary(op)) v[c].wide = true;
+		} else if (op == VM_F32_F80 || op == VM_F64_F80 || op == VM_LDF80) {
+			v[a].wide = true;
+		} else if (op == VM_F80_F32 || op == VM_F80_F64 || op == VM_STF80) {
+			v[b].wide = true;
+		} else if (op == VM_RET && _is_f80(&f->ret_type)) {
+			v[a].wide = true;
+		} else if (op == VM_CALL) {
+			const struct val_type *t = _call_type(x, ncall++);
+			if (!t) return;
+			if (_is_f80(t->func.ret_type)) v[a].wide = true;
+			for (size_t j = 0; j < c; ++j) {
+				if (_is_f80(&t->func.args[j].to)) v[b + 1 + j].wide = true;
+			}
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t k = 0; k < x->ninsns; ++k) {
+			uint32_t i = f->code[x->pcs[k]];
+			if (VM_OP(i) != VM_MOV || v[VM_A(i)].wide == v[VM_B(i)].wide) continue;
+			v[VM_A(i)].wide = v[VM_B(i)].wide = true;
+			changed = true;
+		}
+	}
+}
+
+static size_t _reloc_sym(struct _x64_gen *x, struct vm_reloc *r, bool *got);
+
+// Folds what needn't be materialized: the address of a function that is
+// only called, and a comparison that is only branched on
+// Whether v is dead after instruction k of block b
+static bool _dead_after(struct _x64_gen *x, struct _x64_block *b, size_t k, uint8_t v) {
+	uint8_t uses[257];
+	int def;
+	for (size_t j = k + 1; j <= b->end; ++j) {
+		size_t nuses = _operands(x->f->code[x->pcs[j]], uses, &def);
+		for (size_t u = 0; u < nuses; ++u) {
+			if (uses[u] == v) return false;
+		}
+		if (def == v) return true;
+	}
+	return !_SET_HAS(b->out, v);
+}
+
+// A function constant that only feeds a call becomes a direct call, and a
+// comparison that only feeds the branch after it becomes a compare and jump.
+// When that was the register's only value it needs no location at all.
+static void _fold(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	int known[256];
+	uint8_t uses[257];
+	int def;
+
+	for (size_t n = 0; n < x->nblocks; ++n) {
+		struct _x64_block *b = x->blocks + n;
+		for (int r = 0; r < 256; ++r) known[r] = -1;
+
+		for (size_t k = b->start; k <= b->end; ++k) {
+			uint32_t i = f->code[x->pcs[k]];
+			enum vm_op op = VM_OP(i);
+			uint8_t a = VM_A(i), bb = VM_B(i);
+			struct _x64_vreg *va = x->vregs + a, *vb = x->vregs + bb;
+
+			if (op == VM_CALL && known[bb] >= 0 && !vb->wide && _dead_after(x, b, k, bb)) {
+				size_t load = known[bb];
+				bool got;
+				x->skip[load] = true;
+				x->direct[k] = 1 + _reloc_sym(x, x->konsts[VM_BX(f->code[x->pcs[load]])], &got);
+				if (vb->nuses == 1 && vb->ndefs == 1) vb->folded = true;
+			}
+			if ((op == VM_EQ || (op >= VM_LTS && op <= VM_LEU)) && k < b->end) {
+				uint32_t next = f->code[x->pcs[k + 1]];
+				if ((VM_OP(next) == VM_JT || VM_OP(next) == VM_JF) && VM_A(next) == a
+						&& !va->wide && _dead_after(x, b, k + 1, a)) {
+					x->skip[k + 1] = true;
+					if (va->nuses == 1 && va->ndefs == 1) va->folded = true;
+				}
+			}
+
+			// Any other read needs the constant in its register
+			size_t nuses = _operands(i, uses, &def);
+			for (size_t j = 0; j < nuses; ++j) known[uses[j]] = -1;
+			if (def >= 0) known[def] = -1;
+			if (op == VM_LOADK && x->konsts[VM_BX(i)]) known[a] = k;
+		}
+	}
+}
+
+// }}}
+
+// Register allocation {{{
+
+static int _by_start(const void *a, const void *b) {
+	const struct _x64_vreg *x = *(struct _x64_vreg *const *)a, *y = *(struct _x64_vreg *const *)b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+static bool _in(const uint8_t *regs, size_t n, int reg) {
+	for (size_t i = 0; i < n; ++i) {
+		if (regs[i] == reg) return true;
+	}
+	return false;
+}
+
+// Linear scan over the ranges, in order of their start. When registers
+// run out, whichever range ends last is spilled for all of its life.
+static void _allocate(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	struct _x64_vreg *order[256], *active[16];
+	size_t norder = 0, nactive = 0;
+
+	// Calls, and copies big enough to call memmove, clobber the rest
+	size_t ncalls = 0, calls_alloc = 0;
+	size_t *call_pos = NULL;
+	for (size_t k = 0; k < x->ninsns; ++k) {
+		uint32_t i = f->code[x->pcs[k]];
+		if (VM_OP(i) == VM_CALL || (VM_OP(i) == VM_COPY && f->code[x->pcs[k] + 1] > 128)) {
+			if (ncalls == calls_alloc) {
+				calls_alloc = calls_alloc ? calls_alloc * 2 : 16;
+				call_pos = realloc(call_pos, calls_alloc * sizeof *call_pos);
+			}
+			call_pos[ncalls++] = 2 * k + 2;
+		}
+	}
+
+	for (size_t r = 0; r < 256; ++r) {
+		struct _x64_vreg *v = x->vregs + r;
+		v->reg = -1;
+		if (v->start > v->end || v->wide || v->folded) continue;
+
+		// Arguments arrive in registers that calls use
+		v->call = r < f->nargs;
+		size_t lo = 0, hi = ncalls;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (call_pos[mid] < v->start) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo < ncalls && call_pos[lo] <= v->end) v->call = true;
+		order[norder++] = v;
+	}
+	free(call_pos);
+	qsort(order, norder, sizeof *order, _by_start);
+
+	for (size_t n = 0; n < norder; ++n) {
+		struct _x64_vreg *v = order[n];
+		size_t keep = 0;
+		for (size_t i = 0; i < nactive; ++i) {
+			if (active[i]->end >= v->start) active[keep++] = active[i];
+		}
+		nactive = keep;
+
+		// Caller-saved registers first, as the others cost a push and pop
+		uint8_t cands[10];
+		size_t ncands = 0;
+		if (!v->call) {
+			memcpy(cands, _caller_saved, sizeof _caller_saved);
+			ncands = sizeof _caller_saved;
+		}
+		memcpy(cands + ncands, _callee_saved, sizeof _callee_saved);
+		ncands += sizeof _callee_saved;
+
+		for (size_t c = 0; c < ncands && v->reg < 0; ++c) {
+			bool taken = false;
+			for (size_t i = 0; i < nactive; ++i) taken |= active[i]->reg == cands[c];
+			if (!taken) v->reg = cands[c];
+		}
+		if (v->reg >= 0) {
+			active[nactive++] = v;
+			continue;
+		}
+
+		size_t spill = SIZE_MAX;
+		for (size_t i = 0; i < nactive; ++i) {
+			if (!_in(cands, ncands, active[i]->reg)) continue;
+			if (spill == SIZE_MAX || active[i]->end > active[spill]->end) spill = i;
+		}
+		if (spill != SIZE_MAX && active[spill]->end > v->end) {
+			v->reg = active[spill]->reg;
+			active[spill]->reg = -1;
+			active[spill] = v;
+		}
+	}
+
+	x->saved = 0;
+	x->nsaved = 0;
+	for (size_t r = 0; r < 256; ++r) {
+		int reg = x->vregs[r].reg;
+		if (reg >= 0 && _in(_callee_saved, sizeof _callee_saved, reg) && !(x->saved & 1 << reg)) {
+			x->saved |= 1 << reg;
+			++x->nsaved;
+		}
+	}
+}
+
+// }}}
+
+// Frame layout {{{
+
+static int32_t _align16(int32_t off) {
+	return (off + 15) & ~15;
+}
+
+// From rbp down: saved registers, the hidden result pointer, scratch for
+// the x87, spills, copies of aggregate arguments, frame memory, and the
+// results of calls. Outgoing stack arguments are at rsp.
+static void _layout(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	int32_t off = 8 * x->nsaved;
+
+	if (_hidden(&f->ret_type)) {
+		off += 8;
+		x->hidden = -off;
+	}
+	off = _align16(off + 16);
+	x->tmp = -off;
+
+	// Wide arguments are used where the caller left them
+	struct _x64_cc cc = {.ngpr = _hidden(&f->ret_type)};
+	for (size_t i = 0; i < f->nargs; ++i) {
+		struct _x64_place p = _place(&cc, f->arg_types + i);
+		x->arg_slots[i] = 0;
+		if (_is_aggr(f->arg_types + i)) {
+			if (!p.stack) {
+				off = _align16(off + 16);
+				x->arg_slots[i] = -off;
+			}
+		} else if (_is_f80(f->arg_types + i)) {
+			x->vregs[i].slot = 16 + p.off;
+		}
+	}
+
+	for (size_t r = 0; r < 256; ++r) {
+		struct _x64_vreg *v = x->vregs + r;
+		if (v->start > v->end || v->reg >= 0 || v->folded || v->slot > 0) continue;
+		if (v->wide) {
+			off = _align16(off + 16);
+		} else {
+			off += 8;
+		}
+		v->slot = -off;
+	}
+
+	off = _align16(off + f->memsize);
+	x->mem = -off;
+
+	// Results of calls, and their outgoing arguments
+	size_t result = 0, out = 0, ncall = 0;
+	for (size_t k = 0; k < x->ninsns; ++k) {
+		uint32_t i = f->code[x->pcs[k]];
+		if (VM_OP(i) != VM_CALL) continue;
+		const struct val_type *t = _call_type(x, ncall++);
+		if (!t) return;
+
+		if (_is_aggr(t->func.ret_type)) {
+			size_t size = (vm_sizeof(t->func.ret_type) + 15) & ~(size_t)15;
+			if (size > result) result = size;
+		}
+		struct _x64_cc cc = {.ngpr = _hidden(t->func.ret_type)};
+		for (size_t j = 0; j < VM_C(i); ++j) _place(&cc, &t->func.args[j].to);
+		if (cc.stack > out) out = cc.stack;
+	}
+	off = _align16(off + result);
+	x->result = -off;
+
+	x->frame = _align16(off + out) - 8 * x->nsaved;
+}
+
+// }}}
+
+// Instruction selection {{{
+
+static struct _x64_rm _loc(struct _x64_gen *x, uint8_t r) {
+	struct _x64_vreg *v = x->vregs + r;
+	return v->reg >= 0 ? _r(v->reg) : _m(_RBP, v->slot);
+}
+
+// A register holding r's value, loading it into scratch if it has none
+static uint8_t _get(struct _x64_gen *x, uint8_t r, uint8_t scratch) {
+	struct _x64_rm loc = _loc(x, r);
+	if (!loc.mem) return loc.reg;
+	_mov(x, scratch, loc);
+	return scratch;
+}
+
+// The register to compute r's new value in
+static uint8_t _dst(struct _x64_gen *x, uint8_t r, uint8_t scratch) {
+	int reg = x->vregs[r].reg;
+	return reg >= 0 ? reg : scratch;
+}
+
+static void _set(struct _x64_gen *x, uint8_t r, uint8_t reg) {
+	_store(x, _loc(x, r), reg);
+}
+
+static bool _same(struct _x64_rm a, struct _x64_rm b) {
+	return !a.mem && !b.mem && a.reg == b.reg;
+}
+
+// A memory operand holding r's value, for the x87
+static struct _x64_rm _in_mem(struct _x64_gen *x, uint8_t r, int32_t tmp) {
+	struct _x64_rm loc = _loc(x, r);
+	if (loc.mem) return loc;
+	_store(x, _m(_RBP, tmp), loc.reg);
+	return _m(_RBP, tmp);
+}
+
+// fprem until the remainder is complete, leaving it in st(0) with the
+// divisor popped
+static void _fprem(struct _x64_gen *x) {
+	size_t loop = x->ncode;
+	_RAW(x, 0xd9, 0xf8); // fprem
+	_RAW(x, 0xdf, 0xe0); // fnstsw ax
+	_RAW(x, 0xf6, 0xc4, 0x04); // test ah, C2
+	_RAW(x, 0x75, (uint8_t)(loop - (x->ncode + 2)));
+	_RAW(x, 0xdd, 0xd9); // fstp st(1)
+}
+
+static void _int_binop(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	static const uint32_t opcodes[] = {
+		[VM_ADD] = 0x03, [VM_SUB] = 0x2b, [VM_MUL] = 0x0faf,
+		[VM_AND] = 0x23, [VM_OR] = 0x0b, [VM_XOR] = 0x33,
+	};
+	uint8_t d = _dst(x, a, _RAX);
+	if (_same(_r(d), _loc(x, c)) && !_same(_r(d), _loc(x, b))) {
+		if (op != VM_SUB) {
+			uint8_t tmp = b;
+			b = c;
+			c = tmp;
+		} else {
+			d = _RAX;
+		}
+	}
+	_mov(x, d, _loc(x, b));
+	_modrm(x, 0, _W, opcodes[op], d, _loc(x, c));
+	_set(x, a, d);
+}
+
+static void _div(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	_mov(x, _RAX, _loc(x, b));
+	_mov(x, _RCX, _loc(x, c));
+	if (op == VM_DIVU || op == VM_MODU) {
+		_RAW(x, 0x31, 0xd2); // xor edx, edx
+		_RAW(x, 0x48, 0xf7, 0xf1); // div rcx
+	} else {
+		// INT64_MIN / -1 traps, but the VM wraps
+		_alu_imm(x, 7, _r(_RCX), -1);
+		size_t special = _jcc8(x, _CC_E);
+		_RAW(x, 0x48, 0x99); // cqo
+		_RAW(x, 0x48, 0xf7, 0xf9); // idiv rcx
+		size_t done = _jcc8(x, -1);
+		_patch8(x, special);
+		if (op == VM_DIVS) {
+			_RAW(x, 0x48, 0xf7, 0xd8); // neg rax
+		} else {
+			_RAW(x, 0x31, 0xd2);
+		}
+		_patch8(x, done);
+	}
+	_set(x, a, op == VM_DIVS || op == VM_DIVU ? _RAX : _RDX);
+}
+
+static void _shift(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	uint8_t d = _dst(x, a, _R11);
+	_mov(x, _RCX, _loc(x, c));
+	if (op == VM_SHRS) {
+		// Shifting by 64 or more fills with the sign, as 63 does
+		_imm(x, _RAX, 63);
+		_modrm(x, 0, _W, 0x3b, _RCX, _r(_RAX));
+		_modrm(x, 0, _W, 0x0f47, _RCX, _r(_RAX));
+		_mov(x, d, _loc(x, b));
+		_modrm(x, 0, _W, 0xd3, 7, _r(d));
+	} else {
+		_mov(x, d, _loc(x, b));
+		_modrm(x, 0, _W, 0xd3, op == VM_SHL ? 4 : 5, _r(d));
+		_RAW(x, 0x31, 0xc0); // xor eax, eax
+		_alu_imm(x, 7, _r(_RCX), 63);
+		_modrm(x, 0, _W, 0x0f47, d, _r(_RAX));
+	}
+	_set(x, a, d);
+}
+
+static int _compare_cc(enum vm_op op) {
+	switch (op) {
+	case VM_EQ: return _CC_E;
+	case VM_LTS: return _CC_L;
+	case VM_LTU: return _CC_B;
+	case VM_LES: return _CC_LE;
+	default: return _CC_BE;
+	}
+}
+
+// Float ops on F32 and F64, through xmm0 and xmm1
+static void _float_op(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	bool f64 = op >= VM_ADD_F64;
+	enum vm_op base = op - (f64 ? VM_ADD_F64 - VM_ADD_F32 : 0);
+	uint8_t pfx = f64 ? 0xf2 : 0xf3;
+
+	switch (base) {
+	case VM_ADD_F32:
+	case VM_SUB_F32:
+	case VM_MUL_F32:
+	case VM_DIV_F32:;
+		static const uint8_t ops[] = {
+			[VM_ADD_F32 - VM_ADD_F32] = 0x58, [VM_SUB_F32 - VM_ADD_F32] = 0x5c,
+			[VM_MUL_F32 - VM_ADD_F32] = 0x59, [VM_DIV_F32 - VM_ADD_F32] = 0x5e,
+		};
+		_to_xmm(x, f64, 0, _loc(x, b));
+		_to_xmm(x, f64, 1, _loc(x, c));
+		_modrm(x, pfx, 0, 0x0f00 | ops[base - VM_ADD_F32], 0, _r(1));
+		_from_xmm(x, f64, _loc(x, a), 0);
+		break;
+
+	case VM_MOD_F32:
+		// fmod, which the x87 does directly
+		_x87(x, f64 ? 0xdd : 0xd9, 0, _in_mem(x, c, x->tmp + 8));
+		_x87(x, f64 ? 0xdd : 0xd9, 0, _in_mem(x, b, x->tmp));
+		_fprem(x);
+		_x87(x, f64 ? 0xdd : 0xd9, 3, _m(_RBP, x->tmp));
+		_modrm(x, 0, f64 ? _W : 0, 0x8b, _RAX, _m(_RBP, x->tmp));
+		_set(x, a, _RAX);
+		break;
+
+	case VM_NEG_F32:;
+		uint8_t d = _dst(x, a, _RAX);
+		_mov(x, d, _loc(x, b));
+		// btc d, sign bit
+		_modrm(x, 0, f64 ? _W : 0, 0x0fba, 7, _r(d));
+		_byte(x, f64 ? 63 : 31);
+		_set(x, a, d);
+		break;
+
+	case VM_EQ_F32:
+	case VM_LT_F32:
+	case VM_LE_F32:
+		_to_xmm(x, f64, 0, _loc(x, b));
+		_to_xmm(x, f64, 1, _loc(x, c));
+		if (base == VM_EQ_F32) {
+			// Unordered is not equal
+			_modrm(x, f64 ? 0x66 : 0, 0, 0x0f2e, 0, _r(1));
+			_RAW(x, 0x0f, 0x90 | _CC_E, 0xc0);
+			_RAW(x, 0x0f, 0x90 | _CC_NP, 0xc1);
+			_RAW(x, 0x20, 0xc8); // and al, cl
+			_RAW(x, 0x0f, 0xb6, 0xc0);
+		} else {
+			// c > b and c >= b are false when unordered
+			_modrm(x, f64 ? 0x66 : 0, 0, 0x0f2e, 1, _r(0));
+			_setcc(x, base == VM_LT_F32 ? _CC_A : _CC_AE);
+		}
+		_set(x, a, _RAX);
+		break;
+
+	case VM_TOBOOL_F32:
+		_to_xmm(x, f64, 0, _loc(x, b));
+		_RAW(x, 0x0f, 0x57, 0xc9); // xorps xmm1, xmm1
+		_modrm(x, f64 ? 0x66 : 0, 0, 0x0f2e, 0, _r(1));
+		_RAW(x, 0x0f, 0x90 | _CC_NE, 0xc0);
+		_RAW(x, 0x0f, 0x90 | _CC_P, 0xc1);
+		_RAW(x, 0x08, 0xc8); // or al, cl
+		_RAW(x, 0x0f, 0xb6, 0xc0);
+		_set(x, a, _RAX);
+		break;
+
+	default:
+		break;
+	}
+}
+
+// F80 ops, on the x87 from 16-byte slots
+static void _float80_op(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	switch (op) {
+	case VM_ADD_F80:
+	case VM_SUB_F80:
+	case VM_MUL_F80:
+	case VM_DIV_F80:;
+		// faddp, fsubp, fmulp and fdivp st(1), st(0): st(1) op st(0)
+		static const uint8_t ops[] = {
+			[VM_ADD_F80 - VM_ADD_F80] = 0xc1, [VM_SUB_F80 - VM_ADD_F80] = 0xe9,
+			[VM_MUL_F80 - VM_ADD_F80] = 0xc9, [VM_DIV_F80 - VM_ADD_F80] = 0xf9,
+		};
+		_x87(x, _FLD80, _loc(x, b));
+		_x87(x, _FLD80, _loc(x, c));
+		_RAW(x, 0xde, ops[op - VM_ADD_F80]);
+		_x87(x, _FSTP80, _loc(x, a));
+		break;
+
+	case VM_MOD_F80:
+		_x87(x, _FLD80, _loc(x, c));
+		_x87(x, _FLD80, _loc(x, b));
+		_fprem(x);
+		_x87(x, _FSTP80, _loc(x, a));
+		break;
+
+	case VM_NEG_F80:
+		_x87(x, _FLD80, _loc(x, b));
+		_RAW(x, 0xd9, 0xe0); // fchs
+		_x87(x, _FSTP80, _loc(x, a));
+		break;
+
+	case VM_EQ_F80:
+		_x87(x, _FLD80, _loc(x, c));
+		_x87(x, _FLD80, _loc(x, b));
+		_RAW(x, 0xdf, 0xe9); // fucomip st, st(1)
+		_RAW(x, 0xdd, 0xd8); // fstp st(0)
+		_RAW(x, 0x0f, 0x90 | _CC_E, 0xc0);
+		_RAW(x, 0x0f, 0x90 | _CC_NP, 0xc1);
+		_RAW(x, 0x20, 0xc8);
+		_RAW(x, 0x0f, 0xb6, 0xc0);
+		_set(x, a, _RAX);
+		break;
+
+	case VM_LT_F80:
+	case VM_LE_F80:
+		_x87(x, _FLD80, _loc(x, b));
+		_x87(x, _FLD80, _loc(x, c));
+		_RAW(x, 0xdf, 0xe9);
+		_RAW(x, 0xdd, 0xd8);
+		_setcc(x, op == VM_LT_F80 ? _CC_A : _CC_AE);
+		_set(x, a, _RAX);
+		break;
+
+	case VM_TOBOOL_F80:
+		_x87(x, _FLD80, _loc(x, b));
+		_RAW(x, 0xd9, 0xee); // fldz
+		_RAW(x, 0xdf, 0xe9);
+		_RAW(x, 0xdd, 0xd8);
+		_RAW(x, 0x0f, 0x90 | _CC_NE, 0xc0);
+		_RAW(x, 0x0f, 0x90 | _CC_P, 0xc1);
+		_RAW(x, 0x08, 0xc8);
+		_RAW(x, 0x0f, 0xb6, 0xc0);
+		_set(x, a, _RAX);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void _convert(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b) {
+	switch (op) {
+	case VM_F32_F64:
+	case VM_F64_F32:;
+		bool from64 = op == VM_F64_F32;
+		_to_xmm(x, from64, 0, _loc(x, b));
+		_RAW(x, from64 ? 0xf2 : 0xf3, 0x0f, 0x5a, 0xc0);
+		_from_xmm(x, !from64, _loc(x, a), 0);
+		break;
+	case VM_F32_F80:
+		_x87(x, _FLD32, _in_mem(x, b, x->tmp));
+		_x87(x, _FSTP80, _loc(x, a));
+		break;
+	case VM_F64_F80:
+		_x87(x, _FLD64, _in_mem(x, b, x->tmp));
+		_x87(x, _FSTP80, _loc(x, a));
+		break;
+	case VM_F80_F32:
+		_x87(x, _FLD80, _loc(x, b));
+		_x87(x, _FSTP32, _m(_RBP, x->tmp));
+		_modrm(x, 0, 0, 0x8b, _RAX, _m(_RBP, x->tmp));
+		_set(x, a, _RAX);
+		break;
+	case VM_F80_F64:
+		_x87(x, _FLD80, _loc(x, b));
+		_x87(x, _FSTP64, _m(_RBP, x->tmp));
+		_mov(x, _RAX, _m(_RBP, x->tmp));
+		_set(x, a, _RAX);
+		break;
+	default:
+		break;
+	}
+}
+
+static void _load_mem(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	struct _x64_rm src = _m(_get(x, b, _R11), c);
+	if (op == VM_LDF80) {
+		_x87(x, _FLD80, src);
+		_x87(x, _FSTP80, _loc(x, a));
+		return;
+	}
+
+	uint8_t d = _dst(x, a, _RAX);
+	switch (op) {
+	case VM_LD8U: _modrm(x, 0, 0, 0x0fb6, d, src); break;
+	case VM_LD8S: _modrm(x, 0, _W, 0x0fbe, d, src); break;
+	case VM_LD16U: _modrm(x, 0, 0, 0x0fb7, d, src); break;
+	case VM_LD16S: _modrm(x, 0, _W, 0x0fbf, d, src); break;
+	case VM_LD32U: case VM_LDF32: _modrm(x, 0, 0, 0x8b, d, src); break;
+	case VM_LD32S: _modrm(x, 0, _W, 0x63, d, src); break;
+	default: _mov(x, d, src); break;
+	}
+	_set(x, a, d);
+}
+
+static void _store_mem(struct _x64_gen *x, enum vm_op op, uint8_t a, uint8_t b, uint8_t c) {
+	struct _x64_rm dst = _m(_get(x, a, _R11), c);
+	if (op == VM_STF80) {
+		_x87(x, _FLD80, _loc(x, b));
+		_x87(x, _FSTP80, dst);
+		return;
+	}
+
+	uint8_t v = _get(x, b, _RAX);
+	switch (op) {
+	case VM_ST8: _modrm(x, 0, v >= 4 ? _REX : 0, 0x88, v, dst); break;
+	case VM_ST16: _modrm(x, 0x66, 0, 0x89, v, dst); break;
+	case VM_ST32: case VM_STF32: _modrm(x, 0, 0, 0x89, v, dst); break;
+	default: _store(x, dst, v); break;
+	}
+}
+
+static void _call_memmove(struct _x64_gen *x) {
+	_RAW(x, 0x31, 0xc0);
+	_byte(x, 0xe8);
+	_reloc(x, elf_sym(x->o, "memmove"), R_X86_64_PLT32, -4);
+	_u32(x, 0);
+}
+
+static void _call(struct _x64_gen *x, size_t k, uint8_t a, uint8_t b, uint8_t nargs, const struct val_type *t) {
+	const struct val_type *ret = t->func.ret_type;
+	bool hidden = _hidden(ret);
+	struct _x64_cc cc = {.ngpr = hidden};
+	struct _x64_place places[256];
+	for (size_t j = 0; j < nargs; ++j) places[j] = _place(&cc, &t->func.args[j].to);
+
+	// Everything the call reads is in a callee-saved register or the frame,
+	// so nothing is overwritten before it's read
+	for (size_t j = 0; j < nargs; ++j) {
+		struct _x64_place *p = places + j;
+		uint8_t v = b + 1 + j;
+		if (!p->stack) continue;
+
+		if (_is_aggr(&t->func.args[j].to)) {
+			uint8_t src = _get(x, v, _RAX);
+			for (size_t off = 0; off < p->abi.size; off += 8) {
+				_mov(x, _RCX, _m(src, off));
+				_store(x, _m(_RSP, p->off + off), _RCX);
+			}
+		} else if (x->vregs[v].wide) {
+			_modrm(x, 0, 0, 0x0f10, 0, _loc(x, v));
+			_modrm(x, 0, 0, 0x0f11, 0, _m(_RSP, p->off));
+		} else {
+			_store(x, _m(_RSP, p->off), _get(x, v, _RAX));
+		}
+	}
+	for (size_t j = 0; j < nargs; ++j) {
+		struct _x64_place *p = places + j;
+		uint8_t v = b + 1 + j;
+		if (p->stack) continue;
+
+		if (_is_aggr(&t->func.args[j].to)) {
+			uint8_t src = _get(x, v, _RAX);
+			for (int e = 0; e < 2; ++e) {
+				if (p->abi.cls[e] == _INTEGER) _mov(x, p->regs[e], _m(src, 8 * e));
+				if (p->abi.cls[e] == _SSE) _to_xmm(x, true, p->regs[e], _m(src, 8 * e));
+			}
+		} else if (p->abi.cls[0] == _SSE) {
+			_to_xmm(x, true, p->regs[0], _loc(x, v));
+		} else {
+			_mov(x, p->regs[0], _loc(x, v));
+		}
+	}
+	if (hidden) _lea(x, _RDI, _m(_RBP, x->result));
+
+	// al holds the number of vector registers, for variadic callees
+	if (x->direct[k]) {
+		_imm(x, _RAX, cc.nsse);
+		_byte(x, 0xe8);
+		_reloc(x, x->direct[k] - 1, R_X86_64_PLT32, -4);
+		_u32(x, 0);
+	} else {
+		_mov(x, _R11, _loc(x, b));
+		_imm(x, _RAX, cc.nsse);
+		_RAW(x, 0x41, 0xff, 0xd3); // call r11
+	}
+
+	struct _x64_abi abi = _classify(ret);
+	if (ret->t == TYPE_VOID) return;
+	if (_is_aggr(ret)) {
+		if (abi.cls[0] == _X87) {
+			_x87(x, _FSTP80, _m(_RBP, x->result));
+		} else if (abi.cls[0] != _MEMORY) {
+			uint8_t gprs[] = {_RAX, _RDX};
+			size_t ngpr = 0, nsse = 0;
+			for (int e = 0; e < 2; ++e) {
+				if (abi.cls[e] == _INTEGER) _store(x, _m(_RBP, x->result + 8 * e), gprs[ngpr++]);
+				if (abi.cls[e] == _SSE) _from_xmm(x, true, _m(_RBP, x->result + 8 * e), nsse++);
+			}
+		}
+		_lea(x, _RAX, _m(_RBP, x->result));
+		_set(x, a, _RAX);
+	} else if (abi.cls[0] == _X87) {
+		_x87(x, _FSTP80, _loc(x, a));
+	} else if (abi.cls[0] == _SSE) {
+		_from_xmm(x, true, _loc(x, a), 0);
+	} else {
+		uint8_t d = _dst(x, a, _RAX);
+		_extend(x, ret, d, _r(_RAX));
+		_set(x, a, d);
+	}
+}
+
+static void _epilogue(struct _x64_gen *x) {
+	if (x->nsaved) {
+		_lea(x, _RSP, _m(_RBP, -8 * (int32_t)x->nsaved));
+		for (size_t i = sizeof _callee_saved; i-- > 0;) {
+			uint8_t reg = _callee_saved[i];
+			if (!(x->saved & 1 << reg)) continue;
+			if (reg & 8) _byte(x, 0x41);
+			_byte(x, 0x58 | (reg & 7));
+		}
+		_byte(x, 0x5d); // pop rbp
+	} else {
+		_byte(x, 0xc9); // leave
+	}
+	_byte(x, 0xc3);
+}
+
+static void _ret(struct _x64_gen *x, uint8_t a) {
+	const struct val_type *t = &x->f->ret_type;
+	struct _x64_abi abi = _classify(t);
+
+	if (t->t == TYPE_VOID) {
+		// Nothing
+	} else if (_is_aggr(t)) {
+		uint8_t src = _get(x, a, _RDX);
+		if (abi.cls[0] == _MEMORY) {
+			_mov(x, _R11, _m(_RBP, x->hidden));
+			if (abi.size <= 128) {
+				_copy(x, _R11, src, abi.size);
+			} else {
+				_mov(x, _RSI, _r(src));
+				_mov(x, _RDI, _r(_R11));
+				_imm(x, _RDX, abi.size);
+				_call_memmove(x);
+			}
+			_mov(x, _RAX, _m(_RBP, x->hidden));
+		} else if (abi.cls[0] == _X87) {
+			_x87(x, _FLD80, _m(src, 0));
+		} else {
+			// src is never rax, so it survives the first eightbyte
+			if (src == _RDX) {
+				_mov(x, _R11, _r(_RDX));
+				src = _R11;
+			}
+			uint8_t gprs[] = {_RAX, _RDX};
+			size_t ngpr = 0, nsse = 0;
+			for (int e = 0; e < 2; ++e) {
+				if (abi.cls[e] == _INTEGER) _mov(x, gprs[ngpr++], _m(src, 8 * e));
+				if (abi.cls[e] == _SSE) _to_xmm(x, true, nsse++, _m(src, 8 * e));
+			}
+		}
+	} else if (abi.cls[0] == _X87) {
+		_x87(x, _FLD80, _loc(x, a));
+	} else if (abi.cls[0] == _SSE) {
+		_to_xmm(x, true, 0, _loc(x, a));
+	} else {
+		_mov(x, _RAX, _loc(x, a));
+	}
+	_epilogue(x);
+}
+
+static void _prologue(struct _x64_gen *x) {
+	struct vm_func *f = x->f;
+	_byte(x, 0x55); // push rbp
+	_RAW(x, 0x48, 0x89, 0xe5); // mov rbp, rsp
+	for (size_t i = 0; i < sizeof _callee_saved; ++i) {
+		uint8_t reg = _callee_saved[i];
+		if (!(x->saved & 1 << reg)) continue;
+		if (reg & 8) _byte(x, 0x41);
+		_byte(x, 0x50 | (reg & 7));
+	}
+	if (x->frame) _alu_imm(x, 5, _r(_RSP), x->frame);
+
+	// Arguments go straight to callee-saved registers or the frame, so
+	// none of them is overwritten before it's moved
+	bool hidden = _hidden(&f->ret_type);
+	if (hidden) _store(x, _m(_RBP, x->hidden), _RDI);
+	struct _x64_cc cc = {.ngpr = hidden};
+	for (size_t i = 0; i < f->nargs; ++i) {
+		const struct val_type *t = f->arg_types + i;
+		struct _x64_place p = _place(&cc, t);
+		struct _x64_vreg *v = x->vregs + i;
+		if (!v->nuses || v->slot > 0) continue;
+		struct _x64_rm src = p.stack ? _m(_RBP, 16 + p.off) : _r(p.regs[0]);
+
+		if (_is_aggr(t)) {
+			if (!p.stack) {
+				for (int e = 0; e < 2; ++e) {
+					struct _x64_rm at = _m(_RBP, x->arg_slots[i] + 8 * e);
+					if (p.abi.cls[e] == _INTEGER) _store(x, at, p.regs[e]);
+					if (p.abi.cls[e] == _SSE) _from_xmm(x, true, at, p.regs[e]);
+				}
+				src = _m(_RBP, x->arg_slots[i]);
+			}
+			uint8_t d = _dst(x, i, _RAX);
+			_lea(x, d, src);
+			_set(x, i, d);
+		} else if (!p.stack && p.abi.cls[0] == _SSE) {
+			_from_xmm(x, true, _loc(x, i), p.regs[0]);
+		} else {
+			uint8_t d = _dst(x, i, _RAX);
+			_extend(x, t, d, src);
+			_set(x, i, d);
+		}
+	}
+}
+
+static void _insn(struct _x64_gen *x, size_t k, size_t *ncall) {
+	struct vm_func *f = x->f;
+	size_t pc = x->pcs[k];
+	uint32_t i = f->code[pc];
+	enum vm_op op = VM_OP(i);
+	uint8_t a = VM_A(i), b = VM_B(i), c = VM_C(i);
+	uint8_t d;
+
+	if (op == VM_CALL) {
+		const struct val_type *t = _call_type(x, (*ncall)++);
+		if (t) _call(x, k, a, b, c, t);
+		return;
+	}
+	if (x->skip[k]) return;
+
+	switch (op) {
+	case VM_MOV:
+		if (x->vregs[a].wide) {
+			_modrm(x, 0, 0, 0x0f10, 0, _loc(x, b));
+			_modrm(x, 0, 0, 0x0f11, 0, _loc(x, a));
+		} else if (!_loc(x, a).mem) {
+			_mov(x, _loc(x, a).reg, _loc(x, b));
+		} else {
+			_set(x, a, _get(x, b, _RAX));
+		}
+		break;
+
+	case VM_LOADK:;
+		union vm_value v = f->consts[VM_BX(i)];
+		struct vm_reloc *r = x->konsts[VM_BX(i)];
+		d = _dst(x, a, _RAX);
+		if (r) {
+			bool got;
+			size_t sym = _reloc_sym(x, r, &got);
+			if (got) {
+				_rip(x, _W, 0x8b, d, sym, R_X86_64_GOTPCREL);
+			} else {
+				_rip(x, _W, 0x8d, d, sym, R_X86_64_PC32);
+			}
+			_set(x, a, d);
+		} else if (x->vregs[a].wide) {
+			uint64_t halves[2];
+			memcpy(halves, &v, sizeof halves);
+			for (int h = 0; h < 2; ++h) {
+				_imm(x, _RAX, halves[h]);
+				_store(x, _m(_RBP, x->vregs[a].slot + 8 * h), _RAX);
+			}
+		} else {
+			_imm(x, d, v.u);
+			_set(x, a, d);
+		}
+		break;
+
+	case VM_LOADI:
+		d = _dst(x, a, _RAX);
+		_imm(x, d, (int64_t)VM_SBX(i));
+		_set(x, a, d);
+		break;
+
+	case VM_ADDR:
+		d = _dst(x, a, _RAX);
+		_lea(x, d, _m(_RBP, x->mem + f->consts[VM_BX(i)].u));
+		_set(x, a, d);
+		break;
+
+	case VM_ADD:
+	case VM_SUB:
+	case VM_MUL:
+	case VM_AND:
+	case VM_OR:
+	case VM_XOR:
+		_int_binop(x, op, a, b, c);
+		break;
+
+	case VM_DIVS:
+	case VM_DIVU:
+	case VM_MODS:
+	case VM_MODU:
+		_div(x, op, a, b, c);
+		break;
+
+	case VM_SHL:
+	case VM_SHRS:
+	case VM_SHRU:
+		_shift(x, op, a, b, c);
+		break;
+
+	case VM_NEG:
+	case VM_NOT:
+		d = _dst(x, a, _RAX);
+		_mov(x, d, _loc(x, b));
+		_modrm(x, 0, _W, 0xf7, op == VM_NEG ? 3 : 2, _r(d));
+		_set(x, a, d);
+		break;
+
+	case VM_LNOT:
+	case VM_TOBOOL:
+		_alu_imm(x, 7, _loc(x, b), 0);
+		_setcc(x, op == VM_LNOT ? _CC_E : _CC_NE);
+		_set(x, a, _RAX);
+		break;
+
+	case VM_SEXT8:
+	case VM_SEXT16:
+	case VM_SEXT32:
+	case VM_ZEXT8:
+	case VM_ZEXT16:
+	case VM_ZEXT32:;
+		static const enum int_type types[] = {
+			[VM_SEXT8 - VM_SEXT8] = I_8, [VM_SEXT16 - VM_SEXT8] = I_16, [VM_SEXT32 - VM_SEXT8] = I_32,
+			[VM_ZEXT8 - VM_SEXT8] = U_8, [VM_ZEXT16 - VM_SEXT8] = U_16, [VM_ZEXT32 - VM_SEXT8] = U_32,
+		};
+		d = _dst(x, a, _RAX);
+		_extend(x, &(struct val_type){.t = TYPE_INT, .int_ = types[op - VM_SEXT8]}, d, _loc(x, b));
+		_set(x, a, d);
+		break;
+
+	case VM_EQ:
+	case VM_LTS:
+	case VM_LTU:
+	case VM_LES:
+	case VM_LEU:
+		_modrm(x, 0, _W, 0x3b, _get(x, b, _RAX), _loc(x, c));
+		if (x->skip[k + 1]) {
+			// Fused with the branch that follows
+			uint32_t next = f->code[x->pcs[k + 1]];
+			int cc = _compare_cc(op);
+			_jump(x, VM_OP(next) == VM_JT ? cc : cc ^ 1, x->pcs[k + 1] + 1 + VM_SBX(next));
+		} else {
+			_setcc(x, _compare_cc(op));
+			_set(x, a, _RAX);
+		}
+		break;
+
+	case VM_COPY:;
+		uint32_t size = f->code[pc + 1];
+		if (size <= 128) {
+			uint8_t src = _get(x, b, _RDX);
+			_copy(x, _get(x, a, _R11), src, size);
+		} else {
+			_mov(x, _RDI, _loc(x, a));
+			_mov(x, _RSI, _loc(x, b));
+			_imm(x, _RDX, size);
+			_call_memmove(x);
+		}
+		break;
+
+	case VM_JMP:
+		_jump(x, -1, pc + 1 + VM_SAX(i));
+		break;
+
+	case VM_JT:
+	case VM_JF:;
+		struct _x64_rm cond = _loc(x, a);
+		if (cond.mem) {
+			_alu_imm(x, 7, cond, 0);
+		} else {
+			_modrm(x, 0, _W, 0x85, cond.reg, cond);
+		}
+		_jump(x, op == VM_JT ? _CC_NE : _CC_E, pc + 1 + VM_SBX(i));
+		break;
+
+	case VM_RET:
+		_ret(x, a);
+		break;
+
+	case VM_RET0:
+		_epilogue(x);
+		break;
+
+	default:
+		if (op >= VM_ADD_F32 && op <= VM_TOBOOL_F64) {
+			_float_op(x, op, a, b, c);
+		} else if (_is_float80_op(op)) {
+			_float80_op(x, op, a, b, c);
+		} else if (op >= VM_F32_F64 && op <= VM_F80_F64) {
+			_convert(x, op, a, b);
+		} else if (op >= VM_LD8U && op <= VM_LDF80) {
+			_load_mem(x, op, a, b, c);
+		} else if (op >= VM_ST8 && op <= VM_STF80) {
+			_store_mem(x, op, a, b, c);
+		}
+		break;
+	}
+}
+
+// }}}
+
+// Functions {{{
+
+static int _by_addr(const void *a, const void *b) {
+	const struct _x64_func *x = a, *y = b;
+	return (x->f > y->f) - (x->f < y->f);
+}
+
+static size_t _reloc_sym(struct _x64_gen *x, struct vm_reloc *r, bool *got) {
+	*got = false;
+	if (r->global == SIZE_MAX) {
+		struct _x64_func key = {r->func, 0}, *found;
+		found = bsearch(&key, x->by_addr, x->m->nfuncs, sizeof key, _by_addr);
+		return found->sym;
+	}
+
+	// Prototypes with no definition are resolved by the linker, perhaps to
+	// a shared library
+	struct vm_global *global = x->m->globals + r->global;
+	if (global->offset == SIZE_MAX && !global->func) *got = true;
+	return elf_sym(x->o, global->name);
+}
+
+static void _function(struct _x64_gen *x, struct vm_func *f, size_t sym, bool global) {
+	x->f = f;
+	x->ncode = x->nfixups = x->nrelocs = 0;
+
+	x->pcs = malloc((f->ncode + 1) * sizeof *x->pcs);
+	x->index = malloc((f->ncode + 1) * sizeof *x->index);
+	x->offsets = malloc((f->ncode + 1) * sizeof *x->offsets);
+	x->leader = malloc((f->ncode + 1) * sizeof *x->leader);
+	x->skip = calloc(f->ncode + 1, sizeof *x->skip);
+	x->direct = calloc(f->ncode + 1, sizeof *x->direct);
+	x->blocks = malloc((f->ncode + 1) * sizeof *x->blocks);
+	x->arg_slots = malloc((f->nargs + 1) * sizeof *x->arg_slots);
+	x->konsts = calloc(f->nconsts + 1, sizeof *x->konsts);
+	for (size_t i = 0; i < f->nrelocs; ++i) x->konsts[f->relocs[i].konst] = f->relocs + i;
+	for (size_t r = 0; r < 256; ++r) x->vregs[r] = (struct _x64_vreg){.start = SIZE_MAX};
+
+	_blocks(x);
+	_ranges(x);
+	_widen(x);
+	_fold(x);
+	_allocate(x);
+	_layout(x);
+
+	_prologue(x);
+	size_t ncall = 0;
+	for (size_t k = 0; k < x->ninsns && !x->error; ++k) {
+		x->offsets[k] = x->ncode;
+		_insn(x, k, &ncall);
+	}
+	x->offsets[x->ninsns] = x->ncode;
+
+	for (size_t i = 0; i < x->nfixups; ++i) {
+		size_t at = x->fixups[i].at;
+		int32_t rel = x->offsets[x->index[x->fixups[i].pc]] - (at + 4);
+		memcpy(x->code + at, &rel, sizeof rel);
+	}
+
+	size_t base = elf_append(x->o, ELF_TEXT, x->code, x->ncode, 16);
+	for (size_t i = 0; i < x->nrelocs; ++i) {
+		struct elf_reloc *r = x->relocs + i;
+		elf_reloc(x->o, ELF_TEXT, base + r->offset, r->sym, r->type, r->addend);
+	}
+	elf_define(x->o, sym, ELF_TEXT, base, x->ncode, true, global);
+
+	free(x->pcs);
+	free(x->index);
+	free(x->offsets);
+	free(x->leader);
+	free(x->skip);
+	free(x->direct);
+	free(x->blocks);
+	free(x->arg_slots);
+	free(x->konsts);
+}
+
+// }}}
+
+bool x64_compile_module(struct vm_module *m, struct elf_obj *o) {
+	if (m->error) return false;
+	struct _x64_gen x = {.m = m, .o = o};
+
+	// Storage for variables, which init fills in
+	for (size_t i = 0; i < m->nglobals; ++i) {
+		struct vm_global *g = m->globals + i;
+		if (g->offset == SIZE_MAX) continue;
+		size_t size = vm_sizeof(&g->type), align = vm_alignof(&g->type);
+		size_t off = elf_append(o, ELF_BSS, NULL, size, align ? align : 1);
+		elf_define(o, elf_sym(o, g->name), ELF_BSS, off, size, false, true);
+	}
+
+	// Toplevel functions keep their names, and the rest are numbered
+	x.syms = malloc(m->nfuncs * sizeof *x.syms);
+	x.by_addr = malloc(m->nfuncs * sizeof *x.by_addr);
+	size_t nlits = 0;
+	for (size_t i = 0; i < m->nfuncs; ++i) {
+		struct vm_func *f = m->funcs[i];
+		size_t *global = f == m->init ? NULL : strmap_get(&m->names, f->name);
+		if (global && m->globals[*global].func == f) {
+			x.syms[i] = elf_sym(o, f->name);
+		} else {
+			char name[32];
+			if (f == m->init) {
+				snprintf(name, sizeof name, "__cec_init");
+			} else {
+				snprintf(name, sizeof name, "__cec_lit.%zu", nlits++);
+			}
+			x.syms[i] = elf_sym(o, name);
+			o->syms[x.syms[i]].global = false;
+		}
+		x.by_addr[i] = (struct _x64_func){f, x.syms[i]};
+	}
+	qsort(x.by_addr, m->nfuncs, sizeof *x.by_addr, _by_addr);
+
+	for (size_t i = 0; i < m->nfuncs && !x.error; ++i) {
+		_function(&x, m->funcs[i], x.syms[i], o->syms[x.syms[i]].global);
+	}
+
+	// Variables are initialized before main, in the order the VM would
+	for (size_t i = 0; i < m->nfuncs; ++i) {
+		if (m->funcs[i] != m->init || m->init->ncode <= 1) continue;
+		size_t at = elf_append(o, ELF_INIT_ARRAY, NULL, sizeof (uint64_t), sizeof (uint64_t));
+		elf_reloc(o, ELF_INIT_ARRAY, at, x.syms[i], R_X86_64_64, 0);
+	}
+
+	free(x.syms);
+	free(x.by_addr);
+	free(x.code);
+	free(x.fixups);
+	free(x.relocs);
+	m->error = x.error;
+	return !x.error;
+}
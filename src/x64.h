@@ -0,0 +1,22 @@
+// vim: noet
+
+#ifndef X64_H
+#define X64_H
+
+#include "elfobj.h"
+#include "vm.h"
+
+// Native x86-64 code for the System V ABI, translated from a module's
+// bytecode. Toplevel functions and variables become global symbols of the
+// same names, and init runs from .init_array. Prototypes that are never
+// defined are left for the linker, so C functions can be called directly.
+//
+// Native code has no status to return, so it diverges from vm_call where the
+// VM would fail. Division or remainder by zero raises SIGFPE, as div and
+// idiv do, instead of returning VM_ERR_DIV_ZERO. Calling a null function
+// pointer, or recursing past the end of the stack, faults instead of
+// returning VM_ERR_NULL_CALL or VM_ERR_STACK. Everything else matches the
+// VM, including the most negative value over -1 wrapping at every width.
+bool x64_compile_module(struct vm_module *m, struct elf_obj *o);
+
+#endif
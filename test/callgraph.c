@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "callgraph.h"
+#include "type.h"
+
+// even and odd call each other, loop calls itself, and main calls all three
+// and f. ns has its own f, which calls ns.g, and ns.inner.h calls ns.g too.
+// None of ns, nor dead, is reachable from main.
+static size_t build(struct ast_toplevel *tops) {
+	static struct ast_toplevel ns[3], inner[1];
+	func(inner, "h", T_I32, T_I32, call("g", 1, ident("n")));
+	func(ns + 0, "f", T_I32, T_I32, call("g", 1, ident("n")));
+	func(ns + 1, "g", T_I32, T_I32, ident("n"));
+	ns[2] = (struct ast_toplevel){.type = EXPRTOP_NAMESPACE, .namespace = {.size = 1, .body = inner, .name = "inner"}};
+
+	func(tops + 0, "main", T_I32, T_I32, binop(BINOP_ADD,
+		binop(BINOP_ADD, call("even", 1, ident("n")), call("f", 1, ident("n"))),
+		call("loop", 1, ident("n"))));
+	func(tops + 1, "even", T_I32, T_I32, call("odd", 1, ident("n")));
+	func(tops + 2, "odd", T_I32, T_I32, call("even", 1, ident("n")));
+	func(tops + 3, "loop", T_I32, T_I32, call("loop", 1, ident("n")));
+	func(tops + 4, "f", T_I32, T_I32, ident("n"));
+	func(tops + 5, "dead", T_I32, T_I32, ident("n"));
+	tops[6] = (struct ast_toplevel){.type = EXPRTOP_DECL, .decl = {.type = {.to = T_I32}, .name = "gv", .val = int_lit(I_32, 1)}};
+	tops[7] = (struct ast_toplevel){.type = EXPRTOP_NAMESPACE, .namespace = {.size = 3, .body = ns, .name = "ns"}};
+	return 8;
+}
+
+static bool calls(struct callgraph *cg, const char *from, const char *to) {
+	struct cg_node *f = cg_lookup(cg, from), *t = cg_lookup(cg, to);
+	vassert_not_null(f);
+	vassert_not_null(t);
+	for (size_t i = 0; i < f->ncallees; ++i) {
+		if (f->callees[i] == (size_t)(t - cg->nodes)) return true;
+	}
+	return false;
+}
+
+VTEST(test_cg_sccs) {
+	struct ast_toplevel tops[8];
+	struct callgraph cg;
+	cg_build(&cg, build(tops), tops);
+	vassert_eq(cg.nnodes, 10);
+
+	// Same-named functions in different namespaces stay apart
+	vassert(cg_lookup(&cg, "f") != cg_lookup(&cg, "ns.f"));
+	vassert_null(cg_lookup(&cg, "g"));
+	vassert_null(cg_lookup(&cg, "h"));
+	vassert(calls(&cg, "main", "f"));
+	vassert(!calls(&cg, "main", "ns.f"));
+	vassert(calls(&cg, "ns.f", "ns.g"));
+	vassert(calls(&cg, "ns.inner.h", "ns.g"));
+	vassert_eq(cg_resolve(&cg, cg_lookup(&cg, "ns.inner.h"), "f"), cg_lookup(&cg, "ns.f"));
+	vassert_eq(cg_resolve(&cg, cg_lookup(&cg, "ns.inner.h"), "dead"), cg_lookup(&cg, "dead"));
+
+	// Mutual recursion shares an SCC, and a self-loop is an edge of its own
+	struct cg_node *even = cg_lookup(&cg, "even"), *odd = cg_lookup(&cg, "odd");
+	struct cg_node *loop = cg_lookup(&cg, "loop"), *main = cg_lookup(&cg, "main");
+	vassert_eq(even->scc, odd->scc);
+	vassert_eq(cg.scc_start[even->scc + 1] - cg.scc_start[even->scc], 2);
+	vassert(calls(&cg, "loop", "loop"));
+	vassert_eq(cg.scc_start[loop->scc + 1] - cg.scc_start[loop->scc], 1);
+
+	// Callees are numbered first
+	vassert_eq(cg.nsccs, 9);
+	vassert(even->scc < main->scc);
+	vassert(loop->scc < main->scc);
+	vassert(cg_lookup(&cg, "f")->scc < main->scc);
+	vassert(cg_lookup(&cg, "ns.g")->scc < cg_lookup(&cg, "ns.f")->scc);
+	for (size_t i = 0; i < cg.nsccs; ++i) {
+		for (size_t j = cg.scc_start[i]; j < cg.scc_start[i+1]; ++j) {
+			vassert_eq(cg.nodes[cg.sccs[j]].scc, i);
+		}
+	}
+
+	cg_free(&cg);
+}
+
+VTEST(test_cg_reachable) {
+	struct ast_toplevel tops[8];
+	struct callgraph cg;
+	cg_build(&cg, build(tops), tops);
+
+	// Globals are always roots, and unknown roots are ignored
+	const char *roots[] = {"main", "nonexistent"};
+	vassert_eq(cg_mark_reachable(&cg, 2, roots), 6);
+	vassert(cg_lookup(&cg, "gv")->reachable);
+	vassert(cg_lookup(&cg, "odd")->reachable);
+	vassert(!cg_lookup(&cg, "dead")->reachable);
+	vassert(!cg_lookup(&cg, "ns.f")->reachable);
+	vassert(!cg_lookup(&cg, "ns.inner.h")->reachable);
+
+	char *out;
+	size_t len;
+	FILE *f = open_memstream(&out, &len);
+	cg_report(&cg, f);
+	fclose(f);
+	vassert_eq_s(out, "callgraph: pruned 4 of 9 functions (8 of 29 expression nodes)\n");
+	free(out);
+
+	f = open_memstream(&out, &len);
+	cg_dump(&cg, f);
+	fclose(f);
+	vassert_not_null(strstr(out, "\tloop -> loop\n"));
+	vassert_not_null(strstr(out, "\tns.f (pruned) -> ns.g\n"));
+	vassert_not_null(strstr(out, "\tdead (pruned)\n"));
+	vassert_not_null(strstr(out, "\tmain -> even f loop\n"));
+	free(out);
+
+	cg_free(&cg);
+}
+
+// The checker resolves globals by qualified name as well, so ns.f's g is
+// ns.g, and the g in the anonymous namespace inside ns is ns.g too
+VTEST(test_cg_checker_names) {
+	struct ast_toplevel tops[3], ns[3], anon[1];
+	struct val_type i64 = {.t = TYPE_INT, .int_ = I_64};
+	func(anon, "h", T_I32, T_I32, ident("g"));
+	ns[0] = (struct ast_toplevel){.type = EXPRTOP_DECL, .decl = {.type = {.to = T_I32}, .name = "g", .val = int_lit(I_32, 1)}};
+	func(ns + 1, "f", T_I32, T_I32, ident("g"));
+	ns[2] = (struct ast_toplevel){.type = EXPRTOP_NAMESPACE, .namespace = {.size = 1, .body = anon}};
+	tops[0] = (struct ast_toplevel){.type = EXPRTOP_DECL, .decl = {.type = {.to = i64}, .name = "g", .val = int_lit(I_64, 2)}};
+	func(tops + 1, "f", T_I32, i64, ident("g"));
+	tops[2] = (struct ast_toplevel){.type = EXPRTOP_NAMESPACE, .namespace = {.size = 3, .body = ns, .name = "ns"}};
+
+	annotate_unit(3, tops);
+	vassert_eq(tops[1].func.body->type.int_, I_64);
+	vassert_eq(ns[1].func.body->type.int_, I_32);
+	vassert_eq(anon[0].func.body->type.int_, I_32);
+
+	// Checking one toplevel again finds its namespace
+	ns[1].func.body->type.int_ = I_8;
+	annotate_toplevel(ns + 1);
+	vassert_eq(ns[1].func.body->type.int_, I_32);
+
+	struct callgraph cg;
+	cg_build(&cg, 3, tops);
+	vassert(calls(&cg, "ns.f", "ns.g"));
+	vassert(calls(&cg, "f", "g"));
+	cg_free(&cg);
+}
+
+VTESTS_BEGIN
+	test_cg_sccs,
+	test_cg_reachable,
+	test_cg_checker_names,
+VTESTS_END
@@ -0,0 +1,54 @@
+#include <string.h>
+#include "vtest.h"
+#include "driver.h"
+
+static void scan(struct drv_file *f, const char *src) {
+	drv_scan(f, src, strlen(src));
+}
+
+VTEST(test_driver_scan) {
+	struct driver d;
+	char *paths[] = {"a"};
+	drv_init(&d, 1, paths, 1, 0);
+	scan(&d.files[0],
+		"ns a { ns inner {} fn f() b.g(x.y.z) + 1.5e3; }\n"
+		"// c.h\n"
+		"/* d.i */ \"e.j\" 'f' ns g {} b.k\n"
+	);
+
+	struct drv_file *f = &d.files[0];
+	vassert_eq(f->ndecls, 2);
+	vassert_eq_s(f->decls[0], "a");
+	vassert_eq_s(f->decls[1], "g");
+	vassert_eq(f->nrefs, 2);
+	vassert_eq_s(f->refs[0], "b");
+	vassert_eq_s(f->refs[1], "x");
+	drv_free(&d);
+}
+
+VTEST(test_driver_order) {
+	// 0 uses 2, 2 uses 3, and 4 and 5 use each other
+	const char *srcs[] = {
+		"fn f() two.f();",
+		"fn g() 1;",
+		"ns two { fn f() three.f(); }",
+		"ns three { fn f() 3; }",
+		"ns four { fn f() five.f(); }",
+		"ns five { fn f() four.f(); }",
+	};
+	char *paths[] = {"0", "1", "2", "3", "4", "5"};
+	struct driver d;
+	drv_init(&d, 6, paths, 1, 0);
+	for (size_t i = 0; i < 6; ++i) scan(&d.files[i], srcs[i]);
+	drv_link(&d);
+
+	size_t order[6], expect[] = {1, 3, 2, 0, 4, 5};
+	drv_order(&d, order);
+	for (size_t i = 0; i < 6; ++i) vassert_eq(order[i], expect[i]);
+	drv_free(&d);
+}
+
+VTESTS_BEGIN
+	test_driver_scan,
+	test_driver_order,
+VTESTS_END
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "escape.h"
+#include "type.h"
+#include "vm.h"
+
+// Runs the pass on a unit of one function, then compiles it and calls it
+static int64_t run(struct ast_toplevel *top, int64_t arg, struct escape_stats *stats, size_t *memsize) {
+	annotate_unit(1, top);
+	*stats = (struct escape_stats){0};
+	escape_unit(1, top, NULL, stats);
+
+	struct vm_module m;
+	vassert(vm_compile_unit(&m, 1, top));
+	struct vm_func *f = vm_lookup(&m, top->func.name);
+	*memsize = f->memsize;
+
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, m.init, 0, NULL, NULL), VM_OK);
+	union vm_value a = {.i = arg}, ret;
+	vassert_eq(vm_call(&vm, f, 1, &a, &ret), VM_OK);
+	vm_free(&vm);
+	vm_module_free(&m);
+	return (int32_t)ret.i;
+}
+
+VTEST(test_escape_promote) {
+	// let x = n; let p = &x; *p = *p * 3; x + 1
+	struct ast_expr *body = let("x", T_I32, ident("n"), let("p", ptr(T_I32), unop(UNOP_REF, ident("x")), binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, unop(UNOP_DEREF, ident("p")), binop(BINOP_MUL, unop(UNOP_DEREF, ident("p")), int_lit(I_32, 3))),
+		binop(BINOP_ADD, ident("x"), int_lit(I_32, 1)))));
+
+	struct ast_toplevel top;
+	struct escape_stats stats;
+	size_t memsize;
+	func(&top, "triple", T_I32, T_I32, body);
+	vassert_eq(run(&top, 5, &stats, &memsize), 16);
+	vassert_eq(stats.npromoted, 1);
+	vassert_eq(stats.nbindings, 2);
+	vassert_eq(stats.nregisters, 2);
+	vassert_eq(memsize, 0);
+}
+
+VTEST(test_escape_call) {
+	// let x = n; let p = &x; f(p); x, where f is a prototype that may keep p
+	struct ast_expr *body = let("x", T_I32, ident("n"), let("p", ptr(T_I32), unop(UNOP_REF, ident("x")),
+		binop(BINOP_SEQOP, call("f", 1, ident("p")), ident("x"))));
+
+	struct ast_toplevel tops[2];
+	func(tops, "f", ptr(T_I32), (struct val_type){.t = TYPE_VOID}, NULL);
+	func(tops + 1, "g", T_I32, T_I32, body);
+
+	annotate_unit(2, tops);
+	struct escape_stats stats = {0};
+	escape_unit(2, tops, NULL, &stats);
+	vassert_eq(stats.npromoted, 0);
+	vassert_eq(stats.nescaping[ESC_CALL], 1);
+	vassert_eq(stats.nregisters, 2);
+	vassert_eq(stats.nbindings, 3);
+}
+
+VTEST(test_escape_split) {
+	// let s = S{n, n * 2}; let p = &s.y; *p = *p + 1; s.x * 100 + s.y
+	static const char *names[] = {"x", "y"};
+	static struct val_type i32 = T_I32;
+	struct val_type s = {.t = TYPE_STRUCT};
+	s.composite.nfields = 2;
+	s.composite.fields = malloc(2 * sizeof *s.composite.fields);
+	for (int i = 0; i < 2; ++i) {
+		s.composite.fields[i].name = names[i];
+		s.composite.fields[i].type = &i32;
+	}
+
+	struct ast_expr *elems = malloc(2 * sizeof *elems);
+	elems[0] = *ident("n");
+	elems[1] = *binop(BINOP_MUL, ident("n"), int_lit(I_32, 2));
+	struct ast_expr *lit = node((struct ast_expr){.t = EXPR_COMPOSITE_LIT, .composite_lit = {.type = s, .nelems = 2, .elems = elems}});
+	struct ast_expr *field[3];
+	for (int i = 0; i < 3; ++i) {
+		field[i] = node((struct ast_expr){.t = EXPR_FIELD_ACCESS, .field_access = {ident("s"), names[i != 1]}});
+	}
+	struct ast_expr *body = let("s", s, lit, let("p", ptr(T_I32), unop(UNOP_REF, field[0]), binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, unop(UNOP_DEREF, ident("p")), binop(BINOP_ADD, unop(UNOP_DEREF, ident("p")), int_lit(I_32, 1))),
+		binop(BINOP_ADD, binop(BINOP_MUL, field[1], int_lit(I_32, 100)), field[2]))));
+
+	struct ast_toplevel top;
+	struct escape_stats stats;
+	size_t memsize;
+	func(&top, "pair", T_I32, T_I32, body);
+	vassert_eq(run(&top, 3, &stats, &memsize), 307);
+	vassert_eq(stats.npromoted, 1);
+	vassert_eq(stats.nsplit, 1);
+	vassert_eq(stats.nregisters, stats.nbindings);
+	vassert_eq(memsize, 0);
+}
+
+VTESTS_BEGIN
+	test_escape_promote,
+	test_escape_call,
+	test_escape_split,
+VTESTS_END
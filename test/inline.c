@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "inline.h"
+#include "type.h"
+#include "vm.h"
+#include "walk.h"
+
+static char *report;
+
+// Inlines the unit, keeping the decisions in report, and returns how many
+// call sites were inlined
+static size_t inline_(size_t ntops, struct ast_toplevel *tops, struct inline_opts opts) {
+	size_t len;
+	FILE *f = open_memstream(&report, &len);
+	opts.report = f;
+
+	annotate_unit(ntops, tops);
+	struct callgraph cg;
+	cg_build(&cg, ntops, tops);
+	size_t n = inline_unit(&cg, &opts);
+	cg_free(&cg);
+	fclose(f);
+	return n;
+}
+
+static int64_t run(size_t ntops, struct ast_toplevel *tops, const char *name, int64_t arg) {
+	struct vm_module m;
+	vassert(vm_compile_unit(&m, ntops, tops));
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, m.init, 0, NULL, NULL), VM_OK);
+	union vm_value a = {.i = arg}, ret;
+	vassert_eq(vm_call(&vm, vm_lookup(&m, name), 1, &a, &ret), VM_OK);
+	vm_free(&vm);
+	vm_module_free(&m);
+	return (int32_t)ret.i;
+}
+
+struct names {
+	size_t ncalls, nlets, ndeferred;
+	bool renamed;
+};
+
+static bool names_pre(struct ast_expr *e, void *ctx) {
+	struct names *c = ctx;
+	if (e->t == EXPR_CALL) ++c->ncalls;
+	if (e->t == EXPR_LET) {
+		++c->nlets;
+		if (e->let.deferred) ++c->ndeferred;
+		if (!strchr(e->let.name, '.')) c->renamed = false;
+	}
+	return true;
+}
+
+static struct names names(struct ast_expr *body) {
+	struct names c = {.renamed = true};
+	struct walk_stack s = {0};
+	walk_expr(&s, body, &(struct walk_ops){.pre = names_pre}, &c);
+	walk_free(&s);
+	return c;
+}
+
+VTEST(test_inline_rename) {
+	// sq(n) = let y = n * n; y, and main(n) = let y = 1; sq(n + y) + sq(2) + y
+	struct ast_toplevel tops[2];
+	func(tops + 0, "sq", T_I32, T_I32, let("y", T_I32, binop(BINOP_MUL, ident("n"), ident("n")), ident("y")));
+	func(tops + 1, "main", T_I32, T_I32, let("y", T_I32, int_lit(I_32, 1), binop(BINOP_ADD,
+		binop(BINOP_ADD, call("sq", 1, binop(BINOP_ADD, ident("n"), ident("y"))), call("sq", 1, int_lit(I_32, 2))),
+		ident("y"))));
+
+	vassert_eq(inline_(2, tops, (struct inline_opts){0}), 2);
+	// Each copy binds its argument and its let under fresh names
+	struct ast_expr *body = tops[1].func.body;
+	vassert_eq_s(body->let.name, "y");
+	struct names n = names(body->let.body);
+	vassert_eq(n.ncalls, 0);
+	vassert_eq(n.nlets, 4);
+	vassert(n.renamed);
+	vassert_eq(run(2, tops, "main", 3), 16 + 4 + 1);
+}
+
+VTEST(test_inline_returns) {
+	// clamp(n) = if n < 0 return 0 else return n, a tail return in an if;
+	// early(n) = (if n < 0 return 0); n + 1, a return that isn't
+	struct ast_toplevel tops[4];
+	func(tops + 0, "clamp", T_I32, T_I32, if_(binop(BINOP_LT, ident("n"), int_lit(I_32, 0)),
+		return_(int_lit(I_32, 0)), return_(ident("n"))));
+	func(tops + 1, "early", T_I32, T_I32, binop(BINOP_SEQOP,
+		if_(binop(BINOP_LT, ident("n"), int_lit(I_32, 0)), return_(int_lit(I_32, 0)), NULL),
+		binop(BINOP_ADD, ident("n"), int_lit(I_32, 1))));
+	func(tops + 2, "main", T_I32, T_I32, binop(BINOP_MUL, call("clamp", 1, ident("n")), int_lit(I_32, 10)));
+	func(tops + 3, "main2", T_I32, T_I32, call("early", 1, ident("n")));
+
+	vassert_eq(inline_(4, tops, (struct inline_opts){0}), 1);
+	vassert_eq(names(tops[2].func.body).ncalls, 0);
+	vassert_eq(names(tops[3].func.body).ncalls, 1);
+	vassert_not_null(strstr(report, "inline: main2 <- early: non-tail return\n"));
+	vassert_eq(run(4, tops, "main", -7), 0);
+	vassert_eq(run(4, tops, "main", 7), 70);
+	free(report);
+}
+
+VTEST(test_inline_void_return) {
+	// set(n) void = if n > 0 return else g = n, and main(n) = set(n); g
+	struct ast_toplevel g = {.type = EXPRTOP_DECL, .decl = {.type = {.mut = true, .to = T_I32}, .name = "g", .val = int_lit(I_32, 0)}};
+	struct ast_toplevel tops[3] = {g};
+	func(tops + 1, "set", T_I32, (struct val_type){.t = TYPE_VOID}, if_(binop(BINOP_GT, ident("n"), int_lit(I_32, 0)),
+		return_(NULL), binop(BINOP_ASSIGN, ident("g"), ident("n"))));
+	func(tops + 2, "main", T_I32, T_I32, binop(BINOP_SEQOP, call("set", 1, ident("n")), ident("g")));
+
+	vassert_eq(inline_(3, tops, (struct inline_opts){0}), 1);
+	free(report);
+	vassert_eq(names(tops[2].func.body).ncalls, 0);
+	vassert_eq(run(3, tops, "main", 5), 0);
+	vassert_eq(run(3, tops, "main", -5), -5);
+}
+
+VTEST(test_inline_deferred) {
+	// trace(n) = let y = n; (t = t * 10 + 1; return y) defer (y = 0; t = t * 10 + 2),
+	// main(n) = let r = 0; (while r == 0 r = trace(n) * 100 + t); r. The loop
+	// makes inlining trace worth it.
+	struct ast_toplevel t = {.type = EXPRTOP_DECL, .decl = {.type = {.mut = true, .to = T_I32}, .name = "t", .val = int_lit(I_32, 0)}};
+	struct ast_expr *step[2];
+	for (int i = 0; i < 2; ++i) {
+		step[i] = binop(BINOP_ASSIGN, ident("t"), binop(BINOP_ADD, binop(BINOP_MUL, ident("t"), int_lit(I_32, 10)), int_lit(I_32, i + 1)));
+	}
+	struct ast_expr *body = let("y", T_I32, ident("n"), binop(BINOP_SEQOP, step[0], return_(ident("y"))));
+	body->let.deferred = binop(BINOP_SEQOP, binop(BINOP_ASSIGN, ident("y"), int_lit(I_32, 0)), step[1]);
+
+	struct ast_toplevel tops[3] = {t};
+	func(tops + 1, "trace", T_I32, T_I32, body);
+	struct ast_expr *r = binop(BINOP_ADD, binop(BINOP_MUL, call("trace", 1, ident("n")), int_lit(I_32, 100)), ident("t"));
+	func(tops + 2, "main", T_I32, T_I32, let("r", T_I32, int_lit(I_32, 0), binop(BINOP_SEQOP,
+		while_(binop(BINOP_EQUAL, ident("r"), int_lit(I_32, 0)), binop(BINOP_ASSIGN, ident("r"), r)),
+		ident("r"))));
+
+	annotate_unit(3, tops);
+	int64_t before = run(3, tops, "main", 7);
+	vassert_eq(before, 712);
+	vassert_eq(inline_(3, tops, (struct inline_opts){0}), 1);
+	free(report);
+	// The copy keeps its deferred code on the renamed let
+	struct names n = names(tops[2].func.body);
+	vassert_eq(n.ncalls, 0);
+	vassert_eq(n.ndeferred, 1);
+	// The body's value is taken before the deferred code changes y
+	vassert_eq(run(3, tops, "main", 7), before);
+}
+
+VTEST(test_inline_refused) {
+	// even(n) = if n == 0 return 1 else return odd(n - 1), odd likewise,
+	// id(n) = n, sq(n) = n * n, and main(n) = even(n) + id(n) + sq(n) + sq(2) + sq(3)
+	struct ast_toplevel tops[5];
+	const char *pair[2][2] = {{"even", "odd"}, {"odd", "even"}};
+	for (int i = 0; i < 2; ++i) {
+		func(tops + i, pair[i][0], T_I32, T_I32, if_(binop(BINOP_EQUAL, ident("n"), int_lit(I_32, 0)),
+			return_(int_lit(I_32, !i)), return_(call(pair[i][1], 1, binop(BINOP_SUB, ident("n"), int_lit(I_32, 1))))));
+	}
+	func(tops + 2, "id", T_I32, T_I32, ident("n"));
+	func(tops + 3, "sq", T_I32, T_I32, binop(BINOP_MUL, ident("n"), ident("n")));
+	struct ast_expr *sum = call("even", 1, ident("n"));
+	sum = binop(BINOP_ADD, sum, call("id", 1, ident("n")));
+	sum = binop(BINOP_ADD, sum, call("sq", 1, ident("n")));
+	sum = binop(BINOP_ADD, sum, call("sq", 1, int_lit(I_32, 2)));
+	sum = binop(BINOP_ADD, sum, call("sq", 1, int_lit(I_32, 3)));
+	func(tops + 4, "main", T_I32, T_I32, sum);
+
+	// Only the first sq fits in the budget
+	const char *noinline[] = {"id"};
+	struct inline_opts opts = {.caller_budget = 4, .nnoinline = 1, .noinline = noinline};
+	vassert_eq(inline_(5, tops, opts), 1);
+	vassert_not_null(strstr(report, "inline: even <- odd: recursive\n"));
+	vassert_not_null(strstr(report, "inline: odd <- even: recursive\n"));
+	vassert_not_null(strstr(report, "inline: main <- id: noinline\n"));
+	vassert_not_null(strstr(report, "inline: main <- sq: inlined (cost 3, benefit 8)\n"));
+	vassert_not_null(strstr(report, "inline: main <- sq: over budget (cost 3, benefit 10)\n"));
+	vassert_not_null(strstr(report, "inline: 1 of 7 call sites inlined\n"));
+	free(report);
+	vassert_eq(names(tops[4].func.body).ncalls, 4);
+	vassert_eq(run(5, tops, "main", 4), 1 + 4 + 16 + 4 + 9);
+}
+
+VTEST(test_inline_capture) {
+	// get(n) = g refers to the toplevel g. ns declares its own g, and main
+	// binds a local one, so inlining get into either would change its meaning.
+	struct ast_toplevel tops[4], ns[2];
+	tops[0] = (struct ast_toplevel){.type = EXPRTOP_DECL, .decl = {.type = {.to = T_I32}, .name = "g", .val = int_lit(I_32, 1)}};
+	func(tops + 1, "get", T_I32, T_I32, ident("g"));
+	ns[0] = (struct ast_toplevel){.type = EXPRTOP_DECL, .decl = {.type = {.to = T_I32}, .name = "g", .val = int_lit(I_32, 2)}};
+	func(ns + 1, "f", T_I32, T_I32, call("get", 1, ident("n")));
+	tops[2] = (struct ast_toplevel){.type = EXPRTOP_NAMESPACE, .namespace = {.size = 2, .body = ns, .name = "ns"}};
+	func(tops + 3, "main", T_I32, T_I32, let("g", T_I32, int_lit(I_32, 3), call("get", 1, ident("n"))));
+
+	vassert_eq(inline_(4, tops, (struct inline_opts){0}), 0);
+	vassert_not_null(strstr(report, "inline: ns.f <- get: would capture a global\n"));
+	vassert_not_null(strstr(report, "inline: main <- get: would capture a local\n"));
+	free(report);
+	vassert_eq(names(ns[1].func.body).ncalls, 1);
+	vassert_eq(names(tops[3].func.body).ncalls, 1);
+}
+
+VTESTS_BEGIN
+	test_inline_rename,
+	test_inline_returns,
+	test_inline_void_return,
+	test_inline_deferred,
+	test_inline_refused,
+	test_inline_capture,
+VTESTS_END
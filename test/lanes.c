@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "type.h"
+#include "lanes.h"
+#include "vm.h"
+
+#define U8 ((struct val_type){.t = TYPE_INT, .int_ = U_8})
+#define VOID ((struct val_type){.t = TYPE_VOID})
+
+// Adds an argument to a function made with func
+static void arg(struct ast_toplevel *top, const char *name, struct val_type type) {
+	size_t n = top->func.nargs++;
+	top->func.args = realloc(top->func.args, top->func.nargs * sizeof *top->func.args);
+	top->func.args[n].name = name;
+	top->func.args[n].type = (struct ref_type){.mut = true, .to = type};
+}
+
+static struct ast_expr *at(const char *base, const char *index) {
+	return unop(UNOP_DEREF, binop(BINOP_ADD, ident(base), ident(index)));
+}
+
+static struct ast_expr *inc(const char *name, enum int_type type) {
+	return binop(BINOP_ASSIGN, ident(name), binop(BINOP_ADD, ident(name), int_lit(type, 1)));
+}
+
+// sum(n i32, a *i32) i32:
+//   let i = 0; let s = 0; (while i < n (s = s + *(a + i); i = i + 1)); s
+static void sum(struct ast_toplevel *top, struct ast_expr *step) {
+	struct ast_expr *body = binop(BINOP_SEQOP, binop(BINOP_ASSIGN, ident("s"), binop(BINOP_ADD, ident("s"), step)), inc("i", I_32));
+	func(top, "sum", T_I32, T_I32, let("i", T_I32, int_lit(I_32, 0), let("s", T_I32, int_lit(I_32, 0), binop(BINOP_SEQOP,
+		while_(binop(BINOP_LT, ident("i"), ident("n")), body),
+		ident("s")))));
+	arg(top, "a", ptr(T_I32));
+}
+
+// add(n i32, p *i32, q *i32, end *i32): while p != end (*p = *p + *q; p++; q++)
+static void add(struct ast_toplevel *top) {
+	struct ast_expr *body = binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, unop(UNOP_DEREF, ident("p")), binop(BINOP_ADD, unop(UNOP_DEREF, ident("p")), unop(UNOP_DEREF, ident("q")))),
+		binop(BINOP_SEQOP, unop(UNOP_POSTINC, ident("p")), unop(UNOP_POSTINC, ident("q"))));
+	func(top, "add", T_I32, VOID, while_(binop(BINOP_NEQUAL, ident("p"), ident("end")), body));
+	arg(top, "p", ptr(T_I32));
+	arg(top, "q", ptr(T_I32));
+	arg(top, "end", ptr(T_I32));
+}
+
+// Plans the function's first loop, returning why it can't be unrolled by lanes
+static const char *plan(struct ast_toplevel *top, struct lanes_plan *p) {
+	annotate_unit(1, top);
+	struct loop_nest ln;
+	loop_nest_build(&ln, top->func.nargs, (void *)top->func.args, top->func.body);
+	vassert(ln.nloops > 0);
+	lanes_plan_loop(&ln, ln.loops[0], LANES_SSE2, p);
+	loop_nest_free(&ln);
+	return p->reason;
+}
+
+static union vm_value run(struct vm_module *m, const char *name, size_t nargs, union vm_value *args) {
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, m->init, 0, NULL, NULL), VM_OK);
+	union vm_value ret = {0};
+	vassert_eq(vm_call(&vm, vm_lookup(m, name), nargs, args, &ret), VM_OK);
+	vm_free(&vm);
+	return ret;
+}
+
+// Compiles a unit of one function before and after unrolling it by lanes
+static struct lanes_stats compile(struct ast_toplevel *top, struct vm_module *before, struct vm_module *after) {
+	annotate_unit(1, top);
+	vassert(vm_compile_unit(before, 1, top));
+	struct lanes_stats stats = {0};
+	lanes_unit(1, top, LANES_SSE2, NULL, &stats);
+	vassert(vm_compile_unit(after, 1, top));
+	return stats;
+}
+
+VTEST(test_lanes_reduction) {
+	struct ast_toplevel top;
+	sum(&top, at("a", "i"));
+	struct lanes_plan p;
+	vassert(!plan(&top, &p));
+	vassert_eq(p.lanes, 4);
+	vassert_eq(p.nreductions, 1);
+	vassert_eq(p.nchecks, 0);
+	lanes_plan_free(&p);
+
+	struct vm_module before, after;
+	struct lanes_stats stats = compile(&top, &before, &after);
+	vassert_eq(stats.nunrolled, 1);
+
+	int32_t a[100];
+	for (int i = 0; i < 100; ++i) a[i] = i * i - 37;
+	static const int64_t ns[] = {0, 1, 3, 4, 5, 8, 17, 100, -5};
+	for (size_t i = 0; i < sizeof ns / sizeof *ns; ++i) {
+		union vm_value args[] = {{.i = ns[i]}, {.u = (uintptr_t)a}};
+		vassert_eq(run(&after, "sum", 2, args).i, run(&before, "sum", 2, args).i);
+	}
+	vm_module_free(&before);
+	vm_module_free(&after);
+}
+
+VTEST(test_lanes_alias_check) {
+	struct ast_toplevel top;
+	add(&top);
+	struct lanes_plan p;
+	vassert(!plan(&top, &p));
+	vassert_eq(p.nsteppers, 2);
+	vassert_eq(p.nchecks, 1);
+	lanes_plan_free(&p);
+
+	struct vm_module before, after;
+	compile(&top, &before, &after);
+
+	// q after, before and well away from p. Where they overlap the check
+	// fails, and the original loop does all the work.
+	static const int offsets[] = {1, -1, 64};
+	static const int lens[] = {0, 3, 4, 9, 32};
+	for (size_t o = 0; o < 3; ++o) {
+		for (size_t l = 0; l < 5; ++l) {
+			int32_t x[128], y[128];
+			for (int i = 0; i < 128; ++i) x[i] = y[i] = i * 3 + 1;
+
+			int32_t *bufs[] = {x, y};
+			for (int b = 0; b < 2; ++b) {
+				int32_t *buf = bufs[b] + 16;
+				union vm_value args[] = {{.i = 0}, {.u = (uintptr_t)buf}, {.u = (uintptr_t)(buf + offsets[o])},
+					{.u = (uintptr_t)(buf + lens[l])}};
+				run(b ? &after : &before, "add", 4, args);
+			}
+			vassert(!memcmp(x, y, sizeof x));
+		}
+	}
+	vm_module_free(&before);
+	vm_module_free(&after);
+}
+
+VTEST(test_lanes_wrap) {
+	// u8 indices wrap around from i to n:
+	// xor(n u8, i u8, d *u8, s *u8): while i != n (*(d + i) = *(s + i) ^ 90; i = i + 1)
+	struct ast_expr *store = binop(BINOP_ASSIGN, at("d", "i"), binop(BINOP_BIN_XOR, at("s", "i"), int_lit(U_8, 90)));
+	struct ast_toplevel top;
+	func(&top, "xor", U8, VOID, while_(binop(BINOP_NEQUAL, ident("i"), ident("n")), binop(BINOP_SEQOP, store, inc("i", U_8))));
+	arg(&top, "i", U8);
+	arg(&top, "d", ptr(U8));
+	arg(&top, "s", ptr(U8));
+
+	struct lanes_plan p;
+	vassert(!plan(&top, &p));
+	vassert_eq(p.lanes, 16);
+	lanes_plan_free(&p);
+
+	struct vm_module before, after;
+	compile(&top, &before, &after);
+
+	static const int ranges[][2] = {{0, 0}, {0, 15}, {0, 16}, {3, 200}, {250, 4}, {255, 254}};
+	uint8_t s[256];
+	for (int i = 0; i < 256; ++i) s[i] = i * 7;
+	for (size_t r = 0; r < sizeof ranges / sizeof *ranges; ++r) {
+		uint8_t x[256] = {0}, y[256] = {0};
+		union vm_value args[] = {{.u = ranges[r][1]}, {.u = ranges[r][0]}, {.u = (uintptr_t)x}, {.u = (uintptr_t)s}};
+		run(&before, "xor", 4, args);
+		args[2].u = (uintptr_t)y;
+		run(&after, "xor", 4, args);
+		vassert(!memcmp(x, y, sizeof x));
+	}
+	vm_module_free(&before);
+	vm_module_free(&after);
+}
+
+VTEST(test_lanes_rejected) {
+	struct ast_toplevel top;
+	struct lanes_plan p;
+
+	// s = s + *(a + i * 2)
+	sum(&top, unop(UNOP_DEREF, binop(BINOP_ADD, ident("a"), binop(BINOP_MUL, ident("i"), int_lit(I_32, 2)))));
+	vassert_eq_s(plan(&top, &p), "access is not unit-stride");
+	lanes_plan_free(&p);
+
+	// s = s + i
+	sum(&top, ident("i"));
+	vassert_eq_s(plan(&top, &p), "counter used as a value");
+	lanes_plan_free(&p);
+
+	// s = s + *(a + i) / 3
+	sum(&top, binop(BINOP_DIV, at("a", "i"), int_lit(I_32, 3)));
+	vassert_eq_s(plan(&top, &p), "integer division");
+	lanes_plan_free(&p);
+
+	// s = s + if i < 3 *(a + i) else 0
+	sum(&top, if_(binop(BINOP_LT, ident("i"), int_lit(I_32, 3)), at("a", "i"), int_lit(I_32, 0)));
+	vassert_eq_s(plan(&top, &p), "control flow in loop");
+	lanes_plan_free(&p);
+
+	// s = s + *(a + i) + *(a + n)
+	sum(&top, binop(BINOP_ADD, at("a", "i"), at("a", "n")));
+	vassert_eq_s(plan(&top, &p), "access is not unit-stride");
+	lanes_plan_free(&p);
+
+	// let t = &s; ... s = s + *(a + i): the reduction may be read through t
+	sum(&top, at("a", "i"));
+	struct ast_expr *loop = top.func.body->let.body->let.body;
+	top.func.body->let.body->let.body = let("t", ptr(T_I32), unop(UNOP_REF, ident("s")), loop);
+	vassert_eq_s(plan(&top, &p), "reduction has its address taken");
+	lanes_plan_free(&p);
+
+	// while i < n (s = s + *(a + i); break outer; i = i + 1)
+	struct ast_expr *brk = node((struct ast_expr){.t = EXPR_BREAK, .break_ = {"outer"}});
+	sum(&top, binop(BINOP_SEQOP, brk, at("a", "i")));
+	vassert_eq_s(plan(&top, &p), "early exit");
+	lanes_plan_free(&p);
+
+	// i = i + 1; s = s + *(a + i)
+	sum(&top, at("a", "i"));
+	struct ast_expr *body = top.func.body->let.body->let.body->binop.x->while_.body;
+	struct ast_expr *tmp = body->binop.x;
+	body->binop.x = body->binop.y;
+	body->binop.y = tmp;
+	vassert_eq_s(plan(&top, &p), "stepped in the middle of the loop");
+	lanes_plan_free(&p);
+}
+
+VTESTS_BEGIN
+	test_lanes_reduction,
+	test_lanes_alias_check,
+	test_lanes_wrap,
+	test_lanes_rejected,
+VTESTS_END
@@ -1,13 +1,14 @@
+#include <stdlib.h>
+#include <unistd.h>
 #include "vtest.h"
 #include "testhelper.h"
 #include "lex.h"
 #include "y.tab.h"
 
 #define _assert_toks(source, ...) do { \
-		yyin = stropen(source); \
-		vassert_not_null(yyin); \
+		yyscan_t scanner = strlex(source); \
 		int toks[] = {__VA_ARGS__}, *tok = toks; \
-		do vassert_eq(yylex(), *tok); while (*tok++); \
+		do vassert_eq(yylex(scanner), *tok); while (*tok++); \
 	} while (0)
 #define assert_toks(...) _assert_toks(__VA_ARGS__, 0)
 
@@ -62,7 +63,7 @@ VTEST(test_operator) {
 }
 
 VTEST(test_literal) {
-	yyin = stropen(
+	yyscan_t scanner = strlex(
 		"hello foo_bar i123\n"
 		"fnns ifelse whilebreak continuereturn ptrmutvol mybool boolvoid\n"
 
@@ -81,7 +82,6 @@ VTEST(test_literal) {
 
 		"123foo 1.foo foo.1\n"
 	);
-	vassert_not_null(yyin);
 
 	struct {int tok; const char *text;} tokens[] = {
 		{IDENTIFIER, "hello"},
@@ -138,11 +138,53 @@ VTEST(test_literal) {
 	}, *tok = tokens;
 
 	do {
-		vassert_eq(yylex(), tok->tok);
-		vassert_eq_s(yytext, tok->text);
+		vassert_eq(yylex(scanner), tok->tok);
+		vassert_eq_s(yyget_text(scanner), tok->text);
 	} while (tok++->tok);
 }
 
+VTEST(test_large_input) {
+	// Much more than a pipe holds
+	size_t n = 1 << 20;
+	char *source = malloc(n + 1);
+	for (size_t i = 0; i < n; i += 2) {
+		source[i] = '1';
+		source[i+1] = ' ';
+	}
+	source[n] = 0;
+
+	yyscan_t scanner = strlex(source);
+	for (size_t i = 0; i < n / 2; ++i) vassert_eq(yylex(scanner), DEC_INTEGER);
+	vassert_eq(yylex(scanner), 0);
+	free(source);
+}
+
+VTEST(test_mapped_file) {
+	char path[] = "/tmp/cec-test-XXXXXX";
+	int fd = mkstemp(path);
+	vassert(fd >= 0);
+	const char *source = "fn ns 123";
+	vassert_eq(write(fd, source, strlen(source)), strlen(source));
+	close(fd);
+
+	struct lex_file f;
+	vassert(lex_map(&f, path));
+	unlink(path);
+	vassert_eq(f.len, strlen(source));
+
+	yyscan_t scanner;
+	vassert(lex_init(&scanner));
+	lex_mapped(scanner, &f);
+	vassert_eq(yylex(scanner), FN);
+	vassert_eq(yylex(scanner), NS);
+	vassert_eq(yylex(scanner), DEC_INTEGER);
+	vassert_eq_s(yyget_text(scanner), "123");
+	vassert_eq(yylex(scanner), 0);
+	lex_end(scanner);
+	lex_unmap(&f);
+	lex_free(scanner);
+}
+
 VTESTS_BEGIN
 	test_whitespace,
 	test_comment,
@@ -151,4 +193,6 @@ VTESTS_BEGIN
 	test_symbol,
 	test_operator,
 	test_literal,
+	test_large_input,
+	test_mapped_file,
 VTESTS_END
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "loop.h"
+#include "type.h"
+#include "vm.h"
+
+#define U8 ((struct val_type){.t = TYPE_INT, .int_ = U_8})
+#define I64 ((struct val_type){.t = TYPE_INT, .int_ = I_64})
+
+// let i = 0; let s = 0; (while i < n (s = s + step; i = i + 1)); s
+static struct ast_expr *sum_loop(struct val_type type, struct ast_expr *step) {
+	struct ast_expr *body = binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, ident("s"), binop(BINOP_ADD, ident("s"), step)),
+		binop(BINOP_ASSIGN, ident("i"), binop(BINOP_ADD, ident("i"), int_lit(type.int_, 1))));
+	return let("i", type, int_lit(type.int_, 0), let("s", type, int_lit(type.int_, 0), binop(BINOP_SEQOP,
+		while_(binop(BINOP_LT, ident("i"), ident("n")), body),
+		ident("s"))));
+}
+
+static int64_t call1(struct vm_module *m, const char *name, int64_t arg) {
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, m->init, 0, NULL, NULL), VM_OK);
+	union vm_value a = {.i = arg}, ret;
+	vassert_eq(vm_call(&vm, vm_lookup(m, name), 1, &a, &ret), VM_OK);
+	vm_free(&vm);
+	return ret.i;
+}
+
+// Optimizes a unit of one function, checking that it returns the same
+// for every argument as it did before
+static struct loop_stats agree(struct ast_toplevel *top, const int64_t *args, size_t nargs) {
+	annotate_unit(1, top);
+	struct vm_module before, after;
+	vassert(vm_compile_unit(&before, 1, top));
+
+	struct loop_stats stats = {0};
+	loop_opt_unit(1, top, &stats);
+	vassert(vm_compile_unit(&after, 1, top));
+
+	for (size_t i = 0; i < nargs; ++i) {
+		vassert_eq(call1(&after, top->func.name, args[i]), call1(&before, top->func.name, args[i]));
+	}
+	vm_module_free(&before);
+	vm_module_free(&after);
+	return stats;
+}
+
+static const int64_t args[] = {0, 1, 2, 7, 100};
+
+VTEST(test_loop_hoist) {
+	// s = s + n * 3 + i: n * 3 moves out of the loop
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, T_I32, sum_loop(T_I32, binop(BINOP_ADD, binop(BINOP_MUL, ident("n"), int_lit(I_32, 3)), ident("i"))));
+	struct loop_stats stats = agree(&top, args, 5);
+	vassert_eq(stats.nloops, 1);
+	vassert_eq(stats.nhoisted, 1);
+	vassert_eq(stats.nreduced, 0);
+}
+
+VTEST(test_loop_reduce_mul) {
+	// s = s + i * n becomes s = s + $iv, with $iv = $iv + n at each step
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, T_I32, sum_loop(T_I32, binop(BINOP_MUL, ident("i"), ident("n"))));
+	struct loop_stats stats = agree(&top, args, 5);
+	vassert_eq(stats.nhoisted, 0);
+	vassert_eq(stats.nivs, 1);
+	vassert_eq(stats.nreduced, 1);
+}
+
+VTEST(test_loop_reduce_ptr) {
+	// let b = S{n, n, n, n}; let p = &b.x0; i: i64 = 0; while i < 4 (*(p + i) = *(p + i) * n; i = i + 1);
+	// b.x0 + b.x1 + b.x2 + b.x3
+	static const char *fields[] = {"x0", "x1", "x2", "x3"};
+	static struct val_type i32 = T_I32;
+	struct val_type s = {.t = TYPE_STRUCT};
+	s.composite.nfields = 4;
+	s.composite.fields = malloc(4 * sizeof *s.composite.fields);
+	struct ast_expr *elems = malloc(4 * sizeof *elems), *sum = NULL;
+	for (int i = 0; i < 4; ++i) {
+		s.composite.fields[i].name = fields[i];
+		s.composite.fields[i].type = &i32;
+		elems[i] = *ident("n");
+		struct ast_expr *f = node((struct ast_expr){.t = EXPR_FIELD_ACCESS, .field_access = {ident("b"), fields[i]}});
+		sum = sum ? binop(BINOP_ADD, sum, f) : f;
+	}
+	struct ast_expr *lit = node((struct ast_expr){.t = EXPR_COMPOSITE_LIT, .composite_lit = {.type = s, .nelems = 4, .elems = elems}});
+	struct ast_expr *field = node((struct ast_expr){.t = EXPR_FIELD_ACCESS, .field_access = {ident("b"), "x0"}});
+
+	struct ast_expr *elem = unop(UNOP_DEREF, binop(BINOP_ADD, ident("p"), ident("i")));
+	struct ast_expr *body = binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, elem, binop(BINOP_MUL, unop(UNOP_DEREF, binop(BINOP_ADD, ident("p"), ident("i"))), ident("n"))),
+		binop(BINOP_ASSIGN, ident("i"), binop(BINOP_ADD, ident("i"), int_lit(I_64, 1))));
+	struct ast_expr *loop = while_(binop(BINOP_LT, ident("i"), int_lit(I_64, 4)), body);
+	struct ast_expr *p = let("p", ptr(T_I32), unop(UNOP_REF, field), let("i", I64, int_lit(I_64, 0), binop(BINOP_SEQOP, loop, sum)));
+	p->let.type.mut = false;
+
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, T_I32, let("b", s, lit, p));
+	struct loop_stats stats = agree(&top, args, 5);
+	vassert_eq(stats.nivs, 1);
+	vassert_eq(stats.nreduced, 2);
+}
+
+VTEST(test_loop_u8_wrap) {
+	// i and s are u8, i counts from n until it wraps around to 4, and
+	// s = s + i * 7 wraps as it goes. The reduced i * 7 must wrap with them.
+	struct ast_expr *body = binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, ident("s"), binop(BINOP_ADD, ident("s"), binop(BINOP_MUL, ident("i"), int_lit(U_8, 7)))),
+		binop(BINOP_ASSIGN, ident("i"), binop(BINOP_ADD, ident("i"), int_lit(U_8, 1))));
+	struct ast_expr *e = let("i", U8, ident("n"), let("s", U8, int_lit(U_8, 0), binop(BINOP_SEQOP,
+		while_(binop(BINOP_NEQUAL, ident("i"), int_lit(U_8, 4)), body),
+		ident("s"))));
+
+	static const int64_t u8_args[] = {0, 4, 5, 200, 250, 255};
+	struct ast_toplevel top;
+	func(&top, "f", U8, U8, e);
+	struct loop_stats stats = agree(&top, u8_args, 6);
+	vassert_eq(stats.nreduced, 1);
+}
+
+VTEST(test_loop_u8_ptr) {
+	// let b = n; let p = &b; i: u8 = 250; s = 0;
+	// while i != 3 (if p + i == p (s = s + 1); i = i + 1); s
+	// p + i is p again once i wraps, which a pointer stepped from p + 250
+	// never is, so p + i stays as it is.
+	struct ast_expr *body = binop(BINOP_SEQOP,
+		if_(binop(BINOP_EQUAL, binop(BINOP_ADD, ident("p"), ident("i")), ident("p")),
+			binop(BINOP_ASSIGN, ident("s"), binop(BINOP_ADD, ident("s"), int_lit(I_32, 1))), NULL),
+		binop(BINOP_ASSIGN, ident("i"), binop(BINOP_ADD, ident("i"), int_lit(U_8, 1))));
+	struct ast_expr *loop = while_(binop(BINOP_NEQUAL, ident("i"), int_lit(U_8, 3)), body);
+	struct ast_expr *e = let("i", U8, int_lit(U_8, 250), let("s", T_I32, int_lit(I_32, 0), binop(BINOP_SEQOP, loop, ident("s"))));
+	struct ast_expr *p = let("p", ptr(T_I32), unop(UNOP_REF, ident("b")), e);
+	p->let.type.mut = false;
+
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, T_I32, let("b", T_I32, ident("n"), p));
+	struct loop_stats stats = agree(&top, args, 5);
+	vassert_eq(stats.nreduced, 0);
+
+	struct vm_module m;
+	vassert(vm_compile_unit(&m, 1, &top));
+	vassert_eq(call1(&m, "f", 0), 1);
+	vm_module_free(&m);
+}
+
+VTEST(test_loop_no_hoist) {
+	// A volatile binding may change between iterations
+	struct ast_expr *vol = let("v", T_I32, ident("n"), sum_loop(T_I32, binop(BINOP_MUL, ident("v"), int_lit(I_32, 3))));
+	vol->let.type.vol = true;
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, T_I32, vol);
+	struct loop_stats stats = agree(&top, args, 5);
+	vassert_eq(stats.nhoisted, 0);
+
+	// x has its address taken and the loop stores through a pointer, so
+	// x * 3 may change: let x = n; let p = &x; ... (*p = *p + 1; s = s + x * 3) ...
+	struct ast_expr *store = binop(BINOP_ASSIGN, unop(UNOP_DEREF, ident("p")), binop(BINOP_ADD, unop(UNOP_DEREF, ident("p")), int_lit(I_32, 1)));
+	struct ast_expr *step = binop(BINOP_SEQOP, store, binop(BINOP_MUL, ident("x"), int_lit(I_32, 3)));
+	func(&top, "g", T_I32, T_I32, let("x", T_I32, ident("n"), let("p", ptr(T_I32), unop(UNOP_REF, ident("x")), sum_loop(T_I32, step))));
+	stats = agree(&top, args, 5);
+	vassert_eq(stats.nhoisted, 0);
+}
+
+VTEST(test_loop_label) {
+	// A labelled break may leave an outer loop, so neither loop is touched:
+	// while i < n (while 1 < 2 break outer; s = s + n * 3)
+	struct ast_expr *brk = node((struct ast_expr){.t = EXPR_BREAK, .break_ = {"outer"}});
+	struct ast_expr *inner = while_(binop(BINOP_LT, int_lit(I_32, 1), int_lit(I_32, 2)), brk);
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, T_I32, sum_loop(T_I32, binop(BINOP_SEQOP, inner, binop(BINOP_MUL, ident("n"), int_lit(I_32, 3)))));
+	annotate_unit(1, &top);
+
+	struct loop_stats stats = {0};
+	loop_opt_unit(1, &top, &stats);
+	vassert_eq(stats.nloops, 2);
+	vassert_eq(stats.nskipped, 2);
+	vassert_eq(stats.nhoisted, 0);
+}
+
+VTESTS_BEGIN
+	test_loop_hoist,
+	test_loop_reduce_mul,
+	test_loop_reduce_ptr,
+	test_loop_u8_wrap,
+	test_loop_u8_ptr,
+	test_loop_no_hoist,
+	test_loop_label,
+VTESTS_END
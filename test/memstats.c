@@ -0,0 +1,16 @@
+#include "vtest.h"
+#include "memstats.h"
+
+VTEST(test_memstats_names) {
+	vassert_eq_s(mem_cat_name(MEM_EXPR + EXPR_BINOP), "EXPR_BINOP");
+	vassert_eq_s(mem_cat_name(MEM_EXPR + EXPR_IDENT), "EXPR_IDENT");
+	vassert_eq_s(mem_cat_name(MEM_TOPLEVEL), "ast_toplevel");
+	vassert_eq_s(mem_cat_name(MEM_TYPE + TYPE_PTR), "TYPE_PTR");
+	vassert_eq_s(mem_cat_name(MEM_TYPE + TYPE_BOOL), "TYPE_BOOL");
+	vassert_eq_s(mem_cat_name(MEM_NAME), "names");
+	vassert_eq_s(mem_cat_name(MEM_LEXER), "lexer");
+}
+
+VTESTS_BEGIN
+	test_memstats_names,
+VTESTS_END
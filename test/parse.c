@@ -0,0 +1,126 @@
+#include "vtest.h"
+#include "testhelper.h"
+#include "lex.h"
+#include "y.tab.h"
+
+static int parse(const char *source) {
+	return yyparse(strlex(source), "test", NULL, NULL);
+}
+
+// Hash of the shape of the function body expr, for comparing with the same
+// expression bracketed by hand
+static unsigned long shape(const char *expr) {
+	char source[256];
+	snprintf(source, sizeof source, "fn f() %s", expr);
+	unsigned long h = 0;
+	vassert_eq(yyparse(strlex(source), "test", NULL, &h), 0);
+	return h;
+}
+
+#define assert_same(a, b) vassert_eq(shape(a), shape(b))
+#define assert_differ(a, b) vassert_ne(shape(a), shape(b))
+
+VTEST(test_parse_operators) {
+	vassert_eq(parse("fn f() 1 = 2 += 3 || 4 && 5 == 6 < 7 | 8 ^ 9 & 10 << 11 + 12 * 13"), 0);
+	vassert_eq(parse("fn f() -1++ . x(2, 3) * ~!4"), 0);
+	vassert_eq(parse("fn f() (i32) 1 * (2 + 3)"), 0);
+	vassert_eq(parse("fn f() 1; 2 = 3; 4"), 0);
+}
+
+VTEST(test_parse_prefix) {
+	// Used to be read as the start of a pointer type
+	vassert_eq(parse("fn f() ptr ptr 1"), 0);
+	vassert_eq(parse("fn f() ++ptr --1"), 0);
+}
+
+VTEST(test_parse_assoc) {
+	assert_same("1 = 2 = 3", "1 = (2 = 3)");
+	assert_differ("1 = 2 = 3", "(1 = 2) = 3");
+	assert_same("1 = 2 += 3 <<= 4", "1 = (2 += (3 <<= 4))");
+	assert_same("1 - 2 - 3", "(1 - 2) - 3");
+	assert_differ("1 - 2 - 3", "1 - (2 - 3)");
+	assert_same("1 / 2 * 3 % 4", "((1 / 2) * 3) % 4");
+	assert_same("1 || 2 || 3", "(1 || 2) || 3");
+	assert_same("1; 2; 3", "(1; 2); 3");
+}
+
+VTEST(test_parse_precedence) {
+	assert_same("1 = 2 || 3 && 4 == 5 < 6 | 7 ^ 8 & 9 << 10 + 11 * 12",
+		"1 = (2 || (3 && (4 == (5 < (6 | (7 ^ (8 & (9 << (10 + (11 * 12))))))))))");
+	assert_same("1 * 2 + 3 << 4 & 5 ^ 6 | 7 < 8 == 9 && 10 || 11 = 12",
+		"((((((((((1 * 2) + 3) << 4) & 5) ^ 6) | 7) < 8) == 9) && 10) || 11) = 12");
+	assert_same("1 < 2 > 3 <= 4 >= 5", "(((1 < 2) > 3) <= 4) >= 5");
+	assert_same("1 == 2 != 3", "(1 == 2) != 3");
+}
+
+VTEST(test_parse_xor) {
+	// The xor rule used to match '|', so ^ didn't parse at all
+	assert_same("1 | 2 ^ 3 | 4", "(1 | (2 ^ 3)) | 4");
+	assert_same("1 ^ 2 & 3 ^ 4", "(1 ^ (2 & 3)) ^ 4");
+	assert_differ("1 ^ 2", "1 | 2");
+	assert_differ("1 ^ 2", "1 & 2");
+}
+
+VTEST(test_parse_unary) {
+	// Postfix binds tighter than prefix
+	assert_same("-1++", "-(1++)");
+	assert_differ("-1++", "(-1)++");
+	assert_same("!~1--", "!(~(1--))");
+	assert_same("ptr 1(2)", "ptr (1(2))");
+	assert_same("++1 . x", "++(1 . x)");
+	assert_same("1++ . x(2)--", "((((1++) . x)(2))--)");
+	// And prefix tighter than binary
+	assert_same("-1 * -2", "(-1) * (-2)");
+	assert_same("1 - -2", "1 - (-2)");
+	assert_differ("-1", "+1");
+	assert_differ("1 - 2", "-2");
+}
+
+VTEST(test_parse_cast) {
+	// A cast is a prefix operator, so calls and field accesses bind tighter
+	assert_same("(i32) 1(2)", "(i32) (1(2))");
+	assert_differ("(i32) 1(2)", "((i32) 1)(2)");
+	assert_same("(i32) 1 . x", "(i32) (1 . x)");
+	assert_same("(i32) 1 + 2", "((i32) 1) + 2");
+	assert_same("(i32) -1", "(i32) (-1)");
+	assert_same("-(i32) 1", "-((i32) 1)");
+	assert_same("1((i32) 2, 3 = 4)", "1(((i32) 2), (3 = 4))");
+}
+
+VTEST(test_parse_toplevels) {
+	// Prototypes may leave arguments unnamed, but definitions may not
+	vassert_eq(parse("fn f(x i32, i32);"), 0);
+	vassert_eq(parse("fn f(x i32);"), 0);
+	vassert_eq(parse("fn f();"), 0);
+	vassert_ne(parse("fn f(i32) 1"), 0);
+	vassert_ne(parse("fn f() fn (i32) 1"), 0);
+	// The ';' ends an initializer rather than starting a sequence
+	vassert_eq(parse("x i32; y i32 = 1 + 2; fn f() 3"), 0);
+	vassert_eq(parse("fn f() (fn (i32) -> i32) 1"), 0);
+}
+
+VTEST(test_parse_body) {
+	// A function literal's body extends as far right as it can
+	assert_differ("fn () 1 + 2", "(fn () 1) + 2");
+	assert_same("1; fn () 2; 3", "1; fn () (2; 3)");
+	assert_differ("1; fn () 2; 3", "(1; fn () 2); 3");
+}
+
+VTEST(test_parse_error) {
+	vassert_ne(parse("fn f() 1 +"), 0);
+	vassert_ne(parse("fn f() * 1"), 0);
+	vassert_ne(parse("fn f() 1 2"), 0);
+}
+
+VTESTS_BEGIN
+	test_parse_operators,
+	test_parse_prefix,
+	test_parse_assoc,
+	test_parse_precedence,
+	test_parse_xor,
+	test_parse_unary,
+	test_parse_cast,
+	test_parse_toplevels,
+	test_parse_body,
+	test_parse_error,
+VTESTS_END
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "pass.h"
+#include "type.h"
+
+struct counts {
+	size_t pre, post, ints;
+};
+
+static bool count_pre(struct ast_expr *e, void *ctx) {
+	++((struct counts *)ctx)->pre;
+	return true;
+}
+
+// Counts nodes the checker has already typed as integers
+static void count_post(struct ast_expr *e, void *ctx) {
+	struct counts *c = ctx;
+	++c->post;
+	if (e->type.t == TYPE_INT) ++c->ints;
+}
+
+// Skips the subtree under every multiplication
+static bool skip_pre(struct ast_expr *e, void *ctx) {
+	++((struct counts *)ctx)->pre;
+	return e->t != EXPR_BINOP || e->binop.t != BINOP_MUL;
+}
+
+static const char *const after_type[] = {"type", NULL};
+
+// f(n) = n * 2 + 3
+static void build(struct ast_toplevel *top) {
+	func(top, "f", T_I32, T_I32, binop(BINOP_ADD, binop(BINOP_MUL, ident("n"), int_lit(I_32, 2)), int_lit(I_32, 3)));
+}
+
+static size_t group_of(struct pass_manager *pm, struct pass *p) {
+	for (size_t i = 0; i < pm->npasses; ++i) {
+		if (pm->passes[i].pass == p) return pm->passes[i].group;
+	}
+	vassert(false);
+	return 0;
+}
+
+VTEST(test_pass_fusion) {
+	struct counts local = {0}, global = {0};
+	struct pass local_pass = {.name = "local", .deps = after_type, .local = true, .pre = count_pre, .post = count_post, .ctx = &local};
+	struct pass global_pass = {.name = "global", .deps = after_type, .pre = count_pre, .post = count_post, .ctx = &global};
+
+	// Added before its dependency, which must still run first
+	struct pass_manager pm = {0};
+	pm_add(&pm, &local_pass);
+	pm_add(&pm, &global_pass);
+	pm_add(&pm, &type_pass);
+	vassert(pm_schedule(&pm));
+	vassert_eq(pm.ngroups, 2);
+	vassert_eq(group_of(&pm, &type_pass), 0);
+	vassert_eq(group_of(&pm, &local_pass), 0);
+	vassert_eq(group_of(&pm, &global_pass), 1);
+	vassert(pm.passes[pm.order[0]].pass == &type_pass);
+	vassert(pm.passes[pm.order[1]].pass == &local_pass);
+
+	// The local pass sees each node's type as soon as the checker sets it
+	struct ast_toplevel top;
+	build(&top);
+	pm_run(&pm, 1, &top);
+	vassert_eq(local.pre, 5);
+	vassert_eq(local.post, 5);
+	vassert_eq(local.ints, 5);
+	vassert_eq(global.ints, 5);
+	pm_free(&pm);
+}
+
+VTEST(test_pass_bad_deps) {
+	static const char *const missing[] = {"nonexistent", NULL};
+	static const char *const on_a[] = {"a", NULL}, *const on_b[] = {"b", NULL};
+	struct pass p = {.name = "p", .deps = missing};
+	struct pass a = {.name = "a", .deps = on_b}, b = {.name = "b", .deps = on_a};
+
+	struct pass_manager pm = {0};
+	pm_add(&pm, &p);
+	vassert(!pm_schedule(&pm));
+	pm_free(&pm);
+
+	pm_add(&pm, &a);
+	pm_add(&pm, &b);
+	vassert(!pm_schedule(&pm));
+	pm_free(&pm);
+
+	// A pass may not depend on itself either
+	pm_add(&pm, &a);
+	a.deps = on_a;
+	vassert(!pm_schedule(&pm));
+	pm_free(&pm);
+}
+
+VTEST(test_pass_skip) {
+	struct counts all = {0}, skipper = {0};
+	struct pass all_pass = {.name = "all", .local = true, .pre = count_pre, .post = count_post, .ctx = &all};
+	struct pass skip_pass = {.name = "skip", .local = true, .pre = skip_pre, .post = count_post, .ctx = &skipper};
+
+	struct pass_manager pm = {0};
+	pm_add(&pm, &skip_pass);
+	pm_add(&pm, &all_pass);
+	vassert(pm_schedule(&pm));
+	vassert_eq(pm.ngroups, 1);
+
+	// The skipping pass sees the multiplication's pre but nothing under it,
+	// while the other pass still walks the whole tree
+	struct ast_toplevel top;
+	build(&top);
+	pm_run(&pm, 1, &top);
+	vassert_eq(skipper.pre, 3);
+	vassert_eq(skipper.post, 2);
+	vassert_eq(all.pre, 5);
+	vassert_eq(all.post, 5);
+	pm_free(&pm);
+}
+
+VTEST(test_pass_report) {
+	struct counts global = {0};
+	struct pass global_pass = {.name = "global", .deps = after_type, .post = count_post, .ctx = &global};
+
+	struct pass_manager pm = {0};
+	pm_add(&pm, &type_pass);
+	pm_add(&pm, &global_pass);
+	vassert(pm_schedule(&pm));
+
+	struct ast_toplevel top;
+	build(&top);
+	pm_run(&pm, 1, &top);
+
+	char *out;
+	size_t len;
+	FILE *f = open_memstream(&out, &len);
+	pm_report(&pm, f);
+	fclose(f);
+	vassert_eq_s(out, "traversal 0:\n\ttype\ntraversal 1:\n\tglobal\n");
+	free(out);
+
+	pm.timing = true;
+	pm_run(&pm, 1, &top);
+	f = open_memstream(&out, &len);
+	pm_report(&pm, f);
+	fclose(f);
+	vassert(!strncmp(out, "traversal 0 (", 13));
+	vassert_not_null(strstr(out, " ms):\n\ttype "));
+	vassert_not_null(strstr(out, "\ntraversal 1 ("));
+	vassert_not_null(strstr(out, " ms):\n\tglobal "));
+	free(out);
+	pm_free(&pm);
+}
+
+VTESTS_BEGIN
+	test_pass_fusion,
+	test_pass_bad_deps,
+	test_pass_skip,
+	test_pass_report,
+VTESTS_END
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "program.h"
+#include "type.h"
+#include "vm.h"
+
+static void write_unit(char *path, size_t ntops, struct ast_toplevel *tops) {
+	int fd = mkstemp(path);
+	vassert(fd >= 0);
+	FILE *f = fdopen(fd, "wb");
+	vassert(prog_write_unit(f, ntops, tops));
+	fclose(f);
+}
+
+VTEST(test_prog_link) {
+	// a: main(n) = twice(n) + g, unused(n) = n, ns { g = 1 }
+	// b: twice(n) = n * 2, and a prototype of main
+	struct ast_toplevel g = {.type = EXPRTOP_DECL, .decl = {.type = {.mut = true, .to = T_I32}, .name = "g", .val = int_lit(I_32, 1)}};
+	struct ast_toplevel a[3], b[2];
+	func(a + 0, "main", T_I32, T_I32, binop(BINOP_ADD, call("twice", 1, ident("n")), ident("g")));
+	func(a + 1, "unused", T_I32, T_I32, ident("n"));
+	a[2] = (struct ast_toplevel){.type = EXPRTOP_NAMESPACE, .namespace = {1, &g}};
+	func(b + 0, "twice", T_I32, T_I32, binop(BINOP_MUL, ident("n"), int_lit(I_32, 2)));
+	func(b + 1, "main", T_I32, T_I32, NULL);
+	char path_a[] = "/tmp/cec-test-XXXXXX", path_b[] = "/tmp/cec-test-XXXXXX";
+	write_unit(path_a, 3, a);
+	write_unit(path_b, 2, b);
+
+	struct program p;
+	prog_init(&p);
+	vassert(prog_add_unit(&p, path_a));
+	vassert(prog_add_unit(&p, path_b));
+	vassert_eq(p.nsyms, 5);
+
+	const char *roots[] = {"main"};
+	vassert_eq(prog_mark_reachable(&p, 1, roots), 3);
+	vassert(prog_load(&p));
+	unlink(path_a);
+	unlink(path_b);
+	vassert_eq(p.ntops, 3);
+
+	// twice is inlined into main, and then pruned
+	prog_optimize(&p, 1, roots, &(struct inline_opts){0});
+	vassert_eq(p.ntops, 2);
+
+	struct vm_module m;
+	vassert(vm_compile_unit(&m, p.ntops, p.tops));
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, m.init, 0, NULL, NULL), VM_OK);
+	union vm_value arg = {.i = 5}, ret;
+	vassert_eq(vm_call(&vm, vm_lookup(&m, "main"), 1, &arg, &ret), VM_OK);
+	vassert_eq(ret.i, 11);
+	vassert_null(vm_lookup(&m, "twice"));
+
+	vm_free(&vm);
+	vm_module_free(&m);
+	prog_free(&p);
+}
+
+VTEST(test_prog_errors) {
+	struct ast_toplevel a[1], b[1];
+	func(a, "f", T_I32, T_I32, ident("n"));
+	func(b, "f", T_I32, T_I32, int_lit(I_32, 0));
+	char path_a[] = "/tmp/cec-test-XXXXXX", path_b[] = "/tmp/cec-test-XXXXXX";
+	write_unit(path_a, 1, a);
+	write_unit(path_b, 1, b);
+
+	struct program p;
+	prog_init(&p);
+	vassert(prog_add_unit(&p, path_a));
+	vassert(!prog_add_unit(&p, path_b));
+	vassert_eq_s(p.error, "defined more than once");
+	vassert_eq_s(p.error_name, "f");
+	prog_free(&p);
+
+	// Cut short in the middle of its summaries
+	truncate(path_b, 20);
+	prog_init(&p);
+	vassert(!prog_add_unit(&p, path_b));
+	vassert_eq_s(p.error, "corrupt unit file");
+	prog_free(&p);
+
+	unlink(path_a);
+	unlink(path_b);
+}
+
+VTESTS_BEGIN
+	test_prog_link,
+	test_prog_errors,
+VTESTS_END
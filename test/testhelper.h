@@ -1,28 +1,110 @@
 #ifndef TESTHELPER_H
 #define TESTHELPER_H
 
-#include <stdio.h>
-#include <unistd.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "lex.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-function"
 
-static FILE *stropen(const char *s) {
-	int fds[2];
-	if (pipe(fds)) return NULL;
+// Lexes a copy of s, followed by the two NULs lex_buffer needs, with a
+// scanner shared by every call. The copy lives until the next call.
+static yyscan_t strlex(const char *s) {
+	static yyscan_t scanner;
+	static char *buf;
+	if (!scanner && !lex_init(&scanner)) abort();
+	size_t len = strlen(s);
+	char *copy = malloc(len + 2);
+	memcpy(copy, s, len);
+	copy[len] = copy[len+1] = 0;
 
-	FILE *rpipe = fdopen(fds[0], "r");
-	FILE *wpipe = fdopen(fds[1], "w");
-	if (!rpipe || !wpipe) {
-		close(fds[0]);
-		close(fds[1]);
-		return NULL;
+	lex_buffer(scanner, copy, len);
+	free(buf);
+	buf = copy;
+	return scanner;
+}
+
+// AST builders. Nodes are never freed; tests are short-lived.
+
+#define T_I32 ((struct val_type){.t = TYPE_INT, .int_ = I_32})
+
+static struct ast_expr *node(struct ast_expr e) {
+	struct ast_expr *p = malloc(sizeof *p);
+	*p = e;
+	return p;
+}
+
+static struct ast_expr *ident(const char *name) {
+	return node((struct ast_expr){.t = EXPR_IDENT, .ident = name});
+}
+
+static struct ast_expr *int_lit(enum int_type type, int64_t i) {
+	return node((struct ast_expr){.t = EXPR_INT_LIT, .int_lit = {.type = type, .i = i}});
+}
+
+static struct ast_expr *float_lit(enum float_type type, long double x) {
+	return node((struct ast_expr){.t = EXPR_FLOAT_LIT, .float_lit = {.type = type, .x = x}});
+}
+
+static struct ast_expr *binop(int op, struct ast_expr *x, struct ast_expr *y) {
+	return node((struct ast_expr){.t = EXPR_BINOP, .binop = {.t = op, .x = x, .y = y}});
+}
+
+static struct ast_expr *unop(int op, struct ast_expr *x) {
+	return node((struct ast_expr){.t = EXPR_UNOP, .unop = {.t = op, .x = x}});
+}
+
+// A mutable binding
+static struct ast_expr *let(const char *name, struct val_type type, struct ast_expr *val, struct ast_expr *body) {
+	return node((struct ast_expr){.t = EXPR_LET, .let = {.name = name, .type = {.mut = true, .to = type}, .val = val, .body = body}});
+}
+
+// Calls the function called name with nargs argument expressions
+static struct ast_expr *call(const char *name, size_t nargs, ...) {
+	struct ast_expr *args = malloc(nargs * sizeof *args);
+	va_list ap;
+	va_start(ap, nargs);
+	for (size_t i = 0; i < nargs; ++i) {
+		args[i] = *va_arg(ap, struct ast_expr *);
 	}
+	va_end(ap);
+	return node((struct ast_expr){.t = EXPR_CALL, .call = {.func = ident(name), .nargs = nargs, .args = args}});
+}
 
-	fputs(s, wpipe);
-	fclose(wpipe);
+// f may be NULL
+static struct ast_expr *if_(struct ast_expr *cond, struct ast_expr *t, struct ast_expr *f) {
+	return node((struct ast_expr){.t = EXPR_IF, .if_ = {.cond = cond, .t = t, .f = f}});
+}
+
+// val may be NULL
+static struct ast_expr *return_(struct ast_expr *val) {
+	return node((struct ast_expr){.t = EXPR_RETURN, .return_ = {val}});
+}
+
+static struct ast_expr *while_(struct ast_expr *cond, struct ast_expr *body) {
+	return node((struct ast_expr){.t = EXPR_WHILE, .while_ = {.cond = cond, .body = body}});
+}
+
+// A mutable pointer to to
+static struct val_type ptr(struct val_type to) {
+	struct ref_type *ref = malloc(sizeof *ref);
+	*ref = (struct ref_type){.mut = true, .to = to};
+	return (struct val_type){.t = TYPE_PTR, .ptr = ref};
+}
 
-	return rpipe;
+// A function of one mutable argument n. body may be NULL for a prototype.
+static void func(struct ast_toplevel *top, const char *name, struct val_type arg, struct val_type ret, struct ast_expr *body) {
+	*top = (struct ast_toplevel){.type = EXPRTOP_FUNC};
+	top->func.name = name;
+	top->func.nargs = 1;
+	top->func.args = malloc(sizeof *top->func.args);
+	top->func.args[0].name = "n";
+	top->func.args[0].type = (struct ref_type){.mut = true, .to = arg};
+	top->func.ret = ret;
+	top->func.body = body;
 }
 
 #pragma GCC diagnostic pop
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "type.h"
+#include "vm.h"
+
+// Compiles a unit of one function, and calls it with one argument
+static enum vm_status run(struct ast_toplevel *top, int64_t arg, union vm_value *ret) {
+	annotate_unit(1, top);
+
+	struct vm_module m;
+	bool ok = vm_compile_unit(&m, 1, top);
+	vassert(ok);
+
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, m.init, 0, NULL, NULL), VM_OK);
+	union vm_value a = {.i = arg};
+	enum vm_status status = vm_call(&vm, vm_lookup(&m, top->func.name), 1, &a, ret);
+	vm_free(&vm);
+	vm_module_free(&m);
+	return status;
+}
+
+VTEST(test_vm_int_wrap) {
+	struct ast_toplevel top;
+	union vm_value ret;
+	struct val_type i8 = {.t = TYPE_INT, .int_ = I_8}, u8 = {.t = TYPE_INT, .int_ = U_8};
+
+	func(&top, "add", i8, i8, binop(BINOP_ADD, ident("n"), int_lit(I_8, 100)));
+	vassert_eq(run(&top, 100, &ret), VM_OK);
+	vassert_eq(ret.i, -56);
+
+	func(&top, "shl", u8, u8, binop(BINOP_LSHIFT, ident("n"), int_lit(U_8, 3)));
+	vassert_eq(run(&top, 0x35, &ret), VM_OK);
+	vassert_eq(ret.u, 0xa8);
+
+	func(&top, "shr", i8, i8, binop(BINOP_RSHIFT, ident("n"), int_lit(I_8, 9)));
+	vassert_eq(run(&top, -5, &ret), VM_OK);
+	vassert_eq(ret.i, -1);
+}
+
+VTEST(test_vm_div_zero) {
+	struct ast_toplevel top;
+	union vm_value ret;
+	func(&top, "div", T_I32, T_I32, binop(BINOP_DIV, int_lit(I_32, 7), ident("n")));
+	vassert_eq(run(&top, 2, &ret), VM_OK);
+	vassert_eq(ret.i, 3);
+	vassert_eq(run(&top, 0, &ret), VM_ERR_DIV_ZERO);
+}
+
+VTEST(test_vm_loop_defer) {
+	// let mut c = 0; (while n > 0 { let x = n; (n = n - 1; if x == 2 break) defer c = c + x }); c
+	struct ast_expr *dec = binop(BINOP_ASSIGN, ident("n"), binop(BINOP_SUB, ident("n"), int_lit(I_32, 1)));
+	struct ast_expr *brk = node((struct ast_expr){.t = EXPR_IF, .if_ = {
+		.cond = binop(BINOP_EQUAL, ident("x"), int_lit(I_32, 2)),
+		.t = node((struct ast_expr){.t = EXPR_BREAK}),
+	}});
+	struct ast_expr *let_x = node((struct ast_expr){.t = EXPR_LET, .let = {
+		.name = "x",
+		.type = {.to = T_I32},
+		.val = ident("n"),
+		.body = binop(BINOP_SEQOP, dec, brk),
+		.deferred = binop(BINOP_ASSIGN, ident("c"), binop(BINOP_ADD, ident("c"), ident("x"))),
+	}});
+	struct ast_expr *loop = while_(binop(BINOP_GT, ident("n"), int_lit(I_32, 0)), let_x);
+	struct ast_expr *body = let("c", T_I32, int_lit(I_32, 0), binop(BINOP_SEQOP, loop, ident("c")));
+
+	struct ast_toplevel top;
+	union vm_value ret;
+	func(&top, "sum", T_I32, T_I32, body);
+	// 5 + 4 + 3 + 2, with the last added on the way out of the break
+	vassert_eq(run(&top, 5, &ret), VM_OK);
+	vassert_eq(ret.i, 14);
+}
+
+VTEST(test_vm_defer_aggregate) {
+	// let t = (let s = S{n, 2}; s defer s.x = 0); t.x * 10 + t.y
+	static const char *names[] = {"x", "y"};
+	static struct val_type i32 = T_I32;
+	struct val_type st = {.t = TYPE_STRUCT};
+	st.composite.nfields = 2;
+	st.composite.fields = malloc(2 * sizeof *st.composite.fields);
+	for (int i = 0; i < 2; ++i) {
+		st.composite.fields[i].name = names[i];
+		st.composite.fields[i].type = &i32;
+	}
+	struct ast_expr *elems = malloc(2 * sizeof *elems);
+	elems[0] = *ident("n");
+	elems[1] = *int_lit(I_32, 2);
+	struct ast_expr *lit = node((struct ast_expr){.t = EXPR_COMPOSITE_LIT, .composite_lit = {.type = st, .nelems = 2, .elems = elems}});
+	struct ast_expr *field[3];
+	for (int i = 0; i < 3; ++i) {
+		field[i] = node((struct ast_expr){.t = EXPR_FIELD_ACCESS, .field_access = {ident(i ? "t" : "s"), names[i == 2]}});
+	}
+
+	struct ast_expr *inner = let("s", st, lit, ident("s"));
+	inner->let.deferred = binop(BINOP_ASSIGN, field[0], int_lit(I_32, 0));
+	struct ast_expr *body = let("t", st, inner, binop(BINOP_ADD, binop(BINOP_MUL, field[1], int_lit(I_32, 10)), field[2]));
+
+	struct ast_toplevel top;
+	union vm_value ret;
+	func(&top, "f", T_I32, T_I32, body);
+	// The let's value is taken before the deferred code clears s.x
+	vassert_eq(run(&top, 7, &ret), VM_OK);
+	vassert_eq(ret.i, 72);
+}
+
+VTEST(test_vm_deep_else) {
+	// if n == 0 1 else (n = n - 1; if n == 0 1 else (n = n - 1; ... else 0)),
+	// nested far deeper than the C stack could follow
+	enum { N = 1 << 18 };
+	struct ast_expr *body = int_lit(I_32, 0);
+	for (int i = 0; i < N; ++i) {
+		struct ast_expr *dec = binop(BINOP_ASSIGN, ident("n"), binop(BINOP_SUB, ident("n"), int_lit(I_32, 1)));
+		body = if_(binop(BINOP_EQUAL, ident("n"), int_lit(I_32, 0)), int_lit(I_32, 1), binop(BINOP_SEQOP, dec, body));
+	}
+
+	struct ast_toplevel top;
+	union vm_value ret;
+	func(&top, "f", T_I32, T_I32, body);
+	vassert_eq(run(&top, 3, &ret), VM_OK);
+	vassert_eq(ret.i, 1);
+	vassert_eq(run(&top, N, &ret), VM_OK);
+	vassert_eq(ret.i, 0);
+}
+
+VTEST(test_vm_recursion) {
+	// if n < 2 return n else return fib(n - 1) + fib(n - 2)
+	struct ast_expr *calls[2];
+	for (int i = 0; i < 2; ++i) {
+		calls[i] = call("fib", 1, binop(BINOP_SUB, ident("n"), int_lit(I_32, i + 1)));
+	}
+	struct ast_expr *body = node((struct ast_expr){.t = EXPR_IF, .if_ = {
+		.cond = binop(BINOP_LT, ident("n"), int_lit(I_32, 2)),
+		.t = node((struct ast_expr){.t = EXPR_RETURN, .return_ = {ident("n")}}),
+		.f = node((struct ast_expr){.t = EXPR_RETURN, .return_ = {binop(BINOP_ADD, calls[0], calls[1])}}),
+	}});
+
+	struct ast_toplevel top;
+	union vm_value ret;
+	func(&top, "fib", T_I32, T_I32, body);
+	vassert_eq(run(&top, 20, &ret), VM_OK);
+	vassert_eq(ret.i, 6765);
+}
+
+VTEST(test_vm_jobs) {
+	// f0(n) = n, and each later fN(n) = fN-1(n) + 1
+	enum { N = 16 };
+	static char names[N][4];
+	struct ast_toplevel tops[N];
+	for (int i = 0; i < N; ++i) {
+		snprintf(names[i], sizeof names[i], "f%d", i);
+		struct ast_expr *body = ident("n");
+		if (i) {
+			body = binop(BINOP_ADD, call(names[i-1], 1, ident("n")), int_lit(I_32, 1));
+		}
+		func(tops + i, names[i], T_I32, T_I32, body);
+	}
+	annotate_unit(N, tops);
+
+	struct vm_module serial, par;
+	vassert(vm_compile_unit_jobs(&serial, N, tops, 1));
+	vassert(vm_compile_unit_jobs(&par, N, tops, 4));
+	vassert_eq(serial.nfuncs, par.nfuncs);
+	for (size_t i = 0; i < serial.nfuncs; ++i) {
+		vassert_eq_s(serial.funcs[i]->name, par.funcs[i]->name);
+		vassert_eq(serial.funcs[i]->ncode, par.funcs[i]->ncode);
+		vassert(!memcmp(serial.funcs[i]->code, par.funcs[i]->code, serial.funcs[i]->ncode * sizeof *serial.funcs[i]->code));
+	}
+
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, par.init, 0, NULL, NULL), VM_OK);
+	union vm_value a = {.i = 5}, ret;
+	vassert_eq(vm_call(&vm, vm_lookup(&par, names[N-1]), 1, &a, &ret), VM_OK);
+	vassert_eq(ret.i, 5 + N - 1);
+	vm_free(&vm);
+	vm_module_free(&serial);
+	vm_module_free(&par);
+}
+
+VTEST(test_vm_limits) {
+	// n + (n + (... + n)) holds each left operand in a register of its own
+	struct ast_toplevel top;
+	struct vm_module m;
+	for (int depth = 200; depth <= 300; depth += 100) {
+		struct ast_expr *body = ident("n");
+		for (int i = 0; i < depth; ++i) body = binop(BINOP_ADD, ident("n"), body);
+		func(&top, "f", T_I32, T_I32, body);
+		annotate_unit(1, &top);
+		bool ok = vm_compile_unit(&m, 1, &top);
+		if (depth == 200) {
+			vassert(ok);
+		} else {
+			vassert(!ok);
+			vassert_not_null(strstr(m.error, "too many registers"));
+		}
+		vm_module_free(&m);
+	}
+
+	struct ast_expr *args = malloc(256 * sizeof *args);
+	for (int i = 0; i < 256; ++i) args[i] = *ident("n");
+	struct ast_expr *c = call("f", 0);
+	c->call.nargs = 256;
+	c->call.args = args;
+	func(&top, "f", T_I32, T_I32, c);
+	annotate_unit(1, &top);
+	vassert(!vm_compile_unit(&m, 1, &top));
+	vassert_not_null(strstr(m.error, "too many arguments"));
+	vm_module_free(&m);
+}
+
+VTEST(test_vm_float_consts) {
+	// Equal floats share a constant, whatever the padding of long double
+	struct val_type f80 = {.t = TYPE_FLOAT, .float_ = F_80}, f64 = {.t = TYPE_FLOAT, .float_ = F_64};
+	struct ast_toplevel top;
+	func(&top, "f", T_I32, f80, binop(BINOP_ADD,
+		binop(BINOP_ADD, float_lit(F_80, 1.5), float_lit(F_80, 1.5)),
+		float_lit(F_80, 2.5)));
+	annotate_unit(1, &top);
+	struct vm_module m;
+	vassert(vm_compile_unit(&m, 1, &top));
+	vassert_eq(vm_lookup(&m, "f")->nconsts, 2);
+
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	union vm_value a = {.i = 0}, ret;
+	vassert_eq(vm_call(&vm, vm_lookup(&m, "f"), 1, &a, &ret), VM_OK);
+	vassert(ret.f80 == 5.5);
+	vm_free(&vm);
+	vm_module_free(&m);
+
+	func(&top, "f", T_I32, f64, binop(BINOP_SUB, float_lit(F_64, 0.0), float_lit(F_64, -0.0)));
+	annotate_unit(1, &top);
+	vassert(vm_compile_unit(&m, 1, &top));
+	vassert_eq(vm_lookup(&m, "f")->nconsts, 2);
+	vm_module_free(&m);
+}
+
+VTESTS_BEGIN
+	test_vm_int_wrap,
+	test_vm_div_zero,
+	test_vm_loop_defer,
+	test_vm_defer_aggregate,
+	test_vm_deep_else,
+	test_vm_recursion,
+	test_vm_jobs,
+	test_vm_limits,
+	test_vm_float_consts,
+VTESTS_END
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include "vtest.h"
+#include "type.h"
+#include "walk.h"
+
+#define DEPTH 1000000
+
+static bool count_pre(struct ast_expr *e, void *ctx) {
+	++((size_t *)ctx)[0];
+	return true;
+}
+
+static void count_post(struct ast_expr *e, void *ctx) {
+	++((size_t *)ctx)[1];
+}
+
+// (((0; 1); 2); ...), as produced by the left-recursive op_sequence
+static struct ast_expr *long_sequence(struct ast_expr *nodes, size_t n) {
+	struct ast_expr *e = nodes;
+	*e = (struct ast_expr){.t = EXPR_INT_LIT, .int_lit = {.type = I_32, .i = 0}};
+	for (size_t i = 1; i < n; ++i) {
+		struct ast_expr *lit = nodes + 2*i - 1, *seq = nodes + 2*i;
+		*lit = (struct ast_expr){.t = EXPR_INT_LIT, .int_lit = {.type = U_8, .u = i}};
+		*seq = (struct ast_expr){.t = EXPR_BINOP, .binop = {.t = BINOP_SEQOP, .x = e, .y = lit}};
+		e = seq;
+	}
+	return e;
+}
+
+VTEST(test_walk_order) {
+	struct ast_expr nodes[5];
+	struct ast_expr *e = long_sequence(nodes, 3);
+
+	size_t counts[2] = {0};
+	struct walk_stack s = {0};
+	walk_expr(&s, e, &(struct walk_ops){.pre = count_pre, .post = count_post}, counts);
+	vassert_eq(counts[0], 5);
+	vassert_eq(counts[1], 5);
+	vassert_eq(s.n, 0);
+	walk_free(&s);
+}
+
+VTEST(test_walk_deep_sequence) {
+	struct ast_expr *nodes = malloc((2*DEPTH - 1) * sizeof *nodes);
+	vassert_not_null(nodes);
+	struct ast_expr *e = long_sequence(nodes, DEPTH);
+
+	size_t counts[2] = {0};
+	struct walk_stack s = {0};
+	walk_expr(&s, e, &(struct walk_ops){.pre = count_pre, .post = count_post}, counts);
+	vassert_eq(counts[0], 2*DEPTH - 1);
+	vassert_eq(counts[1], 2*DEPTH - 1);
+	walk_free(&s);
+
+	vassert_eq(annotate_type(e), VALTYPE);
+	vassert_eq(e->type.t, TYPE_INT);
+	vassert_eq(e->type.int_, U_8);
+
+	free(nodes);
+}
+
+VTEST(test_annotate_deep_let) {
+	// fn() -> i64 let x i64 = 0; let x i64 = 1; ... x
+	struct ast_expr *nodes = malloc((2*DEPTH + 2) * sizeof *nodes);
+	vassert_not_null(nodes);
+
+	struct ast_expr *func = nodes;
+	*func = (struct ast_expr){.t = EXPR_FUNC, .func = {.ret = {.t = TYPE_INT, .int_ = I_64}}};
+	struct ast_expr **body = &func->func.body;
+	for (size_t i = 0; i < DEPTH; ++i) {
+		struct ast_expr *let = nodes + 1 + 2*i, *val = nodes + 2 + 2*i;
+		*val = (struct ast_expr){.t = EXPR_INT_LIT, .int_lit = {.type = I_64, .i = i}};
+		*let = (struct ast_expr){.t = EXPR_LET, .let = {
+			.name = "x",
+			.type = {.to = {.t = TYPE_INT, .int_ = I_64}},
+			.val = val,
+		}};
+		*body = let;
+		body = &let->let.body;
+	}
+	struct ast_expr *x = nodes + 2*DEPTH + 1;
+	*x = (struct ast_expr){.t = EXPR_IDENT, .ident = "x"};
+	*body = x;
+
+	vassert_eq(annotate_type(func), REFTYPE);
+	vassert_eq(x->type.t, TYPE_INT);
+	vassert_eq(x->type.int_, I_64);
+	vassert_eq(nodes[1].type.t, TYPE_INT);
+
+	free(func->type.func.args);
+	free(nodes);
+}
+
+VTESTS_BEGIN
+	test_walk_order,
+	test_walk_deep_sequence,
+	test_annotate_deep_let,
+VTESTS_END
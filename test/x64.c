@@ -0,0 +1,630 @@
+#define _DEFAULT_SOURCE
+#include <elf.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "vtest.h"
+#include "testhelper.h"
+#include "type.h"
+#include "vm.h"
+#include "x64.h"
+
+// A C function compiled code may call, found by name as the dynamic linker
+// would find it
+struct host {
+	const char *name;
+	void *addr;
+};
+
+// A unit compiled to an object, then loaded and relocated in memory.
+// Undefined functions are called through stubs, as they may be too far
+// away for a rel32, and their addresses are loaded from a GOT.
+struct image {
+	struct vm_module m;
+	struct elf_obj o;
+	uint8_t *base;
+	size_t size;
+	uint8_t *sects[ELF_NSECTS];
+};
+
+static size_t align_up(size_t n, size_t align) {
+	return (n + align - 1) / align * align;
+}
+
+static void load(struct image *im, const struct host *hosts) {
+	struct elf_obj *o = &im->o;
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	// Text, then a stub for each symbol, then the other sections on pages of
+	// their own, then a GOT entry for each symbol
+	size_t stubs = align_up(o->sects[ELF_TEXT].size, 16);
+	size_t exec = align_up(stubs + 16 * o->nsyms, page);
+	size_t off[ELF_NSECTS] = {0}, end = exec;
+	for (int s = ELF_TEXT + 1; s < ELF_NSECTS; ++s) {
+		off[s] = align_up(end, o->sects[s].align ? o->sects[s].align : 1);
+		end = off[s] + o->sects[s].size;
+	}
+	size_t got = align_up(end, 8);
+	im->size = got + 8 * o->nsyms;
+	im->base = mmap(NULL, im->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	vassert(im->base != MAP_FAILED);
+	for (int s = 0; s < ELF_NSECTS; ++s) {
+		im->sects[s] = im->base + off[s];
+		if (o->sects[s].data) memcpy(im->sects[s], o->sects[s].data, o->sects[s].size);
+	}
+
+	// Where each symbol is, and where a call to it goes
+	uint64_t *addr = malloc(o->nsyms * sizeof *addr), *target = malloc(o->nsyms * sizeof *target);
+	for (size_t i = 0; i < o->nsyms; ++i) {
+		struct elf_sym *sym = o->syms + i;
+		if (sym->sect != ELF_UNDEF) {
+			addr[i] = target[i] = (uint64_t)(im->sects[sym->sect] + sym->value);
+			continue;
+		}
+		void *h = NULL;
+		for (const struct host *p = hosts; p && p->name; ++p) {
+			if (!strcmp(p->name, sym->name)) h = p->addr;
+		}
+		vassert_not_null(h);
+		// jmp [rip+2]; ud2; then the address
+		static const uint8_t jmp[] = {0xff, 0x25, 0x02, 0x00, 0x00, 0x00, 0x0f, 0x0b};
+		uint8_t *stub = im->base + stubs + 16 * i;
+		memcpy(stub, jmp, sizeof jmp);
+		memcpy(stub + 8, &h, 8);
+		addr[i] = (uint64_t)h;
+		target[i] = (uint64_t)stub;
+	}
+	memcpy(im->base + got, addr, 8 * o->nsyms);
+
+	for (int s = 0; s < ELF_NSECTS; ++s) {
+		struct elf_section *sect = o->sects + s;
+		for (size_t i = 0; i < sect->nrelocs; ++i) {
+			struct elf_reloc *r = sect->relocs + i;
+			uint8_t *at = im->sects[s] + r->offset;
+			int64_t v;
+			switch (r->type) {
+			case R_X86_64_64:
+				v = addr[r->sym] + r->addend;
+				memcpy(at, &v, 8);
+				continue;
+			case R_X86_64_PC32:
+			case R_X86_64_PLT32:
+				v = target[r->sym] + r->addend - (uint64_t)at;
+				break;
+			case R_X86_64_GOTPCREL:
+				v = (uint64_t)(im->base + got + 8 * r->sym) + r->addend - (uint64_t)at;
+				break;
+			default:
+				vassert(false);
+			}
+			vassert_eq(v, (int32_t)v);
+			int32_t v32 = v;
+			memcpy(at, &v32, 4);
+		}
+	}
+	free(addr);
+	free(target);
+	vassert(!mprotect(im->base, exec, PROT_READ | PROT_EXEC));
+
+	for (size_t i = 0; i < o->sects[ELF_INIT_ARRAY].size; i += 8) {
+		void (*init)(void);
+		memcpy(&init, im->sects[ELF_INIT_ARRAY] + i, 8);
+		init();
+	}
+}
+
+static void build(struct image *im, size_t ntops, struct ast_toplevel *tops, const struct host *hosts) {
+	annotate_unit(ntops, tops);
+	vassert(vm_compile_unit(&im->m, ntops, tops));
+	elf_init(&im->o);
+	vassert(x64_compile_module(&im->m, &im->o));
+	load(im, hosts);
+}
+
+static void *native(struct image *im, const char *name) {
+	struct elf_sym *sym = im->o.syms + elf_sym(&im->o, name);
+	vassert_eq(sym->sect, ELF_TEXT);
+	return im->sects[ELF_TEXT] + sym->value;
+}
+
+static void unload(struct image *im) {
+	munmap(im->base, im->size);
+	elf_free(&im->o);
+	vm_module_free(&im->m);
+}
+
+// Whether the text has a relocation of the given type against name
+static bool has_reloc(struct image *im, const char *name, uint32_t type) {
+	struct elf_section *text = im->o.sects + ELF_TEXT;
+	size_t sym = elf_sym(&im->o, name);
+	for (size_t i = 0; i < text->nrelocs; ++i) {
+		if (text->relocs[i].sym == sym && text->relocs[i].type == type) return true;
+	}
+	return false;
+}
+
+// x as a value of scalar type t, extended to 64 bits as the VM keeps it
+static union vm_value value(const struct val_type *t, long double x) {
+	union vm_value v = {0};
+	if (t->t == TYPE_FLOAT) {
+		switch (t->float_) {
+		case F_32: v.f32 = x; break;
+		case F_64: v.f64 = x; break;
+		case F_80: v.f80 = x; break;
+		}
+		return v;
+	}
+	int64_t i = x;
+	switch (t->int_) {
+	case I_8: v.i = (int8_t)i; break;
+	case I_16: v.i = (int16_t)i; break;
+	case I_32: v.i = (int32_t)i; break;
+	case I_64: v.i = i; break;
+	case U_8: v.u = (uint8_t)i; break;
+	case U_16: v.u = (uint16_t)i; break;
+	case U_32: v.u = (uint32_t)i; break;
+	case U_64: v.u = i; break;
+	}
+	return v;
+}
+
+// Calls f, of one argument of type t and a result of type t, as C would
+static union vm_value call_native(void *f, const struct val_type *t, union vm_value a) {
+	union vm_value r = {0};
+	if (t->t == TYPE_FLOAT) {
+		switch (t->float_) {
+		case F_32: r.f32 = ((float (*)(float))f)(a.f32); break;
+		case F_64: r.f64 = ((double (*)(double))f)(a.f64); break;
+		case F_80: r.f80 = ((long double (*)(long double))f)(a.f80); break;
+		}
+		return r;
+	}
+	switch (t->int_) {
+	case I_8: r.i = ((int8_t (*)(int8_t))f)(a.i); break;
+	case I_16: r.i = ((int16_t (*)(int16_t))f)(a.i); break;
+	case I_32: r.i = ((int32_t (*)(int32_t))f)(a.i); break;
+	case I_64: r.i = ((int64_t (*)(int64_t))f)(a.i); break;
+	case U_8: r.u = ((uint8_t (*)(uint8_t))f)(a.u); break;
+	case U_16: r.u = ((uint16_t (*)(uint16_t))f)(a.u); break;
+	case U_32: r.u = ((uint32_t (*)(uint32_t))f)(a.u); break;
+	case U_64: r.u = ((uint64_t (*)(uint64_t))f)(a.u); break;
+	}
+	return r;
+}
+
+// Runs the last function of the unit natively and in the VM, and checks
+// they agree. It must take one argument of the same scalar type as its
+// result.
+static void agree(size_t ntops, struct ast_toplevel *tops, const long double *args, size_t nargs) {
+	struct ast_toplevel *top = tops + ntops - 1;
+	struct image im;
+	build(&im, ntops, tops, NULL);
+	void *f = native(&im, top->func.name);
+	const struct val_type *t = &top->func.ret;
+
+	struct vm vm;
+	vm_init(&vm, 0, 0, 0);
+	vassert_eq(vm_call(&vm, im.m.init, 0, NULL, NULL), VM_OK);
+	for (size_t i = 0; i < nargs; ++i) {
+		union vm_value a = value(t, args[i]), ret;
+		vassert_eq(vm_call(&vm, vm_lookup(&im.m, top->func.name), 1, &a, &ret), VM_OK);
+		union vm_value got = call_native(f, t, a);
+		if (t->t != TYPE_FLOAT) {
+			vassert_eq(got.i, value(t, ret.i).i);
+		} else if (t->float_ == F_32) {
+			vassert(got.f32 == ret.f32);
+		} else if (t->float_ == F_64) {
+			vassert(got.f64 == ret.f64);
+		} else {
+			vassert(got.f80 == ret.f80);
+		}
+	}
+
+	vm_free(&vm);
+	unload(&im);
+}
+
+static const enum int_type int_types[] = {I_8, I_16, I_32, I_64, U_8, U_16, U_32, U_64};
+static const enum float_type float_types[] = {F_32, F_64, F_80};
+
+// Wrapped to each type as they are passed, so these cover zero, one, the
+// extremes, and shift counts below, at and above every width
+static const long double int_args[] = {
+	0, 1, -1, 2, 5, -5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100,
+	127, -128, 128, 255, 256, 0x7fff, -0x8000, 0xffff, 0x7fffffff, -0x7fffffffLL - 1,
+	0xffffffffLL, INT64_MAX, INT64_MIN,
+};
+#define NINT_ARGS (sizeof int_args / sizeof *int_args)
+
+static const long double float_args[] = {0, 1, -1, 0.5, -0.75, 3.25, 1e10, -1e-5, 123456.789};
+#define NFLOAT_ARGS (sizeof float_args / sizeof *float_args)
+
+// A literal of type t, wrapped to fit it
+static struct ast_expr *lit(enum int_type t, int64_t i) {
+	return int_lit(t, value(&(struct val_type){.t = TYPE_INT, .int_ = t}, i).i);
+}
+
+static const char *names[] = {
+	"a", "b", "c", "d", "e", "f", "g", "h", "i", "j",
+	"k", "l", "m", "n", "o", "p", "q", "r", "s", "t",
+};
+
+// A function of mutable arguments a, b, c and so on
+static void funcn(struct ast_toplevel *top, const char *name, size_t nargs, const struct val_type *args, struct val_type ret, struct ast_expr *body) {
+	*top = (struct ast_toplevel){.type = EXPRTOP_FUNC};
+	top->func.name = name;
+	top->func.nargs = nargs;
+	top->func.args = malloc(nargs * sizeof *top->func.args);
+	for (size_t i = 0; i < nargs; ++i) {
+		top->func.args[i].name = names[i];
+		top->func.args[i].type = (struct ref_type){.mut = true, .to = args[i]};
+	}
+	top->func.ret = ret;
+	top->func.body = body;
+}
+
+// A struct of fields a, b, c and so on
+static struct val_type record(size_t nfields, const struct val_type *types) {
+	struct val_type t = {.t = TYPE_STRUCT};
+	t.composite.nfields = nfields;
+	t.composite.fields = malloc(nfields * sizeof *t.composite.fields);
+	for (size_t i = 0; i < nfields; ++i) {
+		t.composite.fields[i].name = names[i];
+		t.composite.fields[i].type = malloc(sizeof *t.composite.fields[i].type);
+		*t.composite.fields[i].type = types[i];
+	}
+	return t;
+}
+
+// A literal of struct type t from an array of its fields
+static struct ast_expr *record_lit(struct val_type t, struct ast_expr **elems) {
+	size_t n = t.composite.nfields;
+	struct ast_expr *copy = malloc(n * sizeof *copy);
+	for (size_t i = 0; i < n; ++i) copy[i] = *elems[i];
+	return node((struct ast_expr){.t = EXPR_COMPOSITE_LIT, .composite_lit = {.type = t, .nelems = n, .elems = copy}});
+}
+
+static struct ast_expr *field(struct ast_expr *x, const char *name) {
+	return node((struct ast_expr){.t = EXPR_FIELD_ACCESS, .field_access = {x, name}});
+}
+
+VTEST(test_x64_object) {
+	struct ast_toplevel top;
+	func(&top, "sq", T_I32, T_I32, binop(BINOP_MUL, ident("n"), ident("n")));
+	annotate_unit(1, &top);
+	struct vm_module m;
+	vassert(vm_compile_unit(&m, 1, &top));
+
+	struct elf_obj o;
+	elf_init(&o);
+	vassert(x64_compile_module(&m, &o));
+	struct elf_sym *sq = o.syms + elf_sym(&o, "sq");
+	vassert_eq(sq->sect, ELF_TEXT);
+	vassert(sq->global && sq->func);
+
+	FILE *f = tmpfile();
+	vassert(elf_write(&o, f));
+	long len = ftell(f);
+	rewind(f);
+
+	Elf64_Ehdr eh;
+	vassert_eq(fread(&eh, sizeof eh, 1, f), 1);
+	vassert(!memcmp(eh.e_ident, ELFMAG, SELFMAG));
+	vassert_eq(eh.e_type, ET_REL);
+	vassert_eq(eh.e_machine, EM_X86_64);
+	vassert_eq(eh.e_shoff + eh.e_shnum * sizeof (Elf64_Shdr), len);
+
+	fclose(f);
+	elf_free(&o);
+	vm_module_free(&m);
+}
+
+VTEST(test_x64_int_types) {
+	for (size_t i = 0; i < sizeof int_types / sizeof *int_types; ++i) {
+		enum int_type it = int_types[i];
+		struct val_type t = {.t = TYPE_INT, .int_ = it};
+		struct ast_toplevel top;
+
+		// (n * 3 + 100) ^ (n - 7)
+		func(&top, "arith", t, t, binop(BINOP_BIN_XOR,
+			binop(BINOP_ADD, binop(BINOP_MUL, ident("n"), lit(it, 3)), lit(it, 100)),
+			binop(BINOP_SUB, ident("n"), lit(it, 7))));
+		agree(1, &top, int_args, NINT_ARGS);
+
+		// Signed or unsigned by the type: if n < 5 { n | 1 } else { n & 0x5a }
+		func(&top, "cmp", t, t, if_(binop(BINOP_LT, ident("n"), lit(it, 5)),
+			binop(BINOP_BIN_OR, ident("n"), lit(it, 1)),
+			binop(BINOP_BIN_AND, ident("n"), lit(it, 0x5a))));
+		agree(1, &top, int_args, NINT_ARGS);
+
+		func(&top, "neg", t, t, unop(UNOP_BIN_NOT, unop(UNOP_MINUS, ident("n"))));
+		agree(1, &top, int_args, NINT_ARGS);
+	}
+}
+
+VTEST(test_x64_float_types) {
+	for (size_t i = 0; i < sizeof float_types / sizeof *float_types; ++i) {
+		enum float_type ft = float_types[i];
+		struct val_type t = {.t = TYPE_FLOAT, .float_ = ft};
+		struct ast_toplevel top;
+
+		// n * 1.5 - n / 3 + 0.25
+		func(&top, "arith", t, t, binop(BINOP_ADD, binop(BINOP_SUB,
+			binop(BINOP_MUL, ident("n"), float_lit(ft, 1.5)),
+			binop(BINOP_DIV, ident("n"), float_lit(ft, 3))), float_lit(ft, 0.25)));
+		agree(1, &top, float_args, NFLOAT_ARGS);
+
+		// if n < 0.5 { n * n } else { -n }
+		func(&top, "cmp", t, t, if_(binop(BINOP_LT, ident("n"), float_lit(ft, 0.5)),
+			binop(BINOP_MUL, ident("n"), ident("n")),
+			unop(UNOP_MINUS, ident("n"))));
+		agree(1, &top, float_args, NFLOAT_ARGS);
+	}
+}
+
+VTEST(test_x64_shifts) {
+	for (size_t i = 0; i < sizeof int_types / sizeof *int_types; ++i) {
+		enum int_type it = int_types[i];
+		struct val_type t = {.t = TYPE_INT, .int_ = it};
+		struct ast_toplevel top;
+
+		func(&top, "shl", t, t, binop(BINOP_LSHIFT, ident("n"), lit(it, 3)));
+		agree(1, &top, int_args, NINT_ARGS);
+		func(&top, "shr", t, t, binop(BINOP_RSHIFT, ident("n"), lit(it, (it & ~I_SIGNED) - 1)));
+		agree(1, &top, int_args, NINT_ARGS);
+		// By n, which may be the width or more, or negative. The shifted
+		// value has its sign bit set, to show whether it is filled in.
+		func(&top, "shl_by", t, t, binop(BINOP_LSHIFT, lit(it, 0x5a), ident("n")));
+		agree(1, &top, int_args, NINT_ARGS);
+		func(&top, "shr_by", t, t, binop(BINOP_RSHIFT, lit(it, -100), ident("n")));
+		agree(1, &top, int_args, NINT_ARGS);
+	}
+}
+
+VTEST(test_x64_div) {
+	for (size_t i = 0; i < sizeof int_types / sizeof *int_types; ++i) {
+		enum int_type it = int_types[i];
+		struct val_type t = {.t = TYPE_INT, .int_ = it};
+		struct ast_toplevel top;
+
+		// The most negative value over -1 wraps, where idiv would trap.
+		// Unsigned, -1 is the largest value.
+		func(&top, "div", t, t, binop(BINOP_DIV, ident("n"), lit(it, -1)));
+		agree(1, &top, int_args, NINT_ARGS);
+		func(&top, "mod", t, t, binop(BINOP_MOD, ident("n"), lit(it, -1)));
+		agree(1, &top, int_args, NINT_ARGS);
+		func(&top, "div7", t, t, binop(BINOP_DIV, ident("n"), lit(it, 7)));
+		agree(1, &top, int_args, NINT_ARGS);
+		func(&top, "mod_by", t, t, binop(BINOP_MOD, lit(it, 100), binop(BINOP_BIN_OR, ident("n"), lit(it, 1))));
+		agree(1, &top, int_args, NINT_ARGS);
+	}
+}
+
+VTEST(test_x64_div_zero) {
+	// Traps, where the VM returns VM_ERR_DIV_ZERO
+	struct ast_toplevel top;
+	func(&top, "div", T_I32, T_I32, binop(BINOP_DIV, int_lit(I_32, 7), ident("n")));
+	struct image im;
+	build(&im, 1, &top, NULL);
+	int32_t (*div)(int32_t) = native(&im, "div");
+	vassert_eq(div(2), 3);
+
+	pid_t pid = fork();
+	vassert(pid >= 0);
+	if (!pid) {
+		// Not whatever handler a sanitizer may have installed
+		signal(SIGFPE, SIG_DFL);
+		_exit(div(0));
+	}
+	int status;
+	vassert_eq(waitpid(pid, &status, 0), pid);
+	vassert(WIFSIGNALED(status));
+	vassert_eq(WTERMSIG(status), SIGFPE);
+	unload(&im);
+}
+
+VTEST(test_x64_loop) {
+	// let mut c = 0; while n > 0 { c = c + n * n; n = n - 1 }; c
+	struct ast_expr *step = binop(BINOP_SEQOP,
+		binop(BINOP_ASSIGN, ident("c"), binop(BINOP_ADD, ident("c"), binop(BINOP_MUL, ident("n"), ident("n")))),
+		binop(BINOP_ASSIGN, ident("n"), binop(BINOP_SUB, ident("n"), int_lit(I_32, 1))));
+	struct ast_expr *loop = while_(binop(BINOP_GT, ident("n"), int_lit(I_32, 0)), step);
+	struct ast_expr *body = let("c", T_I32, int_lit(I_32, 0), binop(BINOP_SEQOP, loop, ident("c")));
+
+	static const long double args[] = {0, 1, 5, 100, -3};
+	struct ast_toplevel top;
+	func(&top, "squares", T_I32, T_I32, body);
+	agree(1, &top, args, 5);
+}
+
+VTEST(test_x64_calls) {
+	static const long double args[] = {0, 1, 2, 10, 20, -4};
+	struct ast_toplevel tops[2];
+
+	// if n < 2 { n } else { fib(n - 1) + fib(n - 2) }
+	func(tops, "fib", T_I32, T_I32, if_(binop(BINOP_LT, ident("n"), int_lit(I_32, 2)), ident("n"),
+		binop(BINOP_ADD, call("fib", 1, binop(BINOP_SUB, ident("n"), int_lit(I_32, 1))),
+			call("fib", 1, binop(BINOP_SUB, ident("n"), int_lit(I_32, 2))))));
+	agree(1, tops, args, 6);
+
+	// a + 2b + 3c + ..., of eight integers or ten floats, so the last two
+	// are passed on the stack
+	for (int fl = 0; fl < 2; ++fl) {
+		struct val_type t = {.t = TYPE_INT, .int_ = I_64}, types[10];
+		if (fl) t = (struct val_type){.t = TYPE_FLOAT, .float_ = F_64};
+		size_t n = fl ? 10 : 8;
+		struct ast_expr *sum = ident("a"), *argv = malloc(n * sizeof *argv);
+		for (size_t j = 0; j < n; ++j) {
+			types[j] = t;
+			struct ast_expr *k = fl ? float_lit(F_64, j + 1) : int_lit(I_64, j + 1);
+			struct ast_expr *nj = fl ? float_lit(F_64, j) : int_lit(I_64, j);
+			if (j) sum = binop(BINOP_ADD, sum, binop(BINOP_MUL, ident(names[j]), k));
+			argv[j] = *binop(BINOP_SUB, ident("n"), nj);
+		}
+		funcn(tops, "many", n, types, t, sum);
+		func(tops + 1, "call_many", t, t, node((struct ast_expr){.t = EXPR_CALL, .call = {.func = ident("many"), .nargs = n, .args = argv}}));
+		agree(2, tops, args, 6);
+	}
+}
+
+// Structs of each System V class, as C sees them
+struct small { int32_t a, b; };
+struct dpair { double a, b; };
+struct mixed { int64_t a; double b; };
+struct big { int64_t a, b, c; };
+struct ld { long double a; };
+
+static struct small host_small(struct small s) { return (struct small){s.b, s.a}; }
+static struct dpair host_dpair(double x) { return (struct dpair){x, x / 2}; }
+static struct mixed host_mixed(struct mixed m) { return (struct mixed){m.a + 1, m.b * 2}; }
+static struct big host_big(struct big b) { return (struct big){b.c, b.a, b.b}; }
+static struct ld host_ld(struct ld l) { return (struct ld){l.a * 2}; }
+
+VTEST(test_x64_structs) {
+	struct val_type i32 = T_I32, i64 = {.t = TYPE_INT, .int_ = I_64};
+	struct val_type f64 = {.t = TYPE_FLOAT, .float_ = F_64}, f80 = {.t = TYPE_FLOAT, .float_ = F_80};
+	struct val_type small = record(2, (struct val_type[]){i32, i32});
+	struct val_type dpair = record(2, (struct val_type[]){f64, f64});
+	struct val_type mixed = record(2, (struct val_type[]){i64, f64});
+	struct val_type big = record(3, (struct val_type[]){i64, i64, i64});
+	struct val_type ld = record(1, (struct val_type[]){f80});
+
+	struct ast_toplevel tops[16];
+	size_t ntops = 0;
+	func(tops + ntops++, "host_small", small, small, NULL);
+	func(tops + ntops++, "host_dpair", f64, dpair, NULL);
+	func(tops + ntops++, "host_mixed", mixed, mixed, NULL);
+	func(tops + ntops++, "host_big", big, big, NULL);
+	func(tops + ntops++, "host_ld", ld, ld, NULL);
+
+	// In registers: an INTEGER eightbyte, two SSE ones, and one of each
+	func(tops + ntops++, "small_sum", small, i32, binop(BINOP_ADD,
+		binop(BINOP_MUL, field(ident("n"), "a"), int_lit(I_32, 10)), field(ident("n"), "b")));
+	func(tops + ntops++, "small_make", i32, small, record_lit(small,
+		(struct ast_expr *[]){ident("n"), binop(BINOP_MUL, ident("n"), int_lit(I_32, 2))}));
+	func(tops + ntops++, "small_relay", i32, i32, call("small_sum", 1, call("host_small", 1, record_lit(small,
+		(struct ast_expr *[]){ident("n"), binop(BINOP_ADD, ident("n"), int_lit(I_32, 1))}))));
+	func(tops + ntops++, "dpair_mix", dpair, f64, binop(BINOP_ADD,
+		binop(BINOP_MUL, field(ident("n"), "a"), float_lit(F_64, 2)), field(ident("n"), "b")));
+	func(tops + ntops++, "dpair_relay", f64, f64, call("dpair_mix", 1, call("host_dpair", 1, ident("n"))));
+	func(tops + ntops++, "mixed_relay", i64, mixed, call("host_mixed", 1, record_lit(mixed,
+		(struct ast_expr *[]){ident("n"), float_lit(F_64, 1.5)})));
+
+	// In memory: arguments on the stack, and results through a hidden
+	// pointer. A lone long double is returned on the x87 stack.
+	func(tops + ntops++, "big_sum", big, i64, binop(BINOP_ADD, field(ident("n"), "a"), binop(BINOP_ADD,
+		binop(BINOP_MUL, field(ident("n"), "b"), int_lit(I_64, 10)), binop(BINOP_MUL, field(ident("n"), "c"), int_lit(I_64, 100)))));
+	func(tops + ntops++, "big_relay", i64, big, call("host_big", 1, record_lit(big,
+		(struct ast_expr *[]){ident("n"), binop(BINOP_MUL, ident("n"), int_lit(I_64, 2)), binop(BINOP_MUL, ident("n"), int_lit(I_64, 3))})));
+	func(tops + ntops++, "big_pass", big, big, call("host_big", 1, ident("n")));
+	func(tops + ntops++, "ld_relay", f80, ld, call("host_ld", 1, record_lit(ld, (struct ast_expr *[]){ident("n")})));
+	func(tops + ntops++, "ld_get", ld, f80, field(ident("n"), "a"));
+
+	static const struct host hosts[] = {
+		{"host_small", host_small}, {"host_dpair", host_dpair}, {"host_mixed", host_mixed},
+		{"host_big", host_big}, {"host_ld", host_ld}, {NULL, NULL},
+	};
+	struct image im;
+	build(&im, ntops, tops, hosts);
+
+	int32_t (*small_sum)(struct small) = native(&im, "small_sum");
+	struct small (*small_make)(int32_t) = native(&im, "small_make");
+	int32_t (*small_relay)(int32_t) = native(&im, "small_relay");
+	vassert_eq(small_sum((struct small){3, 4}), 34);
+	struct small s = small_make(5);
+	vassert_eq(s.a, 5);
+	vassert_eq(s.b, 10);
+	vassert_eq(small_relay(7), 87);
+
+	double (*dpair_mix)(struct dpair) = native(&im, "dpair_mix");
+	double (*dpair_relay)(double) = native(&im, "dpair_relay");
+	struct mixed (*mixed_relay)(int64_t) = native(&im, "mixed_relay");
+	vassert(dpair_mix((struct dpair){1.5, 0.25}) == 3.25);
+	vassert(dpair_relay(4) == 10);
+	struct mixed m = mixed_relay(5);
+	vassert_eq(m.a, 6);
+	vassert(m.b == 3);
+
+	int64_t (*big_sum)(struct big) = native(&im, "big_sum");
+	struct big (*big_relay)(int64_t) = native(&im, "big_relay");
+	struct big (*big_pass)(struct big) = native(&im, "big_pass");
+	vassert_eq(big_sum((struct big){1, 2, 3}), 321);
+	struct big b = big_relay(2);
+	vassert_eq(b.a, 6);
+	vassert_eq(b.b, 2);
+	vassert_eq(b.c, 4);
+	b = big_pass((struct big){1, 2, 3});
+	vassert_eq(b.a, 3);
+	vassert_eq(b.b, 1);
+	vassert_eq(b.c, 2);
+
+	struct ld (*ld_relay)(long double) = native(&im, "ld_relay");
+	long double (*ld_get)(struct ld) = native(&im, "ld_get");
+	vassert(ld_relay(1.25L).a == 2.5L);
+	vassert(ld_get((struct ld){7.5L}) == 7.5L);
+
+	unload(&im);
+}
+
+static int32_t host_inc(int32_t n) { return n + 1; }
+
+struct huge { int64_t x[20]; };
+
+VTEST(test_x64_relocs) {
+	struct val_type i64 = {.t = TYPE_INT, .int_ = I_64}, fields[20];
+	for (int i = 0; i < 20; ++i) fields[i] = i64;
+	struct val_type huge = record(20, fields);
+	struct val_type inc = {.t = TYPE_FUNC, .func = {.nargs = 1, .args = malloc(sizeof (struct ref_type)), .ret_type = malloc(sizeof (struct val_type))}};
+	inc.func.args[0] = (struct ref_type){.mut = true, .to = T_I32};
+	*inc.func.ret_type = T_I32;
+
+	struct ast_toplevel tops[5];
+	func(tops, "host_inc", T_I32, T_I32, NULL);
+	// Calls to an undefined function go through the PLT, and its address is
+	// loaded from the GOT
+	func(tops + 1, "call_inc", T_I32, T_I32, call("host_inc", 1, ident("n")));
+	func(tops + 2, "addr_inc", T_I32, inc, ident("host_inc"));
+	func(tops + 3, "call_call", T_I32, T_I32, call("call_inc", 1, ident("n")));
+	// Copies of more than 128 bytes call memmove
+	struct ast_expr *elems[20];
+	for (int i = 0; i < 20; ++i) elems[i] = binop(BINOP_ADD, ident("n"), int_lit(I_64, i));
+	func(tops + 4, "make_huge", i64, huge, record_lit(huge, elems));
+
+	static const struct host hosts[] = {{"host_inc", host_inc}, {"memmove", memmove}, {NULL, NULL}};
+	struct image im;
+	build(&im, 5, tops, hosts);
+	vassert_eq(im.o.syms[elf_sym(&im.o, "host_inc")].sect, ELF_UNDEF);
+	vassert(has_reloc(&im, "host_inc", R_X86_64_PLT32));
+	vassert(has_reloc(&im, "host_inc", R_X86_64_GOTPCREL));
+	vassert(has_reloc(&im, "call_inc", R_X86_64_PLT32));
+	vassert(has_reloc(&im, "memmove", R_X86_64_PLT32));
+
+	int32_t (*call_inc)(int32_t) = native(&im, "call_inc");
+	void *(*addr_inc)(int32_t) = native(&im, "addr_inc");
+	int32_t (*call_call)(int32_t) = native(&im, "call_call");
+	struct huge (*make_huge)(int64_t) = native(&im, "make_huge");
+	vassert_eq(call_inc(41), 42);
+	vassert(addr_inc(0) == (void *)host_inc);
+	vassert_eq(call_call(1), 2);
+	struct huge h = make_huge(100);
+	for (int i = 0; i < 20; ++i) vassert_eq(h.x[i], 100 + i);
+
+	unload(&im);
+}
+
+VTESTS_BEGIN
+	test_x64_object,
+	test_x64_int_types,
+	test_x64_float_types,
+	test_x64_shifts,
+	test_x64_div,
+	test_x64_div_zero,
+	test_x64_loop,
+	test_x64_calls,
+	test_x64_structs,
+	test_x64_relocs,
+VTESTS_END